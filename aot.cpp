@@ -0,0 +1,341 @@
+#include "aot.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstdarg>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "chunk.hpp"
+#include "compiler.hpp"
+#include "object_function.hpp"
+#include "optimizer.hpp"
+
+/** Append printf style formatted text to out */
+static void appendf(std::string& out, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    va_list copy;
+    va_copy(copy, args);
+    int length = vsnprintf(nullptr, 0, format, copy);
+    va_end(copy);
+    std::size_t start = out.size();
+    out.resize(start + length + 1);
+    vsnprintf(out.data() + start, length + 1, format, args);
+    out.resize(start + length);
+    va_end(args);
+}
+
+/** Emits the C++ function for a single ObjFunction */
+class AotFunctionEmitter {
+public:
+    AotFunctionEmitter(ObjFunction* function, std::size_t index) : m_function(function), m_chunk(function->chunk()), m_index(index) {}
+
+    /** Returns false if the bytecode isn't what the compiler emits */
+    bool emit();
+    /** The function's definition */
+    const std::string& code() const { return m_code; }
+    std::size_t max_depth() const { return m_max_depth; }
+private:
+    ObjFunction* m_function{};
+    Chunk& m_chunk;
+    std::size_t m_index{};
+    std::string m_code{};
+    std::size_t m_max_depth{};
+    /** Offset and stack depth of the instruction being emitted */
+    std::size_t m_offset{};
+    std::size_t m_depth{};
+
+    std::uint16_t read_short(std::size_t offset) const {
+        auto& code = m_chunk.get_code();
+        return static_cast<std::uint16_t>((code[offset + 1] << 8) | code[offset + 2]);
+    }
+    /** Index of the inline cache of the property instruction at the given offset, after its name */
+    std::uint16_t read_cache(std::size_t offset) const { return read_short(offset + 1); }
+    /** Have the VM execute the current instruction, returning from the function if that failed */
+    void execute(std::string& out) const {
+        appendf(out, "if ((slots = AotRuntime::execute(vm, %zu, %zu)) == nullptr) return 0;\n", m_offset, m_depth);
+    }
+    /** Emit the current binary arithmetic or comparison instruction, with the given C++ operator */
+    void binary(std::string& out, const char* op) const {
+        std::size_t a = m_depth - 2;
+        std::size_t b = m_depth - 1;
+        appendf(out, "if (slots[%zu].is_number() && slots[%zu].is_number()) slots[%zu] = Value(slots[%zu].as_number() %s slots[%zu].as_number());\n",
+                a, b, a, a, op, b);
+        out += "    else ";
+        execute(out);
+    }
+};
+
+bool AotFunctionEmitter::emit() {
+    auto& code = m_chunk.get_code();
+    auto& constants = m_chunk.get_constants();
+
+    // Stack depth of each instruction, and at each forward jump target as the jumps to it are emitted
+    std::vector<std::size_t> depths(code.size(), SIZE_MAX);
+    std::unordered_map<std::size_t, std::size_t> target_depths{};
+    std::unordered_set<std::size_t> labels{};
+    std::vector<std::pair<std::size_t, std::string>> instructions{};
+    bool uses_constants = false;
+    bool uses_inline_caches = false;
+    bool uses_upvalues = false;
+
+    // The callee (or receiver) and arguments are already in place when the frame starts
+    m_depth = m_function->m_arity + 1;
+    m_max_depth = m_depth;
+
+    for (m_offset = 0; m_offset < code.size();) {
+        // Superinstructions only overwrite the opcode of their first component
+        std::uint8_t op_code = code[m_offset];
+        const Superinstruction* super = Chunk::find_superinstruction(op_code);
+        if (super != nullptr) op_code = std::to_underlying(super->m_components[0]);
+        OpCode op = static_cast<OpCode>(Chunk::generic_opcode(op_code));
+        std::size_t next = m_offset + m_chunk.opcode_length(std::to_underlying(op), m_offset);
+
+        auto target_depth = target_depths.find(m_offset);
+        if (target_depth != target_depths.end()) m_depth = target_depth->second;
+        depths[m_offset] = m_depth;
+
+        std::string out{};
+        appendf(out, "    /* %04zu %-16s */ ", m_offset, Chunk::opcode_name(std::to_underlying(op)));
+        switch (op) {
+            case OpCode::CONSTANT: {
+                std::uint8_t index = code[m_offset + 1];
+                Value constant = constants[index];
+                if (constant.is_number()) {
+                    // Spelled out bit for bit, so the C++ compiler sees exactly the same double
+                    appendf(out, "slots[%zu] = Value(std::bit_cast<double>(UINT64_C(0x%016llx)));  // %g\n",
+                            m_depth, static_cast<unsigned long long>(std::bit_cast<std::uint64_t>(constant.as_number())), constant.as_number());
+                }
+                else {
+                    appendf(out, "slots[%zu] = constants[%u];\n", m_depth, index);
+                    uses_constants = true;
+                }
+                break;
+            }
+            case OpCode::NIL: appendf(out, "slots[%zu] = Value();\n", m_depth); break;
+            case OpCode::TRUE: appendf(out, "slots[%zu] = Value(true);\n", m_depth); break;
+            case OpCode::FALSE: appendf(out, "slots[%zu] = Value(false);\n", m_depth); break;
+            case OpCode::POP: out += "\n"; break;
+            case OpCode::GET_LOCAL: appendf(out, "slots[%zu] = slots[%u];\n", m_depth, code[m_offset + 1]); break;
+            case OpCode::SET_LOCAL: appendf(out, "slots[%u] = slots[%zu];\n", code[m_offset + 1], m_depth - 1); break;
+            case OpCode::GET_GLOBAL:
+                appendf(out, "if (globals[%u].m_defined) slots[%zu] = globals[%u].m_value;\n    else ", read_short(m_offset), m_depth, read_short(m_offset));
+                execute(out);
+                break;
+            case OpCode::DEFINE_GLOBAL:
+                appendf(out, "globals[%u].m_value = slots[%zu]; globals[%u].m_defined = true;\n", read_short(m_offset), m_depth - 1, read_short(m_offset));
+                break;
+            case OpCode::SET_GLOBAL:
+                appendf(out, "if (globals[%u].m_defined) globals[%u].m_value = slots[%zu];\n    else ", read_short(m_offset), read_short(m_offset), m_depth - 1);
+                execute(out);
+                break;
+            case OpCode::GET_UPVALUE:
+                appendf(out, "slots[%zu] = AotRuntime::get_upvalue(vm, upvalues[%u]);\n", m_depth, code[m_offset + 1]);
+                uses_upvalues = true;
+                break;
+            case OpCode::SET_UPVALUE:
+                appendf(out, "AotRuntime::set_upvalue(vm, upvalues[%u], slots[%zu]);\n", code[m_offset + 1], m_depth - 1);
+                uses_upvalues = true;
+                break;
+            case OpCode::CLOSE_UPVALUE: appendf(out, "AotRuntime::close_upvalues(vm, %zu);\n", m_depth - 1); break;
+            case OpCode::EQUAL: appendf(out, "slots[%zu] = Value(slots[%zu] == slots[%zu]);\n", m_depth - 2, m_depth - 2, m_depth - 1); break;
+            case OpCode::GREATER: binary(out, ">"); break;
+            case OpCode::LESS: binary(out, "<"); break;
+            case OpCode::ADD: binary(out, "+"); break;
+            case OpCode::SUBTRACT: binary(out, "-"); break;
+            case OpCode::MULTIPLY: binary(out, "*"); break;
+            case OpCode::DIVIDE: binary(out, "/"); break;
+            case OpCode::NOT: appendf(out, "slots[%zu] = Value(slots[%zu].is_falsey());\n", m_depth - 1, m_depth - 1); break;
+            case OpCode::NEGATE:
+                appendf(out, "if (slots[%zu].is_number()) slots[%zu] = Value(-slots[%zu].as_number());\n    else ", m_depth - 1, m_depth - 1, m_depth - 1);
+                execute(out);
+                break;
+            case OpCode::PRINT: appendf(out, "slots[%zu].print(); printf(\"\\n\");\n", m_depth - 1); break;
+            case OpCode::JUMP:
+            case OpCode::JUMP_IF_FALSE: {
+                std::size_t target = next + read_short(m_offset);
+                if (target >= code.size()) return false;
+                target_depths[target] = m_depth;
+                labels.insert(target);
+                if (op == OpCode::JUMP_IF_FALSE) appendf(out, "if (slots[%zu].is_falsey()) ", m_depth - 1);
+                appendf(out, "goto L%04zu;\n", target);
+                break;
+            }
+            case OpCode::LOOP: {
+                std::size_t target = next - read_short(m_offset);
+                if (depths.at(target) != m_depth) return false;
+                labels.insert(target);
+                appendf(out, "goto L%04zu;\n", target);
+                break;
+            }
+            case OpCode::GUARD_CALL:
+            case OpCode::GUARD_INVOKE: {
+                // The jump offset is the last operand
+                std::size_t target = next + read_short(next - 3);
+                if (target >= code.size()) return false;
+                target_depths[target] = m_depth;
+                labels.insert(target);
+                appendf(out, "if (!AotRuntime::guard(vm, %zu, %zu)) goto L%04zu;\n", m_offset, m_depth, target);
+                break;
+            }
+            case OpCode::CALL:
+                appendf(out, "if ((slots = AotRuntime::call(vm, %zu, %zu)) == nullptr) return 0;\n", m_offset, m_depth);
+                break;
+            case OpCode::INVOKE:
+                appendf(out, "if ((slots = AotRuntime::invoke(vm, %zu, %zu)) == nullptr) return 0;\n", m_offset, m_depth);
+                break;
+            case OpCode::TAIL_CALL:
+            case OpCode::TAIL_INVOKE:
+                appendf(out, "return AotRuntime::tail_call(vm, %zu, %zu);\n", m_offset, m_depth);
+                break;
+            case OpCode::GET_PROPERTY:
+                appendf(out, "if (!AotRuntime::get_field(slots[%zu], inline_caches[%u])) ", m_depth - 1, read_cache(m_offset));
+                execute(out);
+                uses_inline_caches = true;
+                break;
+            case OpCode::SET_PROPERTY:
+                appendf(out, "if (!AotRuntime::set_field(slots[%zu], slots[%zu], inline_caches[%u])) ", m_depth - 2, m_depth - 1, read_cache(m_offset));
+                execute(out);
+                uses_inline_caches = true;
+                break;
+            case OpCode::RETURN: appendf(out, "return %zu;\n", m_depth); break;
+            default:
+                // Everything else (closures, classes and super calls) is executed by the VM
+                execute(out);
+                break;
+        }
+        instructions.emplace_back(m_offset, std::move(out));
+
+        m_depth += m_chunk.stack_effect(std::to_underlying(op), m_offset);
+        m_max_depth = std::max(m_max_depth, m_depth);
+        m_offset = next;
+    }
+
+    appendf(m_code, "// %s\n", m_function->name());
+    appendf(m_code, "static std::size_t aot_function_%zu([[maybe_unused]] VM* vm, Value* slots, [[maybe_unused]] GlobalSlot* globals) {\n", m_index);
+    if (uses_constants) m_code += "    const Value* constants = AotRuntime::constants(vm);\n";
+    if (uses_inline_caches) m_code += "    InlineCache* inline_caches = AotRuntime::inline_caches(vm);\n";
+    if (uses_upvalues) m_code += "    ObjUpvalue* const* upvalues = AotRuntime::upvalues(vm);\n";
+    for (auto& [offset, text] : instructions) {
+        if (labels.contains(offset)) appendf(m_code, "L%04zu:\n", offset);
+        m_code += text;
+    }
+    // Every function ends in a RETURN, but the C++ compiler can't know that
+    m_code += "    return 0;\n}\n\n";
+    return true;
+}
+
+/** Append the text as a C++ string literal, one source line per line */
+static void append_string_literal(std::string& out, const char* text) {
+    bool line_open = false;
+    for (const char* c = text; *c != '\0'; c++) {
+        if (!line_open) {
+            out += "    \"";
+            line_open = true;
+        }
+        switch (*c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\t': out += "\\t"; break;
+            case '\n':
+                out += "\\n\"\n";
+                line_open = false;
+                break;
+            default:
+                // Octal escapes stop after three digits, so the next character can't run into them
+                if (static_cast<unsigned char>(*c) < 0x20 || static_cast<unsigned char>(*c) >= 0x7f) {
+                    appendf(out, "\\%03o", static_cast<unsigned char>(*c));
+                }
+                else {
+                    out += *c;
+                }
+                break;
+        }
+    }
+    if (line_open) out += "\"\n";
+    out += "    \"\";\n\n";
+}
+
+static void collect_functions(ObjFunction* function, std::vector<ObjFunction*>& functions) {
+    // Guards of inlined calls refer to functions defined elsewhere too
+    if (std::ranges::find(functions, function) != functions.end()) return;
+    functions.push_back(function);
+    for (auto& constant : function->chunk().get_constants()) {
+        if (constant.is_function()) collect_functions(constant.as_function(), functions);
+    }
+}
+
+std::vector<ObjFunction*> AotCompiler::functions(ObjFunction* script) {
+    std::vector<ObjFunction*> functions{};
+    collect_functions(script, functions);
+    return functions;
+}
+
+bool AotCompiler::emit(const char* source, std::FILE* out) {
+    ObjFunction* script = Compiler::compile(source);
+    if (script == nullptr) return false;
+
+    std::string unit{};
+    unit += "// Generated by ppclox --emit-c. Build it together with every ppclox source file but main.cpp.\n";
+    unit += "#include <bit>\n\n#include \"aot.hpp\"\n\n";
+    unit += "static const char s_source[] =\n";
+    append_string_literal(unit, source);
+
+    std::string table{};
+    std::vector<ObjFunction*> functions = AotCompiler::functions(script);
+    for (std::size_t i = 0; i < functions.size(); i++) {
+        AotFunctionEmitter emitter(functions[i], i);
+        if (!emitter.emit()) {
+            fprintf(stderr, "Can't compile function %s ahead of time.\n", functions[i]->name());
+            return false;
+        }
+        unit += emitter.code();
+        appendf(table, "    { aot_function_%zu, %zu, %zu },\n", i, emitter.max_depth(), functions[i]->chunk().get_code().size());
+    }
+
+    unit += "static const AotFunction s_functions[] = {\n" + table + "};\n\n";
+    unit += "int main() {\n";
+    appendf(unit, "    return aot_main(AotProgram{ s_source, %d, s_functions, std::size(s_functions) });\n", Optimizer::level());
+    unit += "}\n";
+    return fwrite(unit.data(), 1, unit.size(), out) == unit.size();
+}
+
+InterpretResult VM::interpret(const AotProgram& program) {
+    Optimizer::set_level(program.m_optimization_level);
+    ObjFunction* function = Compiler::compile(program.m_source);
+    if (function == nullptr) return InterpretResult::COMPILE_ERROR;
+
+    std::vector<ObjFunction*> functions = AotCompiler::functions(function);
+    if (functions.size() != program.m_function_count) {
+        fprintf(stderr, "Compiled code doesn't match the script.\n");
+        return InterpretResult::COMPILE_ERROR;
+    }
+    for (std::size_t i = 0; i < functions.size(); i++) {
+        if (functions[i]->chunk().get_code().size() != program.m_functions[i].m_code_size) {
+            fprintf(stderr, "Compiled code for %s doesn't match the script.\n", functions[i]->name());
+            return InterpretResult::COMPILE_ERROR;
+        }
+        functions[i]->m_aot_function = &program.m_functions[i];
+    }
+    return run_script(function);
+}
+
+bool VM::run_aot(ObjFunction* function) {
+    std::size_t slots = current_frame().m_value_stack_base_index;
+    m_stack.resize(slots + function->m_aot_function->m_max_depth);
+    std::size_t depth = function->m_aot_function->m_entry(this, m_stack.data() + slots, m_globals.data());
+    if (depth == 0) return false;
+    if (depth != k_tail_called) native_return(depth);
+    return true;
+}
+
+int aot_main(const AotProgram& program) {
+    InterpretResult result = g_vm.interpret(program);
+
+    Obj::collect_garbage();
+    Obj::free_objects();
+    if (result == InterpretResult::COMPILE_ERROR) return 65;
+    if (result == InterpretResult::RUNTIME_ERROR) return 70;
+    return 0;
+}
@@ -0,0 +1,145 @@
+#ifndef ppclox_aot_hpp
+#define ppclox_aot_hpp
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "value.hpp"
+#include "vm.hpp"
+
+/**
+ * Signature of an ahead-of-time compiled function, which works just like stencil code
+ * (see stencil.hpp). Returns 0 if a runtime error occurred, VM::k_tail_called if it
+ * handed the frame over to another function, or else the frame's stack depth at its
+ * RETURN, so that the result is the top value.
+ */
+using AotEntry = std::size_t (*)(VM* vm, Value* slots, GlobalSlot* globals);
+
+/** One function of an ahead-of-time compiled script */
+class AotFunction {
+public:
+    AotEntry m_entry{};
+    /** Stack depth the code needs room for, relative to the frame */
+    std::size_t m_max_depth{};
+    /** Length of the function's bytecode, to check the code was compiled from the same bytecode */
+    std::size_t m_code_size{};
+};
+
+/** Everything an emitted translation unit hands the runtime */
+class AotProgram {
+public:
+    /** The script, which is compiled again at startup for its functions, constants and lines */
+    const char* m_source{};
+    /** Optimization level the script was compiled at (see optimizer.hpp), so it compiles to the same bytecode */
+    int m_optimization_level{};
+    /** Code for every function in the script, in the order AotCompiler::functions lists them */
+    const AotFunction* m_functions{};
+    std::size_t m_function_count{};
+};
+
+/**
+ * Compiles a script's bytecode ahead of time to a C++ translation unit, which is then
+ * built by the system compiler together with the runtime (every source file but main.cpp)
+ * into an executable that runs just that script. Every function becomes a C++ function
+ * in which each instruction is a few statements on the frame's window of the value stack,
+ * with the stack depth at every instruction fixed when it is emitted. The simplest
+ * opcodes (arithmetic on numbers, variables, fields and calls) are emitted inline or as
+ * direct calls into the runtime. The rest, which mostly build classes and closures,
+ * call into the stack VM to run just that instruction with its own handler, so
+ * behaviour is exactly the interpreter's. What goes is the dispatch, and the C++
+ * compiler gets to optimize across whole functions.
+ */
+class AotCompiler {
+public:
+    /** Compile the script and write its translation unit to out. Returns false (after reporting why) if it couldn't be. */
+    static bool emit(const char* source, std::FILE* out);
+    /** Every function in the script, the script itself first, in the order they were compiled */
+    static std::vector<ObjFunction*> functions(ObjFunction* script);
+};
+
+/** What emitted code calls into the VM through */
+class AotRuntime {
+public:
+    /** Have the VM execute the instruction at the given offset of the current frame's function */
+    static Value* execute(VM* vm, std::size_t offset, std::size_t depth) {
+        return vm->native_execute(offset, depth, vm->current_frame().m_closure->function()->m_aot_function->m_max_depth);
+    }
+    /** Have the VM execute the CALL instruction at the given offset of the current frame's function */
+    static Value* call(VM* vm, std::size_t offset, std::size_t depth) {
+        return vm->native_call(offset, depth, vm->current_frame().m_closure->function()->m_aot_function->m_max_depth);
+    }
+    /** Have the VM execute the INVOKE instruction at the given offset of the current frame's function */
+    static Value* invoke(VM* vm, std::size_t offset, std::size_t depth) {
+        return vm->native_invoke(offset, depth, vm->current_frame().m_closure->function()->m_aot_function->m_max_depth);
+    }
+    /** Have the VM make the call of the TAIL_CALL or TAIL_INVOKE at the given offset, returning what the code should return */
+    static std::size_t tail_call(VM* vm, std::size_t offset, std::size_t depth) {
+        return vm->native_tail_call(offset, depth);
+    }
+    /** Whether the GUARD_CALL or GUARD_INVOKE instruction at the given offset carries on into the inlined body */
+    static bool guard(VM* vm, std::size_t offset, std::size_t depth) {
+        return vm->native_guard(offset, depth);
+    }
+    /** The current frame's constants, which never move once the function is compiled */
+    static const Value* constants(VM* vm) {
+        return vm->current_frame().m_closure->function()->chunk().get_constants().data();
+    }
+    /** The current frame's inline caches, which never move once the function is compiled either */
+    static InlineCache* inline_caches(VM* vm) {
+        return vm->current_frame().m_closure->function()->chunk().get_inline_caches().data();
+    }
+    /** The current frame's upvalues, which never change once its closure is created */
+    static ObjUpvalue* const* upvalues(VM* vm) {
+        return vm->current_frame().m_closure->upvalues().data();
+    }
+    /** The value of the variable the upvalue captured, whether it is still on the stack or closed over */
+    static Value get_upvalue(VM* vm, ObjUpvalue* upvalue) {
+        return upvalue->is_stack_index() ? vm->m_stack[upvalue->stack_index()] : upvalue->closed_value();
+    }
+    static void set_upvalue(VM* vm, ObjUpvalue* upvalue, Value value) {
+        if (upvalue->is_stack_index()) {
+            vm->m_stack[upvalue->stack_index()] = value;
+        }
+        else {
+            upvalue->set_closed_value(value);
+        }
+    }
+    /** Close the upvalues of the current frame's slots from the given one up, as CLOSE_UPVALUE does for the top slot */
+    static void close_upvalues(VM* vm, std::size_t slot) {
+        vm->close_upvalues(vm->current_frame().m_value_stack_base_index + slot);
+    }
+    /**
+     * Replace the receiver with its field, if the inline cache has seen its shape store the
+     * field. Otherwise returns false, and the VM has to execute the instruction.
+     */
+    static bool get_field(Value& receiver, const InlineCache& cache) {
+        if (!receiver.is_instance()) return false;
+        ObjInstance* instance = receiver.as_instance();
+        const InlineCacheEntry* entry = cache.find(instance->shape());
+        if (entry == nullptr || entry->m_kind != InlineCacheKind::FIELD) return false;
+        receiver = instance->field_at(entry->m_slot);
+        return true;
+    }
+    /** Like get_field(), but stores the value in the field (adding it if need be) and replaces the receiver with it */
+    static bool set_field(Value& receiver, Value value, const InlineCache& cache) {
+        if (!receiver.is_instance()) return false;
+        ObjInstance* instance = receiver.as_instance();
+        const InlineCacheEntry* entry = cache.find(instance->shape());
+        if (entry == nullptr || entry->m_kind == InlineCacheKind::METHOD) return false;
+        if (entry->m_kind == InlineCacheKind::FIELD) {
+            instance->set_field_at(entry->m_slot, value);
+        }
+        else {
+            instance->add_field(entry->m_transition, value);
+        }
+        receiver = value;
+        return true;
+    }
+};
+
+/** Run the program on the global VM, then clean up. Returns the exit code, as for running a script file. */
+int aot_main(const AotProgram& program);
+
+#endif
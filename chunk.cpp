@@ -3,6 +3,24 @@
 // We need this to access function types below.
 // We don't include it in "chunk.hpp" to avoid circular dependencies.
 #include "object_function.hpp"
+#include "object_class.hpp"
+#include "vm.hpp"
+
+const InlineCacheEntry* InlineCache::insert(const InlineCacheEntry& entry) {
+    InlineCacheEntry* stored = &m_entries[m_next_insert];
+    *stored = entry;
+    m_next_insert = (m_next_insert + 1) % k_max_entries;
+    return stored;
+}
+
+void InlineCache::mark_gc_gray() {
+    for (auto& entry : m_entries) {
+        if (entry.m_shape == nullptr) continue;
+        // Shapes are owned by their class, so keeping the class alive keeps the shapes alive.
+        Obj::mark_gc_gray(entry.m_shape->get_class());
+        Obj::mark_gc_gray(entry.m_method);
+    }
+}
 
 void Chunk::write(std::uint8_t byte, std::size_t line) {
     m_code.push_back(byte);
@@ -13,6 +31,27 @@ void Chunk::patch_at(std::size_t offset, std::uint8_t byte) {
     m_code.at(offset) = byte;
 }
 
+void Chunk::replace_code(std::vector<std::uint8_t> code, std::vector<std::size_t> lines, std::vector<std::size_t> inlined) {
+    m_code = std::move(code);
+    m_lines = std::move(lines);
+    m_inlined = std::move(inlined);
+}
+
+std::size_t Chunk::add_inlined_call(InlinedCall call) {
+    m_inlined_calls.push_back(call);
+    return m_inlined_calls.size() - 1;
+}
+
+const InlinedCall* Chunk::inlined_call(std::size_t offset) const {
+    if (offset >= m_inlined.size() || m_inlined[offset] == 0) return nullptr;
+    return &m_inlined_calls.at(m_inlined[offset] - 1);
+}
+
+std::size_t Chunk::add_inline_cache() {
+    m_inline_caches.emplace_back();
+    return m_inline_caches.size() - 1;
+}
+
 std::size_t Chunk::add_constant(Value value) {
     // NOTE! Unlike in Clox, this push_back will
     //       not trigger a GC since it does not allocate
@@ -21,6 +60,281 @@ std::size_t Chunk::add_constant(Value value) {
     return m_constants.size() - 1;
 }
 
+static const char* s_opcode_names[] = {
+    "OP_CONSTANT",            // [OpCode::CONSTANT]
+    "OP_NIL",                 // [OpCode::NIL]
+    "OP_TRUE",                // [OpCode::TRUE]
+    "OP_FALSE",               // [OpCode::FALSE]
+    "OP_POP",                 // [OpCode::POP]
+    "OP_GET_LOCAL",           // [OpCode::GET_LOCAL]
+    "OP_SET_LOCAL",           // [OpCode::SET_LOCAL]
+    "OP_GET_GLOBAL",          // [OpCode::GET_GLOBAL]
+    "OP_DEFINE_GLOBAL",       // [OpCode::DEFINE_GLOBAL]
+    "OP_SET_GLOBAL",          // [OpCode::SET_GLOBAL]
+    "OP_GET_UPVALUE",         // [OpCode::GET_UPVALUE]
+    "OP_SET_UPVALUE",         // [OpCode::SET_UPVALUE]
+    "OP_GET_PROPERTY",        // [OpCode::GET_PROPERTY]
+    "OP_SET_PROPERTY",        // [OpCode::SET_PROPERTY]
+    "OP_GET_SUPER",           // [OpCode::GET_SUPER]
+    "OP_EQUAL",               // [OpCode::EQUAL]
+    "OP_GREATER",             // [OpCode::GREATER]
+    "OP_LESS",                // [OpCode::LESS]
+    "OP_ADD",                 // [OpCode::ADD]
+    "OP_SUBTRACT",            // [OpCode::SUBTRACT]
+    "OP_MULTIPLY",            // [OpCode::MULTIPLY]
+    "OP_DIVIDE",              // [OpCode::DIVIDE]
+    "OP_NOT",                 // [OpCode::NOT]
+    "OP_NEGATE",              // [OpCode::NEGATE]
+    "OP_PRINT",               // [OpCode::PRINT]
+    "OP_JUMP",                // [OpCode::JUMP]
+    "OP_JUMP_IF_FALSE",       // [OpCode::JUMP_IF_FALSE]
+    "OP_LOOP",                // [OpCode::LOOP]
+    "OP_CALL",                // [OpCode::CALL]
+    "OP_INVOKE",              // [OpCode::INVOKE]
+    "OP_SUPER_INVOKE",        // [OpCode::SUPER_INVOKE]
+    "OP_TAIL_CALL",           // [OpCode::TAIL_CALL]
+    "OP_TAIL_INVOKE",         // [OpCode::TAIL_INVOKE]
+    "OP_CLOSURE",             // [OpCode::CLOSURE]
+    "OP_CLOSE_UPVALUE",       // [OpCode::CLOSE_UPVALUE]
+    "OP_RETURN",              // [OpCode::RETURN]
+    "OP_CLASS",               // [OpCode::CLASS]
+    "OP_INHERIT",             // [OpCode::INHERIT]
+    "OP_METHOD",              // [OpCode::METHOD]
+    "OP_GET_GLOBAL_DEFINED",  // [OpCode::GET_GLOBAL_DEFINED]
+    "OP_SET_GLOBAL_DEFINED",  // [OpCode::SET_GLOBAL_DEFINED]
+    "OP_GET_FIELD",           // [OpCode::GET_FIELD]
+    "OP_SET_FIELD",           // [OpCode::SET_FIELD]
+    "OP_INVOKE_METHOD",       // [OpCode::INVOKE_METHOD]
+    "OP_GREATER_NUM",         // [OpCode::GREATER_NUM]
+    "OP_LESS_NUM",            // [OpCode::LESS_NUM]
+    "OP_ADD_NUM",             // [OpCode::ADD_NUM]
+    "OP_SUBTRACT_NUM",        // [OpCode::SUBTRACT_NUM]
+    "OP_MULTIPLY_NUM",        // [OpCode::MULTIPLY_NUM]
+    "OP_DIVIDE_NUM",          // [OpCode::DIVIDE_NUM]
+    "OP_LOOP_TRACE",          // [OpCode::LOOP_TRACE]
+    "OP_GUARD_CALL",          // [OpCode::GUARD_CALL]
+    "OP_GUARD_INVOKE",        // [OpCode::GUARD_INVOKE]
+    "OP_GET_UNBOUND",         // [OpCode::GET_UNBOUND]
+    "OP_CALL_UNBOUND",        // [OpCode::CALL_UNBOUND]
+    "OP_GET_LOCAL_GET_LOCAL", // [OpCode::GET_LOCAL_GET_LOCAL]
+    "OP_GET_LOCAL_CONSTANT",  // [OpCode::GET_LOCAL_CONSTANT]
+    "OP_GET_LOCAL_GET_PROPERTY",// [OpCode::GET_LOCAL_GET_PROPERTY]
+    "OP_GET_LOCAL_CONSTANT_ADD",// [OpCode::GET_LOCAL_CONSTANT_ADD]
+    "OP_GET_LOCAL_CONSTANT_SUBTRACT",// [OpCode::GET_LOCAL_CONSTANT_SUBTRACT]
+    "OP_GET_LOCAL_CONSTANT_LESS_JUMP_IF_FALSE",// [OpCode::GET_LOCAL_CONSTANT_LESS_JUMP_IF_FALSE]
+    "OP_SET_LOCAL_POP",       // [OpCode::SET_LOCAL_POP]
+};
+static_assert(std::size(s_opcode_names) == k_opcode_count, "Every OpCode needs a name.");
+
+const char* Chunk::opcode_name(std::uint8_t op_code) {
+    if (op_code >= k_opcode_count) return "OP_UNKNOWN";
+    return s_opcode_names[op_code];
+}
+
+// Superinstructions, in the order fuse_superinstructions tries to match them.
+// Longer sequences come before any shorter sequence that is a prefix of them.
+static const Superinstruction s_superinstructions[] = {
+    {OpCode::GET_LOCAL_CONSTANT_LESS_JUMP_IF_FALSE, {OpCode::GET_LOCAL, OpCode::CONSTANT, OpCode::LESS, OpCode::JUMP_IF_FALSE}},
+    {OpCode::GET_LOCAL_CONSTANT_ADD,                {OpCode::GET_LOCAL, OpCode::CONSTANT, OpCode::ADD}},
+    {OpCode::GET_LOCAL_CONSTANT_SUBTRACT,           {OpCode::GET_LOCAL, OpCode::CONSTANT, OpCode::SUBTRACT}},
+    {OpCode::GET_LOCAL_CONSTANT,                    {OpCode::GET_LOCAL, OpCode::CONSTANT}},
+    {OpCode::GET_LOCAL_GET_LOCAL,                   {OpCode::GET_LOCAL, OpCode::GET_LOCAL}},
+    {OpCode::GET_LOCAL_GET_PROPERTY,                {OpCode::GET_LOCAL, OpCode::GET_PROPERTY}},
+    {OpCode::SET_LOCAL_POP,                         {OpCode::SET_LOCAL, OpCode::POP}},
+};
+
+std::uint8_t Chunk::generic_opcode(std::uint8_t op_code) {
+    switch (op_code) {
+        case std::to_underlying(OpCode::GET_GLOBAL_DEFINED): return std::to_underlying(OpCode::GET_GLOBAL);
+        case std::to_underlying(OpCode::SET_GLOBAL_DEFINED): return std::to_underlying(OpCode::SET_GLOBAL);
+        case std::to_underlying(OpCode::GET_FIELD): return std::to_underlying(OpCode::GET_PROPERTY);
+        case std::to_underlying(OpCode::SET_FIELD): return std::to_underlying(OpCode::SET_PROPERTY);
+        case std::to_underlying(OpCode::INVOKE_METHOD): return std::to_underlying(OpCode::INVOKE);
+        case std::to_underlying(OpCode::GREATER_NUM): return std::to_underlying(OpCode::GREATER);
+        case std::to_underlying(OpCode::LESS_NUM): return std::to_underlying(OpCode::LESS);
+        case std::to_underlying(OpCode::ADD_NUM): return std::to_underlying(OpCode::ADD);
+        case std::to_underlying(OpCode::SUBTRACT_NUM): return std::to_underlying(OpCode::SUBTRACT);
+        case std::to_underlying(OpCode::MULTIPLY_NUM): return std::to_underlying(OpCode::MULTIPLY);
+        case std::to_underlying(OpCode::DIVIDE_NUM): return std::to_underlying(OpCode::DIVIDE);
+        case std::to_underlying(OpCode::LOOP_TRACE): return std::to_underlying(OpCode::LOOP);
+        default: return op_code;
+    }
+}
+
+const Superinstruction* Chunk::find_superinstruction(std::uint8_t op_code) {
+    for (auto& super : s_superinstructions) {
+        if (std::to_underlying(super.m_fused) == op_code) return &super;
+    }
+    return nullptr;
+}
+
+void Chunk::fuse_superinstructions() {
+    for (std::size_t offset = 0; offset < m_code.size();) {
+        std::size_t length = instruction_length(offset);
+
+        for (auto& super : s_superinstructions) {
+            // See if the instructions starting here match the whole sequence
+            std::size_t end = offset;
+            bool matches = true;
+            for (OpCode component : super.m_components) {
+                if (end >= m_code.size() || m_code[end] != std::to_underlying(component)) {
+                    matches = false;
+                    break;
+                }
+                end += opcode_length(m_code[end], end);
+            }
+
+            if (matches) {
+                m_code[offset] = std::to_underlying(super.m_fused);
+                length = end - offset;
+                break;
+            }
+        }
+
+        offset += length;
+    }
+}
+
+std::size_t Chunk::instruction_length(std::size_t offset) const {
+    std::uint8_t instruction = m_code.at(offset);
+    const Superinstruction* super = find_superinstruction(instruction);
+    if (super == nullptr) {
+        return opcode_length(instruction, offset);
+    }
+
+    // The first component's opcode was overwritten, but the rest are still in place
+    std::size_t end = offset + opcode_length(std::to_underlying(super->m_components[0]), offset);
+    for (std::size_t i = 1; i < super->m_components.size(); i++) {
+        end += opcode_length(m_code.at(end), end);
+    }
+    return end - offset;
+}
+
+std::size_t Chunk::opcode_length(std::uint8_t op_code, std::size_t offset) const {
+    switch (op_code) {
+        case std::to_underlying(OpCode::CONSTANT):
+        case std::to_underlying(OpCode::GET_LOCAL):
+        case std::to_underlying(OpCode::SET_LOCAL):
+        case std::to_underlying(OpCode::GET_UPVALUE):
+        case std::to_underlying(OpCode::SET_UPVALUE):
+        case std::to_underlying(OpCode::CALL):
+        case std::to_underlying(OpCode::TAIL_CALL):
+        case std::to_underlying(OpCode::CLASS):
+        case std::to_underlying(OpCode::METHOD):
+            return 2;
+        case std::to_underlying(OpCode::GET_GLOBAL):
+        case std::to_underlying(OpCode::DEFINE_GLOBAL):
+        case std::to_underlying(OpCode::SET_GLOBAL):
+        case std::to_underlying(OpCode::GET_GLOBAL_DEFINED):
+        case std::to_underlying(OpCode::SET_GLOBAL_DEFINED):
+        case std::to_underlying(OpCode::JUMP):
+        case std::to_underlying(OpCode::JUMP_IF_FALSE):
+        case std::to_underlying(OpCode::LOOP):
+        case std::to_underlying(OpCode::LOOP_TRACE):
+        case std::to_underlying(OpCode::CALL_UNBOUND):
+            return 3;
+        case std::to_underlying(OpCode::GET_PROPERTY):
+        case std::to_underlying(OpCode::SET_PROPERTY):
+        case std::to_underlying(OpCode::GET_SUPER):
+        case std::to_underlying(OpCode::GET_FIELD):
+        case std::to_underlying(OpCode::SET_FIELD):
+        case std::to_underlying(OpCode::GET_UNBOUND):
+            return 4;
+        case std::to_underlying(OpCode::INVOKE):
+        case std::to_underlying(OpCode::SUPER_INVOKE):
+        case std::to_underlying(OpCode::TAIL_INVOKE):
+        case std::to_underlying(OpCode::INVOKE_METHOD):
+        case std::to_underlying(OpCode::GUARD_CALL):
+            return 5;
+        case std::to_underlying(OpCode::GUARD_INVOKE):
+            return 8;
+        case std::to_underlying(OpCode::CLOSURE): {
+            // The function constant is followed by a pair of bytes per upvalue
+            ObjFunction* function = m_constants.at(m_code.at(offset + 1)).as_function();
+            return 2 + 2 * function->m_upvalue_count;
+        }
+        default:
+            return 1;
+    }
+}
+
+std::ptrdiff_t Chunk::stack_effect(std::uint8_t op_code, const std::uint8_t* operands) {
+    switch (generic_opcode(op_code)) {
+        case std::to_underlying(OpCode::CONSTANT):
+        case std::to_underlying(OpCode::NIL):
+        case std::to_underlying(OpCode::TRUE):
+        case std::to_underlying(OpCode::FALSE):
+        case std::to_underlying(OpCode::GET_LOCAL):
+        case std::to_underlying(OpCode::GET_GLOBAL):
+        case std::to_underlying(OpCode::GET_UPVALUE):
+        case std::to_underlying(OpCode::CLOSURE):
+        case std::to_underlying(OpCode::CLASS):
+            return 1;
+        case std::to_underlying(OpCode::POP):
+        case std::to_underlying(OpCode::DEFINE_GLOBAL):
+        case std::to_underlying(OpCode::SET_PROPERTY):
+        case std::to_underlying(OpCode::GET_SUPER):
+        case std::to_underlying(OpCode::EQUAL):
+        case std::to_underlying(OpCode::GREATER):
+        case std::to_underlying(OpCode::LESS):
+        case std::to_underlying(OpCode::ADD):
+        case std::to_underlying(OpCode::SUBTRACT):
+        case std::to_underlying(OpCode::MULTIPLY):
+        case std::to_underlying(OpCode::DIVIDE):
+        case std::to_underlying(OpCode::PRINT):
+        case std::to_underlying(OpCode::CLOSE_UPVALUE):
+        case std::to_underlying(OpCode::RETURN):
+        case std::to_underlying(OpCode::INHERIT):
+        case std::to_underlying(OpCode::METHOD):
+            return -1;
+        case std::to_underlying(OpCode::CALL):
+        case std::to_underlying(OpCode::TAIL_CALL):
+            // The arguments are popped, and the callee replaced by the result
+            return -static_cast<std::ptrdiff_t>(operands[0]);
+        case std::to_underlying(OpCode::INVOKE):
+        case std::to_underlying(OpCode::TAIL_INVOKE):
+            return -static_cast<std::ptrdiff_t>(operands[1]);
+        case std::to_underlying(OpCode::CALL_UNBOUND):
+            return -static_cast<std::ptrdiff_t>(operands[1]);
+        case std::to_underlying(OpCode::SUPER_INVOKE):
+            // The superclass is popped too
+            return -static_cast<std::ptrdiff_t>(operands[1]) - 1;
+        default:
+            // Including guards, which leave the callee and arguments for whichever path they take
+            return 0;
+    }
+}
+
+std::size_t Chunk::max_stack_depth(std::size_t arity) const {
+    // Depth at each forward jump target, recorded as the jumps to it are seen
+    std::unordered_map<std::size_t, std::size_t> target_depths{};
+    // The callee (or receiver) and arguments are already in place when the frame starts
+    std::size_t depth = arity + 1;
+    std::size_t max_depth = depth;
+    for (std::size_t offset = 0; offset < m_code.size();) {
+        std::uint8_t op_code = m_code[offset];
+        const Superinstruction* super = find_superinstruction(op_code);
+        if (super != nullptr) op_code = std::to_underlying(super->m_components[0]);
+        std::size_t next = offset + opcode_length(op_code, offset);
+
+        auto target_depth = target_depths.find(offset);
+        if (target_depth != target_depths.end()) depth = target_depth->second;
+        switch (generic_opcode(op_code)) {
+            case std::to_underlying(OpCode::JUMP):
+            case std::to_underlying(OpCode::JUMP_IF_FALSE):
+            case std::to_underlying(OpCode::GUARD_CALL):
+            case std::to_underlying(OpCode::GUARD_INVOKE):
+                // The jump offset is always the last operand
+                target_depths[next + ((m_code[next - 2] << 8) | m_code[next - 1])] = depth;
+                break;
+        }
+        depth += stack_effect(op_code, offset);
+        max_depth = std::max(max_depth, depth);
+        offset = next;
+    }
+    return max_depth;
+}
+
 void Chunk::dissassemble(const char* name) {
     printf("== %s ==\n", name);
 
@@ -39,6 +353,23 @@ std::size_t Chunk::disassemble_instruction(std::size_t offset) {
 
     std::uint8_t instruction = m_code.at(offset);
 
+    const Superinstruction* super = find_superinstruction(instruction);
+    if (super != nullptr) {
+        // Print the superinstruction, followed by each of the instructions it fuses
+        printf("%s\n", opcode_name(instruction));
+        std::size_t component_offset = offset;
+        for (std::size_t i = 0; i < super->m_components.size(); i++) {
+            std::uint8_t component = (i == 0) ? std::to_underlying(super->m_components[0]) : m_code.at(component_offset);
+            printf("%04zu    + ", component_offset);
+            component_offset = disassemble_opcode(component, component_offset);
+        }
+        return component_offset;
+    }
+
+    return disassemble_opcode(instruction, offset);
+}
+
+std::size_t Chunk::disassemble_opcode(std::uint8_t instruction, std::size_t offset) {
     switch (instruction) {
         case std::to_underlying(OpCode::CONSTANT):
             return constant_instruction("OP_CONSTANT", *this, offset);
@@ -55,21 +386,21 @@ std::size_t Chunk::disassemble_instruction(std::size_t offset) {
         case std::to_underlying(OpCode::SET_LOCAL):
             return byte_instruction("OP_SET_LOCAL", *this, offset);
         case std::to_underlying(OpCode::GET_GLOBAL):
-            return constant_instruction("OP_GET_GLOBAL", *this, offset);
+            return global_instruction("OP_GET_GLOBAL", *this, offset);
         case std::to_underlying(OpCode::DEFINE_GLOBAL):
-            return constant_instruction("OP_DEFINE_GLOBAL", *this, offset);
+            return global_instruction("OP_DEFINE_GLOBAL", *this, offset);
         case std::to_underlying(OpCode::SET_GLOBAL):
-            return constant_instruction("OP_SET_GLOBAL", *this, offset);
+            return global_instruction("OP_SET_GLOBAL", *this, offset);
         case std::to_underlying(OpCode::GET_UPVALUE):
             return byte_instruction("OP_GET_UPVALUE", *this, offset);
         case std::to_underlying(OpCode::SET_UPVALUE):
             return byte_instruction("OP_SET_UPVALUE", *this, offset);
          case std::to_underlying(OpCode::GET_PROPERTY):
-            return constant_instruction("OP_GET_PROPERTY", *this, offset);
+            return property_instruction("OP_GET_PROPERTY", *this, offset);
         case std::to_underlying(OpCode::SET_PROPERTY):
-            return constant_instruction("OP_SET_PROPERTY", *this, offset);
+            return property_instruction("OP_SET_PROPERTY", *this, offset);
         case std::to_underlying(OpCode::GET_SUPER):
-            return constant_instruction("OP_GET_SUPER", *this, offset);
+            return property_instruction("OP_GET_SUPER", *this, offset);
         case std::to_underlying(OpCode::EQUAL):
             return simple_instruction("OP_EQUAL", offset);
         case std::to_underlying(OpCode::GREATER):
@@ -102,6 +433,10 @@ std::size_t Chunk::disassemble_instruction(std::size_t offset) {
             return invoke_instruction("OP_INVOKE", *this, offset);
         case std::to_underlying(OpCode::SUPER_INVOKE):
             return invoke_instruction("OP_SUPER_INVOKE", *this, offset);
+        case std::to_underlying(OpCode::TAIL_CALL):
+            return byte_instruction("OP_TAIL_CALL", *this, offset);
+        case std::to_underlying(OpCode::TAIL_INVOKE):
+            return invoke_instruction("OP_TAIL_INVOKE", *this, offset);
         case std::to_underlying(OpCode::CLOSURE):
             return closure_instruction("OP_CLOSURE", *this, offset);
         case std::to_underlying(OpCode::CLOSE_UPVALUE):
@@ -114,6 +449,38 @@ std::size_t Chunk::disassemble_instruction(std::size_t offset) {
             return simple_instruction("OP_INHERIT", offset);
         case std::to_underlying(OpCode::METHOD):
             return constant_instruction("OP_METHOD", *this, offset);
+        case std::to_underlying(OpCode::GET_GLOBAL_DEFINED):
+            return global_instruction("OP_GET_GLOBAL_DEFINED", *this, offset);
+        case std::to_underlying(OpCode::SET_GLOBAL_DEFINED):
+            return global_instruction("OP_SET_GLOBAL_DEFINED", *this, offset);
+        case std::to_underlying(OpCode::GET_FIELD):
+            return property_instruction("OP_GET_FIELD", *this, offset);
+        case std::to_underlying(OpCode::SET_FIELD):
+            return property_instruction("OP_SET_FIELD", *this, offset);
+        case std::to_underlying(OpCode::INVOKE_METHOD):
+            return invoke_instruction("OP_INVOKE_METHOD", *this, offset);
+        case std::to_underlying(OpCode::GREATER_NUM):
+            return simple_instruction("OP_GREATER_NUM", offset);
+        case std::to_underlying(OpCode::LESS_NUM):
+            return simple_instruction("OP_LESS_NUM", offset);
+        case std::to_underlying(OpCode::ADD_NUM):
+            return simple_instruction("OP_ADD_NUM", offset);
+        case std::to_underlying(OpCode::SUBTRACT_NUM):
+            return simple_instruction("OP_SUBTRACT_NUM", offset);
+        case std::to_underlying(OpCode::MULTIPLY_NUM):
+            return simple_instruction("OP_MULTIPLY_NUM", offset);
+        case std::to_underlying(OpCode::DIVIDE_NUM):
+            return simple_instruction("OP_DIVIDE_NUM", offset);
+        case std::to_underlying(OpCode::LOOP_TRACE):
+            return jump_instruction("OP_LOOP_TRACE", false, *this, offset);
+        case std::to_underlying(OpCode::GUARD_CALL):
+            return guard_instruction("OP_GUARD_CALL", *this, offset);
+        case std::to_underlying(OpCode::GUARD_INVOKE):
+            return guard_instruction("OP_GUARD_INVOKE", *this, offset);
+        case std::to_underlying(OpCode::GET_UNBOUND):
+            return property_instruction("OP_GET_UNBOUND", *this, offset);
+        case std::to_underlying(OpCode::CALL_UNBOUND):
+            return call_unbound_instruction("OP_CALL_UNBOUND", *this, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -170,11 +537,51 @@ std::size_t Chunk::closure_instruction(const char* name, const Chunk& chunk, std
     return offset;
 }
 
+std::size_t Chunk::global_instruction(const char* name, const Chunk& chunk, std::size_t offset) {
+    std::uint16_t slot = (chunk.get_code().at(offset + 1) << 8) | chunk.get_code().at(offset + 2);
+    printf("%-16s %4d '%s'\n", name, slot, g_vm.global_name(slot)->chars());
+    return offset + 3;
+}
+
+std::size_t Chunk::property_instruction(const char* name, const Chunk& chunk, std::size_t offset) {
+    std::uint8_t constant = chunk.get_code().at(offset + 1);
+    std::uint16_t cache = (chunk.get_code().at(offset + 2) << 8) | chunk.get_code().at(offset + 3);
+    printf("%-16s %4d '", name, constant);
+    chunk.get_constants().at(constant).print();
+    printf("' (cache %d)\n", cache);
+    return offset + 4;
+}
+
 std::size_t Chunk::invoke_instruction(const char* name, const Chunk& chunk, std::size_t offset) {
     std::uint8_t constant = chunk.get_code().at(offset + 1);
     std::uint8_t arg_count = chunk.get_code().at(offset + 2);
+    std::uint16_t cache = (chunk.get_code().at(offset + 3) << 8) | chunk.get_code().at(offset + 4);
     printf("%-16s (%d args) %4d '", name, arg_count, constant);
     chunk.get_constants().at(constant).print();
-    printf("'\n");
+    printf("' (cache %d)\n", cache);
+    return offset + 5;
+}
+
+std::size_t Chunk::call_unbound_instruction(const char* name, const Chunk& chunk, std::size_t offset) {
+    printf("%-16s %4d (%d args)\n", name, chunk.get_code().at(offset + 1), chunk.get_code().at(offset + 2));
     return offset + 3;
-}
\ No newline at end of file
+}
+
+std::size_t Chunk::guard_instruction(const char* name, const Chunk& chunk, std::size_t offset) {
+    auto& code = chunk.get_code();
+    std::size_t next = offset + chunk.opcode_length(code.at(offset), offset);
+    std::uint8_t function = code.at(next - 3);
+    std::uint16_t jump = static_cast<std::uint16_t>((code.at(next - 2) << 8) | code.at(next - 1));
+    if (code.at(offset) == std::to_underlying(OpCode::GUARD_CALL)) {
+        printf("%-16s (%d args) ", name, code.at(offset + 1));
+    }
+    else {
+        std::uint16_t cache = static_cast<std::uint16_t>((code.at(offset + 3) << 8) | code.at(offset + 4));
+        printf("%-16s (%d args) '", name, code.at(offset + 2));
+        chunk.get_constants().at(code.at(offset + 1)).print();
+        printf("' (cache %d) ", cache);
+    }
+    chunk.get_constants().at(function).print();
+    printf(" %4zd -> %zd\n", offset, next + jump);
+    return next;
+}
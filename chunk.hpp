@@ -1,6 +1,10 @@
 #ifndef ppclox_chunk_hpp
 #define ppclox_chunk_hpp
 
+#include <array>
+#include <memory>
+#include <unordered_map>
+
 #include "common.hpp"
 #include "value.hpp"
 
@@ -36,12 +40,131 @@ enum class OpCode : std::uint8_t {
     CALL,
     INVOKE,
     SUPER_INVOKE,
+    // Calls the compiler found in tail position, so always directly followed by a RETURN
+    // of their result. A call to a Lox function takes over the caller's frame rather than
+    // pushing one of its own (see VM::call). Anything else is called as CALL and INVOKE do.
+    TAIL_CALL,
+    TAIL_INVOKE,
     CLOSURE,
     CLOSE_UPVALUE,
     RETURN,
     CLASS,
     INHERIT,
-    METHOD
+    METHOD,
+    // Quickened instructions. The compiler never emits these. Instead the VM rewrites
+    // generic instructions into them in place once it has seen what their operands are.
+    // Each has the same operands as its generic form, and reverts to it if its guard fails.
+    GET_GLOBAL_DEFINED,
+    SET_GLOBAL_DEFINED,
+    GET_FIELD,
+    SET_FIELD,
+    INVOKE_METHOD,
+    GREATER_NUM,
+    LESS_NUM,
+    ADD_NUM,
+    SUBTRACT_NUM,
+    MULTIPLY_NUM,
+    DIVIDE_NUM,
+    // A LOOP whose loop has a compiled trace (see trace.hpp) to run instead
+    LOOP_TRACE,
+    // Guards of calls the optimizer inlined (see optimizer.hpp). Each carries on into the
+    // inlined body if the callee, or the method the receiver would invoke, is still the
+    // function inlined there. Otherwise it jumps forward to the CALL or INVOKE left to make
+    // the call instead. The operands are those of the CALL or INVOKE, then the inlined
+    // function's constant and the jump offset.
+    GUARD_CALL,
+    GUARD_INVOKE,
+    // Methods read into a local that is only ever called (see optimizer.hpp), so that no
+    // bound method needs allocating. GET_UNBOUND reads a property just as GET_PROPERTY
+    // does, except that a method is left as its closure instead of being bound to the
+    // instance. CALL_UNBOUND calls the value in a local slot, with the receiver in the
+    // callee's place under the arguments. Its operands are the slot and argument count.
+    GET_UNBOUND,
+    CALL_UNBOUND,
+    // Superinstructions. Each replaces the opcode of the first instruction in a common
+    // sequence, leaving the bytes of the rest of the sequence in place so jumps into
+    // the middle still work (see Chunk::fuse_superinstructions).
+    GET_LOCAL_GET_LOCAL,
+    GET_LOCAL_CONSTANT,
+    GET_LOCAL_GET_PROPERTY,
+    GET_LOCAL_CONSTANT_ADD,
+    GET_LOCAL_CONSTANT_SUBTRACT,
+    GET_LOCAL_CONSTANT_LESS_JUMP_IF_FALSE,
+    SET_LOCAL_POP
+};
+
+/** Number of opcodes. Keep this in sync with the last OpCode above. */
+constexpr std::size_t k_opcode_count = std::to_underlying(OpCode::SET_LOCAL_POP) + 1;
+
+/** A superinstruction and the sequence of instructions it fuses */
+class Superinstruction {
+public:
+    OpCode m_fused{};
+    std::vector<OpCode> m_components{};
+};
+
+class Shape;
+class Trace;
+
+/** What a property name resolved to for instances of one shape */
+enum class InlineCacheKind {
+    /** The name is a field stored at m_slot */
+    FIELD,
+    /** The name is the method m_method of the shape's class */
+    METHOD,
+    /** Storing the name adds a new field at m_slot, moving the instance to m_transition */
+    TRANSITION
+};
+
+class InlineCacheEntry {
+public:
+    Shape* m_shape{};
+    InlineCacheKind m_kind{};
+    std::size_t m_slot{};
+    ObjClosure* m_method{};
+    Shape* m_transition{};
+};
+
+/**
+ * Polymorphic inline cache attached to a single property access or invoke instruction.
+ * Remembers how the instruction's name resolved for the last few receiver shapes seen
+ * at that site, so repeated executions can skip the field and method table lookups.
+ * Sends through super are keyed on the superclass's root shape.
+ * NOTE! Shapes never change once created, and methods are only added to a class while
+ *       its declaration executes, before any instance can exist. So once a shape has
+ *       been seen its entry never goes stale.
+ */
+class InlineCache {
+public:
+    static constexpr std::size_t k_max_entries = 4;
+
+    /** Return the cached entry for the given shape, or nullptr on a cache miss */
+    const InlineCacheEntry* find(const Shape* shape) const {
+        for (auto& entry : m_entries) {
+            if (entry.m_shape == shape) return &entry;
+        }
+        return nullptr;
+    }
+    /** True when exactly one shape has been seen at this site */
+    bool is_monomorphic() const { return m_entries[0].m_shape != nullptr && m_entries[1].m_shape == nullptr; }
+    /** The first entry inserted, which is the only one when the cache is monomorphic */
+    const InlineCacheEntry& first() const { return m_entries[0]; }
+    /** Remember the given entry, evicting the oldest one once full. Returns the stored entry. */
+    const InlineCacheEntry* insert(const InlineCacheEntry& entry);
+    /** Keep cached shapes (via their classes) and methods alive, since the cache compares against their addresses */
+    void mark_gc_gray();
+private:
+    std::array<InlineCacheEntry, k_max_entries> m_entries{};
+    std::size_t m_next_insert{};
+};
+
+/** A call the optimizer inlined, so that stack traces can still show the frame it would have had */
+class InlinedCall {
+public:
+    /** The function inlined. Its guard's constant keeps it alive. */
+    ObjFunction* m_function{};
+    /** Line of the call */
+    std::size_t m_line{};
 };
 
 class Chunk {
@@ -50,8 +173,51 @@ public:
     void write(std::uint8_t byte, std::size_t line);
     /** Patch the byte at the given offset, assumed to have been previously written to */
     void patch_at(std::size_t offset, std::uint8_t byte);
+    /**
+     * Replace all the code (and its line for every byte) with rewritten code, such as the
+     * optimizer's. For code with calls inlined into it, inlined gives 1 + the index of the
+     * inlined call every byte came from, or 0 for the function's own code.
+     */
+    void replace_code(std::vector<std::uint8_t> code, std::vector<std::size_t> lines, std::vector<std::size_t> inlined = {});
+    /** Remember a call inlined into this chunk, returning its index */
+    std::size_t add_inlined_call(InlinedCall call);
+    /** The inlined call the instruction at the given offset came from, or nullptr if it is the function's own */
+    const InlinedCall* inlined_call(std::size_t offset) const;
     /** Append the constant to this chunk's constant array, returning it's index */
     std::size_t add_constant(Value value);
+    /** Append a new, empty inline cache to this chunk, returning it's index */
+    std::size_t add_inline_cache();
+    /** 
+     * Number of bytes taken by the instruction at the given offset, including its operands.
+     * For superinstructions this covers the whole fused sequence.
+     */
+    std::size_t instruction_length(std::size_t offset) const;
+    /** Map quickened opcodes back to the generic form the compiler emitted */
+    static std::uint8_t generic_opcode(std::uint8_t op_code);
+    /** If the given opcode is a superinstruction, return what it fuses. Otherwise nullptr. */
+    static const Superinstruction* find_superinstruction(std::uint8_t op_code);
+    /** 
+     * Replace the first opcode of each common instruction sequence with the matching
+     * superinstruction, so the VM can execute the whole sequence with one dispatch.
+     * Must only be run once the chunk is complete and all jumps are patched.
+     */
+    void fuse_superinstructions();
+    /** Length of the given (non fused) opcode and its operands, located at the given offset */
+    std::size_t opcode_length(std::uint8_t op_code, std::size_t offset) const;
+    /** 
+     * Change in stack depth made by the given (non fused) opcode located at the given offset.
+     * A RETURN counts as popping its result, since nothing after it runs in the same frame.
+     */
+    std::ptrdiff_t stack_effect(std::uint8_t op_code, std::size_t offset) const { return stack_effect(op_code, m_code.data() + offset + 1); }
+    /** Like stack_effect() above, given the instruction's operand bytes */
+    static std::ptrdiff_t stack_effect(std::uint8_t op_code, const std::uint8_t* operands);
+    /**
+     * The most values a frame running this code ever has on the stack, counting the callee
+     * (or receiver) and arguments it starts with. Calls made from it get their own room.
+     */
+    std::size_t max_stack_depth(std::size_t arity) const;
+    /** Name of the given opcode as printed by the disassembler */
+    static const char* opcode_name(std::uint8_t op_code);
     void dissassemble(const char* name);
     /** Disassemble the instruction at the given offset into the chunk's code vector */
     std::size_t disassemble_instruction(std::size_t offset);
@@ -59,17 +225,39 @@ public:
     const std::vector<std::uint8_t>& get_code() const { return m_code; };
     const std::vector<std::size_t>& get_lines() const { return m_lines; };
     const std::vector<Value>& get_constants() const { return m_constants; };
+    std::vector<InlineCache>& get_inline_caches() { return m_inline_caches; };
+    const std::vector<InlinedCall>& get_inlined_calls() const { return m_inlined_calls; };
+#ifdef JIT
+    /** 
+     * Traces compiled for the loops in this chunk, keyed by the offset of each loop's
+     * first instruction. A nullptr trace marks a loop that couldn't be traced.
+     */
+    std::unordered_map<std::size_t, std::shared_ptr<Trace>>& get_traces() { return m_traces; }
+#endif
 private:
     std::vector<std::uint8_t> m_code{};
     std::vector<std::size_t> m_lines{};
     std::vector<Value> m_constants{};
+    std::vector<InlineCache> m_inline_caches{};
+    std::vector<InlinedCall> m_inlined_calls{};
+    /** See replace_code(). Empty when nothing is inlined. */
+    std::vector<std::size_t> m_inlined{};
+#ifdef JIT
+    std::unordered_map<std::size_t, std::shared_ptr<Trace>> m_traces{};
+#endif
+
+    std::size_t disassemble_opcode(std::uint8_t instruction, std::size_t offset);
     
     static std::size_t simple_instruction(const char* name, std::size_t offset);
     static std::size_t byte_instruction(const char* name, const Chunk& chunk, std::size_t offset);
     static std::size_t jump_instruction(const char* name, bool is_forward, const Chunk& chunk, std::size_t offset);
     static std::size_t constant_instruction(const char* name, const Chunk& chunk, std::size_t offset);
     static std::size_t closure_instruction(const char* name, const Chunk& chunk, std::size_t offset);
+    static std::size_t global_instruction(const char* name, const Chunk& chunk, std::size_t offset);
+    static std::size_t property_instruction(const char* name, const Chunk& chunk, std::size_t offset);
     static std::size_t invoke_instruction(const char* name, const Chunk& chunk, std::size_t offset);
+    static std::size_t guard_instruction(const char* name, const Chunk& chunk, std::size_t offset);
+    static std::size_t call_unbound_instruction(const char* name, const Chunk& chunk, std::size_t offset);
 };
 
 #endif
@@ -12,10 +12,34 @@
 #include <vector>
 #include <string_view>
 
+// Dispatch VM instructions through a per-opcode jump table using the GCC/Clang
+// "labels as values" extension. Other compilers fall back to a plain switch.
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO
+#endif
+
+// Pack every Value into 64 bits by hiding nil, booleans and Obj pointers
+// inside the unused bits of quiet NaN doubles (see value.hpp). Comment
+// out to fall back to the tagged union representation.
+#define NAN_BOXING
+
+// Fuse common instruction sequences into superinstructions once each function
+// is compiled (see Chunk::fuse_superinstructions). Comment out to disable.
+#define SUPERINSTRUCTIONS
+
+// Compile hot functions to machine code (see jit.hpp). This relies on NaN boxing
+// and is only implemented for x86-64 Linux. Comment out to disable.
+#if defined(NAN_BOXING) && defined(__x86_64__) && defined(__linux__)
+#define JIT
+#endif
+
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 
 #define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
 
+// Count executed opcode sequences and report the hottest on exit (see profiler.hpp)
+//#define DEBUG_PROFILE_NGRAMS
+
 #endif
\ No newline at end of file
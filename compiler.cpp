@@ -1,6 +1,8 @@
 #include <optional>
 
 #include "compiler.hpp"
+#include "optimizer.hpp"
+#include "vm.hpp"
 
 /** Zero initialize these to start */
 std::unique_ptr<Scanner> Compiler::s_scanner{};
@@ -77,6 +79,9 @@ ObjFunction* Compiler::compile(const char* source) {
     std::vector<Upvalue> out_upvalues{};
     ObjFunction* function = end_compiler(out_upvalues);
     bool had_error = s_parser->had_error;
+    if (!had_error) {
+        finish_program(function);
+    }
 
     // Now that we are done compiling, destroy the scanner and parser,
     // and release our reference to the chunk
@@ -86,6 +91,34 @@ ObjFunction* Compiler::compile(const char* source) {
     return had_error ? nullptr : function;
 }
 
+/** Every function nested in this one, innermost first, and then the function itself */
+static void collect_functions(ObjFunction* function, std::vector<ObjFunction*>& functions) {
+    for (const Value& constant : function->chunk().get_constants()) {
+        if (constant.is_function()) collect_functions(constant.as_function(), functions);
+    }
+    functions.push_back(function);
+}
+
+void Compiler::finish_program(ObjFunction* script) {
+    // The optimizer runs once the whole program is compiled, since what it may assume
+    // about a global depends on every function that could assign it
+    std::vector<ObjFunction*> functions{};
+    collect_functions(script, functions);
+    Optimizer::optimize(functions);
+
+    for (ObjFunction* function : functions) {
+        // Known before fusing, and kept once code is quickened, since neither changes stack effects
+        function->m_max_stack_depth = function->chunk().max_stack_depth(function->m_arity);
+#ifdef SUPERINSTRUCTIONS
+        function->chunk().fuse_superinstructions();
+#endif
+
+#ifdef DEBUG_PRINT_CODE
+        function->chunk().dissassemble(function->name());
+#endif
+    }
+}
+
 Compiler::Compiler(ObjFunction* fun, FunctionType function_type) : 
     m_function(fun),
     m_function_type(function_type) {
@@ -221,6 +254,21 @@ void Compiler::emit_opcode_arg(OpCode op_code, std::uint8_t byte) {
     emit_byte(byte);
 }
 
+void Compiler::emit_opcode_short(OpCode op_code, std::uint16_t value) {
+    emit_byte(std::to_underlying(op_code));
+    emit_byte((value >> 8) & 0xff);
+    emit_byte(value & 0xff);
+}
+
+void Compiler::emit_inline_cache() {
+    std::size_t cache = current_chunk().add_inline_cache();
+    if (cache > std::numeric_limits<std::uint16_t>::max()) {
+        error("Too many property accesses in one chunk.");
+    }
+    emit_byte((cache >> 8) & 0xff);
+    emit_byte(cache & 0xff);
+}
+
 std::size_t Compiler::emit_jump(OpCode instruction) {
     emit_opcode(instruction);
     // Emit two bytes that will be filled in later
@@ -275,6 +323,19 @@ void Compiler::emit_implicit_return() {
     emit_opcode(OpCode::RETURN);
 }
 
+void Compiler::emit_return() {
+    // A call is in tail position if the RETURN comes straight after it, however
+    // control flow got there (as in "return a or f();")
+    Chunk& chunk = current_chunk();
+    std::size_t call = current().m_last_call;
+    if (call != SIZE_MAX && current().m_function_type != FunctionType::SCRIPT &&
+            call + chunk.opcode_length(chunk.get_code()[call], call) == chunk.get_code().size()) {
+        bool is_call = chunk.get_code()[call] == std::to_underlying(OpCode::CALL);
+        chunk.patch_at(call, std::to_underlying(is_call ? OpCode::TAIL_CALL : OpCode::TAIL_INVOKE));
+    }
+    emit_opcode(OpCode::RETURN);
+}
+
 std::uint8_t Compiler::make_constant(Value value) {
     std::size_t index = current_chunk().add_constant(value);
     if (index > std::numeric_limits<std::uint8_t>::max()) {
@@ -291,6 +352,15 @@ std::uint8_t Compiler::identifier_constant(const Token& name) {
     return make_constant(ObjString::copy_string(name.start, name.length));
 }
 
+std::uint16_t Compiler::global_slot(const Token& name) {
+    std::size_t slot = g_vm.global_slot(ObjString::copy_string(name.start, name.length));
+    if (slot > std::numeric_limits<std::uint16_t>::max()) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return (std::uint16_t)slot;
+}
+
 void Compiler::emit_constant(Value value) {
     emit_opcode_arg(OpCode::CONSTANT, make_constant(value));
 }
@@ -402,12 +472,6 @@ ObjFunction* Compiler::end_compiler(std::vector<Upvalue>& out_upvalues) {
     emit_implicit_return();
     ObjFunction* function = current().m_function;
 
-#ifdef DEBUG_PRINT_CODE
-    if (!s_parser->had_error) {
-        current_chunk().dissassemble(function->name());
-    }
-#endif
-
     // Before we destruct the topmost compiler, we need
     // to hand off its upvalues for use outside of this function.
     // Just move them since the compiler is about to be destructed anyway.
@@ -458,14 +522,14 @@ void Compiler::parse_precedence(Precedence precedence) {
     }
 }
 
-std::uint8_t Compiler::parse_variable(const char* error_message) {
+std::uint16_t Compiler::parse_variable(const char* error_message) {
     consume(TokenType::IDENTIFIER, error_message);
 
     declare_variable();
     // Return dummy index if we're in a local scope
     if (current().scope_depth > 0) return 0;
 
-    return identifier_constant(s_parser->previous);
+    return global_slot(s_parser->previous);
 }
 
 void Compiler::declare_variable() {
@@ -492,14 +556,14 @@ void Compiler::declare_variable() {
     add_local(name);
 }
 
-void Compiler::define_variable(std::uint8_t global) {
+void Compiler::define_variable(std::uint16_t global) {
     // Locals don't need to be explicitly defined since they
     // live on the value stack
     if (current().scope_depth > 0) {
         mark_initialized();
         return;
     }
-    emit_opcode_arg(OpCode::DEFINE_GLOBAL, global);
+    emit_opcode_short(OpCode::DEFINE_GLOBAL, global);
 }
 
 void Compiler::mark_initialized() {
@@ -566,6 +630,7 @@ void Compiler::binary(bool can_assign) {
 
 void Compiler::call(bool can_assign) {
     std::uint8_t arg_count = argument_list();
+    current().m_last_call = current_chunk().get_code().size();
     emit_opcode_arg(OpCode::CALL, arg_count);
 }
 
@@ -576,12 +641,16 @@ void Compiler::dot(bool can_assign) {
     if (can_assign && match(TokenType::EQUAL)) {
         expression();
         emit_opcode_arg(OpCode::SET_PROPERTY, name);
+        emit_inline_cache();
     } else if (match(TokenType::LEFT_PAREN)) {
         std::uint8_t arg_count = argument_list();
+        current().m_last_call = current_chunk().get_code().size();
         emit_opcode_arg(OpCode::INVOKE, name);
         emit_byte(arg_count);
+        emit_inline_cache();
     } else {
         emit_opcode_arg(OpCode::GET_PROPERTY, name);
+        emit_inline_cache();
     }
 }
 
@@ -634,7 +703,7 @@ void Compiler::string(bool can_assign) {
 void Compiler::named_variable(const Token& name, bool can_assign) {
     OpCode get_op{};
     OpCode set_op{};
-    std::uint8_t arg{};
+    std::uint16_t arg{};
 
     std::uint8_t local_index{};
     std::uint8_t upvalue_index{};
@@ -649,15 +718,23 @@ void Compiler::named_variable(const Token& name, bool can_assign) {
     } else {
         get_op = OpCode::GET_GLOBAL;
         set_op = OpCode::SET_GLOBAL;
-        arg = identifier_constant(name);
+        arg = global_slot(name);
     }
 
+    // Globals are addressed by a 2 byte slot, locals and upvalues by a single byte
+    auto emit_variable_op = [&](OpCode op) {
+        if (op == OpCode::GET_GLOBAL || op == OpCode::SET_GLOBAL) {
+            emit_opcode_short(op, arg);
+        } else {
+            emit_opcode_arg(op, (std::uint8_t)arg);
+        }
+    };
 
     if (can_assign && match(TokenType::EQUAL)) {
         expression();
-        emit_opcode_arg(set_op, arg);
+        emit_variable_op(set_op);
     } else {
-        emit_opcode_arg(get_op, arg);
+        emit_variable_op(get_op);
     }
 }
 
@@ -684,9 +761,11 @@ void Compiler::super_(bool can_assign) {
         named_variable(Token("super"), false);
         emit_opcode_arg(OpCode::SUPER_INVOKE, name);
         emit_byte(arg_count);
+        emit_inline_cache();
     } else {
         named_variable(Token("super"), false);
         emit_opcode_arg(OpCode::GET_SUPER, name);
+        emit_inline_cache();
     }
 }
 
@@ -760,9 +839,10 @@ void Compiler::class_declaration() {
     Token class_name = s_parser->previous;
     std::uint8_t name_constant = identifier_constant(s_parser->previous);
     declare_variable();
+    std::uint16_t global = current().scope_depth > 0 ? 0 : global_slot(class_name);
 
     emit_opcode_arg(OpCode::CLASS, name_constant);
-    define_variable(name_constant);
+    define_variable(global);
 
     // When the compiler begins compiling a class, it pushes a new 
     // ClassCompiler onto that stack.
@@ -818,7 +898,7 @@ void Compiler::class_declaration() {
 }
 
 void Compiler::fun_declaration() {
-    std::uint8_t global = parse_variable("Expect function name.");
+    std::uint16_t global = parse_variable("Expect function name.");
     // It’s safe for a function to refer to its own name inside its body. 
     // You can’t call the function and execute the body until after it’s fully defined, 
     // so you’ll never see the variable in an uninitialized state.
@@ -853,7 +933,7 @@ void Compiler::function(FunctionType type) {
             if (current().m_function->m_arity > std::numeric_limits<std::uint8_t>::max()) {
                 error_at_current("Can't have more than 255 parameters.");
             }
-            std::uint8_t constant = parse_variable("Expect parameter name.");
+            std::uint16_t constant = parse_variable("Expect parameter name.");
             define_variable(constant);
         } while (match(TokenType::COMMA));
     }
@@ -890,7 +970,7 @@ void Compiler::method() {
 }
 
 void Compiler::var_declaration() {
-    std::uint8_t global = parse_variable("Expect variable name.");
+    std::uint16_t global = parse_variable("Expect variable name.");
 
     if (match(TokenType::EQUAL)) {
         expression();
@@ -983,7 +1063,7 @@ void Compiler::return_statement() {
 
         expression();
         consume(TokenType::SEMICOLON, "Expect ';' after return value.");
-        emit_opcode(OpCode::RETURN);
+        emit_return();
     }
 }
 
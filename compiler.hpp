@@ -101,6 +101,8 @@ private:
     static constexpr std::size_t k_upvalues_max = std::numeric_limits<std::uint8_t>::max() + 1;
     std::vector<Upvalue> m_upvalues{};
     int scope_depth{};
+    /** Offset of the last CALL or INVOKE emitted, to tell whether a return statement returns a call's result */
+    std::size_t m_last_call{ SIZE_MAX };
 
     /** During compilation, these will contain the scanner and parser for the current source */
 
@@ -146,14 +148,22 @@ private:
     static void emit_opcode(OpCode op_code);
     /** Emit an opcode followed by the given byte argument */
     static void emit_opcode_arg(OpCode op_code, std::uint8_t byte);
+    /** Emit an opcode followed by the given 2 byte argument */
+    static void emit_opcode_short(OpCode op_code, std::uint16_t value);
+    /** Allocate a new inline cache in the current chunk and emit its 2 byte index */
+    static void emit_inline_cache();
     static std::size_t emit_jump(OpCode instruction);
     static void patch_jump(std::size_t offset);
     static void emit_loop(std::size_t loop_start);
     static void emit_implicit_return();
+    /** Emit a RETURN, first turning a call whose result it returns into a tail call */
+    static void emit_return();
     /** Add constant to the current chunk and return its index */
     static std::uint8_t make_constant(Value value);
     static std::uint8_t identifier_constant(const Token& name);
     static void emit_constant(Value value);
+    /** Return the VM's global slot for the given variable name */
+    static std::uint16_t global_slot(const Token& name);
     /** Return index of local in given compiler's locals as output parameter. Boolean return indicates found or not found. */
     static bool resolve_local(const Compiler& compiler, const Token& name, std::uint8_t& out_index);
     /** Return index of upvalue in given compiler's upvalues as output parameter. Boolean return indicates found or not found. */
@@ -163,14 +173,17 @@ private:
     static std::uint8_t verify_index(std::size_t index, const char* message);
     static void add_local(Token name);
     static ObjFunction* end_compiler(std::vector<Upvalue>& out_upvalues);
+    /** Optimize and fuse superinstructions in every function of the program, once it has compiled without errors */
+    static void finish_program(ObjFunction* script);
 
     static void begin_scope();
     static void end_scope();
 
     static void parse_precedence(Precedence precedence);
-    static std::uint8_t parse_variable(const char* error_message);
+    /** Parse a variable name, returning its global slot (or a dummy 0 for locals) */
+    static std::uint16_t parse_variable(const char* error_message);
     static void declare_variable();
-    static void define_variable(std::uint8_t global);
+    static void define_variable(std::uint16_t global);
     static void mark_initialized();
     static void and_(bool can_assign);
     static void or_(bool can_assign);
@@ -0,0 +1,643 @@
+#include "jit.hpp"
+
+#ifdef JIT
+
+#include <cstddef>
+
+#include <sys/mman.h>
+
+#include "object_function.hpp"
+#include "register_code.hpp"
+#include "chunk.hpp"
+#include "vm.hpp"
+#include "x64_assembler.hpp"
+
+NativeCode::NativeCode(const std::vector<std::uint8_t>& bytes, std::vector<std::size_t> instruction_offsets) :
+    m_instruction_offsets(std::move(instruction_offsets)) {
+    // Map writable memory for the copy, then flip it to executable so
+    // that it is never both at once.
+    std::size_t page_size = 4096;
+    std::size_t size = (bytes.size() + page_size - 1) / page_size * page_size;
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return;
+
+    memcpy(memory, bytes.data(), bytes.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return;
+    }
+    m_memory = memory;
+    m_size = size;
+}
+
+NativeCode::~NativeCode() {
+    if (m_memory != nullptr) {
+        munmap(m_memory, m_size);
+    }
+}
+
+/**
+ * Emits the machine code for one function. While the generated code runs the
+ * registers described at X64Assembler hold its state, with rbx pointing at the
+ * frame's registers.
+ */
+class JitCompiler {
+public:
+    explicit JitCompiler(ObjFunction* function) :
+        m_function(function), m_code(function->register_code()), m_constants(function->chunk().get_constants()) {}
+
+    std::shared_ptr<NativeCode> compile();
+
+    /** Called from generated code to execute an instruction it doesn't handle inline */
+    static Value* execute(VM* vm, const RegInstruction* instruction) { return vm->jit_execute(instruction); }
+    /** Called from generated code to make a call */
+    static Value* call(VM* vm, const RegInstruction* instruction) { return vm->jit_call(instruction); }
+    /** Called from generated code to return from the frame */
+    static void return_from(VM* vm, Value result) { vm->jit_return(result); }
+private:
+    ObjFunction* m_function;
+    const RegisterCode& m_code;
+    /** Constants never change once the function is compiled, so their values are built into the code */
+    const std::vector<Value>& m_constants;
+    X64Assembler m_asm{};
+    /** Machine code offset of each register instruction */
+    std::vector<std::size_t> m_instruction_offsets{};
+    /** Positions of rel32 operands to patch, and the register instruction they jump to */
+    std::vector<std::pair<std::size_t, std::size_t>> m_jump_patches{};
+    /** Positions of rel32 operands that jump to the error exit */
+    std::vector<std::size_t> m_error_patches{};
+    /** Positions of rel32 operands that jump to the normal exit */
+    std::vector<std::size_t> m_return_patches{};
+
+    /** Load an operand that may be a register or a constant */
+    void load_rk(X64 dst, std::uint16_t operand);
+    /**
+     * Call the handler (execute() unless given) for the instruction. Jump to the error exit
+     * if it returns null, otherwise make what it returns the new register base.
+     */
+    void call_execute(std::size_t index, const void* handler = reinterpret_cast<const void*>(&JitCompiler::execute));
+    /** Jump to slow_path unless the value in reg is a number. Clobbers rdx. */
+    void guard_number(X64 reg, std::vector<std::size_t>& slow_path);
+
+    void compile_arithmetic(std::size_t index, const RegInstruction& instruction);
+    void compile_global(std::size_t index, const RegInstruction& instruction);
+};
+
+void JitCompiler::load_rk(X64 dst, std::uint16_t operand) {
+    if (RegisterCode::is_constant(operand)) {
+        m_asm.mov_imm64(dst, m_constants[operand & ~RegisterCode::k_constant_bit].bits());
+    }
+    else {
+        m_asm.load(dst, X64::RBX, 8 * operand);
+    }
+}
+
+void JitCompiler::call_execute(std::size_t index, const void* handler) {
+    m_asm.alu(X64Assembler::k_mov, X64::RDI, X64::R12);
+    m_asm.mov_imm64(X64::RSI, reinterpret_cast<std::uint64_t>(&m_code.get_code()[index]));
+    m_asm.call(handler);
+    m_asm.alu(X64Assembler::k_test, X64::RAX, X64::RAX);
+    m_error_patches.push_back(m_asm.jcc(X64Condition::EQUAL));
+    m_asm.alu(X64Assembler::k_mov, X64::RBX, X64::RAX);
+}
+
+void JitCompiler::guard_number(X64 reg, std::vector<std::size_t>& slow_path) {
+    m_asm.test_number(reg);
+    slow_path.push_back(m_asm.jcc(X64Condition::EQUAL));
+}
+
+void JitCompiler::compile_arithmetic(std::size_t index, const RegInstruction& instruction) {
+    std::vector<std::size_t> slow_path{};
+    load_rk(X64::RAX, instruction.m_b);
+    load_rk(X64::RCX, instruction.m_c);
+    guard_number(X64::RAX, slow_path);
+    guard_number(X64::RCX, slow_path);
+    m_asm.movq_to_xmm(0, X64::RAX);
+    m_asm.movq_to_xmm(1, X64::RCX);
+
+    switch (instruction.m_op) {
+        case RegOpCode::ADD: m_asm.sse_arithmetic(0x58); break;
+        case RegOpCode::SUBTRACT: m_asm.sse_arithmetic(0x5c); break;
+        case RegOpCode::MULTIPLY: m_asm.sse_arithmetic(0x59); break;
+        case RegOpCode::DIVIDE: m_asm.sse_arithmetic(0x5e); break;
+        // "above" is false when either side is NaN, which is what we want.
+        // So a < b is tested as b > a.
+        case RegOpCode::GREATER: m_asm.ucomisd(0, 1); break;
+        case RegOpCode::LESS: m_asm.ucomisd(1, 0); break;
+        default: break;
+    }
+    if (instruction.m_op == RegOpCode::GREATER || instruction.m_op == RegOpCode::LESS) {
+        m_asm.setcc_rax(X64Condition::ABOVE);
+        m_asm.alu(X64Assembler::k_or, X64::RAX, X64::R15);
+    }
+    else {
+        m_asm.movq_from_xmm(X64::RAX, 0);
+    }
+    m_asm.store(X64::RBX, 8 * instruction.m_a, X64::RAX);
+    std::size_t done = m_asm.jmp();
+
+    // Anything other than two numbers (string concatenation, or a type error) is left to the VM
+    for (std::size_t position : slow_path) {
+        m_asm.patch_rel32(position, m_asm.size());
+    }
+    call_execute(index);
+    m_asm.patch_rel32(done, m_asm.size());
+}
+
+void JitCompiler::compile_global(std::size_t index, const RegInstruction& instruction) {
+    auto value = static_cast<std::int32_t>(instruction.m_b * sizeof(GlobalSlot) + offsetof(GlobalSlot, m_value));
+    auto defined = static_cast<std::int32_t>(instruction.m_b * sizeof(GlobalSlot) + offsetof(GlobalSlot, m_defined));
+    if (instruction.m_op == RegOpCode::DEFINE_GLOBAL) {
+        load_rk(X64::RAX, instruction.m_a);
+        m_asm.store(X64::R13, value, X64::RAX);
+        m_asm.store_byte(X64::R13, defined, 1);
+        return;
+    }
+
+    // Using a global before it is defined is an error, which the VM reports
+    m_asm.cmp_byte(X64::R13, defined, 0);
+    std::size_t undefined = m_asm.jcc(X64Condition::EQUAL);
+    if (instruction.m_op == RegOpCode::GET_GLOBAL) {
+        m_asm.load(X64::RAX, X64::R13, value);
+        m_asm.store(X64::RBX, 8 * instruction.m_a, X64::RAX);
+    }
+    else {
+        load_rk(X64::RAX, instruction.m_a);
+        m_asm.store(X64::R13, value, X64::RAX);
+    }
+    std::size_t done = m_asm.jmp();
+    m_asm.patch_rel32(undefined, m_asm.size());
+    call_execute(index);
+    m_asm.patch_rel32(done, m_asm.size());
+}
+
+std::shared_ptr<NativeCode> JitCompiler::compile() {
+    const std::vector<RegInstruction>& code = m_code.get_code();
+
+    // Prologue. Five pushes keep the stack 16 byte aligned for our calls.
+    m_asm.push(X64::RBX);
+    m_asm.push(X64::R12);
+    m_asm.push(X64::R13);
+    m_asm.push(X64::R14);
+    m_asm.push(X64::R15);
+    m_asm.alu(X64Assembler::k_mov, X64::R12, X64::RDI);
+    m_asm.alu(X64Assembler::k_mov, X64::RBX, X64::RSI);
+    m_asm.alu(X64Assembler::k_mov, X64::R13, X64::RDX);
+    m_asm.mov_imm64(X64::R14, Value::k_qnan);
+    m_asm.mov_imm64(X64::R15, Value::k_false_bits);
+    // Jump to where we're resuming, if anywhere
+    m_asm.alu(X64Assembler::k_test, X64::RCX, X64::RCX);
+    m_asm.emit({ 0x74, 0x02 });             // jz over the jmp
+    m_asm.emit({ 0xff, 0xe1 });             // jmp rcx
+
+    m_instruction_offsets.resize(code.size());
+    for (std::size_t index = 0; index < code.size(); index++) {
+        m_instruction_offsets[index] = m_asm.size();
+        const RegInstruction& instruction = code[index];
+
+        switch (instruction.m_op) {
+            case RegOpCode::MOVE:
+                load_rk(X64::RAX, instruction.m_b);
+                m_asm.store(X64::RBX, 8 * instruction.m_a, X64::RAX);
+                break;
+            case RegOpCode::GREATER:
+            case RegOpCode::LESS:
+            case RegOpCode::ADD:
+            case RegOpCode::SUBTRACT:
+            case RegOpCode::MULTIPLY:
+            case RegOpCode::DIVIDE:
+                compile_arithmetic(index, instruction);
+                break;
+            case RegOpCode::GET_GLOBAL:
+            case RegOpCode::DEFINE_GLOBAL:
+            case RegOpCode::SET_GLOBAL:
+                compile_global(index, instruction);
+                break;
+            case RegOpCode::JUMP:
+                m_jump_patches.emplace_back(m_asm.jmp(), instruction.target());
+                break;
+            case RegOpCode::JUMP_IF_FALSE:
+                m_asm.load(X64::RAX, X64::RBX, 8 * instruction.m_a);
+                m_asm.test_falsey(X64::RAX);
+                m_jump_patches.emplace_back(m_asm.jcc(X64Condition::BELOW_EQUAL), instruction.target());
+                break;
+            case RegOpCode::CALL:
+            case RegOpCode::CALL_UNBOUND:
+            case RegOpCode::INVOKE:
+                call_execute(index, reinterpret_cast<const void*>(&JitCompiler::call));
+                break;
+            case RegOpCode::CAPTURE:
+                // Only ever read by the CLOSURE before it
+                break;
+            case RegOpCode::RETURN:
+                load_rk(X64::RSI, instruction.m_a);
+                m_asm.alu(X64Assembler::k_mov, X64::RDI, X64::R12);
+                m_asm.call(reinterpret_cast<const void*>(&JitCompiler::return_from));
+                m_return_patches.push_back(m_asm.jmp());
+                break;
+            case RegOpCode::TAIL_CALL:
+            case RegOpCode::TAIL_INVOKE:
+                // A tail call leaves the frame either returned from or handed over to the callee
+                call_execute(index);
+                m_return_patches.push_back(m_asm.jmp());
+                break;
+            default:
+                call_execute(index);
+                break;
+        }
+    }
+
+    // Exits. rax holds whether execution succeeded.
+    std::size_t return_exit = m_asm.size();
+    m_asm.mov_imm32(X64::RAX, 1);
+    m_asm.emit({ 0xeb, 0x02 });             // jmp over the error exit
+    std::size_t error_exit = m_asm.size();
+    m_asm.emit({ 0x31, 0xc0 });             // xor eax, eax
+    m_asm.pop(X64::R15);
+    m_asm.pop(X64::R14);
+    m_asm.pop(X64::R13);
+    m_asm.pop(X64::R12);
+    m_asm.pop(X64::RBX);
+    m_asm.ret();
+
+    for (auto [position, target] : m_jump_patches) {
+        m_asm.patch_rel32(position, m_instruction_offsets.at(target));
+    }
+    for (std::size_t position : m_error_patches) {
+        m_asm.patch_rel32(position, error_exit);
+    }
+    for (std::size_t position : m_return_patches) {
+        m_asm.patch_rel32(position, return_exit);
+    }
+
+    auto native = std::make_shared<NativeCode>(m_asm.bytes(), std::move(m_instruction_offsets));
+    if (!native->is_valid()) return nullptr;
+
+#ifdef DEBUG_PRINT_CODE
+    printf("== jit %s: %zu instructions, %zu bytes ==\n", m_function->name(), code.size(), m_asm.size());
+#endif
+    return native;
+}
+
+std::shared_ptr<NativeCode> Jit::compile(ObjFunction* function) {
+    return JitCompiler(function).compile();
+}
+
+/** Coverage of the instructions from first up to (but not including) end */
+static NativeCoverage coverage_of(const std::vector<RegInstruction>& code, std::size_t first, std::size_t end) {
+    NativeCoverage coverage{};
+    for (std::size_t index = first; index < end; index++) {
+        // As JitCompiler::compile() handles them
+        switch (code[index].m_op) {
+            case RegOpCode::CAPTURE:
+                continue;
+            case RegOpCode::JUMP:
+            case RegOpCode::JUMP_IF_FALSE:
+                coverage.m_has_loop |= code[index].target() <= index;
+                break;
+            case RegOpCode::MOVE:
+            case RegOpCode::GREATER:
+            case RegOpCode::LESS:
+            case RegOpCode::ADD:
+            case RegOpCode::SUBTRACT:
+            case RegOpCode::MULTIPLY:
+            case RegOpCode::DIVIDE:
+            case RegOpCode::GET_GLOBAL:
+            case RegOpCode::DEFINE_GLOBAL:
+            case RegOpCode::SET_GLOBAL:
+            case RegOpCode::RETURN:
+                break;
+            default:
+                coverage.m_exits++;
+                break;
+        }
+        coverage.m_instructions++;
+    }
+    return coverage;
+}
+
+NativeCoverage Jit::coverage(ObjFunction* function) {
+    const std::vector<RegInstruction>& code = function->register_code().get_code();
+    return coverage_of(code, 0, code.size());
+}
+
+NativeCoverage Jit::loop_coverage(ObjFunction* function, std::size_t header) {
+    const std::vector<RegInstruction>& code = function->register_code().get_code();
+    // The loop runs up to its last jump back into it. That may be past code it jumps forward
+    // over to get there, as a for loop's condition jumps over its increment to its body.
+    std::size_t end = header + 1;
+    for (bool grown = true; grown;) {
+        grown = false;
+        for (std::size_t index = end; index < code.size(); index++) {
+            RegOpCode op = code[index].m_op;
+            if ((op != RegOpCode::JUMP && op != RegOpCode::JUMP_IF_FALSE) || code[index].target() < header) continue;
+            if (code[index].target() < end) {
+                end = index + 1;
+                grown = true;
+            }
+        }
+    }
+    NativeCoverage coverage = coverage_of(code, header, end);
+    coverage.m_has_loop = false;
+    return coverage;
+}
+
+bool VM::run_native(ObjFunction* function, std::size_t resume) {
+    CallFrame& frame = current_frame();
+    const RegisterCode& code = function->register_code();
+    frame.m_rip = code.get_code().data() + resume;
+    std::size_t slots = frame.m_value_stack_base_index;
+    m_stack.resize(slots + code.frame_size());
+    const NativeCode& native = *function->m_native_code;
+    return native.entry()(this, m_stack.data() + slots, m_globals.data(),
+                          resume == 0 ? nullptr : native.instruction_address(resume));
+}
+
+Value* VM::jit_call(const RegInstruction* instruction) {
+    CallFrame& frame = current_frame();
+    ObjFunction* caller = frame.m_closure->function();
+    std::size_t slots = frame.m_value_stack_base_index;
+
+    ObjClosure* closure{};
+    if (instruction->m_op == RegOpCode::INVOKE) {
+        // Only methods are called straight into, not closures stored in fields
+        Value receiver = m_stack[slots + instruction->m_a];
+        if (receiver.is_instance()) {
+            ObjString* name = caller->chunk().get_constants()[instruction->m_b].as_string();
+            InlineCache& cache = caller->chunk().get_inline_caches()[instruction->m_c];
+            const InlineCacheEntry* entry = resolve_property(receiver.as_instance()->shape(), name, cache);
+            if (entry != nullptr && entry->m_kind == InlineCacheKind::METHOD) closure = entry->m_method;
+        }
+    }
+    else {
+        Value callee = m_stack[slots + (instruction->m_op == RegOpCode::CALL ? instruction->m_a : instruction->m_b)];
+        if (callee.is_closure()) closure = callee.as_closure();
+    }
+    ObjFunction* function = closure != nullptr ? closure->function() : nullptr;
+    if (function == nullptr || function->m_native_code == nullptr || function->m_aot_function != nullptr ||
+        function->m_arity != instruction->m_x || m_call_stack.size() >= k_max_call_frames) {
+        return jit_execute(instruction);
+    }
+
+    // The callee's registers start at its own register, which holds it (or the receiver)
+    frame.m_rip = instruction + 1;
+    std::size_t depth = m_call_stack.size();
+    std::size_t base = slots + instruction->m_a;
+    const RegisterCode& code = function->register_code();
+    m_stack.resize(base + code.frame_size());
+    m_call_stack.emplace_back(closure, base).m_rip = code.get_code().data();
+    if (!function->m_native_code->entry()(this, m_stack.data() + base, m_globals.data(), nullptr)) {
+        return nullptr;
+    }
+    // Unless the callee returned, it tail called, and whatever it called carries on in the frame
+    if (m_call_stack.size() > depth) {
+        if (!enter_frame()) return nullptr;
+        if (m_call_stack.size() > depth) {
+            InterpretResult result = (m_backend == Backend::REGISTER) ? run_register(depth) : run(depth);
+            if (result != InterpretResult::OK) return nullptr;
+        }
+    }
+    m_stack.resize(slots + caller->register_code().frame_size());
+    return m_stack.data() + slots;
+}
+
+void VM::jit_return(Value result) {
+    // If this is the top level script (after on-stack replacement), the
+    // result is left for whoever entered the native code to clean up.
+    std::size_t slots = current_frame().m_value_stack_base_index;
+    close_upvalues(slots);
+    m_stack.erase(m_stack.begin() + slots, m_stack.end());
+    m_call_stack.pop_back();
+    push(result);
+}
+
+Value* VM::jit_execute(const RegInstruction* instruction) {
+    CallFrame* frame = &current_frame();
+    // Point past the instruction, as the interpreters do, in case of a runtime error
+    frame->m_rip = instruction + 1;
+    ObjFunction* function = frame->m_closure->function();
+    const Value* constants = function->chunk().get_constants().data();
+    InlineCache* inline_caches = function->chunk().get_inline_caches().data();
+    std::size_t slots = frame->m_value_stack_base_index;
+    Value* registers = m_stack.data() + slots;
+
+    auto read_rk = [&](std::uint16_t operand) {
+        return RegisterCode::is_constant(operand) ? constants[operand & ~RegisterCode::k_constant_bit] : registers[operand];
+    };
+    /**
+     * Call the callee in register base with the arguments after it. If that pushed a
+     * frame that isn't native, interpret it until it returns. Either way the result
+     * ends up in the callee's register.
+     */
+    auto finish_call = [&](bool called, std::size_t depth) {
+        if (!called) return false;
+        if (m_call_stack.size() > depth) {
+            InterpretResult result = (m_backend == Backend::REGISTER) ? run_register(depth) : run(depth);
+            if (result != InterpretResult::OK) return false;
+        }
+        m_stack.resize(slots + function->register_code().frame_size());
+        return true;
+    };
+
+    switch (instruction->m_op) {
+        case RegOpCode::GET_GLOBAL: {
+            GlobalSlot& global = m_globals[instruction->m_b];
+            if (!global.m_defined) {
+                runtime_error("Undefined variable '%s'.", global.m_name->chars());
+                return nullptr;
+            }
+            registers[instruction->m_a] = global.m_value;
+            break;
+        }
+        case RegOpCode::DEFINE_GLOBAL: {
+            GlobalSlot& global = m_globals[instruction->m_b];
+            global.m_value = read_rk(instruction->m_a);
+            global.m_defined = true;
+            break;
+        }
+        case RegOpCode::SET_GLOBAL: {
+            GlobalSlot& global = m_globals[instruction->m_b];
+            if (!global.m_defined) {
+                runtime_error("Undefined variable '%s'.", global.m_name->chars());
+                return nullptr;
+            }
+            global.m_value = read_rk(instruction->m_a);
+            break;
+        }
+        case RegOpCode::GET_UPVALUE: {
+            ObjUpvalue* upvalue = frame->m_closure->upvalues()[instruction->m_b];
+            registers[instruction->m_a] = upvalue->is_stack_index() ? m_stack[upvalue->stack_index()] : upvalue->closed_value();
+            break;
+        }
+        case RegOpCode::SET_UPVALUE: {
+            ObjUpvalue* upvalue = frame->m_closure->upvalues()[instruction->m_b];
+            if (upvalue->is_stack_index()) {
+                m_stack[upvalue->stack_index()] = read_rk(instruction->m_a);
+            }
+            else {
+                upvalue->set_closed_value(read_rk(instruction->m_a));
+            }
+            break;
+        }
+        case RegOpCode::GET_PROPERTY:
+        case RegOpCode::GET_UNBOUND: {
+            Value receiver = registers[instruction->m_b];
+            if (!receiver.is_instance()) {
+                runtime_error("Only instances have properties.");
+                return nullptr;
+            }
+            ObjInstance* instance = receiver.as_instance();
+            ObjString* name = constants[instruction->m_x].as_string();
+            const InlineCacheEntry* entry = resolve_property(instance->shape(), name, inline_caches[instruction->m_c]);
+            if (entry == nullptr) {
+                runtime_error("Undefined property '%s'.", name->chars());
+                return nullptr;
+            }
+            if (entry->m_kind == InlineCacheKind::FIELD) {
+                registers[instruction->m_a] = instance->field_at(entry->m_slot);
+            }
+            else if (instruction->m_op == RegOpCode::GET_UNBOUND) {
+                registers[instruction->m_a] = entry->m_method;
+            }
+            else {
+                registers[instruction->m_a] = new ObjBoundMethod(instance, entry->m_method);
+            }
+            break;
+        }
+        case RegOpCode::SET_PROPERTY: {
+            Value receiver = registers[instruction->m_a];
+            if (!receiver.is_instance()) {
+                runtime_error("Only instances have fields.");
+                return nullptr;
+            }
+            ObjString* name = constants[instruction->m_x].as_string();
+            set_property(receiver.as_instance(), name, read_rk(instruction->m_b), inline_caches[instruction->m_c]);
+            break;
+        }
+        case RegOpCode::GET_SUPER: {
+            ObjString* name = constants[instruction->m_x].as_string();
+            ObjClass* superclass = registers[instruction->m_b].as_class();
+            const InlineCacheEntry* entry = resolve_property(superclass->root_shape(), name, inline_caches[instruction->m_c]);
+            if (entry == nullptr) {
+                runtime_error("Undefined property '%s'.", name->chars());
+                return nullptr;
+            }
+            registers[instruction->m_a] = new ObjBoundMethod(registers[instruction->m_a].as_instance(), entry->m_method);
+            break;
+        }
+        case RegOpCode::EQUAL:
+            registers[instruction->m_a] = Value(read_rk(instruction->m_b) == read_rk(instruction->m_c));
+            break;
+        case RegOpCode::GREATER:
+        case RegOpCode::LESS:
+        case RegOpCode::ADD:
+        case RegOpCode::SUBTRACT:
+        case RegOpCode::MULTIPLY:
+        case RegOpCode::DIVIDE: {
+            // The generated code only gets here when the operands aren't both numbers
+            Value a = read_rk(instruction->m_b);
+            Value b = read_rk(instruction->m_c);
+            if (instruction->m_op == RegOpCode::ADD && a.is_string() && b.is_string()) {
+                registers[instruction->m_a] = *a.as_string() + *b.as_string();
+                break;
+            }
+            runtime_error("Operands must be numbers.");
+            return nullptr;
+        }
+        case RegOpCode::NOT:
+            registers[instruction->m_a] = Value(read_rk(instruction->m_b).is_falsey());
+            break;
+        case RegOpCode::NEGATE: {
+            Value value = read_rk(instruction->m_b);
+            if (!value.is_number()) {
+                runtime_error("Operand must be a number.");
+                return nullptr;
+            }
+            registers[instruction->m_a] = Value(-value.as_number());
+            break;
+        }
+        case RegOpCode::PRINT:
+            read_rk(instruction->m_a).print();
+            printf("\n");
+            break;
+        case RegOpCode::CALL: {
+            std::size_t depth = m_call_stack.size();
+            m_stack.resize(slots + instruction->m_a + instruction->m_x + 1);
+            if (!finish_call(call_value(m_stack[slots + instruction->m_a], instruction->m_x), depth)) return nullptr;
+            break;
+        }
+        case RegOpCode::CALL_UNBOUND: {
+            std::size_t depth = m_call_stack.size();
+            m_stack.resize(slots + instruction->m_a + instruction->m_x + 1);
+            if (!finish_call(call_value(m_stack[slots + instruction->m_b], instruction->m_x), depth)) return nullptr;
+            break;
+        }
+        case RegOpCode::INVOKE: {
+            std::size_t depth = m_call_stack.size();
+            ObjString* method = constants[instruction->m_b].as_string();
+            m_stack.resize(slots + instruction->m_a + instruction->m_x + 1);
+            if (!finish_call(invoke(method, instruction->m_x, inline_caches[instruction->m_c]), depth)) return nullptr;
+            break;
+        }
+        case RegOpCode::SUPER_INVOKE: {
+            std::size_t depth = m_call_stack.size();
+            ObjString* method = constants[instruction->m_b].as_string();
+            ObjClass* superclass = registers[instruction->m_a + instruction->m_x + 1].as_class();
+            m_stack.resize(slots + instruction->m_a + instruction->m_x + 1);
+            if (!finish_call(invoke_from_class(superclass, method, instruction->m_x, inline_caches[instruction->m_c]), depth)) return nullptr;
+            break;
+        }
+        case RegOpCode::TAIL_CALL:
+        case RegOpCode::TAIL_INVOKE: {
+            m_stack.resize(slots + instruction->m_a + instruction->m_x + 1);
+            bool called = instruction->m_op == RegOpCode::TAIL_CALL ?
+                call_value(m_stack[slots + instruction->m_a], instruction->m_x, true) :
+                invoke(constants[instruction->m_b].as_string(), instruction->m_x, inline_caches[instruction->m_c], true);
+            if (!called) return nullptr;
+            // Unless a Lox function took over the frame, return the result as the RETURN after would
+            if (!frame->is_fresh()) native_return(instruction->m_a + 1);
+            return m_stack.data();
+        }
+        case RegOpCode::CLOSURE: {
+            ObjClosure* closure = new ObjClosure(constants[instruction->m_b].as_function());
+            registers[instruction->m_a] = closure;
+            const RegInstruction* capture = instruction + 1;
+            for (std::size_t i = 0, len = closure->upvalues().size(); i < len; i++, capture++) {
+                if (capture->m_x) {
+                    closure->set_upvalue(i, capture_upvalue(slots + capture->m_a));
+                }
+                else {
+                    closure->set_upvalue(i, frame->m_closure->upvalues()[capture->m_a]);
+                }
+            }
+            break;
+        }
+        case RegOpCode::CLOSE_UPVALUE:
+            close_upvalues(slots + instruction->m_a);
+            break;
+        case RegOpCode::CLASS:
+            registers[instruction->m_a] = new ObjClass(constants[instruction->m_b].as_string());
+            break;
+        case RegOpCode::INHERIT: {
+            Value superclass = registers[instruction->m_a];
+            if (!superclass.is_class()) {
+                runtime_error("Superclass must be a class.");
+                return nullptr;
+            }
+            registers[instruction->m_b].as_class()->inherit_methods_from(superclass.as_class());
+            break;
+        }
+        case RegOpCode::METHOD:
+            registers[instruction->m_a].as_class()->set_method(constants[instruction->m_x].as_string(), registers[instruction->m_b]);
+            break;
+        default:
+            // Moves, jumps, global access and returns are always compiled inline
+            runtime_error("Unexpected instruction in native code.");
+            return nullptr;
+    }
+
+    // Calls may have moved the value stack
+    return m_stack.data() + slots;
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef ppclox_jit_hpp
+#define ppclox_jit_hpp
+
+#include <memory>
+
+#include "common.hpp"
+#include "value.hpp"
+
+class VM;
+class ObjFunction;
+class GlobalSlot;
+
+#ifdef JIT
+
+/**
+ * Machine code for one function, in its own mapping of executable memory.
+ * The code works on the function's registers (see register_code.hpp), which
+ * live in the frame's window of the VM's value stack just like they do for
+ * the register interpreter.
+ */
+class NativeCode {
+public:
+    /**
+     * Signature of the generated code. Returns false if a runtime error occurred.
+     * resume is null to start at the beginning, or otherwise an instruction_address()
+     * to start from instead (see Tiering for on-stack replacement).
+     */
+    using Entry = bool (*)(VM* vm, Value* registers, GlobalSlot* globals, const void* resume);
+
+    /**
+     * Copy the given machine code into freshly mapped executable memory. instruction_offsets
+     * gives where in the code each register instruction starts, if it can be resumed at.
+     */
+    explicit NativeCode(const std::vector<std::uint8_t>& bytes, std::vector<std::size_t> instruction_offsets = {});
+    ~NativeCode();
+    NativeCode(const NativeCode&) = delete;
+    NativeCode& operator=(const NativeCode&) = delete;
+
+    /** False if executable memory couldn't be mapped */
+    bool is_valid() const { return m_memory != nullptr; }
+    Entry entry() const { return reinterpret_cast<Entry>(m_memory); }
+    /** Start of the code, for code with a signature other than Entry (see trace.hpp) */
+    const void* address() const { return m_memory; }
+    /** Where the code for the register instruction at the given index starts */
+    const void* instruction_address(std::size_t index) const { return static_cast<const std::uint8_t*>(m_memory) + m_instruction_offsets.at(index); }
+    std::size_t size() const { return m_size; }
+private:
+    void* m_memory{};
+    std::size_t m_size{};
+    std::vector<std::size_t> m_instruction_offsets{};
+};
+
+/**
+ * How much of a function one of the native tiers would run in its own code, which
+ * Tiering weighs up before moving the function up to it (see tiering.hpp).
+ */
+class NativeCoverage {
+public:
+    std::size_t m_instructions{};
+    /** Instructions the code would hand back to the VM, calls included */
+    std::size_t m_exits{};
+    /** Whether any instruction jumps backwards */
+    bool m_has_loop{};
+};
+
+/**
+ * Baseline "template" JIT for x86-64 Linux. Each register instruction of a hot
+ * function is replaced by a fixed sequence of machine code. Moves, number
+ * arithmetic, comparisons, jumps and global access are done inline. Calls to
+ * other compiled functions go straight into their code (VM::jit_call). Everything
+ * else (other calls, allocation, property access, and any operands of unexpected
+ * types) calls back into the VM to execute that one instruction (VM::jit_execute).
+ * When functions are compiled is up to Tiering (see tiering.hpp).
+ */
+class Jit {
+public:
+    /** Compile the function. Returns nullptr if it can't be, in which case it stays interpreted. */
+    static std::shared_ptr<NativeCode> compile(ObjFunction* function);
+    /** How much of the function its compiled code would run without calling back into the VM */
+    static NativeCoverage coverage(ObjFunction* function);
+    /**
+     * The same for one pass through the loop whose header is the instruction at the given
+     * index. Inner loops count once, and m_has_loop is left unset.
+     */
+    static NativeCoverage loop_coverage(ObjFunction* function, std::size_t header);
+};
+
+#endif
+
+#endif
@@ -1,7 +1,10 @@
+#include <chrono>
 #include <memory>
 
 #include "common.hpp"
+#include "aot.hpp"
 #include "chunk.hpp"
+#include "optimizer.hpp"
 #include "vm.hpp"
 
 // TODO: Implement using C++ idioms instead of C
@@ -58,15 +61,79 @@ static void runFile(const char* path) {
     if (result == InterpretResult::RUNTIME_ERROR) std::exit(70);
 }
 
+/** Compile the script ahead of time, writing C++ to build into an executable of its own to stdout */
+static void emitC(const char* path) {
+    char* source = readFile(path);
+    bool emitted = AotCompiler::emit(source, stdout);
+    free(source);
+
+    if (!emitted) std::exit(65);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: ppclox [-O0|-O1|-O2|-O3] [--dump-opt] [--register] [--no-jit]\n"
+                    "              [--tier-stats] [--emit-c] [--stencil-threshold=N]\n"
+                    "              [--call-threshold=N] [--trace-threshold=N] [--osr-threshold=N]\n"
+                    "              [--gc-pause=MICROSECONDS] [--gc-concurrent] [--gc-threads=N] [path]\n");
+    std::exit(64);
+}
+
+/** If arg is the given option with a count (--option=N), store the count and return true */
+static bool count_option(const char* arg, const char* option, std::size_t& count) {
+    std::size_t length = strlen(option);
+    if (strncmp(arg, option, length) != 0 || arg[length] != '=') return false;
+    char* end{};
+    count = strtoul(arg + length + 1, &end, 10);
+    if (end == arg + length + 1 || *end != '\0' || count == 0) usage();
+    return true;
+}
+
 int main(int argc, const char* argv[]) {
+    // Options come before the path
+    int arg = 1;
+    bool emit_c = false;
+    std::size_t gc_pause{};
+    std::size_t gc_threads{};
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strncmp(argv[arg], "-O", 2) == 0) {
+            char level = argv[arg][2];
+            if (level < '0' || level > '0' + Optimizer::k_max_level || argv[arg][3] != '\0') usage();
+            Optimizer::set_level(level - '0');
+        } else if (strcmp(argv[arg], "--dump-opt") == 0) {
+            Optimizer::set_dump(true);
+        } else if (strcmp(argv[arg], "--register") == 0) {
+            g_vm.set_backend(Backend::REGISTER);
+        } else if (strcmp(argv[arg], "--no-jit") == 0) {
+            g_vm.set_jit_enabled(false);
+        } else if (strcmp(argv[arg], "--emit-c") == 0) {
+            emit_c = true;
+        } else if (strcmp(argv[arg], "--gc-concurrent") == 0) {
+            Obj::set_concurrent_marking(true);
+        } else if (strcmp(argv[arg], "--tier-stats") == 0) {
+            g_vm.set_tiering_report_enabled(true);
+        } else if (count_option(argv[arg], "--stencil-threshold", g_vm.tiering_policy().m_stencil_threshold) ||
+                   count_option(argv[arg], "--call-threshold", g_vm.tiering_policy().m_call_threshold) ||
+                   count_option(argv[arg], "--trace-threshold", g_vm.tiering_policy().m_trace_threshold) ||
+                   count_option(argv[arg], "--osr-threshold", g_vm.tiering_policy().m_osr_threshold)) {
+            // Already stored
+        } else if (count_option(argv[arg], "--gc-pause", gc_pause)) {
+            Obj::set_pause_budget(std::chrono::microseconds(gc_pause));
+        } else if (count_option(argv[arg], "--gc-threads", gc_threads)) {
+            Obj::set_mark_threads(gc_threads);
+        } else {
+            usage();
+        }
+    }
 
-    if (argc == 1) {
+    if (emit_c) {
+        if (arg != argc - 1) usage();
+        emitC(argv[arg]);
+    } else if (arg == argc) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    } else if (arg == argc - 1) {
+        runFile(argv[arg]);
     } else {
-        fprintf(stderr, "Usage: ppclox [path]\n");
-        std::exit(64);
+        usage();
     }
 
     // Do a final garbage collection to clean up anything no longer reachable
@@ -13,7 +13,9 @@ void Obj::print() const {
 
 void Obj::mark_gc_gray(Obj* obj) {
     if (obj == nullptr) return;
-    if (obj->m_gc_color != ObjGcColor::WHITE) return;
+    if (obj->gc_color() != white()) return;
+    // A minor collection doesn't trace through old objects. The remembered set stands in for them.
+    if (s_collecting_young && obj->m_old) return;
 
 // TODO: An easy optimization we could do in markObject() is to skip adding strings and native functions to the gray stack at all since we know they don’t need to be processed. Instead, they could darken from white straight to black.
 
@@ -23,32 +25,73 @@ void Obj::mark_gc_gray(Obj* obj) {
     printf("\n");
 #endif    
 
-    // Mark this object gray and add it to the worklist for processing
-    obj->m_gc_color = ObjGcColor::GRAY;
+    // Mark this object gray and add it to the worklist for processing. When tracing
+    // in parallel, only the worker that actually turns it gray gets to blacken it.
+    if (t_mark_worker != nullptr) {
+        ObjGcColor expected = white();
+        if (!obj->m_gc_color.compare_exchange_strong(expected, ObjGcColor::GRAY, std::memory_order_relaxed)) return;
+        t_mark_worker->m_local.push_back(obj);
+        return;
+    }
+    obj->set_gc_color(ObjGcColor::GRAY);
     s_gray_worklist.push_back(obj);
 }
 
 void* Obj::operator new(std::size_t size) {
 #ifdef DEBUG_STRESS_GC
-    collect_garbage();
+    // Alternate between minor collections and steps of full ones, to stress both
+    if (s_stress_count++ % 2 == 0) {
+        if (s_phase != GcPhase::MARKING) collect_young_garbage();
+    }
+    else if (s_phase == GcPhase::IDLE) {
+        start_marking();
+        if (!collects_in_slices()) finish_marking();
+    }
+    else {
+        collect_slice();
+    }
 #endif
 
 //FIX - Put practical limit on object heap size
 
-    // If the previous allocation put us over the limit, run the collector before
-    // before allocating more.
-    if (s_bytes_allocated > s_next_gc) {
-        collect_garbage();
+    // While a full collection is marking, do a slice of it every so often, and every time
+    // once the nursery is full, to keep it from growing much past that. While the marker
+    // thread is running, just keep an eye out for it being done.
+    if (s_phase == GcPhase::MARKING) {
+        if (s_marker_running ? s_marker_idle.load(std::memory_order_acquire) || s_young_bytes > k_nursery_size
+                             : s_slice_bytes > k_slice_interval || s_young_bytes > k_nursery_size) {
+            collect_slice();
+        }
+    }
+    else {
+        // Sweeping goes on alongside minor collections, a little with every allocation
+        // unless it is done in slices
+        if (s_phase == GcPhase::SWEEPING && (!collects_in_slices() || s_slice_bytes > k_slice_interval)) {
+            collect_slice();
+        }
+
+        // If the previous allocation put us over the limit, run the collector before
+        // before allocating more. Usually just the nursery is full. A full collection
+        // that isn't in slices marks right away, leaving the sweeping for later.
+        if (s_phase == GcPhase::IDLE && s_bytes_allocated > s_next_gc) {
+            start_marking();
+            if (!collects_in_slices()) finish_marking();
+        }
+        else if (s_young_bytes > k_nursery_size) {
+            collect_young_garbage();
+        }
     }
 
     void* ptr = ::operator new(size);
 
-    // Whenever we allocate an Obj, add it to the master list
+    // Whenever we allocate an Obj, add it to the nursery
     Obj* obj = static_cast<Obj*>(ptr);
-    s_all_objects.push_back(obj);
+    s_young_objects.push_back(obj);
 
     // Accumulate bytes allocated and save for later
     s_bytes_allocated += size;
+    s_young_bytes += size;
+    s_slice_bytes += size;
     s_bytes_map[obj] = size;
 
 #ifdef DEBUG_LOG_GC
@@ -79,11 +122,27 @@ void Obj::operator delete(void *memory) {
 }
 
 void Obj::free_objects() {
-    while (s_all_objects.size() > 0) {
-        Obj* obj = s_all_objects.back();
-        delete obj;
-        s_all_objects.pop_back();
+    {
+        std::lock_guard lock(s_heap_mutex);
+        s_marker_running = false;
     }
+
+    // Partway through sweeping, the old objects already looked at past the survivors are gone
+    if (s_phase == GcPhase::SWEEPING) {
+        s_old_objects.erase(s_old_objects.begin() + s_sweep_kept, s_old_objects.begin() + s_sweep_next);
+    }
+    s_phase = GcPhase::IDLE;
+    for (auto objects : { &s_young_objects, &s_old_objects }) {
+        while (objects->size() > 0) {
+            Obj* obj = objects->back();
+            delete obj;
+            objects->pop_back();
+        }
+    }
+    s_remembered.clear();
+    s_old_functions.clear();
+    s_gray_worklist.clear();
+    s_deferred_functions.clear();
 }
 
 void Obj::collect_garbage() {
@@ -92,24 +151,19 @@ void Obj::collect_garbage() {
     std::size_t before = s_bytes_allocated;
 #endif
 
-    mark_gc_roots();
-    trace_gc_references();
+    // Carry on with an incremental collection that is still marking, but one that is
+    // already sweeping has to finish and a new one start
+    if (s_phase == GcPhase::SWEEPING) {
+        sweep_slice(GcClock::time_point::max());
+    }
+    if (s_phase == GcPhase::IDLE) {
+        start_marking();
+    }
     // NOTE! We don't need to release weak references to ObjStrings
     //       like Clox because ObjString automatically removes itself
     //       from the de-duping table upon destruction.
-    sweep();
-
-    // Now that we're done, adjust next GC threshold based
-    // on total (estimated) heap size.
-    // NOTE! In the unlikely event that the heap is so large that multiplying by the growth factor might overflow,
-    //       choose the midpoint between the heap size and the max
-    if (s_bytes_allocated < (std::numeric_limits<std::size_t>::max() / k_gc_heap_grow_factor)) {
-        s_next_gc = s_bytes_allocated * k_gc_heap_grow_factor;
-    }
-    else {
-        std::size_t increment = (std::numeric_limits<std::size_t>::max() - s_bytes_allocated) / 2;
-        s_next_gc = s_bytes_allocated + increment;
-    }
+    finish_marking();
+    sweep_slice(GcClock::time_point::max());
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
@@ -119,19 +173,88 @@ void Obj::collect_garbage() {
 #endif
 }
 
+void Obj::collect_young_garbage() {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    std::size_t before = s_bytes_allocated;
+#endif
+
+    s_collecting_young = true;
+    mark_gc_roots();
+    for (Obj* obj : s_remembered) {
+        obj->mark_references();
+    }
+    for (Obj* function : s_old_functions) {
+        function->mark_references();
+    }
+    trace_gc_references();
+    // Only a full collection flips which color is white, so the survivors have to be made white again
+    std::size_t promoted = s_old_objects.size();
+    sweep_young();
+    for (auto it = s_old_objects.begin() + promoted; it != s_old_objects.end(); ++it) {
+        (*it)->whiten();
+    }
+    s_collecting_young = false;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n", before - s_bytes_allocated, before, s_bytes_allocated);
+#endif
+}
+
+void Obj::remember(Obj* obj) {
+    obj->m_remembered = true;
+    s_remembered.push_back(obj);
+}
+
 void Obj::add_bytes_allocated(std::size_t bytes) {
     s_bytes_allocated += bytes;
+    s_young_bytes += bytes;
+    s_slice_bytes += bytes;
 }
 
 void Obj::subtract_bytes_allocated(std::size_t bytes) {
     s_bytes_allocated -= bytes;
 }
 
-std::vector<Obj*> Obj::s_all_objects{};
+std::vector<Obj*> Obj::s_old_objects{};
+std::vector<Obj*> Obj::s_young_objects{};
+std::vector<Obj*> Obj::s_remembered{};
+std::vector<Obj*> Obj::s_old_functions{};
 std::unordered_map<Obj*, std::size_t> Obj::s_bytes_map{};
 std::vector<Obj*> Obj::s_gray_worklist{};
 std::size_t Obj::s_bytes_allocated{};
 std::size_t Obj::s_next_gc = Obj::k_initial_gc_threshold;
+std::size_t Obj::s_young_bytes{};
+bool Obj::s_collecting_young{};
+ObjGcColor Obj::s_white = ObjGcColor::WHITE;
+Obj::GcPhase Obj::s_phase = Obj::GcPhase::IDLE;
+std::optional<std::chrono::microseconds> Obj::s_pause_budget{};
+std::size_t Obj::s_slice_bytes{};
+std::size_t Obj::s_sweep_next{};
+std::size_t Obj::s_sweep_kept{};
+std::size_t Obj::s_sweep_end{};
+bool Obj::s_concurrent_marking{};
+bool Obj::s_marker_running{};
+std::atomic<bool> Obj::s_marker_idle{};
+std::vector<Obj*> Obj::s_deferred_functions{};
+std::mutex Obj::s_heap_mutex{};
+std::condition_variable_any Obj::s_marker_wake{};
+std::size_t Obj::s_mark_thread_count = 1;
+std::vector<std::unique_ptr<Obj::MarkWorker>> Obj::s_mark_workers{};
+thread_local Obj::MarkWorker* Obj::t_mark_worker{};
+std::atomic<std::size_t> Obj::s_idle_mark_workers{};
+std::size_t Obj::s_mark_generation{};
+std::size_t Obj::s_busy_mark_helpers{};
+std::mutex Obj::s_mark_mutex{};
+std::condition_variable_any Obj::s_mark_start{};
+std::condition_variable Obj::s_mark_done{};
+// Threads are defined after what they use, so that they are stopped and joined before it is destroyed at exit
+std::jthread Obj::s_marker{};
+std::vector<std::jthread> Obj::s_mark_helpers{};
+#ifdef DEBUG_STRESS_GC
+std::size_t Obj::s_stress_count{};
+#endif
 
 void Obj::mark_gc_roots() {
     // Tell the compiler to mark its roots
@@ -142,6 +265,12 @@ void Obj::mark_gc_roots() {
 }
 
 void Obj::trace_gc_references() {
+    // Minor collections have too little to trace to be worth it
+    if (s_mark_thread_count > 1 && !s_collecting_young) {
+        trace_in_parallel();
+        return;
+    }
+
     while (s_gray_worklist.size() > 0) {
         Obj* gray = s_gray_worklist.back();
         s_gray_worklist.pop_back();
@@ -149,23 +278,279 @@ void Obj::trace_gc_references() {
     }
 }
 
-void Obj::sweep() {
-    // Partition the list into non-white followed by white objects
-    auto white_base_iter = partition(s_all_objects.begin(), s_all_objects.end(), [](Obj* obj) { return obj->m_gc_color != ObjGcColor::WHITE; });
+void Obj::start_marking() {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc start marking\n");
+#endif
+    std::lock_guard lock(s_heap_mutex);
+    s_phase = GcPhase::MARKING;
+    mark_gc_roots();
 
-    // Free all the white objects
-    for (auto free_iter = white_base_iter; free_iter != s_all_objects.end(); ++free_iter) {
-        Obj* free_me = *free_iter;
-        delete free_me;
+    if (s_concurrent_marking) {
+        if (!s_marker.joinable()) s_marker = std::jthread(run_marker);
+        s_marker_idle = false;
+        s_marker_running = true;
+        s_marker_wake.notify_one();
     }
+}
 
-    // Remove all the now dangling pointers to white objects
-    s_all_objects.erase(white_base_iter, s_all_objects.end());
+bool Obj::mark_slice(GcClock::time_point deadline) {
+    std::size_t work = 0;
+    while (s_gray_worklist.size() > 0) {
+        Obj* gray = s_gray_worklist.back();
+        s_gray_worklist.pop_back();
+        gray->blacken();
+        if (++work % k_slice_check_interval == 0 && GcClock::now() >= deadline) return false;
+    }
+    return true;
+}
 
-    // Reset all remaining objects to white for the next GC
-    for (auto obj : s_all_objects) {
-        obj->whiten();
+void Obj::finish_marking() {
+    // Stop the marker thread, which waits for the lock if it is partway through a batch
+    std::unique_lock lock(s_heap_mutex);
+    s_marker_running = false;
+
+    // Stores into the roots and into chunks have no barriers, so anything they reference
+    // now might not have been marked yet
+    mark_gc_roots();
+    auto is_black_function = [](Obj* obj) { return obj->m_type == ObjType::FUNCTION && obj->gc_color() == black(); };
+    for (Obj* function : s_old_functions) {
+        if (is_black_function(function)) function->mark_references();
+    }
+    for (Obj* obj : s_young_objects) {
+        if (is_black_function(obj)) obj->mark_references();
+    }
+    for (Obj* function : s_deferred_functions) {
+        function->blacken();
     }
+    s_deferred_functions.clear();
+    trace_gc_references();
+    // Freeing strings takes the interned strings' lock, which may be held when taking this one
+    lock.unlock();
+
+    // Dead objects must go from the other lists before they are freed
+    std::erase_if(s_old_functions, [](Obj* obj) { return obj->gc_color() == white(); });
+
+    // The old objects there are now are the ones to sweep. The nursery is swept here and
+    // now, since until its survivors are promoted, stores into them aren't remembered.
+    // With the nursery empty, no old object references a young one any more.
+    s_phase = GcPhase::SWEEPING;
+    s_sweep_next = 0;
+    s_sweep_kept = 0;
+    s_sweep_end = s_old_objects.size();
+    sweep_young();
+
+    // Rather than making every survivor white again, swap which color means white, so
+    // they all are at once. The dead objects are the black ones until they are swept.
+    s_white = black();
+}
+
+bool Obj::sweep_slice(GcClock::time_point deadline, std::size_t count) {
+    for (std::size_t swept = 1; s_sweep_next < s_sweep_end; swept++) {
+        Obj* obj = s_old_objects[s_sweep_next++];
+        if (obj->gc_color() == black()) {
+            delete obj;
+        }
+        else {
+            s_old_objects[s_sweep_kept++] = obj;
+        }
+        if (swept == count) return false;
+        if (swept % k_slice_check_interval == 0 && GcClock::now() >= deadline) return false;
+    }
+
+    // Remove all the now dangling pointers to white objects, keeping the promoted ones after them
+    s_old_objects.erase(s_old_objects.begin() + s_sweep_kept, s_old_objects.begin() + s_sweep_end);
+    s_phase = GcPhase::IDLE;
+
+    // Now that we're done, adjust next GC threshold based
+    // on total (estimated) heap size.
+    // NOTE! In the unlikely event that the heap is so large that multiplying by the growth factor might overflow,
+    //       choose the midpoint between the heap size and the max
+    if (s_bytes_allocated < (std::numeric_limits<std::size_t>::max() / k_gc_heap_grow_factor)) {
+        s_next_gc = s_bytes_allocated * k_gc_heap_grow_factor;
+    }
+    else {
+        std::size_t increment = (std::numeric_limits<std::size_t>::max() - s_bytes_allocated) / 2;
+        s_next_gc = s_bytes_allocated + increment;
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc done sweeping, next at %zu\n", s_next_gc);
+#endif
+    return true;
+}
+
+void Obj::collect_slice() {
+    s_slice_bytes = 0;
+    if (!collects_in_slices()) {
+        // Only sweeping is left to do, lazily
+        sweep_slice(GcClock::time_point::max(), k_lazy_sweep_count);
+        return;
+    }
+
+    GcClock::time_point deadline = GcClock::now() + s_pause_budget.value_or(k_concurrent_pause_budget);
+    if (s_marker_running) {
+        // Once the nursery is full, the marker thread has fallen behind, so help it out
+        bool done = s_marker_idle;
+        if (!done && s_young_bytes > k_nursery_size) {
+            std::lock_guard lock(s_heap_mutex);
+            done = mark_slice(deadline);
+        }
+        if (done) finish_marking();
+    }
+    else if (s_phase == GcPhase::MARKING) {
+        if (mark_slice(deadline)) finish_marking();
+    }
+    else {
+        sweep_slice(deadline);
+    }
+}
+
+void Obj::run_marker(std::stop_token stop) {
+    std::unique_lock lock(s_heap_mutex);
+    while (s_marker_wake.wait(lock, stop, [] { return s_marker_running && !s_gray_worklist.empty(); })) {
+        for (std::size_t work = 0; work < k_marker_batch && s_gray_worklist.size() > 0; work++) {
+            Obj* gray = s_gray_worklist.back();
+            s_gray_worklist.pop_back();
+            if (gray->m_type == ObjType::FUNCTION) {
+                s_deferred_functions.push_back(gray);
+            }
+            else {
+                gray->blacken();
+            }
+        }
+
+        if (s_gray_worklist.empty()) {
+            s_marker_idle.store(true, std::memory_order_release);
+        }
+        else {
+            // Let stores in between batches
+            lock.unlock();
+            std::this_thread::yield();
+            lock.lock();
+        }
+    }
+}
+
+void Obj::trace_in_parallel() {
+    if (s_mark_helpers.empty()) {
+        for (std::size_t index = 0; index < s_mark_thread_count; index++) {
+            s_mark_workers.push_back(std::make_unique<MarkWorker>());
+        }
+        for (std::size_t index = 1; index < s_mark_thread_count; index++) {
+            s_mark_helpers.emplace_back(run_mark_helper, index);
+        }
+    }
+
+    // Deal the gray objects out between the workers to start them off
+    for (std::size_t index = 0; index < s_gray_worklist.size(); index++) {
+        MarkWorker& worker = *s_mark_workers[index % s_mark_workers.size()];
+        worker.m_shared.push_back(s_gray_worklist[index]);
+    }
+    s_gray_worklist.clear();
+    for (auto& worker : s_mark_workers) {
+        worker->m_shared_size = worker->m_shared.size();
+    }
+    s_idle_mark_workers = 0;
+
+    {
+        std::lock_guard lock(s_mark_mutex);
+        s_mark_generation++;
+        s_busy_mark_helpers = s_mark_helpers.size();
+    }
+    s_mark_start.notify_all();
+    mark_as_worker(*s_mark_workers[0]);
+
+    std::unique_lock lock(s_mark_mutex);
+    s_mark_done.wait(lock, [] { return s_busy_mark_helpers == 0; });
+}
+
+void Obj::mark_as_worker(MarkWorker& worker) {
+    t_mark_worker = &worker;
+    for (;;) {
+        while (worker.m_local.size() > 0) {
+            Obj* gray = worker.m_local.back();
+            worker.m_local.pop_back();
+            gray->blacken();
+
+            // Offer the oldest half, which tend to lead to the most, to any workers that run out
+            if (worker.m_local.size() >= k_mark_share_threshold && worker.m_shared_size == 0) {
+                std::lock_guard lock(worker.m_shared_mutex);
+                auto half = worker.m_local.begin() + worker.m_local.size() / 2;
+                worker.m_shared.insert(worker.m_shared.end(), worker.m_local.begin(), half);
+                worker.m_local.erase(worker.m_local.begin(), half);
+                worker.m_shared_size = worker.m_shared.size();
+            }
+        }
+
+        if (take_gray(worker, worker)) continue;
+        bool stole = false;
+        for (auto& victim : s_mark_workers) {
+            if (victim.get() != &worker && take_gray(worker, *victim)) {
+                stole = true;
+                break;
+            }
+        }
+        if (stole) continue;
+
+        // Nothing left to steal. Once every worker is in the same position, none can offer
+        // any more, so the trace is done. Until then, watch for offers.
+        s_idle_mark_workers++;
+        for (;;) {
+            if (s_idle_mark_workers == s_mark_workers.size()) {
+                t_mark_worker = nullptr;
+                return;
+            }
+            if (std::any_of(s_mark_workers.begin(), s_mark_workers.end(), [](auto& victim) { return victim->m_shared_size > 0; })) {
+                s_idle_mark_workers--;
+                break;
+            }
+            std::this_thread::yield();
+        }
+    }
+}
+
+bool Obj::take_gray(MarkWorker& worker, MarkWorker& victim) {
+    if (victim.m_shared_size == 0) return false;
+    std::lock_guard lock(victim.m_shared_mutex);
+    if (victim.m_shared.empty()) return false;
+    // Take all of our own, or half of someone else's
+    std::size_t count = &victim == &worker ? victim.m_shared.size() : (victim.m_shared.size() + 1) / 2;
+    worker.m_local.insert(worker.m_local.end(), victim.m_shared.begin(), victim.m_shared.begin() + count);
+    victim.m_shared.erase(victim.m_shared.begin(), victim.m_shared.begin() + count);
+    victim.m_shared_size = victim.m_shared.size();
+    return true;
+}
+
+void Obj::run_mark_helper(std::stop_token stop, std::size_t index) {
+    std::size_t seen = 0;
+    std::unique_lock lock(s_mark_mutex);
+    while (s_mark_start.wait(lock, stop, [&seen] { return s_mark_generation != seen; })) {
+        seen = s_mark_generation;
+        lock.unlock();
+        mark_as_worker(*s_mark_workers[index]);
+        lock.lock();
+        if (--s_busy_mark_helpers == 0) s_mark_done.notify_one();
+    }
+}
+
+void Obj::sweep_young() {
+    for (Obj* obj : s_young_objects) {
+        if (obj->gc_color() == white()) {
+            delete obj;
+            continue;
+        }
+        obj->m_old = true;
+        s_old_objects.push_back(obj);
+        if (obj->m_type == ObjType::FUNCTION) s_old_functions.push_back(obj);
+    }
+    s_young_objects.clear();
+    s_young_bytes = 0;
+
+    for (Obj* obj : s_remembered) {
+        obj->m_remembered = false;
+    }
+    s_remembered.clear();
 }
 
 void Obj::blacken() {
@@ -175,6 +560,14 @@ void Obj::blacken() {
     printf("\n");
 #endif    
 
+    mark_references();
+
+    // Now that we are done graying our external references, the object is black
+    set_gc_color(black());
+}
+
+void Obj::mark_references() {
+
 // TODO: Could move responsibility for tracing references down into each subclass,
 // e.g. make it a virtual method. Though the explicit switch here might be more performant.
 // Might need to measure it.
@@ -189,6 +582,7 @@ void Obj::blacken() {
             ObjClass* klass = (ObjClass*)this;
             Obj::mark_gc_gray(klass->name());
             klass->mark_methods_gc_gray();
+            klass->mark_shapes_gc_gray();
             break;
         }
         case ObjType::CLOSURE: {
@@ -205,13 +599,17 @@ void Obj::blacken() {
             for (auto val : function->chunk().get_constants()) {
                 val.mark_obj_gc_gray();
             }
+            for (auto& cache : function->chunk().get_inline_caches()) {
+                cache.mark_gc_gray();
+            }
             break;
         }
         case ObjType::INSTANCE: {
             ObjInstance* instance = (ObjInstance*)this;
             Obj::mark_gc_gray(instance->get_class());
             instance->mark_fields_gc_gray();
-        }  
+            break;
+        }
         case ObjType::UPVALUE: {
             ((ObjUpvalue*)this)->closed_value().mark_obj_gc_gray();
             break;
@@ -222,7 +620,4 @@ void Obj::blacken() {
             //TODO: An easy optimization we could do in markObject() is to skip adding strings and native functions to the gray stack at all since we know they don’t need to be processed. Instead, they could darken from white straight to black.
             break;
     }
-
-    // Now that we are done graying our external references, the object is black
-    m_gc_color = ObjGcColor::BLACK;
 }
\ No newline at end of file
@@ -1,7 +1,14 @@
 #ifndef ppclox_object_hpp
 #define ppclox_object_hpp
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
 #include <unordered_map>
 #include <string>
 #include <string_view>
@@ -20,6 +27,7 @@ enum class ObjType {
     UPVALUE
 };
 
+// WHITE and BLACK swap meanings after every full collection (see Obj::s_white)
 enum class ObjGcColor {
     // White color means we have not reached or processed the object at all.
     // When GC is done, white objects are the unreachable ones.
@@ -32,6 +40,39 @@ enum class ObjGcColor {
     BLACK
 };
 
+class Value;
+
+/**
+ * Objects are collected generationally. New objects start out young, in the nursery
+ * (s_young_objects), and most collections are minor ones that only trace and sweep the
+ * nursery. Roots are the same as for a full collection, plus every old object that a
+ * reference to a young object has been stored into since the last collection: the
+ * remembered set, which the write barriers below maintain. Every young object that
+ * survives is promoted to the old generation in place (objects never move, since raw
+ * pointers to them are held all over), so after any collection the nursery is empty.
+ * A full collection runs instead once the whole heap has grown enough since the last one.
+ * It only stops to mark. The old objects are swept afterwards, a few with every allocation,
+ * alongside minor collections.
+ *
+ * Full collections may also be incremental (see set_pause_budget), interleaving slices of
+ * marking and then sweeping with allocation rather than stopping for the whole heap.
+ * Minor collections wait until a full one is done marking. While marking, the write barrier keeps
+ * any black object from referencing a white one by graying the stored object (so objects
+ * allocated meanwhile can start out white). The roots and the functions' chunks have no
+ * barriers, so the one pause that isn't bounded is at the end of marking: going over them
+ * again and tracing whatever they reach that is still white, then settling the nursery.
+ *
+ * Or the marking may be concurrent (see set_concurrent_marking), with a background thread
+ * doing it while the interpreter carries on, under the same write barrier. The marker
+ * thread and stores into objects (see StoreGuard) take turns holding s_heap_mutex, so it
+ * never traces an object halfway through a change. Chunks change without it, so the marker
+ * leaves functions for the end of marking. Sweeping is still done in slices between
+ * allocations, as is marking too if the nursery fills up before the marker thread is done.
+ *
+ * Whatever tracing a full collection does while the interpreter is stopped can be spread
+ * over several threads (see set_mark_threads). Each has its own gray objects, offering
+ * some of them up whenever it has plenty, for threads that have run out to steal.
+ */
 class Obj {
 public:
     ObjType type() const { return m_type; }
@@ -47,6 +88,53 @@ public:
 
     /** Collect all unreachable objects */
     static void collect_garbage();
+    /** Collect the unreachable young objects, promoting the rest */
+    static void collect_young_garbage();
+    /** Make full collections incremental, working in slices of at most about the given length */
+    static void set_pause_budget(std::chrono::microseconds budget) { s_pause_budget = budget; }
+    /** Have full collections mark on a background thread */
+    static void set_concurrent_marking(bool enabled) { s_concurrent_marking = enabled; }
+    /** Have full collections trace with the given number of threads (counting the interpreter's) while it is stopped */
+    static void set_mark_threads(std::size_t count) { s_mark_thread_count = count; }
+
+    /**
+     * Must be held around every store of a reference into an object (so around its write
+     * barrier too), in case the marker thread is running
+     */
+    class StoreGuard {
+    public:
+        StoreGuard() : m_locked(s_marker_running) {
+            if (m_locked) s_heap_mutex.lock();
+        }
+        ~StoreGuard() {
+            if (m_locked) s_heap_mutex.unlock();
+        }
+        StoreGuard(const StoreGuard&) = delete;
+        StoreGuard& operator=(const StoreGuard&) = delete;
+    private:
+        bool m_locked{};
+    };
+
+    /**
+     * Write barrier, which must follow every store of a reference into an object
+     * that may already have been promoted (any store after its constructor), so that
+     * a minor collection finds young objects only referenced from old ones, and
+     * incremental marking doesn't miss objects stored into ones it already traced.
+     */
+    static void write_barrier(Obj* container, Obj* value) {
+        if (value == nullptr) return;
+        if (container->m_old && !value->m_old && !container->m_remembered) remember(container);
+        if (s_phase == GcPhase::MARKING && container->gc_color() == black()) mark_gc_gray(value);
+    }
+    static inline void write_barrier(Obj* container, Value value);
+
+    /**
+     * Keep an object found again through a weak reference (the interned strings), since
+     * while sweeping it may have been found unreachable but not yet freed
+     */
+    static void revive(Obj* obj) {
+        if (s_phase == GcPhase::SWEEPING && obj->m_old && obj->gc_color() == black()) obj->set_gc_color(white());
+    }
 
     /** Free all allocated objects */
     static void free_objects();
@@ -54,12 +142,12 @@ public:
     /** Virtual destructor ensures that deleting through base pointer will call derived destructors */
     virtual ~Obj() {
 #ifdef DEBUG_LOG_GC
-        printf("%p object type %d. Color: %d\n", this, m_type, m_gc_color);
+        printf("%p object type %d. Color: %d\n", this, m_type, gc_color());
 #endif            
     }
 
 protected:
-    Obj(ObjType type) : m_type(type), m_gc_color(ObjGcColor::WHITE) {
+    Obj(ObjType type) : m_type(type), m_gc_color(white()) {
 #ifdef DEBUG_LOG_GC
         printf("%p object type %d\n", this, m_type);
 #endif      
@@ -72,8 +160,20 @@ protected:
     // of the subclass itself.
     static void subtract_bytes_allocated(std::size_t bytes);
 private:
+    using GcClock = std::chrono::steady_clock;
+    enum class GcPhase {
+        IDLE,
+        MARKING,
+        SWEEPING
+    };
+
     ObjType m_type{};
-    ObjGcColor m_gc_color{};
+    /** Atomic, since parallel marking threads race to gray the same object */
+    std::atomic<ObjGcColor> m_gc_color{};
+    /** Survived a collection, so is only collected by a full one */
+    bool m_old{};
+    /** In the remembered set */
+    bool m_remembered{};
 
     /** 
      * Master list of all allocated objects
@@ -82,7 +182,17 @@ private:
      *       Clox uses an intrusive linked list but I'd prefer to avoid manual linked lists 
      *       in favor of a C++ collection of some sort.
      */
-    static std::vector<Obj*> s_all_objects;
+    static std::vector<Obj*> s_old_objects;
+    /** Objects allocated since the last collection */
+    static std::vector<Obj*> s_young_objects;
+    /** Old objects that may reference young ones, traced as roots by minor collections */
+    static std::vector<Obj*> s_remembered;
+    /**
+     * Old functions are always traced by minor collections, rather than having barriers on
+     * everything that adds to their chunks (constants from the compiler and optimizer,
+     * and the inline caches' methods and shapes).
+     */
+    static std::vector<Obj*> s_old_functions;
 
     /**
      * Track bytes allocated to Obj instances themselves
@@ -98,15 +208,127 @@ private:
     static constexpr std::size_t k_initial_gc_threshold = 1024 * 1024;
     static constexpr std::size_t k_gc_heap_grow_factor = 2;
     static std::size_t s_next_gc;
+    /** Bytes allocated since the last collection, and how many trigger a minor one */
+    static std::size_t s_young_bytes;
+    static constexpr std::size_t k_nursery_size = 256 * 1024;
+    /** Whether a minor collection is running, which leaves old objects alone */
+    static bool s_collecting_young;
+    /**
+     * Which of WHITE and BLACK means white. A full collection flips it once it is done
+     * marking, so the survivors, all black, are white for the next one without being
+     * touched. Old objects not yet swept that are "white" are then the dead ones.
+     */
+    static ObjGcColor s_white;
+    static ObjGcColor white() { return s_white; }
+    static ObjGcColor black() { return s_white == ObjGcColor::WHITE ? ObjGcColor::BLACK : ObjGcColor::WHITE; }
+
+    /** Where the full collection is up to, unless it runs in one go */
+    static GcPhase s_phase;
+    /** Length of each slice of an incremental full collection, if they are incremental */
+    static std::optional<std::chrono::microseconds> s_pause_budget;
+    /** Bytes allocated since the last slice, and how many call for the next one */
+    static std::size_t s_slice_bytes;
+    static constexpr std::size_t k_slice_interval = 64 * 1024;
+    /** Old objects each allocation sweeps, when full collections aren't in slices */
+    static constexpr std::size_t k_lazy_sweep_count = 64;
+    /** Objects a slice blackens or sweeps between checks of the clock */
+    static constexpr std::size_t k_slice_check_interval = 32;
+    /**
+     * While sweeping, survivors so far are compacted to below s_sweep_kept, and the
+     * old objects left to look at are from s_sweep_next up to s_sweep_end (the objects
+     * after that were promoted at the end of marking, and are live).
+     */
+    static std::size_t s_sweep_next;
+    static std::size_t s_sweep_kept;
+    static std::size_t s_sweep_end;
+
+    static bool s_concurrent_marking;
+    /** Whether the marker thread is (or may be about to start) marking, which only the interpreter's thread changes */
+    static bool s_marker_running;
+    /** Set by the marker thread when it has run out of gray objects, for the interpreter's thread to finish marking */
+    static std::atomic<bool> s_marker_idle;
+    /** Functions the marker thread left gray, since their chunks may be changing */
+    static std::vector<Obj*> s_deferred_functions;
+    /** Length of the interpreter's own slices (sweeping, or helping the marker thread) if concurrent marking has no budget given */
+    static constexpr std::chrono::microseconds k_concurrent_pause_budget{1000};
+    /** Objects the marker thread blackens before letting stores in again */
+    static constexpr std::size_t k_marker_batch = 256;
+    /** Guards the gray worklist and the objects' references while the marker thread is running */
+    static std::mutex s_heap_mutex;
+    static std::condition_variable_any s_marker_wake;
+    static std::jthread s_marker;
 
+    /** One thread's share of a parallel trace */
+    class MarkWorker {
+    public:
+        /** Gray objects only this worker touches */
+        std::vector<Obj*> m_local{};
+        /** Gray objects offered up for any worker to take, from the front */
+        std::deque<Obj*> m_shared{};
+        std::mutex m_shared_mutex{};
+        /** Size of m_shared, to look at without taking the lock */
+        std::atomic<std::size_t> m_shared_size{};
+    };
+    static std::size_t s_mark_thread_count;
+    /** The interpreter's thread works on the first, and a helper thread on each of the rest */
+    static std::vector<std::unique_ptr<MarkWorker>> s_mark_workers;
+    /** The worker of the thread that is tracing in parallel, if it is */
+    static thread_local MarkWorker* t_mark_worker;
+    /** Workers that have run out of gray objects, and found none to steal */
+    static std::atomic<std::size_t> s_idle_mark_workers;
+    /** A worker offers half its gray objects once it has this many and none on offer */
+    static constexpr std::size_t k_mark_share_threshold = 64;
+    /** Counts the parallel traces started, to wake the helpers up for each */
+    static std::size_t s_mark_generation;
+    /** Helpers that haven't finished the current parallel trace */
+    static std::size_t s_busy_mark_helpers;
+    static std::mutex s_mark_mutex;
+    static std::condition_variable_any s_mark_start;
+    static std::condition_variable s_mark_done;
+    static std::vector<std::jthread> s_mark_helpers;
+#ifdef DEBUG_STRESS_GC
+    static std::size_t s_stress_count;
+#endif
+
+    static void remember(Obj* obj);
     static void mark_gc_roots();
     static void trace_gc_references();
-    static void sweep();
+    /** Gray the roots to start a full collection */
+    static void start_marking();
+    /** Blacken gray objects until there are none left (returning true) or the deadline passes */
+    static bool mark_slice(GcClock::time_point deadline);
+    /** Go over the roots and functions again, trace the rest, and settle the nursery, ready to sweep */
+    static void finish_marking();
+    /**
+     * Free dead old objects until there are none left (returning true and ending the
+     * collection), the deadline passes or the given number of objects have been swept
+     */
+    static bool sweep_slice(GcClock::time_point deadline, std::size_t count = SIZE_MAX);
+    /** Whether full collections are done in slices, rather than marking all at once and then sweeping lazily */
+    static bool collects_in_slices() { return s_pause_budget || s_concurrent_marking; }
+    /** Do one slice of the incremental full collection */
+    static void collect_slice();
+    /** Body of the marker thread, which blackens gray objects whenever the interpreter's thread has it marking */
+    static void run_marker(std::stop_token stop);
+    /** Trace from the gray worklist with every mark worker */
+    static void trace_in_parallel();
+    /** Blacken gray objects as the given worker until every worker is out of them */
+    static void mark_as_worker(MarkWorker& worker);
+    /** Move some of the worker's gray objects, or of a victim's offered ones, to its local ones. Returns false if there were none. */
+    static bool take_gray(MarkWorker& worker, MarkWorker& victim);
+    /** Body of a helper thread, which works on the given worker in every parallel trace */
+    static void run_mark_helper(std::stop_token stop, std::size_t index);
+    /** Free the white young objects, and promote the rest */
+    static void sweep_young();
 
     /** Blacken a gray object by first graying its references, then mark it as black */
     void blacken();
+    /** Gray the objects this one references */
+    void mark_references();
     /** Reset object color to white */
-    void whiten() { m_gc_color = ObjGcColor::WHITE; };
+    void whiten() { set_gc_color(white()); };
+    ObjGcColor gc_color() const { return m_gc_color.load(std::memory_order_relaxed); }
+    void set_gc_color(ObjGcColor color) { m_gc_color.store(color, std::memory_order_relaxed); }
 };
 
 #endif
\ No newline at end of file
@@ -1,5 +1,42 @@
 #include "object_class.hpp"
 
+std::optional<std::size_t> Shape::find_slot(ObjString* name) const {
+    auto it = m_slots.find(ObjStringRef(name));
+    if (it != m_slots.end()) {
+        return it->second;
+    }
+    return std::nullopt;
+}
+
+Shape* Shape::add_field(ObjString* name) {
+    auto it = m_transitions.find(ObjStringRef(name));
+    if (it != m_transitions.end()) {
+        return it->second.get();
+    }
+
+    // The new shape has all of our slots, plus the new field in the next slot
+    auto shape = std::make_unique<Shape>(m_class);
+    shape->m_slots = m_slots;
+    shape->m_slots[ObjStringRef(name)] = m_slots.size();
+    m_class->update_field_count_hint(shape->field_count());
+
+    // The class owns its shapes, and so their names
+    Obj::StoreGuard guard;
+    Shape* result = shape.get();
+    m_transitions[ObjStringRef(name)] = std::move(shape);
+    Obj::write_barrier(m_class, name);
+    return result;
+}
+
+void Shape::mark_gc_gray() {
+    // Every field name appears as a transition key somewhere in the tree,
+    // so marking the transitions covers all of the slot table keys too.
+    for (auto& pair : m_transitions) {
+        Obj::mark_gc_gray(pair.first.obj_string());
+        pair.second->mark_gc_gray();
+    }
+}
+
 ObjClass::~ObjClass() {
     // When we are being destructed, inform the garbage collector of the
     // approximate number of additional bytes being removed due to the fields.
@@ -17,6 +54,7 @@ std::optional<Value> ObjClass::get_method(ObjString* name) {
 }
 
 void ObjClass::set_method(ObjString* name, Value value) {
+    StoreGuard guard;
     if (m_methods.insert_or_assign(ObjStringRef(name), value).second) {
         // If insertion took place, inform the garbage collector of the
         // approximate number of additional bytes used by the instance
@@ -24,6 +62,8 @@ void ObjClass::set_method(ObjString* name, Value value) {
 //See https://stackoverflow.com/questions/25375202/how-to-measure-the-memory-usage-of-stdunordered-map   
         Obj::add_bytes_allocated(sizeof(ObjStringRef) + sizeof(Value));
     }
+    Obj::write_barrier(this, name);
+    Obj::write_barrier(this, value);
 }
 
 void ObjClass::mark_methods_gc_gray() {
@@ -35,40 +75,55 @@ void ObjClass::mark_methods_gc_gray() {
 
 void ObjClass::inherit_methods_from(ObjClass* superclass) {
     // Copy all the methods from the superclass into the subclass
+    StoreGuard guard;
     for (auto method_pair : superclass->m_methods) {
         m_methods[method_pair.first] = method_pair.second;
+        Obj::write_barrier(this, method_pair.first.obj_string());
+        Obj::write_barrier(this, method_pair.second);
     }
 }
 
+ObjInstance::ObjInstance(ObjClass* klass) : Obj(ObjType::INSTANCE), m_shape(klass->root_shape()) {
+    // Instances of a class tend to end up with the same fields, so
+    // make room for as many as we've seen before to avoid regrowing.
+    m_fields.reserve(klass->field_count_hint());
+}
+
 ObjInstance::~ObjInstance() {
     // When we are being destructed, inform the garbage collector of the
     // approximate number of additional bytes being removed due to the fields.
-//FIX - Is there a better way to get the approximate number of bytes used by the field table?
-//See https://stackoverflow.com/questions/25375202/how-to-measure-the-memory-usage-of-stdunordered-map   
-    Obj::subtract_bytes_allocated(m_fields.size() * (sizeof(ObjStringRef) + sizeof(Value)));   
+    Obj::subtract_bytes_allocated(m_fields.size() * sizeof(Value));
 }
 
 std::optional<Value> ObjInstance::get_field(ObjString* name) {
-    auto it = m_fields.find(ObjStringRef(name));
-    if (it != m_fields.end()) {
-        return it->second;
+    auto slot = m_shape->find_slot(name);
+    if (slot.has_value()) {
+        return m_fields[slot.value()];
     }
     return std::nullopt;
 }
 
 void ObjInstance::set_field(ObjString* name, Value value) {
-    if (m_fields.insert_or_assign(ObjStringRef(name), value).second) {
-        // If insertion took place, inform the garbage collector of the
-        // approximate number of additional bytes used by the instance
-//FIX - Is there a better way to get the approximate number of bytes used by the field table?
-//See https://stackoverflow.com/questions/25375202/how-to-measure-the-memory-usage-of-stdunordered-map   
-        Obj::add_bytes_allocated(sizeof(ObjStringRef) + sizeof(Value));
+    auto slot = m_shape->find_slot(name);
+    if (slot.has_value()) {
+        set_field_at(slot.value(), value);
+        return;
     }
+    add_field(m_shape->add_field(name), value);
+}
+
+void ObjInstance::add_field(Shape* shape, Value value) {
+    StoreGuard guard;
+    m_shape = shape;
+    m_fields.push_back(value);
+    Obj::write_barrier(this, value);
+    // Inform the garbage collector of the approximate
+    // number of additional bytes used by the instance
+    Obj::add_bytes_allocated(sizeof(Value));
 }
 
 void ObjInstance::mark_fields_gc_gray() {
-    for (auto pair : m_fields) {
-        Obj::mark_gc_gray(pair.first.obj_string());
-        pair.second.mark_obj_gc_gray();
+    for (auto value : m_fields) {
+        value.mark_obj_gc_gray();
     }
-}
\ No newline at end of file
+}
@@ -1,17 +1,50 @@
 #ifndef ppclox_object_class_hpp
 #define ppclox_object_class_hpp
 
+#include <algorithm>
 #include <unordered_map>
 #include <optional>
+#include <memory>
 
 #include "common.hpp"
 #include "value.hpp"
 #include "object.hpp"
 #include "object_string.hpp"
 
+class ObjClass;
+
+/**
+ * A shape (or hidden class) describes the layout of an instance's fields: which slot
+ * of the instance's field array holds each field name. Instances of the same class
+ * that had the same fields added in the same order share a single shape, so the
+ * name -> slot table is stored once rather than per instance.
+ * Shapes form a tree rooted at the class's empty root shape. Adding a field follows
+ * (or creates) the transition for that name to a child shape.
+ * NOTE! Shapes are immutable once created and owned by their class, so
+ *       a shape also identifies the class of its instances.
+ */
+class Shape {
+public:
+    Shape(ObjClass* klass) : m_class(klass) {}
+
+    ObjClass* get_class() const { return m_class; }
+    /** Number of fields (slots) an instance of this shape has */
+    std::size_t field_count() const { return m_slots.size(); }
+    /** Return the slot holding the named field, if instances of this shape have it */
+    std::optional<std::size_t> find_slot(ObjString* name) const;
+    /** Return the shape reached by adding the named field to this one, creating it if needed */
+    Shape* add_field(ObjString* name);
+    /** Mark the field names of this shape and all shapes reachable from it */
+    void mark_gc_gray();
+private:
+    ObjClass* m_class{};
+    std::unordered_map<ObjStringRef, std::size_t, ObjStringRefHash> m_slots{};
+    std::unordered_map<ObjStringRef, std::unique_ptr<Shape>, ObjStringRefHash> m_transitions{};
+};
+
 class ObjClass : public Obj {
 public:
-    ObjClass(ObjString* name) : Obj(ObjType::CLASS), m_name(name) {}
+    ObjClass(ObjString* name) : Obj(ObjType::CLASS), m_name(name), m_root_shape(std::make_unique<Shape>(this)) {}
     ~ObjClass();
 
     void print() const override { printf("%s class", m_name->chars()); }
@@ -22,8 +55,16 @@ public:
     void mark_methods_gc_gray();
     // Inherit all methods from the given superclass
     void inherit_methods_from(ObjClass* superclass);
+    /** The shape of a new instance with no fields */
+    Shape* root_shape() { return m_root_shape.get(); }
+    void mark_shapes_gc_gray() { m_root_shape->mark_gc_gray(); }
+    /** Largest field count seen on any instance so far, used to size new instances up front */
+    std::size_t field_count_hint() const { return m_field_count_hint; }
+    void update_field_count_hint(std::size_t field_count) { m_field_count_hint = std::max(m_field_count_hint, field_count); }
 private:
     ObjString* m_name{};
+    std::unique_ptr<Shape> m_root_shape{};
+    std::size_t m_field_count_hint{};
 //TODO: I think these Values are always ObjClosures, so we could store them
 //      as ObjClosure* directly potentially.
     std::unordered_map<ObjStringRef, Value, ObjStringRefHash> m_methods{};
@@ -31,18 +72,30 @@ private:
 
 class ObjInstance : public Obj {
 public:
-    ObjInstance(ObjClass* klass) : Obj(ObjType::INSTANCE), m_class(klass) {}
+    ObjInstance(ObjClass* klass);
      ~ObjInstance();
 
-    void print() const override { printf("%s instance", m_class->name()->chars()); }
+    void print() const override { printf("%s instance", get_class()->name()->chars()); }
 
-    ObjClass* get_class() { return m_class; }
+    ObjClass* get_class() const { return m_shape->get_class(); }
+    Shape* shape() const { return m_shape; }
     std::optional<Value> get_field(ObjString* name);
     void set_field(ObjString* name, Value value);
+    /** Read the field at the given slot, which must exist in this instance's shape */
+    Value field_at(std::size_t slot) const { return m_fields[slot]; }
+    /** Write the field at the given slot, which must exist in this instance's shape */
+    void set_field_at(std::size_t slot, Value value) {
+        StoreGuard guard;
+        m_fields[slot] = value;
+        Obj::write_barrier(this, value);
+    }
+    /** Append a new field, moving to the given shape which must be the transition for it */
+    void add_field(Shape* shape, Value value);
     void mark_fields_gc_gray();
 private:
-    ObjClass* m_class{};
-    std::unordered_map<ObjStringRef, Value, ObjStringRefHash> m_fields{};
+    Shape* m_shape{};
+    /** Field values, indexed by the slots in m_shape */
+    std::vector<Value> m_fields{};
 };
 
 #endif
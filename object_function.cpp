@@ -1,6 +1,11 @@
 #include "object_function.hpp"
 #include "chunk.hpp"
+#include "register_code.hpp"
 
 void ObjFunction::print() const {
     printf("<fn %s>", name());
-}
\ No newline at end of file
+}
+RegisterCode& ObjFunction::translate_register_code() {
+    m_register_code = std::make_shared<RegisterCode>(*m_chunk, m_arity);
+    return *m_register_code;
+}
@@ -7,10 +7,15 @@
 #include "object.hpp"
 #include "object_string.hpp"
 #include "value.hpp"
+#include "value_stack.hpp"
 
 // We forward declare these instead of including their headers to avoid circular
 // dependencies.
 class Chunk;
+class RegisterCode;
+class NativeCode;
+class StencilCode;
+class AotFunction;
 class ObjInstance;
 
 enum class FunctionType {
@@ -35,8 +40,28 @@ public:
 
     /** Return a mutable reference to the Chunk for writing, etc. */
     Chunk& chunk() { return *m_chunk; };
+    /** The register backend's form of this function, translated from the chunk on first use */
+    RegisterCode& register_code() { return m_register_code != nullptr ? *m_register_code : translate_register_code(); }
+    bool has_register_code() const { return m_register_code != nullptr; }
     std::size_t m_arity{};
     std::size_t m_upvalue_count{};
+    /** The most values the function's frame holds on the stack (see Chunk::max_stack_depth), set once the program is compiled */
+    std::size_t m_max_stack_depth{};
+    // Hotness counters and compiled code, managed by Tiering (see tiering.hpp)
+    /** Number of times this function has been called */
+    std::size_t m_call_count{};
+    /** Loop iterations run in this function (across all its activations) since it last considered tracing */
+    std::size_t m_back_edge_count{};
+    /** Machine code for this function, once the JIT has compiled it */
+    std::shared_ptr<NativeCode> m_native_code{};
+    /** Machine code for this function's bytecode, once it has been built from stencils (see stencil.hpp) */
+    std::shared_ptr<StencilCode> m_stencil_code{};
+    /** Code compiled ahead of time for this function, when running an emitted program (see aot.hpp) */
+    const AotFunction* m_aot_function{};
+    /** Set if the JIT couldn't compile this function, so it isn't tried again */
+    bool m_compile_failed{};
+    /** Set once a loop of this function was found not to run faster in native code, so activations stay interpreted */
+    bool m_osr_skipped{};
     const char* name() const { return m_name != nullptr ? m_name->chars() : "<script>"; };
     ObjString* name_obj() { return m_name; }
 private:
@@ -44,8 +69,11 @@ private:
     //       we don't worry about including them in GC memory pressure analysis.
     //       Any objects actually included in the chunk's contants will be included as expected.
     std::shared_ptr<Chunk> m_chunk{};
+    std::shared_ptr<RegisterCode> m_register_code{};
     /** @todo Can we make this safer than a raw pointer somehow? */
     ObjString* m_name{};
+
+    RegisterCode& translate_register_code();
 };
 
 class ObjUpvalue : public Obj {
@@ -57,13 +85,24 @@ public:
     // Lox user can directly access in a program. So this code will never actually execute
     void print() const override { printf("upvalue"); }
 
-    void close(const std::vector<Value>& stack) { m_value = stack[m_value_stack_index.value()]; m_value_stack_index = std::nullopt; }
+    void close(const ValueStack& stack) {
+        StoreGuard guard;
+        m_value = stack[m_value_stack_index.value()];
+        m_value_stack_index = std::nullopt;
+        Obj::write_barrier(this, m_value);
+    }
 
     /** Returns if upvalue contains index into value stack. If not, use closed_value. */
     bool is_stack_index() { return m_value_stack_index.has_value(); }
     /** Only use if is_stack_index() reports true */
     std::size_t stack_index() { return m_value_stack_index.value(); }
-    Value& closed_value() { return m_value; }
+    Value closed_value() const { return m_value; }
+    /** Only use if is_stack_index() reports false */
+    void set_closed_value(Value value) {
+        StoreGuard guard;
+        m_value = value;
+        Obj::write_barrier(this, value);
+    }
 private:
     std::optional<std::size_t> m_value_stack_index{};
     Value m_value{};
@@ -83,7 +122,12 @@ public:
     }
     void print() const override { m_function->print(); }
     ObjFunction* function() { return m_function; }
-    std::vector<ObjUpvalue*>& upvalues() { return m_upvalues; }
+    const std::vector<ObjUpvalue*>& upvalues() const { return m_upvalues; }
+    void set_upvalue(std::size_t index, ObjUpvalue* upvalue) {
+        StoreGuard guard;
+        m_upvalues[index] = upvalue;
+        Obj::write_barrier(this, upvalue);
+    }
     std::size_t upvalues_vector_bytes() { return m_upvalues.capacity() * sizeof(ObjUpvalue*); }
 private:
     ObjFunction* m_function{};
@@ -109,7 +153,7 @@ private:
     ObjClosure* m_method{};
 };
 
-typedef std::vector<Value>::iterator NativeFnArgsIterator;
+typedef ValueStack::iterator NativeFnArgsIterator;
 typedef Value (*NativeFn)(std::size_t arg_count, NativeFnArgsIterator args_start, NativeFnArgsIterator args_end);
 
 class ObjNative : public Obj {
@@ -106,6 +106,7 @@ ObjString* ObjString::operator+(const ObjString& rhs) const {
 ObjString* ObjString::find_existing(const InternedStringKey& search) {
     auto it = s_interned_strings.find(search);
     if (it != s_interned_strings.end()) {
+        Obj::revive(it->second);
         return it->second;
     }
     return nullptr;
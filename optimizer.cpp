@@ -0,0 +1,822 @@
+#include "optimizer.hpp"
+
+#include <bit>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include "chunk.hpp"
+#include "object_string.hpp"
+#include "ssa.hpp"
+
+int Optimizer::s_level{};
+bool Optimizer::s_dump{};
+GlobalFacts Optimizer::s_globals{};
+
+/** Stack depth before each instruction, with the frame starting out with the callee (or receiver) and arguments */
+static std::vector<std::size_t> stack_depths(const std::vector<OptInstruction>& instructions, std::size_t arity) {
+    std::vector<std::size_t> depths(instructions.size(), SIZE_MAX);
+    // Depth at each forward jump target, as the jumps to it are seen
+    std::vector<std::size_t> target_depths(instructions.size() + 1, SIZE_MAX);
+    std::size_t depth = arity + 1;
+    for (std::size_t i = 0; i < instructions.size(); i++) {
+        const OptInstruction& instruction = instructions[i];
+        if (target_depths[i] != SIZE_MAX) depth = target_depths[i];
+        depths[i] = depth;
+        if (instruction.is_jump() && instruction.m_op != OpCode::LOOP && instruction.m_target < target_depths.size()) {
+            target_depths[instruction.m_target] = depth;
+        }
+        depth += Chunk::stack_effect(std::to_underlying(instruction.m_op), instruction.m_operands.data());
+    }
+    return depths;
+}
+
+/** How many values an instruction takes off the top of the stack (or reads from under the top) */
+static std::size_t stack_reads(const OptInstruction& instruction) {
+    switch (instruction.m_op) {
+        case OpCode::CONSTANT:
+        case OpCode::NIL:
+        case OpCode::TRUE:
+        case OpCode::FALSE:
+        case OpCode::GET_LOCAL:
+        case OpCode::GET_GLOBAL:
+        case OpCode::GET_UPVALUE:
+        case OpCode::CLOSURE:
+        case OpCode::CLASS:
+        case OpCode::JUMP:
+        case OpCode::LOOP:
+            return 0;
+        case OpCode::GET_SUPER:
+        case OpCode::SET_PROPERTY:
+        case OpCode::EQUAL:
+        case OpCode::GREATER:
+        case OpCode::LESS:
+        case OpCode::ADD:
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+        case OpCode::INHERIT:
+        case OpCode::METHOD:
+            return 2;
+        case OpCode::CALL:
+        case OpCode::TAIL_CALL:
+        case OpCode::GUARD_CALL:
+            return instruction.m_operands[0] + 1;
+        case OpCode::INVOKE:
+        case OpCode::TAIL_INVOKE:
+        case OpCode::GUARD_INVOKE:
+        case OpCode::CALL_UNBOUND:
+            return instruction.m_operands[1] + 1;
+        case OpCode::SUPER_INVOKE:
+            return instruction.m_operands[1] + 2;
+        default:
+            return 1;
+    }
+}
+
+/**
+ * The functions the program's calls can have inlined (see optimizer.hpp), by the global
+ * or method name the program defines them under.
+ */
+class InlineCandidates {
+public:
+    class Candidate {
+    public:
+        ObjFunction* m_function{};
+        /** The function as a constant */
+        Value m_value{};
+        /** Its instructions, and the stack depth before each */
+        std::vector<OptInstruction> m_body{};
+        std::vector<std::size_t> m_depths{};
+    };
+
+    InlineCandidates(const std::vector<ObjFunction*>& functions, const std::vector<std::vector<OptInstruction>>& instructions);
+
+    const Candidate* global(std::size_t slot) const { return find(m_globals, slot); }
+    const Candidate* method(ObjString* name) const { return find(m_methods, name); }
+private:
+    static constexpr std::size_t k_max_body_size = 16;
+
+    std::unordered_map<ObjFunction*, Candidate> m_candidates{};
+    /** The function each name is defined as, or nullptr if it is defined more than once or can't be inlined */
+    std::unordered_map<std::size_t, const Candidate*> m_globals{};
+    std::unordered_map<ObjString*, const Candidate*> m_methods{};
+
+    template <typename Key>
+    static const Candidate* find(const std::unordered_map<Key, const Candidate*>& names, Key key) {
+        auto it = names.find(key);
+        return it != names.end() ? it->second : nullptr;
+    }
+    /** Whether the function is short, and only uses what can run in its caller's frame. Calls rule out recursion too. */
+    static bool is_inlinable(const ObjFunction* function, const std::vector<OptInstruction>& body);
+};
+
+class ChunkOptimizer {
+public:
+    ChunkOptimizer(ObjFunction* function) : m_function(function), m_chunk(function->chunk()) {
+        decode();
+        find_targets();
+    }
+
+    const std::vector<OptInstruction>& instructions() const { return m_instructions; }
+    /** Run the passes below, once or until they stop finding anything */
+    void run_passes(int level);
+    /** Inline the calls to the candidates (see optimizer.hpp), and tidy up after */
+    void inline_calls(const InlineCandidates& candidates, int level);
+    /** Run the SSA based passes at -O3, then write the chunk back if anything changed */
+    void finish(int level, const GlobalFacts& globals);
+private:
+    ObjFunction* m_function;
+    Chunk& m_chunk;
+    std::vector<OptInstruction> m_instructions{};
+    /** Whether each instruction is the target of some jump */
+    std::vector<bool> m_targets{};
+    bool m_changed{};
+
+    void decode();
+    /** Write the instructions back to the chunk. Returns false (leaving the chunk alone) if a jump no longer fits. */
+    bool encode();
+    /** Drop removed instructions, moving jumps to them onto the next instruction kept */
+    void compact();
+    void find_targets();
+
+    bool fold_constants();
+    bool simplify();
+    bool thread_jumps();
+    bool remove_dead_code();
+    /** Read methods into locals that are only ever called unbound (see optimizer.hpp) */
+    bool elide_bound_methods();
+    /** Index of the CALL taking the value the instruction at the given index pushes as its callee, if one does */
+    std::optional<std::size_t> callee_call(const std::vector<std::size_t>& depths, std::size_t load) const;
+
+    /**
+     * The guard, the callee's body and then the call itself, for the call at the given
+     * index. Jumps in it are to indices relative to its start. Nothing if it can't be inlined.
+     */
+    std::optional<std::vector<OptInstruction>> inline_call(std::size_t call, const InlineCandidates::Candidate& callee, std::size_t base);
+
+    /** The value an instruction pushes, if it is a literal */
+    std::optional<Value> literal(const OptInstruction& instruction) const;
+    /** An instruction pushing the value, or nothing if the constant table is full */
+    std::optional<OptInstruction> make_literal(Value value, std::size_t line);
+    /** Index of the value in the constant table, adding it if it isn't there. Nothing if the table is full. */
+    std::optional<std::uint8_t> constant_index(Value value);
+    /** Whether instructions first+1 up to first+count-1 can be replaced, since no jump lands among them */
+    bool is_straight(std::size_t first, std::size_t count) const;
+};
+
+void ChunkOptimizer::decode() {
+    auto& code = m_chunk.get_code();
+    auto& lines = m_chunk.get_lines();
+    std::vector<std::size_t> indices(code.size() + 1, SIZE_MAX);
+
+    for (std::size_t offset = 0; offset < code.size();) {
+        std::size_t length = m_chunk.opcode_length(code[offset], offset);
+        OptInstruction instruction{ .m_op = static_cast<OpCode>(code[offset]), .m_line = lines[offset] };
+        if (instruction.is_jump()) {
+            instruction.m_operands.assign(code.begin() + offset + 1, code.begin() + offset + length - 2);
+            std::uint16_t jump = static_cast<std::uint16_t>((code[offset + length - 2] << 8) | code[offset + length - 1]);
+            // Offset of the target for now, mapped to an index below
+            instruction.m_target = instruction.m_op == OpCode::LOOP ? offset + length - jump : offset + length + jump;
+        }
+        else {
+            instruction.m_operands.assign(code.begin() + offset + 1, code.begin() + offset + length);
+        }
+        indices[offset] = m_instructions.size();
+        m_instructions.push_back(std::move(instruction));
+        offset += length;
+    }
+    indices[code.size()] = m_instructions.size();
+
+    for (auto& instruction : m_instructions) {
+        if (instruction.is_jump()) instruction.m_target = indices.at(instruction.m_target);
+    }
+}
+
+bool ChunkOptimizer::encode() {
+    std::vector<std::size_t> offsets(m_instructions.size() + 1);
+    for (std::size_t i = 0; i < m_instructions.size(); i++) {
+        std::size_t length = 1 + m_instructions[i].m_operands.size() + (m_instructions[i].is_jump() ? 2 : 0);
+        offsets[i + 1] = offsets[i] + length;
+    }
+
+    std::vector<std::uint8_t> code{};
+    std::vector<std::size_t> lines{};
+    std::vector<std::size_t> inlined{};
+    bool has_inlined = false;
+    for (std::size_t i = 0; i < m_instructions.size(); i++) {
+        const OptInstruction& instruction = m_instructions[i];
+        code.push_back(std::to_underlying(instruction.m_op));
+        code.insert(code.end(), instruction.m_operands.begin(), instruction.m_operands.end());
+        if (instruction.is_jump()) {
+            if (instruction.m_target >= m_instructions.size()) return false;
+            std::size_t from = offsets[i + 1];
+            std::size_t to = offsets[instruction.m_target];
+            std::size_t jump = instruction.m_op == OpCode::LOOP ? from - to : to - from;
+            if (jump > std::numeric_limits<std::uint16_t>::max()) return false;
+            code.push_back(static_cast<std::uint8_t>(jump >> 8));
+            code.push_back(static_cast<std::uint8_t>(jump & 0xff));
+        }
+        lines.resize(code.size(), instruction.m_line);
+        inlined.resize(code.size(), instruction.m_inlined);
+        has_inlined |= instruction.m_inlined != 0;
+    }
+    m_chunk.replace_code(std::move(code), std::move(lines), has_inlined ? std::move(inlined) : std::vector<std::size_t>{});
+    return true;
+}
+
+void ChunkOptimizer::compact() {
+    // Where each instruction ends up is the number kept before it. For a removed
+    // instruction that is where the next kept one ends up, which is where jumps to it go.
+    std::vector<std::size_t> indices(m_instructions.size() + 1);
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < m_instructions.size(); i++) {
+        indices[i] = kept;
+        if (!m_instructions[i].m_removed) kept++;
+    }
+    indices[m_instructions.size()] = kept;
+
+    std::vector<OptInstruction> instructions{};
+    for (auto& instruction : m_instructions) {
+        if (instruction.m_removed) continue;
+        if (instruction.is_jump()) instruction.m_target = indices[instruction.m_target];
+        instructions.push_back(std::move(instruction));
+    }
+    m_instructions = std::move(instructions);
+    find_targets();
+}
+
+void ChunkOptimizer::find_targets() {
+    m_targets.assign(m_instructions.size() + 1, false);
+    for (auto& instruction : m_instructions) {
+        if (instruction.is_jump()) m_targets[instruction.m_target] = true;
+    }
+}
+
+bool ChunkOptimizer::is_straight(std::size_t first, std::size_t count) const {
+    if (first + count > m_instructions.size()) return false;
+    for (std::size_t i = first; i < first + count; i++) {
+        if (m_instructions[i].m_removed) return false;
+        if (i > first && m_targets[i]) return false;
+    }
+    return true;
+}
+
+std::optional<Value> ChunkOptimizer::literal(const OptInstruction& instruction) const {
+    switch (instruction.m_op) {
+        case OpCode::CONSTANT: return m_chunk.get_constants()[instruction.m_operands[0]];
+        case OpCode::NIL: return Value();
+        case OpCode::TRUE: return Value(true);
+        case OpCode::FALSE: return Value(false);
+        default: return std::nullopt;
+    }
+}
+
+std::optional<OptInstruction> ChunkOptimizer::make_literal(Value value, std::size_t line) {
+    if (value.is_nil()) return OptInstruction{ .m_op = OpCode::NIL, .m_line = line };
+    if (value.is_bool()) return OptInstruction{ .m_op = value.as_bool() ? OpCode::TRUE : OpCode::FALSE, .m_line = line };
+
+    std::optional<std::uint8_t> index = constant_index(value);
+    if (!index) return std::nullopt;
+    return OptInstruction{ .m_op = OpCode::CONSTANT, .m_operands = { *index }, .m_line = line };
+}
+
+std::optional<std::uint8_t> ChunkOptimizer::constant_index(Value value) {
+    // Numbers have to match bit for bit (so 0 and -0 stay apart)
+    auto same = [&](Value constant) {
+        if (!value.is_number()) return constant == value;
+        return constant.is_number() && std::bit_cast<std::uint64_t>(constant.as_number()) == std::bit_cast<std::uint64_t>(value.as_number());
+    };
+    auto& constants = m_chunk.get_constants();
+    std::size_t index = 0;
+    while (index < constants.size() && !same(constants[index])) {
+        index++;
+    }
+    if (index == constants.size()) {
+        if (index > std::numeric_limits<std::uint8_t>::max()) return std::nullopt;
+        m_chunk.add_constant(value);
+    }
+    return static_cast<std::uint8_t>(index);
+}
+
+bool ChunkOptimizer::fold_constants() {
+    bool changed = false;
+    for (std::size_t i = 0; i < m_instructions.size();) {
+        std::optional<Value> a = literal(m_instructions[i]);
+        std::optional<Value> b = is_straight(i, 2) ? literal(m_instructions[i + 1]) : std::nullopt;
+        std::optional<Value> result{};
+        std::size_t length = 0;
+
+        if (a && is_straight(i, 2)) {
+            // Unary operators on a literal
+            OpCode op = m_instructions[i + 1].m_op;
+            length = 2;
+            if (op == OpCode::NOT) {
+                result = Value(a->is_falsey());
+            }
+            else if (op == OpCode::NEGATE && a->is_number()) {
+                result = Value(-a->as_number());
+            }
+        }
+        if (a && b && !result && is_straight(i, 3)) {
+            // Binary operators on two literals. Anything that would be a runtime error is left alone.
+            OpCode op = m_instructions[i + 2].m_op;
+            length = 3;
+            if (op == OpCode::EQUAL) {
+                result = Value(*a == *b);
+            }
+            else if (a->is_number() && b->is_number()) {
+                double x = a->as_number();
+                double y = b->as_number();
+                switch (op) {
+                    case OpCode::GREATER: result = Value(x > y); break;
+                    case OpCode::LESS: result = Value(x < y); break;
+                    case OpCode::ADD: result = Value(x + y); break;
+                    case OpCode::SUBTRACT: result = Value(x - y); break;
+                    case OpCode::MULTIPLY: result = Value(x * y); break;
+                    case OpCode::DIVIDE: result = Value(x / y); break;
+                    default: break;
+                }
+            }
+        }
+
+        std::optional<OptInstruction> folded = result ? make_literal(*result, m_instructions[i].m_line) : std::nullopt;
+        if (!folded) {
+            i++;
+            continue;
+        }
+        m_instructions[i] = *folded;
+        for (std::size_t j = 1; j < length; j++) m_instructions[i + j].m_removed = true;
+        compact();
+        changed = true;
+        // The result may fold again along with the literal before it
+        if (i > 0) i--;
+    }
+    return changed;
+}
+
+bool ChunkOptimizer::simplify() {
+    bool changed = false;
+    for (std::size_t i = 0; i < m_instructions.size(); i++) {
+        OptInstruction& instruction = m_instructions[i];
+        if (instruction.m_removed) continue;
+
+        // A jump to the very next instruction does nothing (JUMP_IF_FALSE only peeks)
+        if ((instruction.m_op == OpCode::JUMP || instruction.m_op == OpCode::JUMP_IF_FALSE) && instruction.m_target == i + 1) {
+            instruction.m_removed = true;
+            changed = true;
+            continue;
+        }
+        if (!is_straight(i, 2)) continue;
+        OptInstruction& next = m_instructions[i + 1];
+
+        switch (instruction.m_op) {
+            case OpCode::CONSTANT:
+            case OpCode::NIL:
+            case OpCode::TRUE:
+            case OpCode::FALSE:
+            case OpCode::GET_LOCAL:
+            case OpCode::GET_UPVALUE:
+                // Pushing something without side effects, only to pop it
+                if (next.m_op == OpCode::POP) {
+                    instruction.m_removed = true;
+                    next.m_removed = true;
+                    changed = true;
+                    continue;
+                }
+                break;
+            case OpCode::SET_LOCAL:
+            case OpCode::SET_GLOBAL:
+            case OpCode::SET_UPVALUE: {
+                // Storing a value, popping it and loading it again leaves it on the stack anyway
+                OpCode get = instruction.m_op == OpCode::SET_LOCAL ? OpCode::GET_LOCAL :
+                             instruction.m_op == OpCode::SET_GLOBAL ? OpCode::GET_GLOBAL : OpCode::GET_UPVALUE;
+                if (next.m_op == OpCode::POP && is_straight(i, 3) && m_instructions[i + 2].m_op == get &&
+                        m_instructions[i + 2].m_operands == instruction.m_operands) {
+                    next.m_removed = true;
+                    m_instructions[i + 2].m_removed = true;
+                    changed = true;
+                    continue;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+
+        // A conditional jump on a literal always or never jumps
+        if (next.m_op == OpCode::JUMP_IF_FALSE) {
+            if (std::optional<Value> condition = literal(instruction)) {
+                if (condition->is_falsey()) {
+                    next.m_op = OpCode::JUMP;
+                }
+                else {
+                    next.m_removed = true;
+                }
+                changed = true;
+            }
+        }
+    }
+    compact();
+    return changed;
+}
+
+bool ChunkOptimizer::thread_jumps() {
+    bool changed = false;
+    for (std::size_t i = 0; i < m_instructions.size(); i++) {
+        OptInstruction& instruction = m_instructions[i];
+        if (!instruction.is_jump()) continue;
+
+        // Follow chains of jumps, never changing direction so back edges (which the
+        // interpreters count for tiering) stay exactly where the loops are. Bounded,
+        // since jumps can form a cycle.
+        for (std::size_t hops = 0; hops < m_instructions.size(); hops++) {
+            const OptInstruction& target = m_instructions[instruction.m_target];
+            bool forward = instruction.m_op != OpCode::LOOP;
+            bool threads = target.m_op == (forward ? OpCode::JUMP : OpCode::LOOP) ||
+                           // The condition is still the same value when it gets there, so it jumps again
+                           (instruction.m_op == OpCode::JUMP_IF_FALSE && target.m_op == OpCode::JUMP_IF_FALSE);
+            if (!threads || target.m_target == instruction.m_target) break;
+            instruction.m_target = target.m_target;
+            changed = true;
+        }
+
+        // An unconditional jump to a RETURN might as well return
+        if (instruction.m_op == OpCode::JUMP && m_instructions[instruction.m_target].m_op == OpCode::RETURN) {
+            instruction = OptInstruction{ .m_op = OpCode::RETURN, .m_line = instruction.m_line };
+            changed = true;
+        }
+    }
+    find_targets();
+    return changed;
+}
+
+bool ChunkOptimizer::remove_dead_code() {
+    // Everything reachable from the start, following fall through and jumps
+    std::vector<bool> reachable(m_instructions.size(), false);
+    std::vector<std::size_t> work{ 0 };
+    while (!work.empty()) {
+        std::size_t i = work.back();
+        work.pop_back();
+        if (i >= m_instructions.size() || reachable[i]) continue;
+        reachable[i] = true;
+
+        const OptInstruction& instruction = m_instructions[i];
+        if (instruction.is_jump()) work.push_back(instruction.m_target);
+        if (instruction.m_op != OpCode::RETURN && instruction.m_op != OpCode::JUMP && instruction.m_op != OpCode::LOOP) {
+            work.push_back(i + 1);
+        }
+    }
+
+    bool changed = false;
+    for (std::size_t i = 0; i < m_instructions.size(); i++) {
+        if (!reachable[i]) {
+            m_instructions[i].m_removed = true;
+            changed = true;
+        }
+    }
+    compact();
+    return changed;
+}
+
+void ChunkOptimizer::run_passes(int level) {
+    // Each pass can expose more work for the others, which only -O2 goes back for
+    std::size_t rounds = level >= 2 ? 8 : 1;
+    for (std::size_t round = 0; round < rounds; round++) {
+        bool progress = fold_constants();
+        progress |= simplify();
+        progress |= thread_jumps();
+        progress |= remove_dead_code();
+        m_changed |= progress;
+        if (!progress) break;
+    }
+}
+
+std::optional<std::size_t> ChunkOptimizer::callee_call(const std::vector<std::size_t>& depths, std::size_t load) const {
+    // The first instruction to take the value off the stack
+    for (std::size_t i = load + 1; i < m_instructions.size(); i++) {
+        const OptInstruction& instruction = m_instructions[i];
+        if (depths[i] > depths[load] + stack_reads(instruction)) continue;
+        if (instruction.m_op == OpCode::CALL && depths[i] - instruction.m_operands[0] - 1 == depths[load]) return i;
+        return std::nullopt;
+    }
+    return std::nullopt;
+}
+
+bool ChunkOptimizer::elide_bound_methods() {
+    std::vector<std::size_t> depths = stack_depths(m_instructions, m_function->m_arity);
+    // A local some closure captures may be assigned through its upvalue at any call
+    std::vector<bool> captured(std::numeric_limits<std::uint8_t>::max() + 1, false);
+    for (const OptInstruction& instruction : m_instructions) {
+        if (instruction.m_op != OpCode::CLOSURE) continue;
+        for (std::size_t i = 1; i + 1 < instruction.m_operands.size(); i += 2) {
+            if (instruction.m_operands[i]) captured[instruction.m_operands[i + 1]] = true;
+        }
+    }
+
+    bool changed = false;
+    for (std::size_t i = 1; i < m_instructions.size(); i++) {
+        // A property of a local receiver, read into a local of its own
+        OptInstruction& get = m_instructions[i];
+        const OptInstruction& receiver = m_instructions[i - 1];
+        if (get.m_op != OpCode::GET_PROPERTY || receiver.m_op != OpCode::GET_LOCAL || m_targets[i]) continue;
+        std::size_t local = depths[i - 1];
+        std::uint8_t slot = receiver.m_operands[0];
+        if (local >= captured.size() || captured[local] || captured[slot]) continue;
+
+        // Until the local goes out of scope, it must only ever be loaded to be called,
+        // and neither it nor the receiver may be assigned
+        std::vector<std::pair<std::size_t, std::size_t>> calls{};
+        bool escapes = false;
+        for (std::size_t j = i + 1; j < m_instructions.size() && !escapes; j++) {
+            const OptInstruction& instruction = m_instructions[j];
+            if (depths[j] <= local + stack_reads(instruction)) {
+                escapes = instruction.m_op != OpCode::POP || depths[j] != local + 1;
+                break;
+            }
+            if (instruction.m_op == OpCode::SET_LOCAL) {
+                escapes = instruction.m_operands[0] == local || instruction.m_operands[0] == slot;
+            }
+            else if (instruction.m_op == OpCode::GET_LOCAL && instruction.m_operands[0] == local) {
+                std::optional<std::size_t> call = callee_call(depths, j);
+                escapes = !call;
+                if (call) calls.emplace_back(j, *call);
+            }
+        }
+        if (escapes) continue;
+
+        // Each call passes the receiver in place of the method, which the local holds unbound
+        get.m_op = OpCode::GET_UNBOUND;
+        for (auto [load, call] : calls) {
+            m_instructions[load].m_operands[0] = slot;
+            std::uint8_t arg_count = m_instructions[call].m_operands[0];
+            m_instructions[call].m_op = OpCode::CALL_UNBOUND;
+            m_instructions[call].m_operands = { static_cast<std::uint8_t>(local), arg_count };
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+std::optional<std::vector<OptInstruction>> ChunkOptimizer::inline_call(std::size_t call, const InlineCandidates::Candidate& callee, std::size_t base) {
+    const OptInstruction& instruction = m_instructions[call];
+    std::vector<OptInstruction> code{};
+
+    std::optional<std::uint8_t> function = constant_index(callee.m_value);
+    if (!function) return std::nullopt;
+    bool is_call = instruction.m_op == OpCode::CALL || instruction.m_op == OpCode::TAIL_CALL;
+    OptInstruction guard{ .m_op = is_call ? OpCode::GUARD_CALL : OpCode::GUARD_INVOKE,
+                          .m_operands = instruction.m_operands, .m_line = instruction.m_line };
+    guard.m_operands.push_back(*function);
+    code.push_back(std::move(guard));
+
+    // Where each instruction of the body starts, once RETURNs are expanded
+    std::vector<std::size_t> starts(callee.m_body.size() + 1);
+    std::size_t inlined = m_chunk.get_inlined_calls().size() + 1;
+    for (std::size_t i = 0; i < callee.m_body.size(); i++) {
+        starts[i] = code.size();
+        OptInstruction copy = callee.m_body[i];
+        copy.m_inlined = inlined;
+        switch (copy.m_op) {
+            case OpCode::GET_LOCAL:
+            case OpCode::SET_LOCAL: {
+                // The callee's frame starts at the callee's slot
+                std::size_t slot = base + copy.m_operands[0];
+                if (slot > std::numeric_limits<std::uint8_t>::max()) return std::nullopt;
+                copy.m_operands[0] = static_cast<std::uint8_t>(slot);
+                break;
+            }
+            case OpCode::CONSTANT:
+            case OpCode::GET_PROPERTY:
+            case OpCode::SET_PROPERTY: {
+                std::optional<std::uint8_t> index = constant_index(callee.m_function->chunk().get_constants()[copy.m_operands[0]]);
+                if (!index) return std::nullopt;
+                copy.m_operands[0] = *index;
+                if (copy.m_op != OpCode::CONSTANT) {
+                    // A cache of its own, since what the callee's sees is from all its callers
+                    std::size_t cache = m_chunk.add_inline_cache();
+                    copy.m_operands[1] = static_cast<std::uint8_t>(cache >> 8);
+                    copy.m_operands[2] = static_cast<std::uint8_t>(cache & 0xff);
+                }
+                break;
+            }
+            case OpCode::RETURN: {
+                // Leave the result where the callee was, and carry on after the call
+                std::size_t depth = callee.m_depths[i];
+                if (base > std::numeric_limits<std::uint8_t>::max()) return std::nullopt;
+                code.push_back(OptInstruction{ .m_op = OpCode::SET_LOCAL, .m_operands = { static_cast<std::uint8_t>(base) },
+                                               .m_line = copy.m_line, .m_inlined = inlined });
+                for (std::size_t pop = 1; pop < depth; pop++) {
+                    code.push_back(OptInstruction{ .m_op = OpCode::POP, .m_line = copy.m_line, .m_inlined = inlined });
+                }
+                // Jumps to just past the call, which is placed after the body
+                copy = OptInstruction{ .m_op = OpCode::JUMP, .m_line = copy.m_line, .m_target = SIZE_MAX, .m_inlined = inlined };
+                break;
+            }
+            default:
+                break;
+        }
+        code.push_back(std::move(copy));
+    }
+    starts[callee.m_body.size()] = code.size();
+
+    // The call itself, for when the guard fails
+    code[0].m_target = code.size();
+    code.push_back(instruction);
+    for (std::size_t i = 1; i + 1 < code.size(); i++) {
+        if (!code[i].is_jump()) continue;
+        code[i].m_target = code[i].m_target == SIZE_MAX ? code.size() : starts.at(code[i].m_target);
+    }
+
+    m_chunk.add_inlined_call(InlinedCall{ .m_function = callee.m_function, .m_line = instruction.m_line });
+    return code;
+}
+
+void ChunkOptimizer::inline_calls(const InlineCandidates& candidates, int level) {
+    std::vector<std::size_t> depths = stack_depths(m_instructions, m_function->m_arity);
+    auto& constants = m_chunk.get_constants();
+
+    std::vector<OptInstruction> instructions{};
+    // Where each instruction ends up, and which of the new ones jump within inlined code
+    std::vector<std::size_t> indices(m_instructions.size() + 1);
+    std::vector<bool> relocated{};
+    for (std::size_t i = 0; i < m_instructions.size(); i++) {
+        const OptInstruction& instruction = m_instructions[i];
+        indices[i] = instructions.size();
+
+        const InlineCandidates::Candidate* callee = nullptr;
+        std::size_t arg_count = 0;
+        if (instruction.m_op == OpCode::CALL || instruction.m_op == OpCode::TAIL_CALL) {
+            // Look for the global the callee was loaded from, which is the last thing pushed at its depth
+            arg_count = instruction.m_operands[0];
+            std::size_t base = depths[i] - arg_count - 1;
+            for (std::size_t j = i; j-- > 0 && depths[j] >= base;) {
+                if (depths[j] != base) continue;
+                if (m_instructions[j].m_op == OpCode::GET_GLOBAL) callee = candidates.global(m_instructions[j].global_slot());
+                break;
+            }
+        }
+        else if (instruction.m_op == OpCode::INVOKE || instruction.m_op == OpCode::TAIL_INVOKE) {
+            arg_count = instruction.m_operands[1];
+            callee = candidates.method(constants[instruction.m_operands[0]].as_string());
+        }
+
+        std::optional<std::vector<OptInstruction>> code{};
+        if (callee != nullptr && callee->m_function->m_arity == arg_count) {
+            code = inline_call(i, *callee, depths[i] - arg_count - 1);
+        }
+        if (!code) {
+            instructions.push_back(instruction);
+            relocated.push_back(false);
+            continue;
+        }
+        std::size_t start = instructions.size();
+        for (auto& inlined : *code) {
+            if (inlined.is_jump()) inlined.m_target += start;
+            instructions.push_back(std::move(inlined));
+            relocated.push_back(true);
+        }
+        m_changed = true;
+    }
+    indices[m_instructions.size()] = instructions.size();
+
+    if (instructions.size() == m_instructions.size()) return;
+
+    // Jumps to a call that got inlined now go to its guard
+    for (std::size_t i = 0; i < instructions.size(); i++) {
+        if (instructions[i].is_jump() && !relocated[i]) instructions[i].m_target = indices[instructions[i].m_target];
+    }
+    m_instructions = std::move(instructions);
+    find_targets();
+    run_passes(level);
+}
+
+void ChunkOptimizer::finish(int level, const GlobalFacts& globals) {
+    if (level >= 3) {
+        // Hoisting leaves the code in the loop that the values are reused in, so value
+        // numbering goes second, over the SSA form of the code with the loops hoisted
+        bool rewritten = SsaOptimizer(m_function, m_instructions, globals).hoist_invariants();
+        rewritten |= SsaOptimizer(m_function, m_instructions, globals).number_values();
+        if (rewritten) {
+            find_targets();
+            run_passes(level);
+            m_changed = true;
+        }
+    }
+    // Last, since no other pass knows the unbound forms
+    if (level >= 2) m_changed |= elide_bound_methods();
+    if (m_changed) encode();
+}
+
+InlineCandidates::InlineCandidates(const std::vector<ObjFunction*>& functions, const std::vector<std::vector<OptInstruction>>& instructions) {
+    for (std::size_t i = 0; i < functions.size(); i++) {
+        if (!is_inlinable(functions[i], instructions[i])) continue;
+        m_candidates.emplace(functions[i], Candidate{ .m_function = functions[i], .m_body = instructions[i],
+                                                      .m_depths = stack_depths(instructions[i], functions[i]->m_arity) });
+    }
+
+    // Functions are defined by the CLOSURE that creates them, straight followed by its DEFINE_GLOBAL or METHOD
+    for (std::size_t i = 0; i < functions.size(); i++) {
+        auto& constants = functions[i]->chunk().get_constants();
+        const auto& code = instructions[i];
+        for (std::size_t j = 0; j < code.size(); j++) {
+            const Candidate* candidate = nullptr;
+            if (j > 0 && code[j - 1].m_op == OpCode::CLOSURE) {
+                Value function = constants[code[j - 1].m_operands[0]];
+                auto it = m_candidates.find(function.as_function());
+                if (it != m_candidates.end()) {
+                    it->second.m_value = function;
+                    candidate = &it->second;
+                }
+            }
+            // A second definition of the same name means we can't know which one calls get
+            if (code[j].m_op == OpCode::DEFINE_GLOBAL) {
+                auto [it, added] = m_globals.emplace(code[j].global_slot(), candidate);
+                if (!added) it->second = nullptr;
+            }
+            else if (code[j].m_op == OpCode::METHOD) {
+                auto [it, added] = m_methods.emplace(constants[code[j].m_operands[0]].as_string(), candidate);
+                if (!added) it->second = nullptr;
+            }
+        }
+    }
+}
+
+bool InlineCandidates::is_inlinable(const ObjFunction* function, const std::vector<OptInstruction>& body) {
+    if (function->m_upvalue_count != 0 || body.empty() || body.size() > k_max_body_size) return false;
+    for (const auto& instruction : body) {
+        switch (instruction.m_op) {
+            case OpCode::CONSTANT:
+            case OpCode::NIL:
+            case OpCode::TRUE:
+            case OpCode::FALSE:
+            case OpCode::POP:
+            case OpCode::GET_LOCAL:
+            case OpCode::SET_LOCAL:
+            case OpCode::GET_GLOBAL:
+            case OpCode::SET_GLOBAL:
+            case OpCode::GET_PROPERTY:
+            case OpCode::SET_PROPERTY:
+            case OpCode::EQUAL:
+            case OpCode::GREATER:
+            case OpCode::LESS:
+            case OpCode::ADD:
+            case OpCode::SUBTRACT:
+            case OpCode::MULTIPLY:
+            case OpCode::DIVIDE:
+            case OpCode::NOT:
+            case OpCode::NEGATE:
+            case OpCode::PRINT:
+            case OpCode::JUMP:
+            case OpCode::JUMP_IF_FALSE:
+            case OpCode::RETURN:
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+void GlobalFacts::record(const std::vector<OptInstruction>& instructions) {
+    for (const auto& instruction : instructions) {
+        if (instruction.m_op != OpCode::DEFINE_GLOBAL && instruction.m_op != OpCode::SET_GLOBAL) continue;
+        std::size_t slot = instruction.global_slot();
+        if (slot >= m_definitions.size()) {
+            m_definitions.resize(slot + 1);
+            m_assigned.resize(slot + 1);
+        }
+        if (instruction.m_op == OpCode::DEFINE_GLOBAL) {
+            m_definitions[slot]++;
+        }
+        else {
+            m_assigned[slot] = true;
+        }
+    }
+}
+
+void Optimizer::optimize(const std::vector<ObjFunction*>& functions) {
+    if (s_level <= 0) return;
+
+    // Every function's assignments have to be known before any is optimized
+    std::vector<ChunkOptimizer> optimizers{};
+    for (ObjFunction* function : functions) {
+        if (s_dump) function->chunk().dissassemble((std::string(function->name()) + " (before -O" + std::to_string(s_level) + ")").c_str());
+        optimizers.emplace_back(function);
+        s_globals.record(optimizers.back().instructions());
+    }
+
+    for (auto& optimizer : optimizers) optimizer.run_passes(s_level);
+    if (s_level >= 3) {
+        // Calls get what their callees are like once the callees are optimized themselves
+        std::vector<std::vector<OptInstruction>> instructions{};
+        for (auto& optimizer : optimizers) instructions.push_back(optimizer.instructions());
+        InlineCandidates candidates(functions, instructions);
+        for (auto& optimizer : optimizers) optimizer.inline_calls(candidates, s_level);
+    }
+
+    for (std::size_t i = 0; i < functions.size(); i++) {
+        optimizers[i].finish(s_level, s_globals);
+        if (s_dump) functions[i]->chunk().dissassemble((std::string(functions[i]->name()) + " (after -O" + std::to_string(s_level) + ")").c_str());
+    }
+}
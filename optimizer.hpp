@@ -0,0 +1,94 @@
+#ifndef ppclox_optimizer_hpp
+#define ppclox_optimizer_hpp
+
+#include <vector>
+
+#include "common.hpp"
+#include "chunk.hpp"
+#include "object_function.hpp"
+
+/** One decoded instruction, as the optimizer passes see it */
+class OptInstruction {
+public:
+    OpCode m_op{};
+    /** Operand bytes, except for a jump's offset (always its last operand), whose target is kept in m_target instead */
+    std::vector<std::uint8_t> m_operands{};
+    std::size_t m_line{};
+    /** Index of the instruction a jump goes to */
+    std::size_t m_target{};
+    /** 1 + the index of the chunk's inlined call (see Chunk::add_inlined_call) the instruction came from, or 0 */
+    std::size_t m_inlined{};
+    /** Marked for removal by the next compact() */
+    bool m_removed{};
+
+    bool is_jump() const {
+        return m_op == OpCode::JUMP || m_op == OpCode::JUMP_IF_FALSE || m_op == OpCode::LOOP ||
+               m_op == OpCode::GUARD_CALL || m_op == OpCode::GUARD_INVOKE;
+    }
+    /** The global slot operand of a global variable instruction */
+    std::size_t global_slot() const { return static_cast<std::size_t>((m_operands[0] << 8) | m_operands[1]); }
+};
+
+/**
+ * What the optimizer knows about assignments to each global variable, across every
+ * program compiled so far (so the REPL's earlier lines count too). A global defined
+ * once and never assigned keeps its value once it is defined.
+ */
+class GlobalFacts {
+public:
+    /** Count the global definitions and assignments in a function's code */
+    void record(const std::vector<OptInstruction>& instructions);
+    bool is_never_reassigned(std::size_t slot) const {
+        return slot < m_definitions.size() && m_definitions[slot] == 1 && !m_assigned[slot];
+    }
+private:
+    std::vector<std::size_t> m_definitions{};
+    std::vector<bool> m_assigned{};
+};
+
+/**
+ * Optional pass pipeline the compiler runs over every function of a program once the
+ * whole program is compiled (before superinstructions are fused). Each chunk is decoded
+ * into a list of instructions, with jumps pointing at instructions rather than offsets,
+ * rewritten by each pass, and then encoded again with fresh jump offsets and line table.
+ *   -O0 does nothing (the default).
+ *   -O1 runs each pass once: folding operators on literals, simplifying sequences that
+ *       have no effect (a push straight followed by a pop, a store then load of the same
+ *       variable, a jump to the next instruction or on a literal condition), threading
+ *       jumps to jumps, and removing unreachable code (after RETURN and unconditional jumps).
+ *   -O2 repeats the passes until none of them finds anything more to do.
+ *   -O3 also inlines calls to small functions and methods, then lowers each function to
+ *       SSA form (see ssa.hpp) to hoist loop invariant expressions out of loops and reuse
+ *       values already computed, and runs the -O2 passes again over the result.
+ * A call is inlined if the program defines a single global function of the callee's name
+ * (or a single method of the invoked name, in any class) that has no upvalues, calls
+ * nothing and is short. A guard (GUARD_CALL or GUARD_INVOKE) checks the callee is still
+ * that function when the call runs, so the global being reassigned or the receiver being
+ * of another class just means the guard jumps to the original call, kept after the body.
+ * The body runs in the caller's frame, its locals moved up to start at the callee's slot
+ * and each RETURN storing the result there. Since it has no frame of its own, a call
+ * inlined where the call stack is full no longer overflows it.
+ * From -O2, a method read into a local that is only ever called while it is in scope
+ * (and with the receiver in a local that isn't assigned meanwhile) is never bound, which
+ * saves allocating an ObjBoundMethod. GET_UNBOUND leaves the local holding the method's
+ * closure, and each call of it becomes a CALL_UNBOUND that pushes the receiver instead.
+ * Passes never look across a jump target, so they only ever see straight line code.
+ */
+class Optimizer {
+public:
+    static constexpr int k_max_level = 3;
+
+    static int level() { return s_level; }
+    static void set_level(int level) { s_level = level; }
+    /** Print each function's disassembly before and after optimizing it */
+    static void set_dump(bool dump) { s_dump = dump; }
+
+    /** Optimize the chunks of all of a program's functions in place at the current level */
+    static void optimize(const std::vector<ObjFunction*>& functions);
+private:
+    static int s_level;
+    static bool s_dump;
+    static GlobalFacts s_globals;
+};
+
+#endif
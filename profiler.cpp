@@ -0,0 +1,50 @@
+#include <algorithm>
+
+#include "profiler.hpp"
+
+void OpcodeProfiler::record(const Chunk& chunk, std::size_t offset) {
+    // If control didn't just fall through from the previous instruction,
+    // (jumps, calls, returns) then start a new run.
+    if (&chunk != m_last_chunk || offset != m_next_offset) {
+        m_window_size = 0;
+    }
+    m_last_chunk = &chunk;
+    m_next_offset = offset + chunk.instruction_length(offset);
+
+    // Slide the window along
+    if (m_window_size == k_max_ngram) {
+        std::move(m_window.begin() + 1, m_window.end(), m_window.begin());
+        m_window_size--;
+    }
+    m_window[m_window_size++] = Chunk::generic_opcode(chunk.get_code()[offset]);
+
+    // Count every n-gram ending with this instruction
+    std::uint32_t key = 0;
+    for (std::size_t n = 1; n <= m_window_size; n++) {
+        key |= static_cast<std::uint32_t>(m_window[m_window_size - n]) << (8 * (n - 1));
+        if (n >= 2) {
+            m_counts[n][key]++;
+        }
+    }
+}
+
+void OpcodeProfiler::report() const {
+    fprintf(stderr, "== opcode n-gram profile ==\n");
+    for (std::size_t n = 2; n <= k_max_ngram; n++) {
+        std::vector<std::pair<std::uint32_t, std::size_t>> sorted(m_counts[n].begin(), m_counts[n].end());
+        std::sort(sorted.begin(), sorted.end(), [](auto& a, auto& b) { return a.second > b.second; });
+        if (sorted.size() > k_report_count) {
+            sorted.resize(k_report_count);
+        }
+
+        fprintf(stderr, "-- %zu-grams --\n", n);
+        for (auto& [key, count] : sorted) {
+            fprintf(stderr, "%12zu ", count);
+            // The oldest opcode is in the highest byte
+            for (std::size_t i = n; i > 0; i--) {
+                fprintf(stderr, " %s", Chunk::opcode_name((key >> (8 * (i - 1))) & 0xff));
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+}
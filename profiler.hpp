@@ -0,0 +1,38 @@
+#ifndef ppclox_profiler_hpp
+#define ppclox_profiler_hpp
+
+#include <array>
+#include <unordered_map>
+
+#include "common.hpp"
+#include "chunk.hpp"
+
+/**
+ * Counts how often each run of consecutive opcodes (n-gram) executes, so that the
+ * set of superinstructions can be chosen from real workloads. Only sequences that are
+ * adjacent in the bytecode are counted, since those are the only ones that can be fused.
+ * Enabled with DEBUG_PROFILE_NGRAMS. It's best to also disable SUPERINSTRUCTIONS
+ * while profiling, so the report shows the sequences the compiler actually emits.
+ */
+class OpcodeProfiler {
+public:
+    /** Longest n-gram counted */
+    static constexpr std::size_t k_max_ngram = 4;
+    /** Number of n-grams of each length reported */
+    static constexpr std::size_t k_report_count = 15;
+
+    /** Record execution of the instruction at the given offset into the chunk */
+    void record(const Chunk& chunk, std::size_t offset);
+    /** Print the hottest n-grams of each length to stderr */
+    void report() const;
+private:
+    /** The most recent run of adjacent instructions, oldest first */
+    std::array<std::uint8_t, k_max_ngram> m_window{};
+    std::size_t m_window_size{};
+    const Chunk* m_last_chunk{};
+    std::size_t m_next_offset{};
+    /** Counts indexed by n-gram length, keyed by the opcodes packed into an integer */
+    std::array<std::unordered_map<std::uint32_t, std::size_t>, k_max_ngram + 1> m_counts{};
+};
+
+#endif
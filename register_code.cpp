@@ -0,0 +1,587 @@
+#include <optional>
+#include <unordered_map>
+
+#include "register_code.hpp"
+#include "chunk.hpp"
+#include "object_function.hpp"
+#include "vm.hpp"
+
+/**
+ * Translates stack based bytecode into register code by symbolically executing it.
+ * Stack slot N becomes register N, but rather than copying every pushed value into
+ * its slot we track which operand each slot currently holds (m_slots). A slot holding
+ * anything other than its own register is "virtual" and must be materialized (moved
+ * into its register) before anything can depend on the register itself.
+ * NOTE! A slot only ever refers to its own register, a constant, or a register below
+ *       it, so writes to the top of the stack never invalidate other slots. Only
+ *       assignments to locals do.
+ */
+class RegisterTranslator {
+public:
+    RegisterTranslator(Chunk& chunk, RegisterCode& code) : m_chunk(chunk), m_code(code) {}
+
+    void translate(std::size_t arity);
+private:
+    Chunk& m_chunk;
+    RegisterCode& m_code;
+
+    /** Operand currently holding the value of each stack slot */
+    std::vector<std::uint16_t> m_slots{};
+    /** Stack depth at each jump target, recorded as the jumps to it are translated */
+    std::unordered_map<std::size_t, std::size_t> m_target_depths{};
+    std::vector<bool> m_is_jump_target{};
+    /** Register instruction index of each translated stack instruction offset */
+    std::vector<std::size_t> m_instruction_indices{};
+    /** Forward jumps waiting for their target to be translated, as (instruction index, stack offset) */
+    std::vector<std::pair<std::size_t, std::size_t>> m_pending_jumps{};
+    /** Index of the first instruction since the last jump target. Instructions before it can't be rewritten. */
+    std::size_t m_block_start{};
+    std::size_t m_line{};
+    std::optional<std::uint16_t> m_nil{};
+    std::optional<std::uint16_t> m_true{};
+    std::optional<std::uint16_t> m_false{};
+
+    /** The generic opcode at the given offset, looking through superinstructions and quickening */
+    std::uint8_t decode(std::size_t offset) const;
+    std::uint16_t read_short(std::size_t offset) const;
+    std::uint16_t constant(std::size_t index) const { return static_cast<std::uint16_t>(index) | RegisterCode::k_constant_bit; }
+    std::uint16_t literal(std::optional<std::uint16_t>& cached, Value value);
+
+    std::size_t emit(RegInstruction instruction);
+    void push(std::uint16_t operand);
+    std::uint16_t pop();
+    std::uint16_t top() const { return static_cast<std::uint16_t>(m_slots.size() - 1); }
+    /** Move the given slot's value into its own register, if it isn't there already */
+    void materialize(std::size_t slot);
+    void materialize_all();
+    /** An operand that is a register (possibly of a lower slot) holding the slot's value */
+    std::uint16_t register_operand(std::size_t slot);
+    /** Truncate to the given depth, making every slot refer to its own register again */
+    void reset_slots(std::size_t depth);
+    void assign_local(std::uint16_t local);
+    void jump(RegOpCode op, std::size_t target);
+    /** Whether the instruction only writes R[a] after reading its other operands, so a can be retargeted */
+    static bool writes_only_a(RegOpCode op);
+};
+
+std::uint8_t RegisterTranslator::decode(std::size_t offset) const {
+    std::uint8_t op_code = m_chunk.get_code().at(offset);
+    const Superinstruction* super = Chunk::find_superinstruction(op_code);
+    if (super != nullptr) {
+        // Only the first component's opcode was overwritten. The rest decode as normal.
+        op_code = std::to_underlying(super->m_components[0]);
+    }
+    return Chunk::generic_opcode(op_code);
+}
+
+std::uint16_t RegisterTranslator::read_short(std::size_t offset) const {
+    return static_cast<std::uint16_t>((m_chunk.get_code().at(offset) << 8) | m_chunk.get_code().at(offset + 1));
+}
+
+std::uint16_t RegisterTranslator::literal(std::optional<std::uint16_t>& cached, Value value) {
+    if (!cached.has_value()) {
+        cached = constant(m_chunk.add_constant(value));
+    }
+    return cached.value();
+}
+
+std::size_t RegisterTranslator::emit(RegInstruction instruction) {
+    m_code.m_code.push_back(instruction);
+    m_code.m_lines.push_back(m_line);
+    return m_code.m_code.size() - 1;
+}
+
+void RegisterTranslator::push(std::uint16_t operand) {
+    if (m_slots.size() >= RegisterCode::k_max_registers) {
+        throw std::runtime_error("Too many registers needed for register code.");
+    }
+    m_slots.push_back(operand);
+    m_code.m_frame_size = std::max(m_code.m_frame_size, m_slots.size());
+}
+
+std::uint16_t RegisterTranslator::pop() {
+    std::uint16_t operand = m_slots.back();
+    m_slots.pop_back();
+    return operand;
+}
+
+void RegisterTranslator::materialize(std::size_t slot) {
+    if (m_slots[slot] != slot) {
+        emit(RegInstruction { .m_op = RegOpCode::MOVE, .m_a = static_cast<std::uint16_t>(slot), .m_b = m_slots[slot] });
+        m_slots[slot] = static_cast<std::uint16_t>(slot);
+    }
+}
+
+void RegisterTranslator::materialize_all() {
+    for (std::size_t slot = 0; slot < m_slots.size(); slot++) {
+        materialize(slot);
+    }
+}
+
+std::uint16_t RegisterTranslator::register_operand(std::size_t slot) {
+    if (RegisterCode::is_constant(m_slots[slot])) {
+        materialize(slot);
+    }
+    return m_slots[slot];
+}
+
+void RegisterTranslator::reset_slots(std::size_t depth) {
+    m_slots.resize(depth);
+    for (std::size_t slot = 0; slot < depth; slot++) {
+        m_slots[slot] = static_cast<std::uint16_t>(slot);
+    }
+    m_code.m_frame_size = std::max(m_code.m_frame_size, depth);
+}
+
+bool RegisterTranslator::writes_only_a(RegOpCode op) {
+    switch (op) {
+        case RegOpCode::MOVE:
+        case RegOpCode::GET_GLOBAL:
+        case RegOpCode::GET_UPVALUE:
+        case RegOpCode::GET_PROPERTY:
+        case RegOpCode::GET_UNBOUND:
+        case RegOpCode::EQUAL:
+        case RegOpCode::GREATER:
+        case RegOpCode::LESS:
+        case RegOpCode::ADD:
+        case RegOpCode::SUBTRACT:
+        case RegOpCode::MULTIPLY:
+        case RegOpCode::DIVIDE:
+        case RegOpCode::NOT:
+        case RegOpCode::NEGATE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void RegisterTranslator::assign_local(std::uint16_t local) {
+    std::uint16_t value = m_slots.back();
+    if (value == local) return;
+
+    // Anything still reading the local's old value needs its own copy first
+    bool has_readers = false;
+    for (std::size_t slot = 0; slot < m_slots.size(); slot++) {
+        if (slot != local && m_slots[slot] == local) {
+            materialize(slot);
+            has_readers = true;
+        }
+    }
+
+    // If the value was just computed into the top register, compute it straight
+    // into the local instead. The top slot then just reads the local.
+    std::vector<RegInstruction>& code = m_code.m_code;
+    if (!has_readers && value == top() && code.size() > m_block_start &&
+            writes_only_a(code.back().m_op) && code.back().m_a == value) {
+        code.back().m_a = local;
+        m_slots.back() = local;
+    }
+    else {
+        emit(RegInstruction { .m_op = RegOpCode::MOVE, .m_a = local, .m_b = value });
+    }
+    m_slots[local] = local;
+}
+
+void RegisterTranslator::jump(RegOpCode op, std::size_t target) {
+    std::size_t index = emit(RegInstruction { .m_op = op, .m_a = top() });
+    if (target < m_instruction_indices.size() && m_instruction_indices[target] != SIZE_MAX) {
+        m_code.m_code[index].set_target(m_instruction_indices[target]);
+    }
+    else {
+        m_target_depths[target] = m_slots.size();
+        m_pending_jumps.emplace_back(index, target);
+    }
+}
+
+void RegisterTranslator::translate(std::size_t arity) {
+    const std::vector<std::uint8_t>& code = m_chunk.get_code();
+
+    // Find all jump targets up front, since the values on the stack must be
+    // in their registers at any point control flow merges.
+    m_is_jump_target.assign(code.size() + 1, false);
+    for (std::size_t offset = 0; offset < code.size();) {
+        std::uint8_t op_code = decode(offset);
+        std::size_t length = m_chunk.opcode_length(op_code, offset);
+        std::size_t next = offset + length;
+        switch (op_code) {
+            case std::to_underlying(OpCode::JUMP):
+            case std::to_underlying(OpCode::JUMP_IF_FALSE):
+                m_is_jump_target[next + read_short(offset + 1)] = true;
+                break;
+            case std::to_underlying(OpCode::GUARD_CALL):
+            case std::to_underlying(OpCode::GUARD_INVOKE):
+                m_is_jump_target[next + read_short(next - 2)] = true;
+                break;
+            case std::to_underlying(OpCode::LOOP):
+                m_is_jump_target[next - read_short(offset + 1)] = true;
+                m_code.m_loop_headers[next - read_short(offset + 1)] = SIZE_MAX;
+                break;
+        }
+        offset = next;
+    }
+
+    // The callee (or receiver) and arguments are already in place when the frame starts
+    reset_slots(arity + 1);
+    m_instruction_indices.assign(code.size() + 1, SIZE_MAX);
+
+    for (std::size_t offset = 0; offset < code.size();) {
+        std::uint8_t op_code = decode(offset);
+        std::size_t next = offset + m_chunk.opcode_length(op_code, offset);
+        m_line = m_chunk.get_lines().at(offset);
+
+        if (m_is_jump_target[offset]) {
+            materialize_all();
+            auto it = m_target_depths.find(offset);
+            reset_slots(it != m_target_depths.end() ? it->second : m_slots.size());
+            m_block_start = m_code.m_code.size();
+        }
+        m_instruction_indices[offset] = m_code.m_code.size();
+        auto header = m_code.m_loop_headers.find(offset);
+        if (header != m_code.m_loop_headers.end()) {
+            header->second = m_code.m_code.size();
+        }
+
+        switch (op_code) {
+            case std::to_underlying(OpCode::CONSTANT):
+                push(constant(code[offset + 1]));
+                break;
+            case std::to_underlying(OpCode::NIL): push(literal(m_nil, Value())); break;
+            case std::to_underlying(OpCode::TRUE): push(literal(m_true, Value(true))); break;
+            case std::to_underlying(OpCode::FALSE): push(literal(m_false, Value(false))); break;
+            case std::to_underlying(OpCode::POP): pop(); break;
+            case std::to_underlying(OpCode::GET_LOCAL):
+                push(m_slots[code[offset + 1]]);
+                break;
+            case std::to_underlying(OpCode::SET_LOCAL):
+                assign_local(code[offset + 1]);
+                break;
+            case std::to_underlying(OpCode::GET_GLOBAL):
+                push(static_cast<std::uint16_t>(m_slots.size()));
+                emit(RegInstruction { .m_op = RegOpCode::GET_GLOBAL, .m_a = top(), .m_b = read_short(offset + 1) });
+                break;
+            case std::to_underlying(OpCode::DEFINE_GLOBAL):
+                emit(RegInstruction { .m_op = RegOpCode::DEFINE_GLOBAL, .m_a = pop(), .m_b = read_short(offset + 1) });
+                break;
+            case std::to_underlying(OpCode::SET_GLOBAL):
+                emit(RegInstruction { .m_op = RegOpCode::SET_GLOBAL, .m_a = m_slots.back(), .m_b = read_short(offset + 1) });
+                break;
+            case std::to_underlying(OpCode::GET_UPVALUE):
+                push(static_cast<std::uint16_t>(m_slots.size()));
+                emit(RegInstruction { .m_op = RegOpCode::GET_UPVALUE, .m_a = top(), .m_b = code[offset + 1] });
+                break;
+            case std::to_underlying(OpCode::SET_UPVALUE):
+                emit(RegInstruction { .m_op = RegOpCode::SET_UPVALUE, .m_a = m_slots.back(), .m_b = code[offset + 1] });
+                break;
+            case std::to_underlying(OpCode::GET_PROPERTY):
+            case std::to_underlying(OpCode::GET_UNBOUND): {
+                RegOpCode op = op_code == std::to_underlying(OpCode::GET_PROPERTY) ? RegOpCode::GET_PROPERTY : RegOpCode::GET_UNBOUND;
+                std::uint16_t object = register_operand(top());
+                emit(RegInstruction { .m_op = op, .m_x = code[offset + 1], .m_a = top(), .m_b = object, .m_c = read_short(offset + 2) });
+                m_slots.back() = top();
+                break;
+            }
+            case std::to_underlying(OpCode::SET_PROPERTY): {
+                std::uint16_t object = register_operand(top() - 1);
+                std::uint16_t value = pop();
+                emit(RegInstruction { .m_op = RegOpCode::SET_PROPERTY, .m_x = code[offset + 1], .m_a = object, .m_b = value, .m_c = read_short(offset + 2) });
+                // The assignment's result is just the assigned value, although
+                // if that was computed into the popped slot it has to move down.
+                m_slots.back() = value;
+                if (!RegisterCode::is_constant(value) && value > top()) {
+                    m_slots.back() = top() + 1;
+                    materialize(top());
+                }
+                break;
+            }
+            case std::to_underlying(OpCode::GET_SUPER): {
+                std::uint16_t superclass = register_operand(top());
+                pop();
+                materialize(top());
+                emit(RegInstruction { .m_op = RegOpCode::GET_SUPER, .m_x = code[offset + 1], .m_a = top(), .m_b = superclass, .m_c = read_short(offset + 2) });
+                break;
+            }
+            case std::to_underlying(OpCode::EQUAL):
+            case std::to_underlying(OpCode::GREATER):
+            case std::to_underlying(OpCode::LESS):
+            case std::to_underlying(OpCode::ADD):
+            case std::to_underlying(OpCode::SUBTRACT):
+            case std::to_underlying(OpCode::MULTIPLY):
+            case std::to_underlying(OpCode::DIVIDE): {
+                // The binary opcodes are in the same order in both instruction sets
+                RegOpCode op = static_cast<RegOpCode>(std::to_underlying(RegOpCode::EQUAL) + op_code - std::to_underlying(OpCode::EQUAL));
+                std::uint16_t b = pop();
+                std::uint16_t a = pop();
+                push(static_cast<std::uint16_t>(m_slots.size()));
+                emit(RegInstruction { .m_op = op, .m_a = top(), .m_b = a, .m_c = b });
+                break;
+            }
+            case std::to_underlying(OpCode::NOT):
+            case std::to_underlying(OpCode::NEGATE): {
+                RegOpCode op = op_code == std::to_underlying(OpCode::NOT) ? RegOpCode::NOT : RegOpCode::NEGATE;
+                emit(RegInstruction { .m_op = op, .m_a = top(), .m_b = m_slots.back() });
+                m_slots.back() = top();
+                break;
+            }
+            case std::to_underlying(OpCode::PRINT):
+                emit(RegInstruction { .m_op = RegOpCode::PRINT, .m_a = pop() });
+                break;
+            case std::to_underlying(OpCode::JUMP):
+                materialize_all();
+                jump(RegOpCode::JUMP, next + read_short(offset + 1));
+                break;
+            case std::to_underlying(OpCode::JUMP_IF_FALSE):
+                materialize_all();
+                jump(RegOpCode::JUMP_IF_FALSE, next + read_short(offset + 1));
+                break;
+            case std::to_underlying(OpCode::LOOP):
+                materialize_all();
+                jump(RegOpCode::JUMP, next - read_short(offset + 1));
+                break;
+            case std::to_underlying(OpCode::GUARD_CALL):
+            case std::to_underlying(OpCode::GUARD_INVOKE):
+                // Register code always makes the call, leaving the inlined body unreachable
+                materialize_all();
+                jump(RegOpCode::JUMP, next + read_short(next - 2));
+                break;
+            case std::to_underlying(OpCode::CALL):
+            case std::to_underlying(OpCode::INVOKE):
+            case std::to_underlying(OpCode::SUPER_INVOKE):
+            case std::to_underlying(OpCode::TAIL_CALL):
+            case std::to_underlying(OpCode::TAIL_INVOKE): {
+                // The callee may reassign our captured locals through its upvalues,
+                // so nothing may keep reading a local's register across the call.
+                // The arguments also need to be in consecutive registers.
+                materialize_all();
+                RegInstruction instruction{};
+                if (op_code == std::to_underlying(OpCode::CALL) || op_code == std::to_underlying(OpCode::TAIL_CALL)) {
+                    RegOpCode op = op_code == std::to_underlying(OpCode::CALL) ? RegOpCode::CALL : RegOpCode::TAIL_CALL;
+                    instruction = RegInstruction { .m_op = op, .m_x = code[offset + 1] };
+                }
+                else {
+                    RegOpCode op = op_code == std::to_underlying(OpCode::INVOKE) ? RegOpCode::INVOKE :
+                                   op_code == std::to_underlying(OpCode::TAIL_INVOKE) ? RegOpCode::TAIL_INVOKE : RegOpCode::SUPER_INVOKE;
+                    instruction = RegInstruction { .m_op = op, .m_x = code[offset + 2], .m_b = code[offset + 1], .m_c = read_short(offset + 3) };
+                }
+                // SUPER_INVOKE has the superclass on top, above the arguments
+                std::size_t extra = (op_code == std::to_underlying(OpCode::SUPER_INVOKE)) ? 1 : 0;
+                std::size_t base = m_slots.size() - instruction.m_x - 1 - extra;
+                instruction.m_a = static_cast<std::uint16_t>(base);
+                emit(instruction);
+                reset_slots(base + 1);
+                break;
+            }
+            case std::to_underlying(OpCode::CALL_UNBOUND): {
+                materialize_all();
+                std::uint8_t arg_count = code[offset + 2];
+                std::size_t base = m_slots.size() - arg_count - 1;
+                emit(RegInstruction { .m_op = RegOpCode::CALL_UNBOUND, .m_x = arg_count, .m_a = static_cast<std::uint16_t>(base), .m_b = code[offset + 1] });
+                reset_slots(base + 1);
+                break;
+            }
+            case std::to_underlying(OpCode::CLOSURE): {
+                // Captured locals must be in their registers
+                materialize_all();
+                push(static_cast<std::uint16_t>(m_slots.size()));
+                std::uint8_t function = code[offset + 1];
+                emit(RegInstruction { .m_op = RegOpCode::CLOSURE, .m_a = top(), .m_b = function });
+                std::size_t upvalue_count = m_chunk.get_constants().at(function).as_function()->m_upvalue_count;
+                for (std::size_t i = 0; i < upvalue_count; i++) {
+                    emit(RegInstruction { .m_op = RegOpCode::CAPTURE, .m_x = code[offset + 2 + 2 * i], .m_a = code[offset + 3 + 2 * i] });
+                }
+                break;
+            }
+            case std::to_underlying(OpCode::CLOSE_UPVALUE):
+                materialize(top());
+                emit(RegInstruction { .m_op = RegOpCode::CLOSE_UPVALUE, .m_a = top() });
+                pop();
+                break;
+            case std::to_underlying(OpCode::RETURN):
+                emit(RegInstruction { .m_op = RegOpCode::RETURN, .m_a = pop() });
+                break;
+            case std::to_underlying(OpCode::CLASS):
+                push(static_cast<std::uint16_t>(m_slots.size()));
+                emit(RegInstruction { .m_op = RegOpCode::CLASS, .m_a = top(), .m_b = code[offset + 1] });
+                break;
+            case std::to_underlying(OpCode::INHERIT): {
+                std::uint16_t subclass = register_operand(top());
+                std::uint16_t superclass = register_operand(top() - 1);
+                emit(RegInstruction { .m_op = RegOpCode::INHERIT, .m_a = superclass, .m_b = subclass });
+                pop();
+                break;
+            }
+            case std::to_underlying(OpCode::METHOD): {
+                std::uint16_t method = register_operand(top());
+                std::uint16_t klass = register_operand(top() - 1);
+                emit(RegInstruction { .m_op = RegOpCode::METHOD, .m_x = code[offset + 1], .m_a = klass, .m_b = method });
+                pop();
+                break;
+            }
+            default:
+                throw std::runtime_error("Unexpected opcode in register translation.");
+        }
+        offset = next;
+    }
+
+    for (auto [index, target] : m_pending_jumps) {
+        m_code.m_code[index].set_target(m_instruction_indices.at(target));
+    }
+}
+
+RegisterCode::RegisterCode(Chunk& chunk, std::size_t arity) {
+    RegisterTranslator(chunk, *this).translate(arity);
+}
+
+static const char* s_reg_opcode_names[] = {
+    "R_MOVE",                 // [RegOpCode::MOVE]
+    "R_GET_GLOBAL",           // [RegOpCode::GET_GLOBAL]
+    "R_DEFINE_GLOBAL",        // [RegOpCode::DEFINE_GLOBAL]
+    "R_SET_GLOBAL",           // [RegOpCode::SET_GLOBAL]
+    "R_GET_UPVALUE",          // [RegOpCode::GET_UPVALUE]
+    "R_SET_UPVALUE",          // [RegOpCode::SET_UPVALUE]
+    "R_GET_PROPERTY",         // [RegOpCode::GET_PROPERTY]
+    "R_GET_UNBOUND",          // [RegOpCode::GET_UNBOUND]
+    "R_SET_PROPERTY",         // [RegOpCode::SET_PROPERTY]
+    "R_GET_SUPER",            // [RegOpCode::GET_SUPER]
+    "R_EQUAL",                // [RegOpCode::EQUAL]
+    "R_GREATER",              // [RegOpCode::GREATER]
+    "R_LESS",                 // [RegOpCode::LESS]
+    "R_ADD",                  // [RegOpCode::ADD]
+    "R_SUBTRACT",             // [RegOpCode::SUBTRACT]
+    "R_MULTIPLY",             // [RegOpCode::MULTIPLY]
+    "R_DIVIDE",               // [RegOpCode::DIVIDE]
+    "R_NOT",                  // [RegOpCode::NOT]
+    "R_NEGATE",               // [RegOpCode::NEGATE]
+    "R_PRINT",                // [RegOpCode::PRINT]
+    "R_JUMP",                 // [RegOpCode::JUMP]
+    "R_JUMP_IF_FALSE",        // [RegOpCode::JUMP_IF_FALSE]
+    "R_CALL",                 // [RegOpCode::CALL]
+    "R_INVOKE",               // [RegOpCode::INVOKE]
+    "R_SUPER_INVOKE",         // [RegOpCode::SUPER_INVOKE]
+    "R_TAIL_CALL",            // [RegOpCode::TAIL_CALL]
+    "R_TAIL_INVOKE",          // [RegOpCode::TAIL_INVOKE]
+    "R_CALL_UNBOUND",         // [RegOpCode::CALL_UNBOUND]
+    "R_CLOSURE",              // [RegOpCode::CLOSURE]
+    "R_CAPTURE",              // [RegOpCode::CAPTURE]
+    "R_CLOSE_UPVALUE",        // [RegOpCode::CLOSE_UPVALUE]
+    "R_RETURN",               // [RegOpCode::RETURN]
+    "R_CLASS",                // [RegOpCode::CLASS]
+    "R_INHERIT",              // [RegOpCode::INHERIT]
+    "R_METHOD",               // [RegOpCode::METHOD]
+};
+static_assert(std::size(s_reg_opcode_names) == k_reg_opcode_count, "Name table must cover every RegOpCode.");
+
+/** Print an RK operand as either a register or a constant's value */
+static void print_operand(const Chunk& chunk, std::uint16_t operand) {
+    if (RegisterCode::is_constant(operand)) {
+        printf(" '");
+        chunk.get_constants().at(operand & ~RegisterCode::k_constant_bit).print();
+        printf("'");
+    }
+    else {
+        printf(" r%d", operand);
+    }
+}
+
+void RegisterCode::dissassemble(const char* name, const Chunk& chunk) const {
+    printf("== %s (registers: %zu) ==\n", name, m_frame_size);
+
+    for (std::size_t index = 0; index < m_code.size();) {
+        index = disassemble_instruction(chunk, index);
+    }
+}
+
+std::size_t RegisterCode::disassemble_instruction(const Chunk& chunk, std::size_t index) const {
+    printf("%04zu ", index);
+    if (index > 0 && m_lines.at(index) == m_lines.at(index - 1)) {
+        printf("   | ");
+    } else {
+        printf("%4zu ", m_lines.at(index));
+    }
+
+    const RegInstruction& instruction = m_code.at(index);
+    printf("%-16s", s_reg_opcode_names[std::to_underlying(instruction.m_op)]);
+    switch (instruction.m_op) {
+        case RegOpCode::GET_GLOBAL:
+            printf(" r%d = '%s'", instruction.m_a, g_vm.global_name(instruction.m_b)->chars());
+            break;
+        case RegOpCode::DEFINE_GLOBAL:
+        case RegOpCode::SET_GLOBAL:
+            printf(" '%s' =", g_vm.global_name(instruction.m_b)->chars());
+            print_operand(chunk, instruction.m_a);
+            break;
+        case RegOpCode::GET_UPVALUE:
+            printf(" r%d = upvalue %d", instruction.m_a, instruction.m_b);
+            break;
+        case RegOpCode::SET_UPVALUE:
+            printf(" upvalue %d =", instruction.m_b);
+            print_operand(chunk, instruction.m_a);
+            break;
+        case RegOpCode::GET_PROPERTY:
+        case RegOpCode::GET_UNBOUND:
+        case RegOpCode::GET_SUPER:
+            printf(" r%d = r%d.", instruction.m_a, instruction.m_b);
+            chunk.get_constants().at(instruction.m_x).print();
+            printf(" (cache %d)", instruction.m_c);
+            break;
+        case RegOpCode::SET_PROPERTY:
+            printf(" r%d.", instruction.m_a);
+            chunk.get_constants().at(instruction.m_x).print();
+            printf(" =");
+            print_operand(chunk, instruction.m_b);
+            printf(" (cache %d)", instruction.m_c);
+            break;
+        case RegOpCode::JUMP:
+            printf(" -> %zu", instruction.target());
+            break;
+        case RegOpCode::JUMP_IF_FALSE:
+            printf(" r%d -> %zu", instruction.m_a, instruction.target());
+            break;
+        case RegOpCode::CALL:
+        case RegOpCode::TAIL_CALL:
+            printf(" r%d (%d args)", instruction.m_a, instruction.m_x);
+            break;
+        case RegOpCode::CALL_UNBOUND:
+            printf(" r%d on r%d (%d args)", instruction.m_b, instruction.m_a, instruction.m_x);
+            break;
+        case RegOpCode::INVOKE:
+        case RegOpCode::SUPER_INVOKE:
+        case RegOpCode::TAIL_INVOKE:
+            printf(" r%d.", instruction.m_a);
+            chunk.get_constants().at(instruction.m_b).print();
+            printf(" (%d args) (cache %d)", instruction.m_x, instruction.m_c);
+            break;
+        case RegOpCode::CLOSURE:
+        case RegOpCode::CLASS:
+            printf(" r%d = ", instruction.m_a);
+            chunk.get_constants().at(instruction.m_b).print();
+            break;
+        case RegOpCode::CAPTURE:
+            printf(" %s %d", instruction.m_x ? "local" : "upvalue", instruction.m_a);
+            break;
+        case RegOpCode::CLOSE_UPVALUE:
+            printf(" r%d", instruction.m_a);
+            break;
+        case RegOpCode::PRINT:
+        case RegOpCode::RETURN:
+            print_operand(chunk, instruction.m_a);
+            break;
+        case RegOpCode::INHERIT:
+            printf(" r%d -> r%d", instruction.m_a, instruction.m_b);
+            break;
+        case RegOpCode::METHOD:
+            printf(" r%d.", instruction.m_a);
+            chunk.get_constants().at(instruction.m_x).print();
+            printf(" = r%d", instruction.m_b);
+            break;
+        default:
+            // Unary and binary operators and moves
+            printf(" r%d =", instruction.m_a);
+            print_operand(chunk, instruction.m_b);
+            if (instruction.m_op >= RegOpCode::EQUAL && instruction.m_op <= RegOpCode::DIVIDE) {
+                print_operand(chunk, instruction.m_c);
+            }
+            break;
+    }
+    printf("\n");
+    return index + 1;
+}
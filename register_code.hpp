@@ -0,0 +1,152 @@
+#ifndef ppclox_register_code_hpp
+#define ppclox_register_code_hpp
+
+#include <unordered_map>
+
+#include "common.hpp"
+
+class Chunk;
+
+/**
+ * Opcodes of the register based backend. Operands name registers (slots of the
+ * call frame) directly instead of implicitly using the top of the value stack.
+ * Operands documented as "RK" are either a register, or a constant when
+ * RegisterCode::k_constant_bit is set.
+ */
+enum class RegOpCode : std::uint8_t {
+    /** R[a] = RK[b] */
+    MOVE,
+    /** R[a] = globals[b] */
+    GET_GLOBAL,
+    /** globals[b] = RK[a], marking it defined */
+    DEFINE_GLOBAL,
+    /** globals[b] = RK[a] */
+    SET_GLOBAL,
+    /** R[a] = upvalues[b] */
+    GET_UPVALUE,
+    /** upvalues[b] = RK[a] */
+    SET_UPVALUE,
+    /** R[a] = R[b].constants[x] using inline cache c */
+    GET_PROPERTY,
+    /** Like GET_PROPERTY, but a method is left unbound (see OpCode::GET_UNBOUND) */
+    GET_UNBOUND,
+    /** R[a].constants[x] = RK[b] using inline cache c */
+    SET_PROPERTY,
+    /** R[a] = method constants[x] of superclass R[b] bound to R[a], using inline cache c */
+    GET_SUPER,
+    /** R[a] = RK[b] == RK[c] etc. */
+    EQUAL,
+    GREATER,
+    LESS,
+    ADD,
+    SUBTRACT,
+    MULTIPLY,
+    DIVIDE,
+    /** R[a] = !RK[b] */
+    NOT,
+    /** R[a] = -RK[b] */
+    NEGATE,
+    /** print RK[a] */
+    PRINT,
+    /** Continue at target() */
+    JUMP,
+    /** Continue at target() if R[a] is falsey */
+    JUMP_IF_FALSE,
+    /** Call R[a] with the x arguments in the registers after it, leaving the result in R[a] */
+    CALL,
+    /** Call method constants[b] of R[a] with x arguments, using inline cache c */
+    INVOKE,
+    /** Like INVOKE, but looked up in the superclass in the register after the arguments */
+    SUPER_INVOKE,
+    /** CALL and INVOKE for OpCode::TAIL_CALL and TAIL_INVOKE, which are followed by a RETURN of R[a] */
+    TAIL_CALL,
+    TAIL_INVOKE,
+    /** Like CALL, but calls R[b], with the receiver of the unbound method in R[a] */
+    CALL_UNBOUND,
+    /** R[a] = new closure of function constants[b]. Followed by one CAPTURE per upvalue. */
+    CLOSURE,
+    /** Pseudo instruction read by CLOSURE. Captures register a if x is set, else enclosing upvalue a. */
+    CAPTURE,
+    /** Close any upvalues referring to registers a and up */
+    CLOSE_UPVALUE,
+    /** Return RK[a] to the caller */
+    RETURN,
+    /** R[a] = new class named constants[b] */
+    CLASS,
+    /** Copy the methods of superclass R[a] down into subclass R[b] */
+    INHERIT,
+    /** Add method R[b] to class R[a] with name constants[x] */
+    METHOD
+};
+
+/** Number of register opcodes. Keep this in sync with the last RegOpCode above. */
+constexpr std::size_t k_reg_opcode_count = std::to_underlying(RegOpCode::METHOD) + 1;
+
+/** A fixed size (8 byte) register instruction. Which operands are used depends on the opcode. */
+class RegInstruction {
+public:
+    RegOpCode m_op{};
+    std::uint8_t m_x{};
+    std::uint16_t m_a{};
+    std::uint16_t m_b{};
+    std::uint16_t m_c{};
+
+    /** Jumps keep the index of the instruction they go to across m_b and m_c */
+    std::size_t target() const { return m_b | (static_cast<std::size_t>(m_c) << 16); }
+    void set_target(std::size_t target) {
+        m_b = static_cast<std::uint16_t>(target & 0xffff);
+        m_c = static_cast<std::uint16_t>(target >> 16);
+    }
+};
+
+/**
+ * The register based form of a function, produced from the function's stack
+ * based bytecode the first time the register backend calls it. It shares the
+ * chunk's constants, inline caches and line information rather than having
+ * its own copies, so both backends see the same ObjFunction.
+ *
+ * The translation symbolically executes the stack code, so that stack slot N of a
+ * frame becomes register N. Pushes of locals and constants are not copied anywhere
+ * until a later instruction needs them in their own register, which lets most
+ * instructions read their operands straight out of the locals they came from.
+ */
+class RegisterCode {
+public:
+    /** Set on an RK operand when it refers to a constant instead of a register */
+    static constexpr std::uint16_t k_constant_bit = 0x8000;
+    /** Registers available to a single frame */
+    static constexpr std::size_t k_max_registers = k_constant_bit;
+
+    static bool is_constant(std::uint16_t operand) { return (operand & k_constant_bit) != 0; }
+
+    /** Translate the stack based code of a function with the given arity. May add constants to the chunk. */
+    RegisterCode(Chunk& chunk, std::size_t arity);
+
+    const std::vector<RegInstruction>& get_code() const { return m_code; }
+    /** Line of the source each instruction came from */
+    const std::vector<std::size_t>& get_lines() const { return m_lines; }
+    /** Number of registers the frame needs, including the callee and arguments */
+    std::size_t frame_size() const { return m_frame_size; }
+    /**
+     * Index of the instruction that the loop header at the given offset into the stack
+     * code was translated to, or SIZE_MAX if there is no loop header there. Every value
+     * on the stack there is in its own register, so a stack frame can switch over.
+     */
+    std::size_t loop_header_index(std::size_t offset) const {
+        auto it = m_loop_headers.find(offset);
+        return it != m_loop_headers.end() ? it->second : SIZE_MAX;
+    }
+
+    void dissassemble(const char* name, const Chunk& chunk) const;
+    /** Disassemble the instruction at the given index, returning the index of the next one */
+    std::size_t disassemble_instruction(const Chunk& chunk, std::size_t index) const;
+private:
+    std::vector<RegInstruction> m_code{};
+    std::vector<std::size_t> m_lines{};
+    std::size_t m_frame_size{};
+    std::unordered_map<std::size_t, std::size_t> m_loop_headers{};
+
+    friend class RegisterTranslator;
+};
+
+#endif
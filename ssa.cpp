@@ -0,0 +1,944 @@
+#include "ssa.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <map>
+#include <optional>
+#include <tuple>
+
+bool SsaFunction::writes_memory(OpCode op) {
+    switch (op) {
+        case OpCode::DEFINE_GLOBAL:
+        case OpCode::SET_GLOBAL:
+        case OpCode::SET_UPVALUE:
+        case OpCode::SET_PROPERTY:
+        case OpCode::CALL:
+        case OpCode::INVOKE:
+        case OpCode::SUPER_INVOKE:
+        case OpCode::TAIL_CALL:
+        case OpCode::TAIL_INVOKE:
+        case OpCode::INHERIT:
+        case OpCode::METHOD:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool SsaFunction::is_pure(OpCode op) {
+    switch (op) {
+        case OpCode::CONSTANT:
+        case OpCode::NIL:
+        case OpCode::TRUE:
+        case OpCode::FALSE:
+        case OpCode::GET_LOCAL:
+        case OpCode::GET_GLOBAL:
+        case OpCode::GET_UPVALUE:
+        case OpCode::GET_PROPERTY:
+        case OpCode::EQUAL:
+        case OpCode::GREATER:
+        case OpCode::LESS:
+        case OpCode::ADD:
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+        case OpCode::NOT:
+        case OpCode::NEGATE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+std::size_t SsaFunction::new_value(SsaKind kind, std::size_t block, OpCode op, std::size_t instruction) {
+    m_values.push_back(SsaValue{ .m_kind = kind, .m_op = op, .m_instruction = instruction, .m_block = block });
+    return m_values.size() - 1;
+}
+
+std::size_t SsaFunction::resolve(std::size_t value) const {
+    while (m_values[value].m_replacement != SIZE_MAX) value = m_values[value].m_replacement;
+    return value;
+}
+
+bool SsaFunction::dominates(std::size_t a, std::size_t b) const {
+    for (;;) {
+        if (a == b) return true;
+        if (b == 0) return false;
+        b = m_blocks[b].m_idom;
+    }
+}
+
+bool SsaFunction::can_fail(std::size_t instruction) const {
+    const SsaInstruction& info = m_info[instruction];
+    auto is_number = [&](std::size_t input) { return value(info.m_inputs[input]).m_type == SsaType::NUMBER; };
+    switch (m_instructions[instruction].m_op) {
+        case OpCode::CONSTANT:
+        case OpCode::NIL:
+        case OpCode::TRUE:
+        case OpCode::FALSE:
+        case OpCode::GET_LOCAL:
+        case OpCode::GET_UPVALUE:
+        case OpCode::EQUAL:
+        case OpCode::NOT:
+            return false;
+        case OpCode::GREATER:
+        case OpCode::LESS:
+        case OpCode::ADD:
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+            return !is_number(0) || !is_number(1);
+        case OpCode::NEGATE:
+            return !is_number(0);
+        default:
+            return true;
+    }
+}
+
+bool SsaFunction::build() {
+    if (m_instructions.empty()) return false;
+    build_blocks();
+    for (auto& instruction : m_instructions) {
+        if (instruction.is_jump() && instruction.m_target >= m_instructions.size()) return false;
+    }
+    order_blocks();
+    find_dominators();
+    if (!build_values()) return false;
+    fold_trivial_phis();
+    infer_types();
+    find_loops();
+    return true;
+}
+
+void SsaFunction::build_blocks() {
+    std::size_t count = m_instructions.size();
+    std::vector<bool> leaders(count + 1, false);
+    leaders[0] = true;
+    for (std::size_t i = 0; i < count; i++) {
+        const OptInstruction& instruction = m_instructions[i];
+        if (instruction.is_jump()) {
+            leaders[std::min(instruction.m_target, count)] = true;
+        }
+        if (instruction.is_jump() || instruction.m_op == OpCode::RETURN) {
+            leaders[i + 1] = true;
+        }
+    }
+
+    // Block 0 is an empty entry block, so that a loop at the very start of the
+    // function still has a block outside it to come from
+    m_blocks.push_back(SsaBlock{});
+    m_block_of.assign(count, SIZE_MAX);
+    for (std::size_t i = 0; i < count; i++) {
+        if (leaders[i]) {
+            m_blocks.push_back(SsaBlock{ .m_start = i });
+        }
+        m_blocks.back().m_end = i + 1;
+        m_block_of[i] = m_blocks.size() - 1;
+    }
+
+    m_blocks[0].m_successors.push_back(1);
+    for (std::size_t block = 1; block < m_blocks.size(); block++) {
+        const OptInstruction& last = m_instructions[m_blocks[block].m_end - 1];
+        bool falls_through = last.m_op != OpCode::JUMP && last.m_op != OpCode::LOOP && last.m_op != OpCode::RETURN;
+        if (falls_through && m_blocks[block].m_end < count) {
+            m_blocks[block].m_successors.push_back(block + 1);
+        }
+        if (last.is_jump() && last.m_target < count) {
+            m_blocks[block].m_successors.push_back(m_block_of[last.m_target]);
+        }
+    }
+}
+
+void SsaFunction::order_blocks() {
+    // Depth first from the entry for the postorder, keeping our place in each block's successors
+    std::vector<std::size_t> postorder{};
+    std::vector<std::pair<std::size_t, std::size_t>> stack{ { 0, 0 } };
+    m_blocks[0].m_reachable = true;
+    while (!stack.empty()) {
+        std::size_t block = stack.back().first;
+        std::size_t next = stack.back().second;
+        if (next < m_blocks[block].m_successors.size()) {
+            stack.back().second++;
+            std::size_t successor = m_blocks[block].m_successors[next];
+            if (!m_blocks[successor].m_reachable) {
+                m_blocks[successor].m_reachable = true;
+                stack.emplace_back(successor, 0);
+            }
+            continue;
+        }
+        postorder.push_back(block);
+        stack.pop_back();
+    }
+
+    m_order.assign(postorder.rbegin(), postorder.rend());
+    for (std::size_t i = 0; i < m_order.size(); i++) {
+        m_blocks[m_order[i]].m_order = i;
+    }
+    // Only edges from reachable blocks count
+    for (std::size_t block : m_order) {
+        for (std::size_t successor : m_blocks[block].m_successors) {
+            m_blocks[successor].m_predecessors.push_back(block);
+        }
+    }
+}
+
+void SsaFunction::find_dominators() {
+    // Cooper, Harvey and Kennedy's iterative algorithm over the reverse postorder
+    m_blocks[0].m_idom = 0;
+    auto intersect = [&](std::size_t a, std::size_t b) {
+        while (a != b) {
+            while (m_blocks[a].m_order > m_blocks[b].m_order) a = m_blocks[a].m_idom;
+            while (m_blocks[b].m_order > m_blocks[a].m_order) b = m_blocks[b].m_idom;
+        }
+        return a;
+    };
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (std::size_t block : m_order) {
+            if (block == 0) continue;
+            std::size_t idom = SIZE_MAX;
+            for (std::size_t predecessor : m_blocks[block].m_predecessors) {
+                if (m_blocks[predecessor].m_idom == SIZE_MAX) continue;
+                idom = idom == SIZE_MAX ? predecessor : intersect(predecessor, idom);
+            }
+            if (idom != m_blocks[block].m_idom) {
+                m_blocks[block].m_idom = idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+bool SsaFunction::build_values() {
+    m_info.assign(m_instructions.size(), SsaInstruction{ .m_block = SIZE_MAX });
+
+    m_captured.assign(std::numeric_limits<std::uint8_t>::max() + 1, false);
+    for (const auto& instruction : m_instructions) {
+        if (instruction.m_op != OpCode::CLOSURE) continue;
+        for (std::size_t i = 1; i + 1 < instruction.m_operands.size(); i += 2) {
+            if (instruction.m_operands[i] != 0) m_captured[instruction.m_operands[i + 1]] = true;
+        }
+    }
+
+    // The callee (or receiver) and the arguments
+    for (std::size_t slot = 0; slot <= m_function->m_arity; slot++) {
+        m_blocks[0].m_exit.push_back(new_value(SsaKind::ENTRY, 0));
+    }
+
+    std::size_t epoch = 0;
+    std::vector<std::size_t> merges{};
+    for (std::size_t block : m_order) {
+        if (block == 0) continue;
+        SsaBlock& current = m_blocks[block];
+
+        // Predecessors earlier in the order have been done already, and there is always at
+        // least one. Any others are back edges, which we only know about once they are done.
+        std::vector<std::size_t> done{};
+        for (std::size_t predecessor : current.m_predecessors) {
+            if (m_blocks[predecessor].m_order < current.m_order) done.push_back(predecessor);
+        }
+        if (current.m_predecessors.size() == 1) {
+            current.m_entry = m_blocks[done.at(0)].m_exit;
+        }
+        else {
+            std::size_t depth = m_blocks[done.at(0)].m_exit.size();
+            for (std::size_t predecessor : done) {
+                if (m_blocks[predecessor].m_exit.size() != depth) return false;
+            }
+            for (std::size_t slot = 0; slot < depth; slot++) {
+                current.m_entry.push_back(new_value(SsaKind::PHI, block));
+            }
+            merges.push_back(block);
+        }
+
+        if (!interpret_block(block, epoch)) return false;
+    }
+
+    for (std::size_t block : merges) {
+        SsaBlock& current = m_blocks[block];
+        for (std::size_t predecessor : current.m_predecessors) {
+            const auto& exit = m_blocks[predecessor].m_exit;
+            if (exit.size() != current.m_entry.size()) return false;
+            for (std::size_t slot = 0; slot < exit.size(); slot++) {
+                m_values[current.m_entry[slot]].m_operands.push_back(exit[slot]);
+            }
+        }
+    }
+    return true;
+}
+
+bool SsaFunction::interpret_block(std::size_t block, std::size_t& epoch) {
+    /** A value on the stack, and the instruction that pushed it and where its expression starts */
+    class Entry {
+    public:
+        std::size_t m_value{};
+        std::size_t m_pusher{ SIZE_MAX };
+        std::size_t m_start{ SIZE_MAX };
+    };
+
+    SsaBlock& current = m_blocks[block];
+    std::vector<Entry> stack{};
+    for (std::size_t value : current.m_entry) stack.push_back(Entry{ .m_value = value });
+    epoch++;
+
+    for (std::size_t i = current.m_start; i < current.m_end; i++) {
+        const OptInstruction& instruction = m_instructions[i];
+        SsaInstruction& info = m_info[i];
+        info.m_block = block;
+        info.m_epoch = epoch;
+
+        // Work out what the instruction pops (or just peeks at) and pushes
+        std::size_t pops = 0;
+        std::size_t peeks = 0;
+        std::size_t pushes = 0;
+        bool modelled = true;
+        switch (instruction.m_op) {
+            case OpCode::CONSTANT:
+            case OpCode::NIL:
+            case OpCode::TRUE:
+            case OpCode::FALSE:
+            case OpCode::GET_GLOBAL:
+            case OpCode::GET_UPVALUE:
+                pushes = 1;
+                break;
+            case OpCode::GET_PROPERTY:
+            case OpCode::NOT:
+            case OpCode::NEGATE:
+                pops = 1;
+                pushes = 1;
+                break;
+            case OpCode::EQUAL:
+            case OpCode::GREATER:
+            case OpCode::LESS:
+            case OpCode::ADD:
+            case OpCode::SUBTRACT:
+            case OpCode::MULTIPLY:
+            case OpCode::DIVIDE:
+                pops = 2;
+                pushes = 1;
+                break;
+            case OpCode::GET_LOCAL:
+            case OpCode::SET_LOCAL:
+                // Handled below, as they only move values between slots
+                break;
+            default: {
+                modelled = false;
+                switch (instruction.m_op) {
+                    case OpCode::SET_GLOBAL:
+                    case OpCode::SET_UPVALUE:
+                    case OpCode::JUMP_IF_FALSE:
+                        peeks = 1;
+                        break;
+                    case OpCode::SET_PROPERTY:
+                    case OpCode::GET_SUPER:
+                        pops = 2;
+                        pushes = 1;
+                        break;
+                    case OpCode::CALL:
+                    case OpCode::TAIL_CALL:
+                        pops = instruction.m_operands[0] + 1;
+                        pushes = 1;
+                        break;
+                    case OpCode::INVOKE:
+                    case OpCode::TAIL_INVOKE:
+                        pops = instruction.m_operands[1] + 1;
+                        pushes = 1;
+                        break;
+                    case OpCode::SUPER_INVOKE:
+                        pops = instruction.m_operands[1] + 2;
+                        pushes = 1;
+                        break;
+                    case OpCode::CLOSURE:
+                    case OpCode::CLASS:
+                        pushes = 1;
+                        break;
+                    case OpCode::JUMP:
+                    case OpCode::LOOP:
+                    case OpCode::GUARD_CALL:
+                    case OpCode::GUARD_INVOKE:
+                        break;
+                    default:
+                        // POP, DEFINE_GLOBAL, PRINT, CLOSE_UPVALUE, RETURN, INHERIT and METHOD
+                        pops = 1;
+                        break;
+                }
+                break;
+            }
+        }
+
+        if (instruction.m_op == OpCode::GET_LOCAL || instruction.m_op == OpCode::SET_LOCAL) {
+            std::size_t slot = instruction.m_operands[0];
+            if (slot >= stack.size()) return false;
+            if (instruction.m_op == OpCode::GET_LOCAL) {
+                info.m_inputs.push_back(stack[slot].m_value);
+                info.m_output = stack[slot].m_value;
+                info.m_start = i;
+                stack.push_back(Entry{ .m_value = stack[slot].m_value, .m_pusher = i, .m_start = i });
+            }
+            else {
+                Entry& top = stack.back();
+                info.m_inputs.push_back(top.m_value);
+                if (top.m_pusher != SIZE_MAX && m_info[top.m_pusher].m_consumer == SIZE_MAX) m_info[top.m_pusher].m_consumer = i;
+                stack[slot].m_value = top.m_value;
+                if (slot != stack.size() - 1) {
+                    stack[slot].m_pusher = SIZE_MAX;
+                    stack[slot].m_start = SIZE_MAX;
+                }
+            }
+            continue;
+        }
+
+        if (stack.size() < pops + peeks) return false;
+
+        // The start of the expression is the start of its first operand, as long as they are all in this block
+        std::size_t start = i;
+        for (std::size_t k = stack.size() - pops - peeks; k < stack.size(); k++) {
+            Entry& entry = stack[k];
+            info.m_inputs.push_back(entry.m_value);
+            if (entry.m_pusher != SIZE_MAX && m_info[entry.m_pusher].m_consumer == SIZE_MAX) m_info[entry.m_pusher].m_consumer = i;
+            start = entry.m_start == SIZE_MAX || start == SIZE_MAX ? SIZE_MAX : std::min(start, entry.m_start);
+        }
+        stack.resize(stack.size() - pops);
+
+        if (pushes == 1) {
+            std::size_t value{};
+            if (instruction.m_op == OpCode::SET_PROPERTY) {
+                // Pushes the value it stored
+                value = info.m_inputs[1];
+            }
+            else if (modelled) {
+                value = new_value(SsaKind::INSTRUCTION, block, instruction.m_op, i);
+                m_values[value].m_operands = info.m_inputs;
+            }
+            else {
+                value = new_value(SsaKind::OPAQUE, block);
+            }
+            info.m_output = value;
+            info.m_start = modelled ? start : SIZE_MAX;
+            stack.push_back(Entry{ .m_value = value, .m_pusher = i, .m_start = info.m_start });
+        }
+
+        if (instruction.m_op == OpCode::CALL || instruction.m_op == OpCode::INVOKE || instruction.m_op == OpCode::SUPER_INVOKE ||
+                instruction.m_op == OpCode::TAIL_CALL || instruction.m_op == OpCode::TAIL_INVOKE) {
+            // Whatever was called may have assigned captured locals through their upvalues
+            for (std::size_t slot = 0; slot < stack.size() && slot < m_captured.size(); slot++) {
+                if (m_captured[slot]) stack[slot] = Entry{ .m_value = new_value(SsaKind::OPAQUE, block) };
+            }
+        }
+        if (writes_memory(instruction.m_op)) epoch++;
+    }
+
+    for (const Entry& entry : stack) current.m_exit.push_back(entry.m_value);
+    return true;
+}
+
+void SsaFunction::fold_trivial_phis() {
+    // A phi whose operands are all one value (or the phi itself, around a loop) is just that value
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (std::size_t v = 0; v < m_values.size(); v++) {
+            SsaValue& phi = m_values[v];
+            if (phi.m_kind != SsaKind::PHI || phi.m_replacement != SIZE_MAX) continue;
+            std::size_t same = SIZE_MAX;
+            bool trivial = true;
+            for (std::size_t operand : phi.m_operands) {
+                operand = resolve(operand);
+                if (operand == v || operand == same) continue;
+                if (same != SIZE_MAX) {
+                    trivial = false;
+                    break;
+                }
+                same = operand;
+            }
+            if (trivial && same != SIZE_MAX) {
+                phi.m_replacement = same;
+                changed = true;
+            }
+        }
+    }
+}
+
+SsaType SsaFunction::infer_type(const SsaValue& value) const {
+    auto operand = [&](std::size_t i) { return this->value(value.m_operands[i]).m_type; };
+    switch (value.m_kind) {
+        case SsaKind::PHI: {
+            // Optimistically, what all the operands worked out so far are
+            SsaType type = SsaType::NONE;
+            for (std::size_t i = 0; i < value.m_operands.size(); i++) {
+                SsaType other = operand(i);
+                if (other == SsaType::NONE || other == type) continue;
+                type = type == SsaType::NONE ? other : SsaType::ANY;
+            }
+            return type;
+        }
+        case SsaKind::INSTRUCTION:
+            break;
+        default:
+            return SsaType::ANY;
+    }
+
+    switch (value.m_op) {
+        case OpCode::CONSTANT: {
+            const OptInstruction& instruction = m_instructions[value.m_instruction];
+            return m_chunk.get_constants()[instruction.m_operands[0]].is_number() ? SsaType::NUMBER : SsaType::ANY;
+        }
+        case OpCode::NIL:
+            return SsaType::NIL;
+        case OpCode::TRUE:
+        case OpCode::FALSE:
+        case OpCode::EQUAL:
+        case OpCode::GREATER:
+        case OpCode::LESS:
+        case OpCode::NOT:
+            return SsaType::BOOL;
+        case OpCode::ADD:
+            // Numbers or strings
+            if (operand(0) == SsaType::NONE || operand(1) == SsaType::NONE) return SsaType::NONE;
+            return operand(0) == SsaType::NUMBER && operand(1) == SsaType::NUMBER ? SsaType::NUMBER : SsaType::ANY;
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+        case OpCode::NEGATE:
+            // Anything else is a runtime error
+            return SsaType::NUMBER;
+        default:
+            return SsaType::ANY;
+    }
+}
+
+void SsaFunction::infer_types() {
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto& value : m_values) {
+            if (value.m_replacement != SIZE_MAX) continue;
+            SsaType type = infer_type(value);
+            if (type != value.m_type) {
+                value.m_type = type;
+                changed = true;
+            }
+        }
+    }
+}
+
+void SsaFunction::find_loops() {
+    for (std::size_t latch : m_order) {
+        for (std::size_t header : m_blocks[latch].m_successors) {
+            if (!dominates(header, latch)) continue;
+
+            // A back edge. Merge loops with the same header.
+            auto found = std::ranges::find_if(m_loops, [&](const SsaLoop& loop) { return loop.m_header == header; });
+            if (found == m_loops.end()) {
+                m_loops.push_back(SsaLoop{ .m_header = header, .m_blocks = std::vector<bool>(m_blocks.size(), false) });
+                found = m_loops.end() - 1;
+            }
+            SsaLoop& loop = *found;
+            loop.m_blocks[header] = true;
+            std::vector<std::size_t> work{ latch };
+            while (!work.empty()) {
+                std::size_t block = work.back();
+                work.pop_back();
+                if (loop.m_blocks[block]) continue;
+                loop.m_blocks[block] = true;
+                for (std::size_t predecessor : m_blocks[block].m_predecessors) work.push_back(predecessor);
+            }
+        }
+    }
+
+    for (SsaLoop& loop : m_loops) {
+        for (std::size_t block = 0; block < m_blocks.size(); block++) {
+            if (!loop.m_blocks[block]) continue;
+            loop.m_size++;
+            for (std::size_t i = m_blocks[block].m_start; i < m_blocks[block].m_end; i++) {
+                const OptInstruction& instruction = m_instructions[i];
+                switch (instruction.m_op) {
+                    case OpCode::CALL:
+                    case OpCode::INVOKE:
+                    case OpCode::SUPER_INVOKE:
+                    case OpCode::TAIL_CALL:
+                    case OpCode::TAIL_INVOKE:
+                        loop.m_calls = true;
+                        break;
+                    case OpCode::SET_PROPERTY:
+                    case OpCode::INHERIT:
+                    case OpCode::METHOD:
+                        // Classes getting methods changes what property reads find too
+                        loop.m_writes_properties = true;
+                        break;
+                    case OpCode::SET_UPVALUE:
+                        loop.m_writes_upvalues = true;
+                        break;
+                    case OpCode::SET_GLOBAL:
+                    case OpCode::DEFINE_GLOBAL:
+                        loop.m_written_globals.push_back(instruction.global_slot());
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+    }
+    // Outermost first
+    std::ranges::stable_sort(m_loops, [](const SsaLoop& a, const SsaLoop& b) { return a.m_size > b.m_size; });
+}
+
+bool SsaOptimizer::is_replaceable(const SsaFunction& ssa, std::size_t end) const {
+    // Just a load of a local or literal is no cheaper from a hidden local
+    std::size_t start = ssa.instructions()[end].m_start;
+    if (start == SIZE_MAX || (start == end && !SsaFunction::reads_memory(m_instructions[end].m_op))) return false;
+
+    for (std::size_t i = start; i <= end; i++) {
+        if (!SsaFunction::is_pure(m_instructions[i].m_op)) return false;
+        if (m_instructions[i].m_op != OpCode::GET_PROPERTY) continue;
+
+        // A property that is a method gives a new bound method each time, so one used
+        // where its identity could show (compared, stored, passed on) can't be shared
+        std::size_t consumer = ssa.instructions()[i].m_consumer;
+        if (consumer == SIZE_MAX) return false;
+        switch (m_instructions[consumer].m_op) {
+            case OpCode::GREATER:
+            case OpCode::LESS:
+            case OpCode::ADD:
+            case OpCode::SUBTRACT:
+            case OpCode::MULTIPLY:
+            case OpCode::DIVIDE:
+            case OpCode::NOT:
+            case OpCode::NEGATE:
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+bool SsaOptimizer::is_invariant(const SsaFunction& ssa, const SsaLoop& loop, std::size_t instruction) const {
+    const OptInstruction& code = m_instructions[instruction];
+    switch (code.m_op) {
+        case OpCode::GET_LOCAL: {
+            // The slot has to hold a value from outside the loop, and the same one on the way in
+            std::size_t value = ssa.resolve(ssa.instructions()[instruction].m_output);
+            const auto& entry = ssa.blocks()[loop.m_header].m_entry;
+            std::size_t slot = code.m_operands[0];
+            return !loop.m_blocks[ssa.value(value).m_block] && slot < entry.size() && ssa.resolve(entry[slot]) == value;
+        }
+        case OpCode::GET_UPVALUE:
+            return !loop.m_calls && !loop.m_writes_upvalues;
+        case OpCode::GET_GLOBAL: {
+            std::size_t slot = code.global_slot();
+            return std::ranges::find(loop.m_written_globals, slot) == loop.m_written_globals.end() &&
+                   (!loop.m_calls || m_globals.is_never_reassigned(slot));
+        }
+        case OpCode::GET_PROPERTY:
+            return !loop.m_calls && !loop.m_writes_properties;
+        default:
+            // Anything else pure only depends on its operands, which are part of the same expression
+            return SsaFunction::is_pure(code.m_op);
+    }
+}
+
+std::uint8_t SsaOptimizer::canonical_constant(std::uint8_t index) const {
+    // Bit for bit for numbers, so 0 and -0 stay apart
+    const auto& constants = m_function->chunk().get_constants();
+    Value constant = constants[index];
+    for (std::uint8_t i = 0; i < index; i++) {
+        bool same = constants[i].is_number() && constant.is_number() ?
+            std::bit_cast<std::uint64_t>(constants[i].as_number()) == std::bit_cast<std::uint64_t>(constant.as_number()) :
+            constants[i] == constant;
+        if (same) return i;
+    }
+    return index;
+}
+
+std::size_t SsaOptimizer::allocate_hidden_slot() {
+    // The function's locals are about to move up by one more slot, and slots are a byte
+    std::size_t highest = m_function->m_arity;
+    for (const auto& instruction : m_instructions) {
+        if (instruction.m_op == OpCode::GET_LOCAL || instruction.m_op == OpCode::SET_LOCAL) {
+            highest = std::max<std::size_t>(highest, instruction.m_operands[0]);
+        }
+        else if (instruction.m_op == OpCode::CLOSURE) {
+            for (std::size_t i = 1; i + 1 < instruction.m_operands.size(); i += 2) {
+                if (instruction.m_operands[i] != 0) highest = std::max<std::size_t>(highest, instruction.m_operands[i + 1]);
+            }
+        }
+    }
+    if (m_hidden_slots >= k_max_hidden_slots || highest + m_hidden_slots + 1 > std::numeric_limits<std::uint8_t>::max()) {
+        return SIZE_MAX;
+    }
+    return m_function->m_arity + 1 + m_hidden_slots++;
+}
+
+bool SsaOptimizer::hoist_invariants() {
+    SsaFunction ssa(m_function, m_instructions);
+    if (!ssa.build()) return false;
+    const auto& blocks = ssa.blocks();
+    const auto& info = ssa.instructions();
+    std::size_t count = m_instructions.size();
+    std::vector<bool> hoisted(count, false);
+
+    for (const SsaLoop& loop : ssa.loops()) {
+        const SsaBlock& header = blocks[loop.m_header];
+
+        // The code before the loop only runs on the way in, so every edge into the header
+        // from outside the loop has to be a forward one, and every edge around it a LOOP
+        bool entered_once = true;
+        for (std::size_t predecessor : header.m_predecessors) {
+            bool looping = predecessor != 0 && m_instructions[blocks[predecessor].m_end - 1].m_op == OpCode::LOOP &&
+                           m_instructions[blocks[predecessor].m_end - 1].m_target == header.m_start;
+            if (loop.m_blocks[predecessor] != looping) entered_once = false;
+        }
+        if (!entered_once) continue;
+
+        auto in_loop = [&](std::size_t i) { return info[i].m_block != SIZE_MAX && loop.m_blocks[info[i].m_block]; };
+        auto defined_before_loop = [&](std::size_t slot) {
+            for (std::size_t i = 0; i < count; i++) {
+                const OptInstruction& instruction = m_instructions[i];
+                if (instruction.m_op == OpCode::DEFINE_GLOBAL && instruction.global_slot() == slot && info[i].m_block != SIZE_MAX &&
+                        info[i].m_block != loop.m_header && ssa.dominates(info[i].m_block, loop.m_header)) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        auto can_fail = [&](std::size_t i) {
+            if (m_instructions[i].m_op == OpCode::GET_GLOBAL) return !defined_before_loop(m_instructions[i].global_slot());
+            return ssa.can_fail(i);
+        };
+
+        // Every expression in the loop that could be computed before it instead
+        std::vector<bool> candidates(count, false);
+        for (std::size_t end = header.m_start; end < count; end++) {
+            if (!in_loop(end) || !is_replaceable(ssa, end)) continue;
+            bool invariant = true;
+            for (std::size_t i = info[end].m_start; i <= end && invariant; i++) {
+                invariant = !hoisted[i] && is_invariant(ssa, loop, i);
+            }
+            candidates[end] = invariant;
+        }
+
+        // Take the largest ones, leaving out any that could fail unless the loop always starts
+        // with them, after nothing but what cannot fail or is hoisted ahead of them as well
+        std::vector<bool> chosen{};
+        for (bool changed = true; changed;) {
+            changed = false;
+            chosen.assign(count, false);
+            std::vector<bool> covered(count, false);
+            for (std::size_t end = header.m_start; end < count && !changed; end++) {
+                if (!candidates[end]) continue;
+                std::size_t consumer = info[end].m_consumer;
+                if (consumer != SIZE_MAX && candidates[consumer]) continue;
+
+                std::size_t start = info[end].m_start;
+                bool fails = false;
+                for (std::size_t i = start; i <= end; i++) fails |= can_fail(i);
+                if (fails) {
+                    bool first = info[end].m_block == loop.m_header;
+                    for (std::size_t i = header.m_start; i < start && first; i++) {
+                        first = covered[i] || (SsaFunction::is_pure(m_instructions[i].m_op) && !can_fail(i));
+                    }
+                    if (!first) {
+                        candidates[end] = false;
+                        changed = true;
+                        continue;
+                    }
+                }
+                chosen[end] = true;
+                for (std::size_t i = start; i <= end; i++) covered[i] = true;
+            }
+        }
+
+        for (std::size_t end = header.m_start; end < count; end++) {
+            if (!chosen[end]) continue;
+            std::size_t slot = allocate_hidden_slot();
+            if (slot == SIZE_MAX) break;
+            std::size_t start = info[end].m_start;
+            m_hoists.push_back(Hoist{ .m_header = header.m_start, .m_start = start, .m_end = end, .m_slot = slot });
+            m_reuses.push_back(Reuse{ .m_start = start, .m_end = end, .m_slot = slot });
+            for (std::size_t i = start; i <= end; i++) hoisted[i] = true;
+        }
+    }
+
+    if (m_hidden_slots == 0) return false;
+    rewrite();
+    return true;
+}
+
+bool SsaOptimizer::number_values() {
+    SsaFunction ssa(m_function, m_instructions);
+    if (!ssa.build()) return false;
+    const auto& blocks = ssa.blocks();
+    const auto& info = ssa.instructions();
+    std::size_t count = m_instructions.size();
+
+    // Value numbers, where values computed the same way from the same value numbers get the
+    // same one. Reads of memory also have to be in the same block with no write in between.
+    using Key = std::tuple<OpCode, std::vector<std::size_t>, std::vector<std::uint8_t>, std::size_t>;
+    std::map<Key, std::size_t> table{};
+    std::vector<std::size_t> numbers{};
+    std::size_t next_number = 0;
+    auto number = [&](std::size_t value) {
+        value = ssa.resolve(value);
+        if (value >= numbers.size()) numbers.resize(value + 1, SIZE_MAX);
+        if (numbers[value] == SIZE_MAX) numbers[value] = next_number++;
+        return numbers[value];
+    };
+    /** For each instruction, the earlier one that computes the same value */
+    std::vector<std::size_t> first(count, SIZE_MAX);
+
+    // Walk the dominator tree, so the table only holds values from blocks that dominate the current one
+    std::vector<std::vector<std::size_t>> children(blocks.size());
+    for (std::size_t block : ssa.order()) {
+        if (block != 0) children[blocks[block].m_idom].push_back(block);
+    }
+    std::vector<std::pair<std::size_t, std::size_t>> stack{ { 0, 0 } };
+    std::vector<std::vector<Key>> added(blocks.size());
+    while (!stack.empty()) {
+        auto [block, next] = stack.back();
+        if (next == 0) {
+            for (std::size_t i = blocks[block].m_start; i < blocks[block].m_end && block != 0; i++) {
+                const OptInstruction& instruction = m_instructions[i];
+                if (!SsaFunction::is_pure(instruction.m_op) || instruction.m_op == OpCode::GET_LOCAL) continue;
+
+                std::vector<std::size_t> operands{};
+                for (std::size_t input : info[i].m_inputs) operands.push_back(number(input));
+                // The compiler adds a constant for every use of a name, so compare the constant
+                // rather than its index, and leave out the inline cache of a property
+                std::vector<std::uint8_t> immediate(instruction.m_operands);
+                if (instruction.m_op == OpCode::CONSTANT || instruction.m_op == OpCode::GET_PROPERTY) {
+                    immediate.assign(1, canonical_constant(instruction.m_operands[0]));
+                }
+                Key key{ instruction.m_op, operands, immediate, SsaFunction::reads_memory(instruction.m_op) ? info[i].m_epoch : 0 };
+
+                auto found = table.find(key);
+                if (found != table.end()) {
+                    first[i] = found->second;
+                    numbers.resize(std::max(numbers.size(), ssa.resolve(info[i].m_output) + 1), SIZE_MAX);
+                    numbers[ssa.resolve(info[i].m_output)] = number(info[found->second].m_output);
+                }
+                else {
+                    table.emplace(key, i);
+                    added[block].push_back(key);
+                    number(info[i].m_output);
+                }
+            }
+        }
+        if (next < children[block].size()) {
+            stack.back().second++;
+            stack.emplace_back(children[block][next], 0);
+            continue;
+        }
+        for (const Key& key : added[block]) table.erase(key);
+        stack.pop_back();
+    }
+
+    // Replace the largest repeated expressions, where it saves more than storing the first costs
+    auto redundant = [&](std::size_t i) { return first[i] != SIZE_MAX && is_replaceable(ssa, i); };
+    std::vector<std::vector<std::size_t>> reuses(count);
+    for (std::size_t i = 0; i < count; i++) {
+        if (!redundant(i)) continue;
+        std::size_t consumer = info[i].m_consumer;
+        if (consumer != SIZE_MAX && redundant(consumer)) continue;
+        reuses[first[i]].push_back(i);
+    }
+
+    // Instructions already part of a replaced expression, or whose value is saved
+    std::vector<bool> touched(count, false);
+    for (std::size_t original = 0; original < count; original++) {
+        std::ptrdiff_t saving = -1;
+        bool overlaps = touched[original];
+        for (std::size_t end : reuses[original]) {
+            for (std::size_t i = info[end].m_start; i < end; i++) {
+                saving += SsaFunction::reads_memory(m_instructions[i].m_op) ? 2 : 1;
+            }
+            saving += SsaFunction::reads_memory(m_instructions[end].m_op) ? 1 : 0;
+            for (std::size_t i = info[end].m_start; i <= end; i++) overlaps |= touched[i];
+        }
+        if (saving <= 0 || overlaps) continue;
+
+        std::size_t slot = allocate_hidden_slot();
+        if (slot == SIZE_MAX) break;
+        m_saves.push_back(Save{ .m_instruction = original, .m_slot = slot });
+        touched[original] = true;
+        for (std::size_t end : reuses[original]) {
+            m_reuses.push_back(Reuse{ .m_start = info[end].m_start, .m_end = end, .m_slot = slot });
+            for (std::size_t i = info[end].m_start; i <= end; i++) touched[i] = true;
+        }
+    }
+
+    if (m_hidden_slots == 0) return false;
+    rewrite();
+    return true;
+}
+
+void SsaOptimizer::rewrite() {
+    std::size_t count = m_instructions.size();
+    std::size_t base = m_function->m_arity + 1;
+
+    // Move the function's own locals up past the hidden ones
+    for (auto& instruction : m_instructions) {
+        if (instruction.m_op == OpCode::GET_LOCAL || instruction.m_op == OpCode::SET_LOCAL) {
+            if (instruction.m_operands[0] >= base) instruction.m_operands[0] += static_cast<std::uint8_t>(m_hidden_slots);
+        }
+        else if (instruction.m_op == OpCode::CLOSURE) {
+            for (std::size_t i = 1; i + 1 < instruction.m_operands.size(); i += 2) {
+                if (instruction.m_operands[i] != 0 && instruction.m_operands[i + 1] >= base) {
+                    instruction.m_operands[i + 1] += static_cast<std::uint8_t>(m_hidden_slots);
+                }
+            }
+        }
+    }
+
+    auto local = [](OpCode op, std::size_t slot, std::size_t line) {
+        return OptInstruction{ .m_op = op, .m_operands = { static_cast<std::uint8_t>(slot) }, .m_line = line };
+    };
+    std::vector<std::vector<OptInstruction>> before(count);
+    std::vector<std::vector<OptInstruction>> after(count);
+    std::vector<std::optional<OptInstruction>> replacements(count);
+    std::vector<bool> removed(count, false);
+
+    // The hidden locals start out nil
+    for (std::size_t i = 0; i < m_hidden_slots; i++) {
+        before[0].push_back(OptInstruction{ .m_op = OpCode::NIL, .m_line = m_instructions[0].m_line });
+    }
+    std::ranges::stable_sort(m_hoists, [](const Hoist& a, const Hoist& b) { return a.m_start < b.m_start; });
+    for (const Hoist& hoist : m_hoists) {
+        auto& code = before[hoist.m_header];
+        code.insert(code.end(), m_instructions.begin() + hoist.m_start, m_instructions.begin() + hoist.m_end + 1);
+        code.push_back(local(OpCode::SET_LOCAL, hoist.m_slot, m_instructions[hoist.m_end].m_line));
+        code.push_back(OptInstruction{ .m_op = OpCode::POP, .m_line = m_instructions[hoist.m_end].m_line });
+    }
+    for (const Reuse& reuse : m_reuses) {
+        for (std::size_t i = reuse.m_start; i < reuse.m_end; i++) removed[i] = true;
+        replacements[reuse.m_end] = local(OpCode::GET_LOCAL, reuse.m_slot, m_instructions[reuse.m_end].m_line);
+    }
+    for (const Save& save : m_saves) {
+        after[save.m_instruction].push_back(local(OpCode::SET_LOCAL, save.m_slot, m_instructions[save.m_instruction].m_line));
+    }
+
+    // Forward jumps go to whatever now comes before their target, but LOOPs go straight to
+    // it, so that code inserted before a loop's header only runs on the way into the loop
+    std::vector<OptInstruction> instructions{};
+    std::vector<std::size_t> starts(count + 1);
+    std::vector<std::size_t> positions(count + 1, SIZE_MAX);
+    std::vector<std::size_t> jumps{};
+    for (std::size_t i = 0; i < count; i++) {
+        starts[i] = instructions.size();
+        instructions.insert(instructions.end(), before[i].begin(), before[i].end());
+        if (!removed[i]) {
+            positions[i] = instructions.size();
+            if (m_instructions[i].is_jump()) jumps.push_back(instructions.size());
+            instructions.push_back(replacements[i] ? *replacements[i] : m_instructions[i]);
+        }
+        instructions.insert(instructions.end(), after[i].begin(), after[i].end());
+    }
+    starts[count] = positions[count] = instructions.size();
+    for (std::size_t i = count; i-- > 0;) {
+        if (positions[i] == SIZE_MAX) positions[i] = positions[i + 1];
+    }
+    for (std::size_t jump : jumps) {
+        OptInstruction& instruction = instructions[jump];
+        instruction.m_target = instruction.m_op == OpCode::LOOP ? positions[instruction.m_target] : starts[instruction.m_target];
+    }
+    m_instructions = std::move(instructions);
+}
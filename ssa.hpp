@@ -0,0 +1,224 @@
+#ifndef ppclox_ssa_hpp
+#define ppclox_ssa_hpp
+
+#include <vector>
+
+#include "common.hpp"
+#include "chunk.hpp"
+#include "object_function.hpp"
+#include "optimizer.hpp"
+
+enum class SsaKind {
+    /** Whatever is in a stack slot when the function is called: the callee or receiver, and the arguments */
+    ENTRY,
+    /** Merges what each predecessor of a block has in the same stack slot */
+    PHI,
+    /** Pushed by an instruction the IR models */
+    INSTRUCTION,
+    /** Nothing is known about it, like a call's result, or a captured local once anything has been called */
+    OPAQUE
+};
+
+/** What a value is known to be. NONE is for phis not worked out yet. */
+enum class SsaType {
+    NONE,
+    NUMBER,
+    BOOL,
+    NIL,
+    ANY
+};
+
+class SsaValue {
+public:
+    SsaKind m_kind{};
+    /** For INSTRUCTION values, the instruction that pushes it */
+    OpCode m_op{};
+    std::size_t m_instruction{ SIZE_MAX };
+    std::size_t m_block{};
+    /** Values the instruction pops, or for a phi, the value from each predecessor in order */
+    std::vector<std::size_t> m_operands{};
+    /** Set once a phi turns out to merge just one value, to that value */
+    std::size_t m_replacement{ SIZE_MAX };
+    SsaType m_type{ SsaType::NONE };
+};
+
+/** A run of instructions [m_start, m_end) that is only ever entered at the top and left at the bottom */
+class SsaBlock {
+public:
+    std::size_t m_start{};
+    std::size_t m_end{};
+    std::vector<std::size_t> m_predecessors{};
+    std::vector<std::size_t> m_successors{};
+    bool m_reachable{};
+    /** Immediate dominator, and the block's position in reverse postorder */
+    std::size_t m_idom{ SIZE_MAX };
+    std::size_t m_order{};
+    /** The value in each stack slot of the frame on the way in and out */
+    std::vector<std::size_t> m_entry{};
+    std::vector<std::size_t> m_exit{};
+};
+
+/** What the IR records for each instruction */
+class SsaInstruction {
+public:
+    std::size_t m_block{};
+    /** Values the instruction pops (or peeks at) and the value it pushes, if any */
+    std::vector<std::size_t> m_inputs{};
+    std::size_t m_output{ SIZE_MAX };
+    /**
+     * First instruction of the expression that computes the pushed value, when all of
+     * it is in this block. The instructions from there up to this one compute just that.
+     */
+    std::size_t m_start{ SIZE_MAX };
+    /** Next instruction in the block to use the pushed value */
+    std::size_t m_consumer{ SIZE_MAX };
+    /** Changes whenever memory may have been written, and from block to block */
+    std::size_t m_epoch{};
+};
+
+/** A natural loop: the blocks that can reach a back edge to the header without going through it */
+class SsaLoop {
+public:
+    std::size_t m_header{};
+    std::vector<bool> m_blocks{};
+    std::size_t m_size{};
+    // What running the loop may change
+    bool m_calls{};
+    bool m_writes_properties{};
+    bool m_writes_upvalues{};
+    std::vector<std::size_t> m_written_globals{};
+};
+
+/**
+ * A function's bytecode lowered to SSA form. Every stack slot of the frame (locals and
+ * temporaries alike) is a variable, so a GET_LOCAL pushes whatever value the slot holds
+ * rather than making a new one, and SET_LOCAL just changes which value that is. Blocks
+ * come from the JUMP, JUMP_IF_FALSE and LOOP structure, with a phi for each slot where
+ * control flow merges (trivial ones folded away). The IR refers back to the instructions,
+ * so passes using it rewrite the instruction list rather than generate code from scratch.
+ */
+class SsaFunction {
+public:
+    SsaFunction(ObjFunction* function, const std::vector<OptInstruction>& instructions) :
+        m_function(function), m_chunk(function->chunk()), m_instructions(instructions) {}
+
+    /** Returns false if the bytecode can't be put into SSA form (if the stack depth where paths merge differs) */
+    bool build();
+
+    /** The value standing for the given one, once trivial phis are folded away */
+    std::size_t resolve(std::size_t value) const;
+    const SsaValue& value(std::size_t value) const { return m_values[resolve(value)]; }
+    bool dominates(std::size_t a, std::size_t b) const;
+    /** Whether the instruction could fail with a runtime error, as far as the types of its operands are known */
+    bool can_fail(std::size_t instruction) const;
+
+    const std::vector<SsaBlock>& blocks() const { return m_blocks; }
+    const std::vector<SsaInstruction>& instructions() const { return m_info; }
+    const std::vector<SsaLoop>& loops() const { return m_loops; }
+    /** Blocks in reverse postorder */
+    const std::vector<std::size_t>& order() const { return m_order; }
+
+    /** Whether the instruction writes anything another instruction could read, or could run arbitrary code */
+    static bool writes_memory(OpCode op);
+    /** Whether the instruction's only effect is pushing a value computed from the values it pops */
+    static bool is_pure(OpCode op);
+    /** Whether the instruction reads memory some other instruction could write */
+    static bool reads_memory(OpCode op) { return op == OpCode::GET_GLOBAL || op == OpCode::GET_UPVALUE || op == OpCode::GET_PROPERTY; }
+private:
+    ObjFunction* m_function;
+    Chunk& m_chunk;
+    const std::vector<OptInstruction>& m_instructions;
+    std::vector<SsaBlock> m_blocks{};
+    std::vector<std::size_t> m_block_of{};
+    std::vector<std::size_t> m_order{};
+    std::vector<SsaValue> m_values{};
+    std::vector<SsaInstruction> m_info{};
+    std::vector<SsaLoop> m_loops{};
+    /** Local slots some closure captures, which change behind the function's back whenever it calls anything */
+    std::vector<bool> m_captured{};
+
+    void build_blocks();
+    void order_blocks();
+    void find_dominators();
+    bool build_values();
+    /** Run the block's instructions over the values in its stack slots. Returns false if the stack underflows. */
+    bool interpret_block(std::size_t block, std::size_t& epoch);
+    void fold_trivial_phis();
+    void infer_types();
+    void find_loops();
+
+    std::size_t new_value(SsaKind kind, std::size_t block, OpCode op = OpCode::NIL, std::size_t instruction = SIZE_MAX);
+    SsaType infer_type(const SsaValue& value) const;
+};
+
+/**
+ * Optimizations over a function's SSA form. Each rewrites the instruction list it was
+ * given. Values they keep for later live in hidden locals, slots below the function's own
+ * locals that are set to nil on entry, with the function's locals moved up to make room.
+ */
+class SsaOptimizer {
+public:
+    SsaOptimizer(ObjFunction* function, std::vector<OptInstruction>& instructions, const GlobalFacts& globals) :
+        m_function(function), m_instructions(instructions), m_globals(globals) {}
+
+    /**
+     * Loop invariant code motion. An expression inside a loop whose value is the same on
+     * every iteration is computed once before the loop into a hidden local instead. That
+     * covers pure operators on invariant values, reads of properties (if the loop has no
+     * calls or stores that could change them), and reads of upvalues and globals (if the
+     * loop can't assign them, which for a global it can't if it is never reassigned).
+     * Since the expression now runs even if the loop never gets to it, anything that could
+     * fail is only hoisted when it is the first thing the loop does anyway.
+     */
+    bool hoist_invariants();
+    /**
+     * Global value numbering. An expression that computes a value already computed earlier
+     * on every path to it (with no store in between, if it reads memory) reuses that value
+     * instead, which is saved to a hidden local where it is first computed.
+     */
+    bool number_values();
+private:
+    /** Compute the expression [m_start, m_end] once before the loop with the given header, into the hidden slot */
+    class Hoist {
+    public:
+        std::size_t m_header{};
+        std::size_t m_start{};
+        std::size_t m_end{};
+        std::size_t m_slot{};
+    };
+    /** Replace the expression [m_start, m_end] with a load of the hidden slot */
+    class Reuse {
+    public:
+        std::size_t m_start{};
+        std::size_t m_end{};
+        std::size_t m_slot{};
+    };
+    /** Store the value pushed by an instruction in the hidden slot too */
+    class Save {
+    public:
+        std::size_t m_instruction{};
+        std::size_t m_slot{};
+    };
+
+    static constexpr std::size_t k_max_hidden_slots = 32;
+
+    ObjFunction* m_function;
+    std::vector<OptInstruction>& m_instructions;
+    const GlobalFacts& m_globals;
+    std::vector<Hoist> m_hoists{};
+    std::vector<Reuse> m_reuses{};
+    std::vector<Save> m_saves{};
+    std::size_t m_hidden_slots{};
+
+    /** Whether the expression ending at the instruction is pure, and reuses of its value can't be told apart */
+    bool is_replaceable(const SsaFunction& ssa, std::size_t end) const;
+    bool is_invariant(const SsaFunction& ssa, const SsaLoop& loop, std::size_t instruction) const;
+    /** Index of the first constant the same as the one at the index */
+    std::uint8_t canonical_constant(std::uint8_t index) const;
+    /** A slot for another hidden local, or SIZE_MAX if there is no room for one */
+    std::size_t allocate_hidden_slot();
+    /** Make the planned changes to the instruction list */
+    void rewrite();
+};
+
+#endif
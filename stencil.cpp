@@ -0,0 +1,600 @@
+#include "stencil.hpp"
+
+#ifdef JIT
+
+#include <cstddef>
+#include <unordered_map>
+
+#include "chunk.hpp"
+#include "object_function.hpp"
+#include "vm.hpp"
+#include "x64_assembler.hpp"
+
+/** Holes a stencil leaves, to be patched with the operands of the instruction it is copied for */
+enum class StencilHole : std::uint8_t {
+    /** Displacement (int32) of the first or second stack slot it uses from the frame's base */
+    SLOT_A,
+    SLOT_B,
+    /** A value to load (uint64) */
+    VALUE,
+    /** Displacement (int32) of a global's value, or of whether it is defined, from the globals */
+    GLOBAL_VALUE,
+    GLOBAL_DEFINED,
+    /** Offset of the instruction in the chunk, and the stack depth before it (uint32 each), for the VM */
+    OFFSET,
+    DEPTH,
+    /** Jumps (rel32) to the target instruction, the error exit and the return exit (with the depth in rax) */
+    TARGET,
+    ERROR_EXIT,
+    RETURN_EXIT
+};
+
+/** Precompiled machine code for one kind of instruction, with holes where its operands go */
+class Stencil {
+public:
+    std::vector<std::uint8_t> m_bytes{};
+    std::vector<std::pair<std::size_t, StencilHole>> m_holes{};
+};
+
+enum class StencilKind {
+    /** Store VALUE in slot A */
+    LOAD_VALUE,
+    /** Copy slot A into slot B */
+    COPY,
+    JUMP,
+    /** Jump to TARGET if slot A is falsey */
+    JUMP_IF_FALSE,
+    /** Replace slot A with whether it is falsey */
+    NOT,
+    // Access the global, when it is defined. Otherwise the VM executes the instruction
+    // (which is an error), except in DEFINE_GLOBAL. The value is in slot A.
+    GET_GLOBAL,
+    DEFINE_GLOBAL,
+    SET_GLOBAL,
+    // Replace slot A with the result of the operation on it and slot B. Apart from
+    // EQUAL, that's only if both are numbers, and otherwise the VM executes the
+    // instruction. These are in the same order as the opcodes.
+    EQUAL,
+    GREATER,
+    LESS,
+    ADD,
+    SUBTRACT,
+    MULTIPLY,
+    DIVIDE,
+    /** Have the VM execute the instruction */
+    EXECUTE,
+    /** Have the VM make the call of a CALL or INVOKE (see VM::stencil_call) */
+    CALL,
+    INVOKE,
+    /** Have the VM make a tail call, and leave with whatever it says to return (see VM::native_tail_call) */
+    TAIL_CALL,
+    /** Return from the frame, leaving the VM to pop it */
+    RETURN
+};
+static constexpr std::size_t k_stencil_kind_count = std::to_underlying(StencilKind::RETURN) + 1;
+
+/** Operands to patch into a stencil's holes, besides the instruction's offset and depth */
+class StencilOperands {
+public:
+    std::size_t m_slot_a{};
+    std::size_t m_slot_b{};
+    std::uint64_t m_value{};
+    std::size_t m_global{};
+    std::size_t m_target{};
+};
+
+/**
+ * Copies and patches together the stencils for one function's bytecode, walking it
+ * one (unfused) instruction at a time and keeping track of the stack depth. Stencils
+ * keep their state in the registers described at X64Assembler.
+ */
+class StencilCompiler {
+public:
+    explicit StencilCompiler(ObjFunction* function) : m_function(function), m_chunk(function->chunk()) {}
+
+    /** Returns nullptr if the bytecode isn't what the compiler emits */
+    std::shared_ptr<StencilCode> compile();
+
+    /** Called from stencils to execute an instruction with the VM */
+    static Value* execute(VM* vm, std::uint32_t offset, std::uint32_t depth) {
+        return vm->native_execute(offset, depth, vm->current_frame().m_closure->function()->m_stencil_code->max_depth());
+    }
+    /** Called from stencils to make the call of a CALL or INVOKE with the VM */
+    static Value* call(VM* vm, std::uint32_t offset, std::uint32_t depth) { return vm->stencil_call(offset, depth, false); }
+    static Value* invoke(VM* vm, std::uint32_t offset, std::uint32_t depth) { return vm->stencil_call(offset, depth, true); }
+    /** Called from stencils to make the call of a TAIL_CALL or TAIL_INVOKE with the VM */
+    static std::size_t tail_call(VM* vm, std::uint32_t offset, std::uint32_t depth) {
+        return vm->native_tail_call(offset, depth);
+    }
+private:
+    /** Deeper than this means the bytecode has confused the depth tracking, so we give up */
+    static constexpr std::size_t k_max_depth = 4096;
+
+    ObjFunction* m_function;
+    Chunk& m_chunk;
+    X64Assembler m_asm{};
+    std::size_t m_offset{};
+    std::size_t m_depth{};
+    /** Positions of rel32 operands to patch, and the offset of the instruction they jump to */
+    std::vector<std::pair<std::size_t, std::size_t>> m_jump_patches{};
+    /** Positions of rel32 operands that jump to the error exit */
+    std::vector<std::size_t> m_error_patches{};
+    /** Positions of rel32 operands that jump to the normal exit */
+    std::vector<std::size_t> m_return_patches{};
+
+    static const Stencil& stencil(StencilKind kind);
+    static Stencil build_stencil(StencilKind kind);
+
+    /** Append a copy of the stencil, with its holes filled in for the current instruction */
+    void copy(StencilKind kind, const StencilOperands& operands = {});
+};
+
+Stencil StencilCompiler::build_stencil(StencilKind kind) {
+    X64Assembler a{};
+    Stencil stencil{};
+    // Each hole is the last size bytes emitted when it is declared
+    auto hole = [&](StencilHole hole_kind, std::size_t size) { stencil.m_holes.emplace_back(a.size() - size, hole_kind); };
+    auto load_slot = [&](X64 dst, StencilHole slot) { a.load(dst, X64::RBX, 0); hole(slot, 4); };
+    auto store_slot = [&](StencilHole slot, X64 src) { a.store(X64::RBX, 0, src); hole(slot, 4); };
+    auto call_execute = [&](const void* handler) {
+        a.alu(X64Assembler::k_mov, X64::RDI, X64::R12);
+        a.mov_imm32(X64::RSI, 0);
+        hole(StencilHole::OFFSET, 4);
+        a.mov_imm32(X64::RDX, 0);
+        hole(StencilHole::DEPTH, 4);
+        a.call(handler);
+    };
+    /** Execute the instruction with the VM (or the given handler), leaving for the error exit if that failed */
+    auto execute_or_fail = [&](const void* handler = reinterpret_cast<const void*>(&StencilCompiler::execute)) {
+        call_execute(handler);
+        a.alu(X64Assembler::k_test, X64::RAX, X64::RAX);
+        stencil.m_holes.emplace_back(a.jcc(X64Condition::EQUAL), StencilHole::ERROR_EXIT);
+        a.alu(X64Assembler::k_mov, X64::RBX, X64::RAX);
+    };
+    /** Jump to the returned placeholder if the global isn't defined */
+    auto jump_unless_defined = [&]() {
+        a.cmp_byte(X64::R13, 0, 0);
+        hole(StencilHole::GLOBAL_DEFINED, 5);
+        return a.jcc(X64Condition::EQUAL);
+    };
+    /** Jump to the returned placeholder unless the value in reg is a number. Clobbers rdx. */
+    auto jump_unless_number = [&](X64 reg) {
+        a.test_number(reg);
+        return a.jcc(X64Condition::EQUAL);
+    };
+
+    switch (kind) {
+        case StencilKind::LOAD_VALUE:
+            a.mov_imm64(X64::RAX, 0);
+            hole(StencilHole::VALUE, 8);
+            store_slot(StencilHole::SLOT_A, X64::RAX);
+            break;
+        case StencilKind::COPY:
+            load_slot(X64::RAX, StencilHole::SLOT_A);
+            store_slot(StencilHole::SLOT_B, X64::RAX);
+            break;
+        case StencilKind::JUMP:
+            stencil.m_holes.emplace_back(a.jmp(), StencilHole::TARGET);
+            break;
+        case StencilKind::JUMP_IF_FALSE:
+            load_slot(X64::RAX, StencilHole::SLOT_A);
+            a.test_falsey(X64::RAX);
+            stencil.m_holes.emplace_back(a.jcc(X64Condition::BELOW_EQUAL), StencilHole::TARGET);
+            break;
+        case StencilKind::NOT:
+            load_slot(X64::RAX, StencilHole::SLOT_A);
+            a.test_falsey(X64::RAX);
+            a.setcc_rax(X64Condition::BELOW_EQUAL);
+            a.alu(X64Assembler::k_or, X64::RAX, X64::R15);
+            store_slot(StencilHole::SLOT_A, X64::RAX);
+            break;
+        case StencilKind::GET_GLOBAL:
+        case StencilKind::SET_GLOBAL: {
+            std::size_t undefined = jump_unless_defined();
+            if (kind == StencilKind::GET_GLOBAL) {
+                a.load(X64::RAX, X64::R13, 0);
+                hole(StencilHole::GLOBAL_VALUE, 4);
+                store_slot(StencilHole::SLOT_A, X64::RAX);
+            }
+            else {
+                load_slot(X64::RAX, StencilHole::SLOT_A);
+                a.store(X64::R13, 0, X64::RAX);
+                hole(StencilHole::GLOBAL_VALUE, 4);
+            }
+            std::size_t done = a.jmp();
+            a.patch_rel32(undefined, a.size());
+            execute_or_fail();
+            a.patch_rel32(done, a.size());
+            break;
+        }
+        case StencilKind::DEFINE_GLOBAL:
+            load_slot(X64::RAX, StencilHole::SLOT_A);
+            a.store(X64::R13, 0, X64::RAX);
+            hole(StencilHole::GLOBAL_VALUE, 4);
+            a.store_byte(X64::R13, 0, 1);
+            hole(StencilHole::GLOBAL_DEFINED, 5);
+            break;
+        case StencilKind::EQUAL:
+            load_slot(X64::RAX, StencilHole::SLOT_A);
+            load_slot(X64::RCX, StencilHole::SLOT_B);
+            a.values_equal();
+            a.alu(X64Assembler::k_or, X64::RAX, X64::R15);
+            store_slot(StencilHole::SLOT_A, X64::RAX);
+            break;
+        case StencilKind::ADD:
+        case StencilKind::SUBTRACT:
+        case StencilKind::MULTIPLY:
+        case StencilKind::DIVIDE:
+        case StencilKind::GREATER:
+        case StencilKind::LESS: {
+            load_slot(X64::RAX, StencilHole::SLOT_A);
+            load_slot(X64::RCX, StencilHole::SLOT_B);
+            std::size_t a_not_number = jump_unless_number(X64::RAX);
+            std::size_t b_not_number = jump_unless_number(X64::RCX);
+            a.movq_to_xmm(0, X64::RAX);
+            a.movq_to_xmm(1, X64::RCX);
+            switch (kind) {
+                case StencilKind::ADD: a.sse_arithmetic(0x58); break;
+                case StencilKind::SUBTRACT: a.sse_arithmetic(0x5c); break;
+                case StencilKind::MULTIPLY: a.sse_arithmetic(0x59); break;
+                case StencilKind::DIVIDE: a.sse_arithmetic(0x5e); break;
+                // "above" is false when either side is NaN, so a < b is tested as b > a
+                case StencilKind::GREATER: a.ucomisd(0, 1); break;
+                case StencilKind::LESS: a.ucomisd(1, 0); break;
+                default: break;
+            }
+            if (kind == StencilKind::GREATER || kind == StencilKind::LESS) {
+                a.setcc_rax(X64Condition::ABOVE);
+                a.alu(X64Assembler::k_or, X64::RAX, X64::R15);
+            }
+            else {
+                a.movq_from_xmm(X64::RAX, 0);
+            }
+            store_slot(StencilHole::SLOT_A, X64::RAX);
+            std::size_t done = a.jmp();
+            // String concatenation, or a type error
+            a.patch_rel32(a_not_number, a.size());
+            a.patch_rel32(b_not_number, a.size());
+            execute_or_fail();
+            a.patch_rel32(done, a.size());
+            break;
+        }
+        case StencilKind::EXECUTE:
+            execute_or_fail();
+            break;
+        case StencilKind::CALL:
+            execute_or_fail(reinterpret_cast<const void*>(&StencilCompiler::call));
+            break;
+        case StencilKind::INVOKE:
+            execute_or_fail(reinterpret_cast<const void*>(&StencilCompiler::invoke));
+            break;
+        case StencilKind::TAIL_CALL:
+            a.alu(X64Assembler::k_mov, X64::RDI, X64::R12);
+            a.mov_imm32(X64::RSI, 0);
+            hole(StencilHole::OFFSET, 4);
+            a.mov_imm32(X64::RDX, 0);
+            hole(StencilHole::DEPTH, 4);
+            a.call(reinterpret_cast<const void*>(&StencilCompiler::tail_call));
+            stencil.m_holes.emplace_back(a.jmp(), StencilHole::RETURN_EXIT);
+            break;
+        case StencilKind::RETURN:
+            a.mov_imm32(X64::RAX, 0);
+            hole(StencilHole::DEPTH, 4);
+            stencil.m_holes.emplace_back(a.jmp(), StencilHole::RETURN_EXIT);
+            break;
+    }
+    stencil.m_bytes = a.bytes();
+    return stencil;
+}
+
+const Stencil& StencilCompiler::stencil(StencilKind kind) {
+    // Built the first time anything is compiled, then only ever copied
+    static const std::vector<Stencil> s_stencils = [] {
+        std::vector<Stencil> stencils{};
+        for (std::size_t kind = 0; kind < k_stencil_kind_count; kind++) {
+            stencils.push_back(build_stencil(static_cast<StencilKind>(kind)));
+        }
+        return stencils;
+    }();
+    return s_stencils[std::to_underlying(kind)];
+}
+
+void StencilCompiler::copy(StencilKind kind, const StencilOperands& operands) {
+    const Stencil& stencil = StencilCompiler::stencil(kind);
+    std::size_t start = m_asm.size();
+    m_asm.append(stencil.m_bytes);
+
+    for (auto [position, hole] : stencil.m_holes) {
+        position += start;
+        switch (hole) {
+            case StencilHole::SLOT_A: m_asm.patch(position, 8 * operands.m_slot_a, 4); break;
+            case StencilHole::SLOT_B: m_asm.patch(position, 8 * operands.m_slot_b, 4); break;
+            case StencilHole::VALUE: m_asm.patch(position, operands.m_value, 8); break;
+            case StencilHole::GLOBAL_VALUE:
+                m_asm.patch(position, operands.m_global * sizeof(GlobalSlot) + offsetof(GlobalSlot, m_value), 4);
+                break;
+            case StencilHole::GLOBAL_DEFINED:
+                m_asm.patch(position, operands.m_global * sizeof(GlobalSlot) + offsetof(GlobalSlot, m_defined), 4);
+                break;
+            case StencilHole::OFFSET: m_asm.patch(position, m_offset, 4); break;
+            case StencilHole::DEPTH: m_asm.patch(position, m_depth, 4); break;
+            // Jumps are patched once everything has been copied
+            case StencilHole::TARGET: m_jump_patches.emplace_back(position, operands.m_target); break;
+            case StencilHole::ERROR_EXIT: m_error_patches.push_back(position); break;
+            case StencilHole::RETURN_EXIT: m_return_patches.push_back(position); break;
+        }
+    }
+}
+
+std::shared_ptr<StencilCode> StencilCompiler::compile() {
+    const std::vector<std::uint8_t>& code = m_chunk.get_code();
+    const std::vector<Value>& constants = m_chunk.get_constants();
+    auto read_short = [&](std::size_t offset) {
+        return static_cast<std::uint16_t>((code[offset + 1] << 8) | code[offset + 2]);
+    };
+
+    // Prologue. Five pushes keep the stack 16 byte aligned for calls into the VM.
+    m_asm.push(X64::RBX);
+    m_asm.push(X64::R12);
+    m_asm.push(X64::R13);
+    m_asm.push(X64::R14);
+    m_asm.push(X64::R15);
+    m_asm.alu(X64Assembler::k_mov, X64::R12, X64::RDI);
+    m_asm.alu(X64Assembler::k_mov, X64::RBX, X64::RSI);
+    m_asm.alu(X64Assembler::k_mov, X64::R13, X64::RDX);
+    m_asm.mov_imm64(X64::R14, Value::k_qnan);
+    m_asm.mov_imm64(X64::R15, Value::k_false_bits);
+
+    // Machine code offset, and stack depth, of each instruction
+    std::vector<std::size_t> native_offsets(code.size(), SIZE_MAX);
+    std::vector<std::size_t> depths(code.size(), SIZE_MAX);
+    // Stack depth at each forward jump target, recorded as the jumps to it are copied
+    std::unordered_map<std::size_t, std::size_t> target_depths{};
+    // The callee (or receiver) and arguments are already in place when the frame starts
+    m_depth = m_function->m_arity + 1;
+    std::size_t max_depth = m_depth;
+
+    for (m_offset = 0; m_offset < code.size();) {
+        // Superinstructions only overwrite the opcode of their first component
+        std::uint8_t op_code = code[m_offset];
+        const Superinstruction* super = Chunk::find_superinstruction(op_code);
+        if (super != nullptr) op_code = std::to_underlying(super->m_components[0]);
+        OpCode op = static_cast<OpCode>(Chunk::generic_opcode(op_code));
+        std::size_t next = m_offset + m_chunk.opcode_length(std::to_underlying(op), m_offset);
+
+        auto target_depth = target_depths.find(m_offset);
+        if (target_depth != target_depths.end()) m_depth = target_depth->second;
+        native_offsets[m_offset] = m_asm.size();
+        depths[m_offset] = m_depth;
+        if (m_depth > k_max_depth) return nullptr;
+
+        switch (op) {
+            case OpCode::CONSTANT:
+                copy(StencilKind::LOAD_VALUE, { .m_slot_a = m_depth, .m_value = constants[code[m_offset + 1]].bits() });
+                m_depth++;
+                break;
+            case OpCode::NIL:
+                copy(StencilKind::LOAD_VALUE, { .m_slot_a = m_depth, .m_value = Value::k_nil_bits });
+                m_depth++;
+                break;
+            case OpCode::TRUE:
+                copy(StencilKind::LOAD_VALUE, { .m_slot_a = m_depth, .m_value = Value::k_true_bits });
+                m_depth++;
+                break;
+            case OpCode::FALSE:
+                copy(StencilKind::LOAD_VALUE, { .m_slot_a = m_depth, .m_value = Value::k_false_bits });
+                m_depth++;
+                break;
+            case OpCode::POP:
+                m_depth--;
+                break;
+            case OpCode::GET_LOCAL:
+                copy(StencilKind::COPY, { .m_slot_a = code[m_offset + 1], .m_slot_b = m_depth });
+                m_depth++;
+                break;
+            case OpCode::SET_LOCAL:
+                copy(StencilKind::COPY, { .m_slot_a = m_depth - 1, .m_slot_b = code[m_offset + 1] });
+                break;
+            case OpCode::EQUAL:
+            case OpCode::GREATER:
+            case OpCode::LESS:
+            case OpCode::ADD:
+            case OpCode::SUBTRACT:
+            case OpCode::MULTIPLY:
+            case OpCode::DIVIDE: {
+                auto kind = static_cast<StencilKind>(std::to_underlying(StencilKind::EQUAL) + std::to_underlying(op) - std::to_underlying(OpCode::EQUAL));
+                copy(kind, { .m_slot_a = m_depth - 2, .m_slot_b = m_depth - 1 });
+                m_depth--;
+                break;
+            }
+            case OpCode::NOT:
+                copy(StencilKind::NOT, { .m_slot_a = m_depth - 1 });
+                break;
+            case OpCode::GET_GLOBAL:
+                copy(StencilKind::GET_GLOBAL, { .m_slot_a = m_depth, .m_global = read_short(m_offset) });
+                m_depth++;
+                break;
+            case OpCode::DEFINE_GLOBAL:
+                copy(StencilKind::DEFINE_GLOBAL, { .m_slot_a = m_depth - 1, .m_global = read_short(m_offset) });
+                m_depth--;
+                break;
+            case OpCode::SET_GLOBAL:
+                copy(StencilKind::SET_GLOBAL, { .m_slot_a = m_depth - 1, .m_global = read_short(m_offset) });
+                break;
+            case OpCode::JUMP:
+            case OpCode::JUMP_IF_FALSE: {
+                std::size_t target = next + read_short(m_offset);
+                target_depths[target] = m_depth;
+                copy(op == OpCode::JUMP ? StencilKind::JUMP : StencilKind::JUMP_IF_FALSE, { .m_slot_a = m_depth - 1, .m_target = target });
+                break;
+            }
+            case OpCode::LOOP: {
+                std::size_t target = next - read_short(m_offset);
+                if (depths.at(target) != m_depth) return nullptr;
+                copy(StencilKind::JUMP, { .m_target = target });
+                break;
+            }
+            case OpCode::GUARD_CALL:
+            case OpCode::GUARD_INVOKE: {
+                // Stencils always make the call, leaving the inlined body unreachable
+                std::size_t target = next + read_short(next - 3);
+                target_depths[target] = m_depth;
+                copy(StencilKind::JUMP, { .m_target = target });
+                break;
+            }
+            case OpCode::CALL:
+            case OpCode::INVOKE:
+                copy(op == OpCode::CALL ? StencilKind::CALL : StencilKind::INVOKE);
+                m_depth += m_chunk.stack_effect(std::to_underlying(op), m_offset);
+                break;
+            case OpCode::TAIL_CALL:
+            case OpCode::TAIL_INVOKE:
+                copy(StencilKind::TAIL_CALL);
+                m_depth += m_chunk.stack_effect(std::to_underlying(op), m_offset);
+                break;
+            case OpCode::RETURN:
+                copy(StencilKind::RETURN);
+                m_depth--;
+                break;
+            default:
+                // Everything else is executed by the VM, which leaves the stack as the opcode does
+                copy(StencilKind::EXECUTE);
+                m_depth += m_chunk.stack_effect(std::to_underlying(op), m_offset);
+                break;
+        }
+        max_depth = std::max(max_depth, m_depth);
+        m_offset = next;
+    }
+
+    // Exits. rax holds the depth at the RETURN, or 0 after an error.
+    std::size_t error_exit = m_asm.size();
+    m_asm.alu(X64Assembler::k_xor, X64::RAX, X64::RAX);
+    std::size_t return_exit = m_asm.size();
+    m_asm.pop(X64::R15);
+    m_asm.pop(X64::R14);
+    m_asm.pop(X64::R13);
+    m_asm.pop(X64::R12);
+    m_asm.pop(X64::RBX);
+    m_asm.ret();
+
+    for (auto [position, target] : m_jump_patches) {
+        if (target >= code.size() || native_offsets[target] == SIZE_MAX) return nullptr;
+        m_asm.patch_rel32(position, native_offsets[target]);
+    }
+    for (std::size_t position : m_error_patches) {
+        m_asm.patch_rel32(position, error_exit);
+    }
+    for (std::size_t position : m_return_patches) {
+        m_asm.patch_rel32(position, return_exit);
+    }
+
+    auto stencil_code = std::make_shared<StencilCode>(m_asm.bytes(), max_depth);
+    if (!stencil_code->is_valid()) return nullptr;
+
+#ifdef DEBUG_PRINT_CODE
+    printf("== stencils %s: %zu bytes of code, %zu bytes of machine code ==\n", m_function->name(), code.size(), m_asm.size());
+#endif
+    return stencil_code;
+}
+
+std::shared_ptr<StencilCode> Stencils::compile(ObjFunction* function) {
+    return StencilCompiler(function).compile();
+}
+
+NativeCoverage Stencils::coverage(ObjFunction* function) {
+    NativeCoverage coverage{};
+    const Chunk& chunk = function->chunk();
+    const std::vector<std::uint8_t>& code = chunk.get_code();
+    for (std::size_t offset = 0; offset < code.size(); coverage.m_instructions++) {
+        // Walked as StencilCompiler::compile() walks it
+        std::uint8_t op_code = code[offset];
+        const Superinstruction* super = Chunk::find_superinstruction(op_code);
+        if (super != nullptr) op_code = std::to_underlying(super->m_components[0]);
+        OpCode op = static_cast<OpCode>(Chunk::generic_opcode(op_code));
+        offset += chunk.opcode_length(std::to_underlying(op), offset);
+
+        switch (op) {
+            case OpCode::LOOP:
+                coverage.m_has_loop = true;
+                break;
+            case OpCode::CONSTANT:
+            case OpCode::NIL:
+            case OpCode::TRUE:
+            case OpCode::FALSE:
+            case OpCode::POP:
+            case OpCode::GET_LOCAL:
+            case OpCode::SET_LOCAL:
+            case OpCode::EQUAL:
+            case OpCode::GREATER:
+            case OpCode::LESS:
+            case OpCode::ADD:
+            case OpCode::SUBTRACT:
+            case OpCode::MULTIPLY:
+            case OpCode::DIVIDE:
+            case OpCode::NOT:
+            case OpCode::GET_GLOBAL:
+            case OpCode::DEFINE_GLOBAL:
+            case OpCode::SET_GLOBAL:
+            case OpCode::JUMP:
+            case OpCode::JUMP_IF_FALSE:
+            case OpCode::GUARD_CALL:
+            case OpCode::GUARD_INVOKE:
+            case OpCode::RETURN:
+                break;
+            default:
+                coverage.m_exits++;
+                break;
+        }
+    }
+    return coverage;
+}
+
+bool VM::run_stencils(ObjFunction* function) {
+    std::size_t slots = current_frame().m_value_stack_base_index;
+    const StencilCode& code = *function->m_stencil_code;
+    m_stack.resize(slots + code.max_depth());
+    std::size_t depth = code.run(this, m_stack.data() + slots, m_globals.data());
+    if (depth == 0) return false;
+    if (depth != k_tail_called) native_return(depth);
+    return true;
+}
+
+Value* VM::stencil_call(std::size_t offset, std::size_t depth, bool invoke) {
+    CallFrame& frame = current_frame();
+    ObjFunction* caller = frame.m_closure->function();
+    std::size_t max_depth = caller->m_stencil_code->max_depth();
+    Chunk& chunk = caller->chunk();
+    const std::uint8_t* code = chunk.get_code().data();
+    std::uint8_t arg_count = code[offset + (invoke ? 2 : 1)];
+    std::size_t base = frame.m_value_stack_base_index + depth - arg_count - 1;
+
+    ObjClosure* closure{};
+    if (invoke) {
+        // Only methods are called straight into, not closures stored in fields
+        Value receiver = m_stack[base];
+        if (receiver.is_instance()) {
+            ObjString* name = chunk.get_constants()[code[offset + 1]].as_string();
+            InlineCache& cache = chunk.get_inline_caches()[(code[offset + 3] << 8) | code[offset + 4]];
+            const InlineCacheEntry* entry = resolve_property(receiver.as_instance()->shape(), name, cache);
+            if (entry != nullptr && entry->m_kind == InlineCacheKind::METHOD) closure = entry->m_method;
+        }
+    }
+    else if (m_stack[base].is_closure()) {
+        closure = m_stack[base].as_closure();
+    }
+    if (closure == nullptr || closure->function()->m_arity != arg_count || m_call_stack.size() >= k_max_call_frames ||
+        !m_tiering.on_stencil_call(closure->function())) {
+        return invoke ? native_invoke(offset, depth, max_depth) : native_call(offset, depth, max_depth);
+    }
+
+    // Leave the frame just as CALL and INVOKE do while the callee runs
+    frame.m_ip = code + offset + (invoke ? 5 : 2);
+    std::size_t call_depth = m_call_stack.size();
+    m_call_stack.emplace_back(closure, base);
+    if (!run_stencils(closure->function())) return nullptr;
+    // Unless it returned, the callee tail called, and whatever it called starts in the frame
+    if (m_call_stack.size() > call_depth && !enter_frame()) return nullptr;
+    return native_resume(call_depth, max_depth);
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef ppclox_stencil_hpp
+#define ppclox_stencil_hpp
+
+#include "common.hpp"
+#include "jit.hpp"
+#include "value.hpp"
+
+class ObjFunction;
+class GlobalSlot;
+class VM;
+
+#ifdef JIT
+
+/**
+ * Machine code for a whole function's stack bytecode, made by copy-and-patch: every
+ * instruction is a copy of a precompiled stencil of machine code for its opcode, with
+ * holes in it patched with the instruction's operands (constants, stack slots, jump
+ * targets, globals). Building it is little more than a memcpy per instruction, so it's
+ * worth doing for functions that are barely warm, long before the JIT (see jit.hpp) is.
+ * Only the simplest opcodes have stencils of their own, and a call to a Lox function
+ * that has stencil code too goes straight into it (see VM::stencil_call). Every other
+ * instruction, and any arithmetic on operands that aren't numbers, is a call into the
+ * stack VM to run just that instruction with its own handler (see VM::native_execute),
+ * so behaviour is always exactly the interpreter's, quickening included. What goes is
+ * the dispatch.
+ * The code uses the frame's window of the value stack exactly as the interpreter does,
+ * with the stack depth at every instruction known when it is built.
+ */
+class StencilCode {
+public:
+    /**
+     * Signature of the generated code. Returns 0 if a runtime error occurred, VM::k_tail_called
+     * if a tail call handed the frame over to another function, or else the frame's stack
+     * depth at its RETURN, so that the result is the top value.
+     */
+    using Entry = std::size_t (*)(VM* vm, Value* slots, GlobalSlot* globals);
+
+    StencilCode(const std::vector<std::uint8_t>& bytes, std::size_t max_depth) : m_code(bytes), m_max_depth(max_depth) {}
+
+    /** False if executable memory couldn't be mapped */
+    bool is_valid() const { return m_code.is_valid(); }
+    /** Stack depth the code needs room for, relative to the frame */
+    std::size_t max_depth() const { return m_max_depth; }
+    /** Run the function on the frame whose values start at slots, until it returns */
+    std::size_t run(VM* vm, Value* slots, GlobalSlot* globals) const {
+        return reinterpret_cast<Entry>(const_cast<void*>(m_code.address()))(vm, slots, globals);
+    }
+private:
+    NativeCode m_code;
+    std::size_t m_max_depth{};
+};
+
+class Stencils {
+public:
+    /** Build the function's stencil code. Returns nullptr if it can't be, in which case it stays interpreted. */
+    static std::shared_ptr<StencilCode> compile(ObjFunction* function);
+    /** How much of the function its stencil code would run without calling back into the VM */
+    static NativeCoverage coverage(ObjFunction* function);
+};
+
+#endif
+
+#endif
@@ -0,0 +1,147 @@
+#include "tiering.hpp"
+
+#include "chunk.hpp"
+#include "register_code.hpp"
+
+static const char* s_event_names[] = {
+    "stencils",         // [TieringEvent::STENCILS]
+    "compiled",         // [TieringEvent::COMPILED]
+    "compile failed",   // [TieringEvent::COMPILE_FAILED]
+    "stencils skipped", // [TieringEvent::STENCILS_SKIPPED]
+    "compile skipped",  // [TieringEvent::COMPILE_SKIPPED]
+    "trace compiled",   // [TieringEvent::TRACE_COMPILED]
+    "trace rejected",   // [TieringEvent::TRACE_REJECTED]
+    "osr",              // [TieringEvent::OSR]
+    "osr skipped",      // [TieringEvent::OSR_SKIPPED]
+};
+static_assert(std::size(s_event_names) == std::to_underlying(TieringEvent::OSR_SKIPPED) + 1, "Every TieringEvent needs a name.");
+
+void Tiering::add_record(TieringEvent event, ObjFunction* function, std::size_t location, std::size_t count) {
+    if (!m_report_enabled) return;
+
+    // Repeats of the same event in the same place (OSR into a loop on every activation) are merged.
+    // A function collected since may have left its address to another, which gets a record of its own.
+    auto [index, inserted] = m_record_indices.try_emplace({ event, function, location }, m_records.size());
+    if (!inserted && m_records[index->second].m_function == function->name()) {
+        m_records[index->second].m_times++;
+        return;
+    }
+    index->second = m_records.size();
+    m_records.push_back(TieringRecord{ event, function->name(), function->chunk().get_lines().at(0), location, count });
+}
+
+void Tiering::report() const {
+    if (!m_report_enabled) return;
+
+    fprintf(stderr, "== tiering ==\n");
+    fprintf(stderr, "thresholds: %zu calls for stencils, %zu calls to compile, %zu back edges to trace, %zu back edges to osr%s\n",
+            m_policy.m_stencil_threshold, m_policy.m_call_threshold, m_policy.m_trace_threshold, m_policy.m_osr_threshold,
+            m_enabled ? "" : " (disabled)");
+
+    std::size_t totals[std::size(s_event_names)]{};
+    for (auto& record : m_records) {
+        totals[std::to_underlying(record.m_event)] += record.m_times;
+        fprintf(stderr, "%-16s %s (line %zu)", s_event_names[std::to_underlying(record.m_event)], record.m_function.c_str(), record.m_line);
+        switch (record.m_event) {
+            case TieringEvent::STENCILS:
+            case TieringEvent::COMPILED:
+            case TieringEvent::COMPILE_FAILED:
+            case TieringEvent::STENCILS_SKIPPED:
+            case TieringEvent::COMPILE_SKIPPED:
+                fprintf(stderr, " after %zu calls", record.m_count);
+                break;
+            default:
+                fprintf(stderr, " @%04zu after %zu back edges", record.m_location, record.m_count);
+                break;
+        }
+        if (record.m_times > 1) {
+            fprintf(stderr, " (x%zu)", record.m_times);
+        }
+        fprintf(stderr, "\n");
+    }
+
+    fprintf(stderr, "--");
+    for (std::size_t i = 0; i < std::size(s_event_names); i++) {
+        fprintf(stderr, " %s: %zu%s", s_event_names[i], totals[i], i + 1 < std::size(s_event_names) ? "," : "\n");
+    }
+}
+
+#ifdef JIT
+
+bool Tiering::pays_off(const NativeCoverage& coverage, std::size_t max_exits_per) {
+    if (coverage.m_has_loop || coverage.m_exits == 0) return true;
+    return max_exits_per != 0 && coverage.m_exits * max_exits_per <= coverage.m_instructions;
+}
+
+bool Tiering::compile(ObjFunction* function, std::size_t count) {
+    // What the JIT's code saves on the rest makes up for as much as one call in four instructions
+    if (!pays_off(Jit::coverage(function), 4)) {
+        add_record(TieringEvent::COMPILE_SKIPPED, function, 0, count);
+        return false;
+    }
+    function->m_native_code = Jit::compile(function);
+    if (function->m_native_code == nullptr) {
+        function->m_compile_failed = true;
+        add_record(TieringEvent::COMPILE_FAILED, function, 0, count);
+        return false;
+    }
+    add_record(TieringEvent::COMPILED, function, 0, count);
+    return true;
+}
+
+bool Tiering::build_stencils(ObjFunction* function, std::size_t count) {
+    // Stencil code has no more than the dispatch to save, and any instruction it leaves to the VM costs that
+    if (!pays_off(Stencils::coverage(function), 0)) {
+        add_record(TieringEvent::STENCILS_SKIPPED, function, 0, count);
+        return false;
+    }
+    function->m_stencil_code = Stencils::compile(function);
+    if (function->m_stencil_code == nullptr) return false;
+    add_record(TieringEvent::STENCILS, function, 0, count);
+    return true;
+}
+
+bool Tiering::osr_pays_off(ObjFunction* function, std::size_t header, std::size_t activation_back_edges, std::size_t activation_calls) {
+    // At most one such call in every 8 iterations
+    return pays_off(Jit::loop_coverage(function, header), 4) && activation_calls * 8 <= activation_back_edges;
+}
+
+Tiering::BackEdgeAction Tiering::hot_back_edge(ObjFunction* function, std::size_t location, std::size_t activation_back_edges,
+                                               std::size_t activation_calls, bool can_trace) {
+    bool trace_due = function->m_back_edge_count >= m_policy.m_trace_threshold;
+    if (trace_due) {
+        function->m_back_edge_count = 0;
+    }
+
+    // Leaving the frame would throw the recording out of step
+    if (m_recorder.is_recording()) return BackEdgeAction::NONE;
+
+    if (activation_back_edges >= m_policy.m_osr_threshold && !function->m_compile_failed && !function->m_osr_skipped) {
+        std::size_t header = can_trace ? function->register_code().loop_header_index(location) : location;
+        if (header == SIZE_MAX || !osr_pays_off(function, header, activation_back_edges, activation_calls)) {
+            function->m_osr_skipped = true;
+            add_record(TieringEvent::OSR_SKIPPED, function, location, activation_back_edges);
+            return BackEdgeAction::NONE;
+        }
+        // The function may have got hot enough to compile from calls since this activation started
+        if (function->m_native_code == nullptr && !compile(function, function->m_call_count)) {
+            return BackEdgeAction::NONE;
+        }
+        return BackEdgeAction::OSR;
+    }
+
+    if (can_trace && trace_due && !function->chunk().get_traces().contains(location)) {
+        return BackEdgeAction::RECORD_TRACE;
+    }
+    return BackEdgeAction::NONE;
+}
+
+void Tiering::trace_finished(ObjFunction* function, std::size_t header, bool compiled) {
+    add_record(compiled ? TieringEvent::TRACE_COMPILED : TieringEvent::TRACE_REJECTED, function, header, m_policy.m_trace_threshold);
+}
+
+void Tiering::osr_entered(ObjFunction* function, std::size_t location, std::size_t activation_back_edges) {
+    add_record(TieringEvent::OSR, function, location, activation_back_edges);
+}
+
+#endif
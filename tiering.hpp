@@ -0,0 +1,180 @@
+#ifndef ppclox_tiering_hpp
+#define ppclox_tiering_hpp
+
+#include <map>
+#include <string>
+#include <tuple>
+
+#include "common.hpp"
+#include "object_function.hpp"
+#include "stencil.hpp"
+#include "trace.hpp"
+
+/** Hotness at which code moves up a tier. Each can be set from the command line. */
+class TieringPolicy {
+public:
+    /** Calls after which a function's bytecode is built into native code from stencils */
+    std::size_t m_stencil_threshold{ 2 };
+    /** Calls after which a function is compiled to native code by the JIT */
+    std::size_t m_call_threshold{ 100 };
+    /** Back edges taken in a function after which the stack interpreter records a trace of the loop */
+    std::size_t m_trace_threshold{ 200 };
+    /**
+     * Back edges taken in one activation of a function after which it is compiled (if it
+     * isn't already), and the loop carries on in native code from its current iteration.
+     */
+    std::size_t m_osr_threshold{ 1000 };
+};
+
+/** Kinds of tiering decision, as listed by the stats dump */
+enum class TieringEvent {
+    /** A function's bytecode was built into native code from stencils */
+    STENCILS,
+    /** A function was compiled to native code */
+    COMPILED,
+    /** A function couldn't be compiled, so it stays interpreted */
+    COMPILE_FAILED,
+    /** A function was kept out of stencil code, or from being compiled, as it wouldn't run any faster there */
+    STENCILS_SKIPPED,
+    COMPILE_SKIPPED,
+    /** A loop was traced, and its trace compiled */
+    TRACE_COMPILED,
+    /** A loop did something traces can't, so it won't be traced again */
+    TRACE_REJECTED,
+    /** An interpreted activation of a function switched to native code at a loop header */
+    OSR,
+    /** A loop leaves so much to the VM that its activations stay interpreted */
+    OSR_SKIPPED
+};
+
+class TieringRecord {
+public:
+    TieringEvent m_event{};
+    /** Name of the function, copied since the function itself may be collected before the dump */
+    std::string m_function{};
+    /** Line the function starts at, telling apart functions with the same name (every init, say) */
+    std::size_t m_line{};
+    /** Loop header the event happened at (offset into the chunk, or register instruction index), if any */
+    std::size_t m_location{};
+    /** Call or back edge count of the function when the decision was made */
+    std::size_t m_count{};
+    /** Number of times the same event happened at the same place */
+    std::size_t m_times{ 1 };
+};
+
+/**
+ * Decides when functions and loops move up from the interpreters to compiled code,
+ * and performs the swap. Functions count their calls and back edges (see ObjFunction).
+ * A warm function is quickly built into native code from stencils (see stencil.hpp),
+ * and a hot one is compiled by the JIT (see jit.hpp), as long as the tier would run
+ * enough of the function in its own code to be faster (see pays_off()). VM::call runs
+ * the highest tier a function has reached. A hot loop in the stack interpreter is first traced (see trace.hpp). If that
+ * isn't possible, or the loop is in the register interpreter, a long running loop
+ * instead makes the function compile, and its frame moves into the native code at the
+ * loop's header (on-stack replacement). Every decision is recorded for the stats dump.
+ */
+class Tiering {
+public:
+    /** What an interpreter should do after taking a back edge */
+    enum class BackEdgeAction {
+        NONE,
+        /** Start recording a trace of the loop */
+        RECORD_TRACE,
+        /** Switch to the function's native code at the loop header */
+        OSR
+    };
+
+    TieringPolicy& policy() { return m_policy; }
+    /** Whether anything is compiled at all (only possible when built with JIT) */
+    bool is_enabled() const { return m_enabled; }
+    void set_enabled(bool enabled) { m_enabled = enabled; }
+    /** Print the stats dump to stderr on exit */
+    void set_report_enabled(bool enabled) { m_report_enabled = enabled; }
+    /** Print every decision, and a summary, to stderr if enabled */
+    void report() const;
+
+#ifdef JIT
+    TraceRecorder& recorder() { return m_recorder; }
+
+    /** Count a call to the function. Returns whether it has native code (of either kind) to run. */
+    bool on_call(ObjFunction* function) {
+        if (function->m_native_code != nullptr) return true;
+        // Past both thresholds nothing more is up for compiling, so stop counting
+        if (function->m_call_count >= m_policy.m_call_threshold && function->m_call_count >= m_policy.m_stencil_threshold) {
+            return function->m_stencil_code != nullptr;
+        }
+        std::size_t count = ++function->m_call_count;
+        if (count == m_policy.m_call_threshold && compile(function, count)) return true;
+        if (function->m_stencil_code != nullptr) return true;
+        return count == m_policy.m_stencil_threshold && build_stencils(function, count);
+    }
+    /**
+     * Count a call that stencil code makes straight into the function's own stencil code.
+     * Returns false, without counting it, unless that's what the call would run: if the
+     * function has no stencil code, has been compiled, or is due to be compiled by this
+     * call, the call has to go through on_call() instead.
+     */
+    bool on_stencil_call(ObjFunction* function) {
+        if (function->m_stencil_code == nullptr || function->m_native_code != nullptr) return false;
+        if (function->m_call_count + 1 == m_policy.m_call_threshold) return false;
+        function->m_call_count++;
+        return true;
+    }
+    /**
+     * Count a back edge of an interpreted loop, whose header is at the given location.
+     * activation_back_edges is how many back edges the current activation has taken, and
+     * activation_calls how many calls it made to functions that run in the interpreter.
+     * Traces are only recorded when can_trace is set (the stack interpreter), whose
+     * locations are offsets into the chunk rather than register instruction indices.
+     */
+    BackEdgeAction on_back_edge(ObjFunction* function, std::size_t location, std::size_t activation_back_edges,
+                                std::size_t activation_calls, bool can_trace) {
+        if (++function->m_back_edge_count < m_policy.m_trace_threshold &&
+            (activation_back_edges < m_policy.m_osr_threshold || function->m_osr_skipped)) {
+            return BackEdgeAction::NONE;
+        }
+        return hot_back_edge(function, location, activation_back_edges, activation_calls, can_trace);
+    }
+    /** Record a loop the recorder has finished with */
+    void trace_finished(ObjFunction* function, std::size_t header, bool compiled);
+    /** Record an interpreted frame moving into native code at the given loop header */
+    void osr_entered(ObjFunction* function, std::size_t location, std::size_t activation_back_edges);
+#endif
+private:
+    TieringPolicy m_policy{};
+    bool m_enabled{ true };
+    bool m_report_enabled{};
+    std::vector<TieringRecord> m_records{};
+    /** Index of the record for each event, function and location, for merging repeats */
+    std::map<std::tuple<TieringEvent, const ObjFunction*, std::size_t>, std::size_t> m_record_indices{};
+#ifdef JIT
+    TraceRecorder m_recorder{ *this };
+
+    /**
+     * Whether moving a function up to a tier whose code covers it as given pays off. One
+     * with a loop always does. Without a loop every instruction runs at most once a call,
+     * so there is little dispatch to save, and each instruction left to the VM (calls
+     * included) costs more than interpreting it would. So at most one in max_exits_per
+     * instructions may be, or none at all if that is 0.
+     */
+    static bool pays_off(const NativeCoverage& coverage, std::size_t max_exits_per);
+    /** Compile the function to native code now, unless it wouldn't pay off, returning whether that was done */
+    bool compile(ObjFunction* function, std::size_t count);
+    /** Build the function's stencil code now, unless it wouldn't pay off, returning whether that was done */
+    bool build_stencils(ObjFunction* function, std::size_t count);
+    /**
+     * Whether moving an activation into native code at the loop header pays off. The loop
+     * body's own exits are weighed as pays_off() does for a function. On top of those,
+     * each call the loop makes to a function that runs in the interpreter goes from native code
+     * round the VM into a new interpreter loop, which costs more than native code saves
+     * on a whole iteration. So the calls the activation has made so far must be rare.
+     */
+    static bool osr_pays_off(ObjFunction* function, std::size_t header, std::size_t activation_back_edges, std::size_t activation_calls);
+    BackEdgeAction hot_back_edge(ObjFunction* function, std::size_t location, std::size_t activation_back_edges,
+                                 std::size_t activation_calls, bool can_trace);
+#endif
+
+    void add_record(TieringEvent event, ObjFunction* function, std::size_t location, std::size_t count);
+};
+
+#endif
@@ -0,0 +1,388 @@
+#include "trace.hpp"
+
+#ifdef JIT
+
+#include <cstddef>
+
+#include "chunk.hpp"
+#include "object_function.hpp"
+#include "tiering.hpp"
+#include "vm.hpp"
+#include "x64_assembler.hpp"
+
+/** Whether a trace can contain the given (possibly quickened or fused) opcode */
+static bool is_traceable(std::uint8_t op_code) {
+    const Superinstruction* super = Chunk::find_superinstruction(op_code);
+    if (super != nullptr) {
+        for (OpCode component : super->m_components) {
+            if (!is_traceable(std::to_underlying(component))) return false;
+        }
+        return true;
+    }
+
+    switch (static_cast<OpCode>(Chunk::generic_opcode(op_code))) {
+        case OpCode::CONSTANT:
+        case OpCode::NIL:
+        case OpCode::TRUE:
+        case OpCode::FALSE:
+        case OpCode::POP:
+        case OpCode::GET_LOCAL:
+        case OpCode::SET_LOCAL:
+        case OpCode::GET_GLOBAL:
+        case OpCode::SET_GLOBAL:
+        case OpCode::EQUAL:
+        case OpCode::GREATER:
+        case OpCode::LESS:
+        case OpCode::ADD:
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+        case OpCode::NOT:
+        case OpCode::NEGATE:
+        case OpCode::JUMP:
+        case OpCode::JUMP_IF_FALSE:
+        case OpCode::LOOP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Emits the machine code for a recorded trace, by walking the recorded path through
+ * the bytecode one (unfused) instruction at a time and keeping track of the stack
+ * depth, which is always known statically. The trace keeps its state in the registers
+ * described at X64Assembler, except r12, since it never calls back into the VM.
+ */
+class TraceCompiler {
+public:
+    TraceCompiler(ObjFunction* function, std::size_t header, std::size_t depth, const std::vector<std::size_t>& offsets) :
+        m_chunk(function->chunk()), m_function(function), m_header(header), m_depth(depth), m_offsets(offsets) {}
+
+    /** Returns nullptr if the recorded path contains something a trace can't do */
+    std::shared_ptr<Trace> compile();
+private:
+    Chunk& m_chunk;
+    ObjFunction* m_function;
+    std::size_t m_header;
+    std::size_t m_depth;
+    const std::vector<std::size_t>& m_offsets;
+    X64Assembler m_asm{};
+    std::vector<TraceExit> m_exits{};
+    /** Positions of rel32 operands to patch, and the exit they lead to */
+    std::vector<std::pair<std::size_t, std::size_t>> m_exit_patches{};
+    /** Whether each stack slot is known to hold a number, so its guards can be skipped */
+    std::vector<bool> m_known_number{};
+    std::size_t m_max_depth{};
+
+    static std::int32_t slot(std::size_t index) { return static_cast<std::int32_t>(8 * index); }
+
+    /** Leave the trace to resume at the given instruction if the condition holds */
+    void side_exit(X64Condition condition, std::size_t offset, std::size_t depth);
+    /** Side exit unless the value in reg is a number, and it isn't already known to be. Clobbers rdx. */
+    void guard_number(X64 reg, std::size_t index, std::size_t offset, std::size_t depth);
+    void push_value(X64 reg, std::size_t depth, bool is_number);
+
+    void compile_arithmetic(OpCode op, std::size_t offset, std::size_t depth);
+    void compile_equal(std::size_t depth);
+    /** Emit the side exits and epilogue, and map the finished code */
+    std::shared_ptr<Trace> finish();
+};
+
+void TraceCompiler::side_exit(X64Condition condition, std::size_t offset, std::size_t depth) {
+    m_exits.push_back(TraceExit{ offset, depth });
+    m_exit_patches.emplace_back(m_asm.jcc(condition), m_exits.size() - 1);
+}
+
+void TraceCompiler::guard_number(X64 reg, std::size_t index, std::size_t offset, std::size_t depth) {
+    if (m_known_number[index]) return;
+    m_asm.test_number(reg);
+    side_exit(X64Condition::EQUAL, offset, depth);
+}
+
+void TraceCompiler::push_value(X64 reg, std::size_t depth, bool is_number) {
+    m_asm.store(X64::RBX, slot(depth), reg);
+    m_known_number[depth] = is_number;
+    m_max_depth = std::max(m_max_depth, depth + 1);
+}
+
+void TraceCompiler::compile_arithmetic(OpCode op, std::size_t offset, std::size_t depth) {
+    // On a failed guard the interpreter redoes the instruction, whatever the operands turned out to be
+    m_asm.load(X64::RAX, X64::RBX, slot(depth - 2));
+    m_asm.load(X64::RCX, X64::RBX, slot(depth - 1));
+    guard_number(X64::RAX, depth - 2, offset, depth);
+    guard_number(X64::RCX, depth - 1, offset, depth);
+    m_asm.movq_to_xmm(0, X64::RAX);
+    m_asm.movq_to_xmm(1, X64::RCX);
+
+    switch (op) {
+        case OpCode::ADD: m_asm.sse_arithmetic(0x58); break;
+        case OpCode::SUBTRACT: m_asm.sse_arithmetic(0x5c); break;
+        case OpCode::MULTIPLY: m_asm.sse_arithmetic(0x59); break;
+        case OpCode::DIVIDE: m_asm.sse_arithmetic(0x5e); break;
+        // "above" is false when either side is NaN, so a < b is tested as b > a
+        case OpCode::GREATER: m_asm.ucomisd(0, 1); break;
+        case OpCode::LESS: m_asm.ucomisd(1, 0); break;
+        default: break;
+    }
+    if (op == OpCode::GREATER || op == OpCode::LESS) {
+        m_asm.setcc_rax(X64Condition::ABOVE);
+        m_asm.alu(X64Assembler::k_or, X64::RAX, X64::R15);
+        push_value(X64::RAX, depth - 2, false);
+    }
+    else {
+        m_asm.movq_from_xmm(X64::RAX, 0);
+        push_value(X64::RAX, depth - 2, true);
+    }
+}
+
+void TraceCompiler::compile_equal(std::size_t depth) {
+    m_asm.load(X64::RAX, X64::RBX, slot(depth - 2));
+    m_asm.load(X64::RCX, X64::RBX, slot(depth - 1));
+    m_asm.values_equal();
+    m_asm.alu(X64Assembler::k_or, X64::RAX, X64::R15);
+    push_value(X64::RAX, depth - 2, false);
+}
+
+std::shared_ptr<Trace> TraceCompiler::compile() {
+    const std::vector<std::uint8_t>& code = m_chunk.get_code();
+    const std::vector<Value>& constants = m_chunk.get_constants();
+    auto read_short = [&](std::size_t offset) {
+        return static_cast<std::uint16_t>((code[offset + 1] << 8) | code[offset + 2]);
+    };
+    auto global_value = [&](std::size_t offset) {
+        std::size_t index = read_short(offset);
+        return static_cast<std::int32_t>(index * sizeof(GlobalSlot) + offsetof(GlobalSlot, m_value));
+    };
+
+    // Prologue. The trace calls nothing, so the stack's alignment doesn't matter.
+    m_asm.push(X64::RBX);
+    m_asm.push(X64::R13);
+    m_asm.push(X64::R14);
+    m_asm.push(X64::R15);
+    m_asm.alu(X64Assembler::k_mov, X64::RBX, X64::RDI);
+    m_asm.alu(X64Assembler::k_mov, X64::R13, X64::RSI);
+    m_asm.mov_imm64(X64::R14, Value::k_qnan);
+    m_asm.mov_imm64(X64::R15, Value::k_false_bits);
+
+    // Nothing is known about the values at the top of the loop, since the trace
+    // is entered from the interpreter as well as from its own back edge.
+    std::size_t loop_start = m_asm.size();
+    m_known_number.assign(m_depth + 256, false);
+    m_max_depth = m_depth;
+
+    std::size_t offset = m_header;
+    std::size_t depth = m_depth;
+    std::size_t next_recorded = 0;
+    // Each recorded instruction is at most a few unfused ones
+    for (std::size_t steps = 0; steps < 4 * m_offsets.size() + 4; steps++) {
+        if (steps > 0 && offset == m_header) {
+            // Back at the top of the loop, so jump back to the start of the trace
+            if (depth != m_depth) return nullptr;
+            m_asm.patch_rel32(m_asm.jmp(), loop_start);
+            return finish();
+        }
+        if (next_recorded < m_offsets.size() && m_offsets[next_recorded] == offset) next_recorded++;
+
+        // Superinstructions only overwrite the opcode of their first component
+        std::uint8_t op_code = code[offset];
+        const Superinstruction* super = Chunk::find_superinstruction(op_code);
+        if (super != nullptr) op_code = std::to_underlying(super->m_components[0]);
+        OpCode op = static_cast<OpCode>(Chunk::generic_opcode(op_code));
+        std::size_t next = offset + m_chunk.opcode_length(std::to_underlying(op), offset);
+        if (depth + 2 >= m_known_number.size()) return nullptr;
+
+        switch (op) {
+            case OpCode::CONSTANT: {
+                Value constant = constants[code[offset + 1]];
+                m_asm.mov_imm64(X64::RAX, constant.bits());
+                push_value(X64::RAX, depth++, constant.is_number());
+                break;
+            }
+            case OpCode::NIL:
+                m_asm.mov_imm64(X64::RAX, Value::k_nil_bits);
+                push_value(X64::RAX, depth++, false);
+                break;
+            case OpCode::TRUE:
+                m_asm.mov_imm64(X64::RAX, Value::k_true_bits);
+                push_value(X64::RAX, depth++, false);
+                break;
+            case OpCode::FALSE:
+                push_value(X64::R15, depth++, false);
+                break;
+            case OpCode::POP:
+                depth--;
+                break;
+            case OpCode::GET_LOCAL: {
+                std::size_t local = code[offset + 1];
+                m_asm.load(X64::RAX, X64::RBX, slot(local));
+                push_value(X64::RAX, depth++, m_known_number[local]);
+                break;
+            }
+            case OpCode::SET_LOCAL: {
+                std::size_t local = code[offset + 1];
+                m_asm.load(X64::RAX, X64::RBX, slot(depth - 1));
+                m_asm.store(X64::RBX, slot(local), X64::RAX);
+                m_known_number[local] = m_known_number[depth - 1];
+                break;
+            }
+            // The global was defined when the trace was recorded, and globals never become undefined again
+            case OpCode::GET_GLOBAL:
+                m_asm.load(X64::RAX, X64::R13, global_value(offset));
+                push_value(X64::RAX, depth++, false);
+                break;
+            case OpCode::SET_GLOBAL:
+                m_asm.load(X64::RAX, X64::RBX, slot(depth - 1));
+                m_asm.store(X64::R13, global_value(offset), X64::RAX);
+                break;
+            case OpCode::EQUAL:
+                compile_equal(depth--);
+                break;
+            case OpCode::GREATER:
+            case OpCode::LESS:
+            case OpCode::ADD:
+            case OpCode::SUBTRACT:
+            case OpCode::MULTIPLY:
+            case OpCode::DIVIDE:
+                compile_arithmetic(op, offset, depth--);
+                break;
+            case OpCode::NOT:
+                m_asm.load(X64::RAX, X64::RBX, slot(depth - 1));
+                m_asm.test_falsey(X64::RAX);
+                m_asm.setcc_rax(X64Condition::BELOW_EQUAL);
+                m_asm.alu(X64Assembler::k_or, X64::RAX, X64::R15);
+                push_value(X64::RAX, depth - 1, false);
+                break;
+            case OpCode::NEGATE:
+                m_asm.load(X64::RAX, X64::RBX, slot(depth - 1));
+                guard_number(X64::RAX, depth - 1, offset, depth);
+                m_asm.mov_imm64(X64::RCX, Value::k_sign_bit);
+                m_asm.alu(X64Assembler::k_xor, X64::RAX, X64::RCX);
+                push_value(X64::RAX, depth - 1, true);
+                break;
+            case OpCode::JUMP:
+                next += read_short(offset);
+                break;
+            case OpCode::JUMP_IF_FALSE: {
+                // Follow the branch the way it went while recording, and leave if it goes the other way
+                std::size_t target = next + read_short(offset);
+                std::size_t recorded = next_recorded < m_offsets.size() ? m_offsets[next_recorded] : m_header;
+                m_asm.load(X64::RAX, X64::RBX, slot(depth - 1));
+                m_asm.test_falsey(X64::RAX);
+                if (recorded == target && target != next) {
+                    side_exit(X64Condition::ABOVE, next, depth);
+                    next = target;
+                }
+                else {
+                    side_exit(X64Condition::BELOW_EQUAL, target, depth);
+                }
+                break;
+            }
+            case OpCode::LOOP:
+                // Back edges of the traced loop's own body (a for loop has two)
+                next -= read_short(offset);
+                break;
+            default:
+                return nullptr;
+        }
+        offset = next;
+    }
+
+    // Never got back to the top of the loop
+    return nullptr;
+}
+
+std::shared_ptr<Trace> TraceCompiler::finish() {
+    std::size_t exits = m_asm.size();
+    for (auto [position, exit] : m_exit_patches) {
+        m_asm.patch_rel32(position, exits + 10 * exit);
+    }
+    // Each exit is 10 bytes: mov eax, index then a jmp to the epilogue
+    std::size_t epilogue = exits + 10 * m_exits.size();
+    for (std::size_t exit = 0; exit < m_exits.size(); exit++) {
+        m_asm.mov_imm32(X64::RAX, static_cast<std::uint32_t>(exit));
+        m_asm.patch_rel32(m_asm.jmp(), epilogue);
+    }
+    m_asm.pop(X64::R15);
+    m_asm.pop(X64::R14);
+    m_asm.pop(X64::R13);
+    m_asm.pop(X64::RBX);
+    m_asm.ret();
+
+    auto trace = std::make_shared<Trace>(m_asm.bytes(), std::move(m_exits), m_max_depth);
+    if (!trace->is_valid()) return nullptr;
+#ifdef DEBUG_PRINT_CODE
+    printf("== trace %s @%04zu: %zu instructions, %zu bytes ==\n", m_function->name(), m_header, m_offsets.size(), m_asm.size());
+#endif
+    return trace;
+}
+
+void TraceRecorder::start(ObjFunction* function, std::size_t header, std::size_t loop, std::size_t depth) {
+    m_function = function;
+    m_header = header;
+    m_loop = loop;
+    m_depth = depth;
+    m_offsets.clear();
+}
+
+bool TraceRecorder::record(std::size_t offset, const Value* stack_top) {
+    if (offset == m_header && !m_offsets.empty()) {
+        // Back at the top, so the loop has closed
+        finish(TraceCompiler(m_function, m_header, m_depth, m_offsets).compile());
+        return false;
+    }
+
+    // An inner loop that already has a trace would run it, which we can't see into
+    std::uint8_t op_code = m_function->chunk().get_code()[offset];
+    if (!is_traceable(op_code) || op_code == std::to_underlying(OpCode::LOOP_TRACE) || m_offsets.size() == k_max_trace_length) {
+        finish(nullptr);
+        return false;
+    }
+
+    // Arithmetic is only specialized for numbers. If it isn't seeing numbers now, a
+    // trace would just take a side exit on every iteration.
+    bool numbers_expected = false;
+    std::size_t operand_count = 2;
+    switch (static_cast<OpCode>(Chunk::generic_opcode(op_code))) {
+        case OpCode::GREATER:
+        case OpCode::LESS:
+        case OpCode::ADD:
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+            numbers_expected = true;
+            break;
+        case OpCode::NEGATE:
+            numbers_expected = true;
+            operand_count = 1;
+            break;
+        default:
+            break;
+    }
+    for (std::size_t i = 1; numbers_expected && i <= operand_count; i++) {
+        if (!stack_top[-static_cast<std::ptrdiff_t>(i)].is_number()) {
+            finish(nullptr);
+            return false;
+        }
+    }
+
+    m_offsets.push_back(offset);
+    return true;
+}
+
+void TraceRecorder::abort() {
+    m_function = nullptr;
+    m_offsets.clear();
+}
+
+void TraceRecorder::finish(std::shared_ptr<Trace> trace) {
+    Chunk& chunk = m_function->chunk();
+    if (trace != nullptr) {
+        chunk.patch_at(m_loop, std::to_underlying(OpCode::LOOP_TRACE));
+    }
+    m_tiering.trace_finished(m_function, m_header, trace != nullptr);
+    chunk.get_traces()[m_header] = std::move(trace);
+    abort();
+}
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef ppclox_trace_hpp
+#define ppclox_trace_hpp
+
+#include "common.hpp"
+#include "jit.hpp"
+#include "value.hpp"
+
+class ObjFunction;
+class GlobalSlot;
+class Tiering;
+
+#ifdef JIT
+
+/** Where a trace hands control back to the interpreter */
+class TraceExit {
+public:
+    /** Offset of the instruction in the chunk to resume at */
+    std::size_t m_offset{};
+    /** Number of values the frame has on the value stack at that point */
+    std::size_t m_depth{};
+};
+
+/**
+ * Machine code for one path through a hot loop of the stack interpreter's bytecode,
+ * as it was recorded by TraceRecorder. The code is straight line, specialized for the
+ * types seen while recording: every operand of arithmetic is guarded to be a number,
+ * and every branch to go the way it went. A failed guard leaves through a side exit,
+ * which resumes the interpreter at that instruction. Reaching the loop's back edge
+ * jumps straight back to the start of the trace.
+ * Traces use the frame's window of the value stack exactly as the interpreter does,
+ * so there is no state to reconstruct on exit beyond the instruction and stack depth.
+ */
+class Trace {
+public:
+    /** Signature of the generated code. Returns the index of the exit it left by. */
+    using Entry = std::size_t (*)(Value* slots, GlobalSlot* globals);
+
+    Trace(const std::vector<std::uint8_t>& bytes, std::vector<TraceExit> exits, std::size_t max_depth) :
+        m_code(bytes), m_exits(std::move(exits)), m_max_depth(max_depth) {}
+
+    /** False if executable memory couldn't be mapped */
+    bool is_valid() const { return m_code.is_valid(); }
+    /** Stack depth the trace needs room for, relative to the frame */
+    std::size_t max_depth() const { return m_max_depth; }
+    /** Run the trace on the frame whose values start at slots, until it exits */
+    const TraceExit& run(Value* slots, GlobalSlot* globals) const {
+        return m_exits[reinterpret_cast<Entry>(const_cast<void*>(m_code.address()))(slots, globals)];
+    }
+private:
+    NativeCode m_code;
+    std::vector<TraceExit> m_exits{};
+    std::size_t m_max_depth{};
+};
+
+/**
+ * Records the instructions the stack interpreter executes for one iteration of a hot
+ * loop (see Tiering), starting at the loop's first instruction and ending when its LOOP jumps back
+ * there. The trace is then compiled, and the LOOP rewritten into LOOP_TRACE so that
+ * future iterations run it. Inner loops are unrolled into the trace as they ran.
+ * Loops that do anything a trace can't (calls, property access, allocation, or run an
+ * inner loop's own trace) are given up on, and remembered as such.
+ */
+class TraceRecorder {
+public:
+    /** Longest trace we'll record, in dispatched instructions */
+    static constexpr std::size_t k_max_trace_length = 500;
+
+    explicit TraceRecorder(Tiering& tiering) : m_tiering(tiering) {}
+
+    bool is_recording() const { return m_function != nullptr; }
+    /**
+     * Begin recording the loop of the given function starting at header, whose LOOP
+     * instruction is at loop. depth is the number of values the frame has on the stack.
+     */
+    void start(ObjFunction* function, std::size_t header, std::size_t loop, std::size_t depth);
+    /**
+     * Record that the instruction at offset is about to execute, with stack_top just past
+     * the top value of the stack. Returns false once recording is over, either because the
+     * loop closed and its trace has been compiled, or because it can't be traced.
+     */
+    bool record(std::size_t offset, const Value* stack_top);
+    /** Stop recording without compiling or blacklisting anything */
+    void abort();
+private:
+    /** Told the outcome of every recording */
+    Tiering& m_tiering;
+    ObjFunction* m_function{};
+    std::size_t m_header{};
+    std::size_t m_loop{};
+    std::size_t m_depth{};
+    /** Offset of each instruction dispatched so far, in order */
+    std::vector<std::size_t> m_offsets{};
+
+    /** Store the result of recording (nullptr if it failed) and stop */
+    void finish(std::shared_ptr<Trace> trace);
+};
+
+#endif
+
+#endif
@@ -1,27 +1,19 @@
 #include "value.hpp"
 #include "object.hpp"
 
-Value::Value(bool val) {
-    m_type = ValueType::BOOL;
-    m_as.boolean = val;
-}
-
-Value::Value() {
-    m_type = ValueType::NIL;
-}
-
-Value::Value(double val) {
-    m_type = ValueType::NUMBER;
-    m_as.number = val;
-}
-
-Value::Value(Obj* obj) {
-    m_type = ValueType::OBJ;
-    m_as.obj = obj;
+ValueType Value::type() const {
+#ifdef NAN_BOXING
+    if (is_number()) return ValueType::NUMBER;
+    if (is_nil()) return ValueType::NIL;
+    if (is_bool()) return ValueType::BOOL;
+    return ValueType::OBJ;
+#else
+    return m_type;
+#endif
 }
 
 void Value::print() const {
-    switch (m_type) {
+    switch (type()) {
         case ValueType::BOOL:
             printf(as_bool() ? "true" : "false");
             break;
@@ -41,6 +33,12 @@ void Value::print() const {
 }
 
 bool Value::operator==(const Value& rhs) const {
+#ifdef NAN_BOXING
+    // Numbers must still be compared as doubles so that NaN != NaN
+    // (and 0 == -0). Every other value has exactly one bit pattern.
+    if (is_number() && rhs.is_number()) return as_number() == rhs.as_number();
+    return m_bits == rhs.m_bits;
+#else
     if (m_type != rhs.m_type) return false;
     switch (m_type) {
         case ValueType::BOOL: return as_bool() == rhs.as_bool();
@@ -56,10 +54,11 @@ bool Value::operator==(const Value& rhs) const {
 // TODO: Throw an exception instead?
             return false;
     }
+#endif
 }
 
 void Value::mark_obj_gc_gray() {
     if (is_obj()) {
         Obj::mark_gc_gray(as_obj());
     }
-}
\ No newline at end of file
+}
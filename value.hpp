@@ -1,6 +1,8 @@
 #ifndef ppclox_value_hpp
 #define ppclox_value_hpp
 
+#include <bit>
+
 #include "common.hpp"
 #include "object.hpp"
 #include "object_string.hpp"
@@ -23,17 +25,37 @@ enum class ValueType {
 
 class Value {
 public:
-    ValueType type() { return m_type; }
+    ValueType type() const;
 
-    Value(bool val);
+#ifdef NAN_BOXING
+    Value(bool val) : m_bits(val ? k_true_bits : k_false_bits) {}
+    /** Construct NIL Value */
+    Value() : m_bits(k_nil_bits) {}
+    Value(double val) : m_bits(std::bit_cast<std::uint64_t>(val)) {}
+    Value(Obj* obj) : m_bits(k_sign_bit | k_qnan | static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(obj))) {}
+#else
+    Value(bool val) : m_type(ValueType::BOOL) { m_as.boolean = val; }
     /** Construct NIL Value */
-    Value();
-    Value(double val);
-    Value(Obj* obj);
+    Value() : m_type(ValueType::NIL) {}
+    Value(double val) : m_type(ValueType::NUMBER) { m_as.number = val; }
+    Value(Obj* obj) : m_type(ValueType::OBJ) { m_as.obj = obj; }
+#endif
 
     void print() const;
     bool operator==(const Value& rhs) const;
 
+#ifdef NAN_BOXING
+    bool as_bool() const { return m_bits == k_true_bits; }
+    double as_number() const { return std::bit_cast<double>(m_bits); }
+    Obj* as_obj() const { return reinterpret_cast<Obj*>(static_cast<std::uintptr_t>(m_bits & ~(k_sign_bit | k_qnan))); }
+
+    // true and false differ only in the lowest bit, so OR-ing it in maps both onto true.
+    bool is_bool() const { return (m_bits | 1) == k_true_bits; }
+    bool is_nil() const { return m_bits == k_nil_bits; }
+    // Any double that isn't one of our quiet NaNs is a number.
+    bool is_number() const { return (m_bits & k_qnan) != k_qnan; }
+    bool is_obj() const { return (m_bits & (k_sign_bit | k_qnan)) == (k_sign_bit | k_qnan); }
+#else
     bool as_bool() const { return m_as.boolean; }
     double as_number() const { return m_as.number; }
     Obj* as_obj() const { return m_as.obj; }
@@ -42,6 +64,7 @@ public:
     bool is_nil() const { return m_type == ValueType::NIL; }
     bool is_number() const { return m_type == ValueType::NUMBER; }
     bool is_obj() const { return m_type == ValueType::OBJ; }
+#endif
 
     ObjType obj_type() const { return as_obj()->type(); }
     bool is_obj_type(ObjType type) const { return is_obj() && as_obj()->type() == type; }
@@ -67,6 +90,32 @@ public:
 
     // If type is Obj, mark the value as gray for GC
     void mark_obj_gc_gray();
+    /** Object the value references, or nullptr */
+    Obj* obj_or_null() const { return is_obj() ? as_obj() : nullptr; }
+#ifdef NAN_BOXING
+    /** The raw boxed bits, for code that tests values directly (see jit.cpp) */
+    std::uint64_t bits() const { return m_bits; }
+
+    /**
+     * A double whose exponent bits are all set, along with the "quiet" bit and one more
+     * bit to stay clear of the Intel "QNaN Floating-Point Indefinite" value, is a NaN
+     * that real arithmetic never produces. That leaves the low 50 bits (plus the sign
+     * bit) free to encode non-number values:
+     *   - nil, false and true are small tags in the lowest bits.
+     *   - Objects set the sign bit and store the pointer in the low bits. This relies
+     *     on pointers fitting in 48 bits, which holds on current 64-bit platforms.
+     */
+    static constexpr std::uint64_t k_sign_bit = 0x8000000000000000;
+    static constexpr std::uint64_t k_qnan = 0x7ffc000000000000;
+    static constexpr std::uint64_t k_tag_nil = 1;
+    static constexpr std::uint64_t k_tag_false = 2;
+    static constexpr std::uint64_t k_tag_true = 3;
+    static constexpr std::uint64_t k_nil_bits = k_qnan | k_tag_nil;
+    static constexpr std::uint64_t k_false_bits = k_qnan | k_tag_false;
+    static constexpr std::uint64_t k_true_bits = k_qnan | k_tag_true;
+private:
+    std::uint64_t m_bits{};
+#else
 private:
     ValueType m_type{ValueType::NIL};
     union {
@@ -74,6 +123,11 @@ private:
         double number;
         Obj* obj;
     } m_as{};
+#endif
 };
 
+inline void Obj::write_barrier(Obj* container, Value value) {
+    write_barrier(container, value.obj_or_null());
+}
+
 #endif
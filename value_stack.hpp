@@ -0,0 +1,71 @@
+#ifndef ppclox_value_stack_hpp
+#define ppclox_value_stack_hpp
+
+#include <algorithm>
+#include <memory>
+
+#include "common.hpp"
+#include "value.hpp"
+
+/**
+ * The VM's value stack. It has the parts of std::vector's interface the VM uses, except
+ * that push_back() never checks for room, so pushing is just a store and a pointer bump.
+ * Instead, room is made once per call: every function knows the deepest its frame's
+ * stack gets (see Chunk::max_stack_depth), and VM::call() reserves that much above the
+ * frame's base. Growing moves the values, so just as with a vector, nothing may keep a
+ * pointer into the stack across anything that may call.
+ */
+class ValueStack {
+public:
+    using iterator = Value*;
+
+    ValueStack() = default;
+    ValueStack(const ValueStack&) = delete;
+    ValueStack& operator=(const ValueStack&) = delete;
+
+    std::size_t size() const { return m_top - m_values.get(); }
+    std::size_t capacity() const { return m_capacity; }
+    bool empty() const { return m_top == m_values.get(); }
+
+    Value* data() { return m_values.get(); }
+    const Value* data() const { return m_values.get(); }
+    Value* begin() { return m_values.get(); }
+    Value* end() { return m_top; }
+    const Value* begin() const { return m_values.get(); }
+    const Value* end() const { return m_top; }
+    Value& operator[](std::size_t index) { return m_values[index]; }
+    const Value& operator[](std::size_t index) const { return m_values[index]; }
+    Value& back() { return m_top[-1]; }
+
+    /** Push without checking there is room, which must have been reserved */
+    void push_back(Value value) { *m_top++ = value; }
+    void pop_back() { m_top--; }
+
+    /** Make room for at least the given number of values, at least doubling the capacity if it grows */
+    void reserve(std::size_t capacity) {
+        if (capacity <= m_capacity) return;
+        capacity = std::max(capacity, 2 * m_capacity);
+        auto values = std::make_unique<Value[]>(capacity);
+        std::size_t size = this->size();
+        std::copy(m_values.get(), m_top, values.get());
+        m_values = std::move(values);
+        m_top = m_values.get() + size;
+        m_capacity = capacity;
+    }
+    /** Grow (with nils) or shrink to the given size, growing the capacity if need be */
+    void resize(std::size_t size) {
+        reserve(size);
+        Value* top = m_values.get() + size;
+        if (top > m_top) std::fill(m_top, top, Value());
+        m_top = top;
+    }
+    /** Remove the values in [first, last), moving any above them down */
+    void erase(Value* first, Value* last) { m_top = std::copy(last, m_top, first); }
+    void clear() { m_top = m_values.get(); }
+private:
+    std::unique_ptr<Value[]> m_values{};
+    Value* m_top{};
+    std::size_t m_capacity{};
+};
+
+#endif
@@ -1,6 +1,8 @@
+#include <algorithm>
 #include <memory>
 #include <cstdarg>
 #include <ctime>
+#include <optional>
 
 #include "common.hpp"
 #include "compiler.hpp"
@@ -34,21 +36,33 @@ VM::VM() {
     m_init_string = ObjString::copy_string(Compiler::k_init_string.data(), Compiler::k_init_string.length());
 }
 VM::~VM() {
+    m_tiering.report();
+#ifdef DEBUG_PROFILE_NGRAMS
+    m_profiler.report();
+#endif
 }
 
 InterpretResult VM::interpret(const char* source) {
     ObjFunction* function = Compiler::compile(source);
     if (function == nullptr) return InterpretResult::COMPILE_ERROR;
+    return run_script(function);
+}
 
+InterpretResult VM::run_script(ObjFunction* function) {
     // Set up our initial call frame.
     // We push the function so it doesn't get GC'd when we create the closure
     push(function);
     ObjClosure* closure = new ObjClosure(function);
     pop();
     push(closure);
-    call(closure, 0);
+    if (!call(closure, 0)) return InterpretResult::RUNTIME_ERROR;
+    // Compiled ahead of time, or with a low enough call threshold, the script has already run natively
+    if (m_call_stack.empty()) {
+        reset_stack();
+        return InterpretResult::OK;
+    }
 
-    return run();
+    return m_backend == Backend::REGISTER ? run_register() : run();
 }
 
 void VM::mark_gc_roots() {
@@ -57,10 +71,10 @@ void VM::mark_gc_roots() {
         value.mark_obj_gc_gray();
     }
 
-    // Mark keys and values in globals table
-    for (auto pair : m_globals) {
-        Obj::mark_gc_gray(pair.first.obj_string());
-        pair.second.mark_obj_gc_gray();
+    // Mark names and values in globals table
+    for (auto& global : m_globals) {
+        Obj::mark_gc_gray(global.m_name);
+        global.m_value.mark_obj_gc_gray();
     }
 
     // Mark closures in active call frames
@@ -77,6 +91,18 @@ void VM::mark_gc_roots() {
     Obj::mark_gc_gray(m_init_string);
 }
 
+std::size_t VM::global_slot(ObjString* name) {
+    auto it = m_global_slots.find(ObjStringRef(name));
+    if (it != m_global_slots.end()) {
+        return it->second;
+    }
+
+    std::size_t slot = m_globals.size();
+    m_globals.push_back(GlobalSlot{ .m_name = name });
+    m_global_slots[ObjStringRef(name)] = slot;
+    return slot;
+}
+
 void VM::reset_stack() {
     m_stack.clear(); 
     m_stack.reserve(VALUE_STACK_INIT_CAPACITY);
@@ -90,9 +116,13 @@ void VM::runtime_error(const char* format, ...) {
     fputs("\n", stderr);
 
     for (auto frame_it = m_call_stack.rbegin(); frame_it != m_call_stack.rend(); ++frame_it) {
-        // Get the instruction that was in the process of being executed
-        size_t instruction = frame_it->current_instruction_offset();
-        std::size_t line = frame_it->m_closure->function()->chunk().get_lines().at(instruction);
+        // Get the line of the instruction that was in the process of being executed
+        std::size_t line = frame_it->current_line();
+        // Code inlined from another function still shows up as that function's frame
+        if (const InlinedCall* inlined = frame_it->current_inlined_call()) {
+            fprintf(stderr, "[line %zd] in %s()\n", line, inlined->m_function->name());
+            line = inlined->m_line;
+        }
         fprintf(stderr, "[line %zd] in %s()\n", line, frame_it->m_closure->function()->name());
     }
     
@@ -107,11 +137,12 @@ void VM::define_native(const char* name, NativeFn function) {
     ObjNative* native = new ObjNative(function);
     push(native);
 
-    auto it = m_globals.find(ObjStringRef(name_obj));
-    if (it != m_globals.end()) {
+    GlobalSlot& global = m_globals[global_slot(name_obj)];
+    if (global.m_defined) {
         throw std::runtime_error("Native function with duplicate name.");
     }
-    m_globals[ObjStringRef(name_obj)] = Value(native);
+    global.m_value = Value(native);
+    global.m_defined = true;
 
     // Clean up stack now that the fcn is safely inserted
     pop();
@@ -139,7 +170,7 @@ Value VM::peek(std::size_t distance) {
     return m_stack[m_stack.size() - 1 - distance];
 }
 
-bool VM::call_value(Value callee, std::size_t arg_count) {
+bool VM::call_value(Value callee, std::size_t arg_count, bool tail) {
     if (callee.is_obj()) {
         switch (callee.obj_type()) {
             case ObjType::BOUND_METHOD: {
@@ -149,7 +180,7 @@ bool VM::call_value(Value callee, std::size_t arg_count) {
                 // slot zero in the new CallFrame will be. This line of code inserts the 
                 // receiver into that slot.
                 patch(bound->receiver(), arg_count);
-                return call(bound->method(), arg_count);
+                return call(bound->method(), arg_count, tail);
             }
             case ObjType::CLASS: {
                 ObjClass* klass = callee.as_class();
@@ -167,7 +198,8 @@ bool VM::call_value(Value callee, std::size_t arg_count) {
                 // Check for an initializer
                 auto maybe_initializer = klass->get_method(m_init_string);
                 if (maybe_initializer.has_value()) {
-                    return call(maybe_initializer.value().as_closure(), arg_count);
+                    // The initializer returns the instance, so it can take over the frame too
+                    return call(maybe_initializer.value().as_closure(), arg_count, tail);
                 } else if (arg_count != 0) {
                     // Passing arguments when there isn't an initializer
                     // doesn't make sense and is an error.
@@ -177,7 +209,7 @@ bool VM::call_value(Value callee, std::size_t arg_count) {
                 return true;
             }
             case ObjType::CLOSURE:
-                return call(callee.as_closure(), arg_count);
+                return call(callee.as_closure(), arg_count, tail);
             case ObjType::NATIVE: {
                 NativeFn native = callee.as_native()->function();
                 Value result = native(arg_count, m_stack.end() - arg_count, m_stack.end());
@@ -196,16 +228,77 @@ bool VM::call_value(Value callee, std::size_t arg_count) {
     return false;
 }
 
-bool VM::invoke_from_class(ObjClass* klass, ObjString* name, std::uint8_t arg_count) {
-    auto maybe_method = klass->get_method(name);
-    if (!maybe_method.has_value()) {
+const InlineCacheEntry* VM::resolve_property(Shape* shape, ObjString* name, InlineCache& cache) {
+    const InlineCacheEntry* entry = cache.find(shape);
+    if (entry != nullptr) {
+        return entry;
+    }
+
+    // Cache miss, so do the full lookup and remember the result for next time.
+    // Fields shadow methods, so check those first.
+    // NOTE! Failed lookups are not cached since they end in a runtime error anyway.
+    auto maybe_slot = shape->find_slot(name);
+    if (maybe_slot.has_value()) {
+        return cache.insert(InlineCacheEntry {
+            .m_shape = shape,
+            .m_kind = InlineCacheKind::FIELD,
+            .m_slot = maybe_slot.value()
+        });
+    }
+    auto maybe_method = shape->get_class()->get_method(name);
+    if (maybe_method.has_value()) {
+        return cache.insert(InlineCacheEntry {
+            .m_shape = shape,
+            .m_kind = InlineCacheKind::METHOD,
+            .m_method = maybe_method.value().as_closure()
+        });
+    }
+    return nullptr;
+}
+
+void VM::set_property(ObjInstance* instance, ObjString* name, Value value, InlineCache& cache) {
+    Shape* shape = instance->shape();
+    const InlineCacheEntry* entry = cache.find(shape);
+    if (entry == nullptr) {
+        // Cache miss. Either we are overwriting an existing field,
+        // or adding a new one which moves the instance to a new shape.
+        auto maybe_slot = shape->find_slot(name);
+        if (maybe_slot.has_value()) {
+            entry = cache.insert(InlineCacheEntry {
+                .m_shape = shape,
+                .m_kind = InlineCacheKind::FIELD,
+                .m_slot = maybe_slot.value()
+            });
+        }
+        else {
+            entry = cache.insert(InlineCacheEntry {
+                .m_shape = shape,
+                .m_kind = InlineCacheKind::TRANSITION,
+                .m_slot = shape->field_count(),
+                .m_transition = shape->add_field(name)
+            });
+        }
+    }
+
+    if (entry->m_kind == InlineCacheKind::FIELD) {
+        instance->set_field_at(entry->m_slot, value);
+    }
+    else {
+        instance->add_field(entry->m_transition, value);
+    }
+}
+
+bool VM::invoke_from_class(ObjClass* klass, ObjString* name, std::uint8_t arg_count, InlineCache& cache) {
+    // A class's root shape has no fields, so this only ever finds methods
+    const InlineCacheEntry* entry = resolve_property(klass->root_shape(), name, cache);
+    if (entry == nullptr) {
         runtime_error("undefined property '%s'.", name->chars());
         return false;
     }
-    return call(maybe_method.value().as_closure(), arg_count);
+    return call(entry->m_method, arg_count);
 }
 
-bool VM::invoke(ObjString* name, std::uint8_t arg_count) {
+bool VM::invoke(ObjString* name, std::uint8_t arg_count, InlineCache& cache, bool tail) {
     Value receiver = peek(arg_count);
 
     if (!receiver.is_instance()) {
@@ -214,24 +307,53 @@ bool VM::invoke(ObjString* name, std::uint8_t arg_count) {
     }
 
     ObjInstance* instance = receiver.as_instance();
+    const InlineCacheEntry* entry = resolve_property(instance->shape(), name, cache);
+    if (entry == nullptr) {
+        runtime_error("undefined property '%s'.", name->chars());
+        return false;
+    }
 
     // Fields shadow methods, so we need to call that if its there.
     // We need to store the field in place of the receiver under the argument list
-    auto maybe_field = instance->get_field(name);
-    if (maybe_field.has_value()) {
-        patch(maybe_field.value(), arg_count);
-        return call_value(maybe_field.value(), arg_count);
+    if (entry->m_kind == InlineCacheKind::FIELD) {
+        Value field = instance->field_at(entry->m_slot);
+        patch(field, arg_count);
+        return call_value(field, arg_count, tail);
     }
 
-    return invoke_from_class(instance->get_class(), name, arg_count);
+    return call(entry->m_method, arg_count, tail);
+}
+
+bool VM::is_inlined_closure(Value callee, ObjFunction* function) {
+    return callee.is_closure() && callee.as_closure()->function() == function;
 }
 
-bool VM::call(ObjClosure* closure, std::size_t arg_count) {
+bool VM::is_inlined_method(Value receiver, ObjString* name, InlineCache& cache, ObjFunction* function) {
+    if (!receiver.is_instance()) return false;
+    const InlineCacheEntry* entry = resolve_property(receiver.as_instance()->shape(), name, cache);
+    return entry != nullptr && entry->m_kind == InlineCacheKind::METHOD && entry->m_method->function() == function;
+}
+
+bool VM::call(ObjClosure* closure, std::size_t arg_count, bool tail) {
     if (arg_count != closure->function()->m_arity) {
         runtime_error("Expected %zd arguments but got %zd.", closure->function()->m_arity, arg_count);
         return false;
     }
 
+    if (tail) {
+        // The current frame only has the callee's result left to return, so its locals
+        // can go. Move the callee and arguments down to where its own slot zero is, and
+        // reuse the frame for the callee, so tail recursion runs in constant space.
+        CallFrame& frame = current_frame();
+        std::size_t slots = frame.m_value_stack_base_index;
+        close_upvalues(slots);
+        std::copy(m_stack.end() - arg_count - 1, m_stack.end(), m_stack.begin() + slots);
+        m_stack.resize(slots + arg_count + 1);
+        m_stack.reserve(slots + closure->function()->m_max_stack_depth);
+        frame = CallFrame(closure, slots);
+        return true;
+    }
+
     if (m_call_stack.size() >= k_max_call_frames) {
         runtime_error("Call stack overflow.");
         return false;
@@ -241,10 +363,131 @@ bool VM::call(ObjClosure* closure, std::size_t arg_count) {
     // The base index for the new frame includes all the arguments, plus
     // the function Value that was being called (which is pushed before all arguments).
     std::size_t value_stack_base_index = m_stack.size() - arg_count - 1;
+    // The only check for room on the stack that the frame's code needs
+    m_stack.reserve(value_stack_base_index + closure->function()->m_max_stack_depth);
     m_call_stack.emplace_back(closure, value_stack_base_index);
+    if (has_native_entry(closure->function())) return run_native_frames();
+    // Counted against the caller, whose loops aren't worth OSR if they keep calling into the interpreter
+    if (m_call_stack.size() > 1) m_call_stack.end()[-2].m_interpreted_calls++;
     return true;
 }
 
+bool VM::run_native_frames() {
+    for (;;) {
+        std::size_t call_depth = m_call_stack.size();
+        ObjFunction* function = current_frame().m_closure->function();
+        if (function->m_aot_function != nullptr) {
+            if (!run_aot(function)) return false;
+        }
+#ifdef JIT
+        // Once a function is warm it runs as stencil code, and once hot as the JIT's code
+        else if (!(function->m_native_code != nullptr ? run_native(function) : run_stencils(function))) {
+            return false;
+        }
+#endif
+        // Unless it returned, the code tail called, and the callee starts in turn
+        if (m_call_stack.size() < call_depth) return true;
+        if (!has_native_entry(current_frame().m_closure->function())) return true;
+    }
+}
+
+Value* VM::native_execute(std::size_t offset, std::size_t depth, std::size_t max_depth) {
+    std::size_t call_depth = m_call_stack.size();
+    CallFrame& frame = current_frame();
+    frame.m_ip = frame.m_closure->function()->chunk().get_code().data() + offset;
+    m_stack.resize(frame.m_value_stack_base_index + depth);
+
+    if (run(call_depth - 1, true) != InterpretResult::OK) return nullptr;
+    return native_resume(call_depth, max_depth);
+}
+
+Value* VM::native_call(std::size_t offset, std::size_t depth, std::size_t max_depth) {
+    std::size_t call_depth = m_call_stack.size();
+    CallFrame& frame = current_frame();
+    const std::uint8_t* code = frame.m_closure->function()->chunk().get_code().data();
+    std::uint8_t arg_count = code[offset + 1];
+    // Leave the frame just as CALL does while the callee runs
+    frame.m_ip = code + offset + 2;
+    m_stack.resize(frame.m_value_stack_base_index + depth);
+
+    if (!call_value(peek(arg_count), arg_count)) return nullptr;
+    return native_resume(call_depth, max_depth);
+}
+
+Value* VM::native_invoke(std::size_t offset, std::size_t depth, std::size_t max_depth) {
+    std::size_t call_depth = m_call_stack.size();
+    CallFrame& frame = current_frame();
+    Chunk& chunk = frame.m_closure->function()->chunk();
+    const std::uint8_t* code = chunk.get_code().data();
+    ObjString* method = chunk.get_constants()[code[offset + 1]].as_string();
+    std::uint8_t arg_count = code[offset + 2];
+    InlineCache& cache = chunk.get_inline_caches()[(code[offset + 3] << 8) | code[offset + 4]];
+    frame.m_ip = code + offset + 5;
+    m_stack.resize(frame.m_value_stack_base_index + depth);
+
+    if (!invoke(method, arg_count, cache)) return nullptr;
+    return native_resume(call_depth, max_depth);
+}
+
+std::size_t VM::native_tail_call(std::size_t offset, std::size_t depth) {
+    CallFrame& frame = current_frame();
+    Chunk& chunk = frame.m_closure->function()->chunk();
+    const std::uint8_t* code = chunk.get_code().data();
+    std::size_t slots = frame.m_value_stack_base_index;
+    frame.m_ip = code + offset + chunk.opcode_length(code[offset], offset);
+    m_stack.resize(slots + depth);
+
+    bool called{};
+    if (code[offset] == std::to_underlying(OpCode::TAIL_CALL)) {
+        std::uint8_t arg_count = code[offset + 1];
+        called = call_value(peek(arg_count), arg_count, true);
+    }
+    else {
+        ObjString* method = chunk.get_constants()[code[offset + 1]].as_string();
+        InlineCache& cache = chunk.get_inline_caches()[(code[offset + 3] << 8) | code[offset + 4]];
+        called = invoke(method, code[offset + 2], cache, true);
+    }
+    if (!called) return 0;
+    // Otherwise it was a native function, or a class without an initializer, which pushed no frame
+    if (frame.is_fresh()) return k_tail_called;
+    return m_stack.size() - slots;
+}
+
+bool VM::native_guard(std::size_t offset, std::size_t depth) {
+    Chunk& chunk = current_frame().m_closure->function()->chunk();
+    const std::uint8_t* code = chunk.get_code().data();
+    const Value* top = m_stack.data() + current_frame().m_value_stack_base_index + depth;
+    std::size_t next = offset + chunk.opcode_length(code[offset], offset);
+    ObjFunction* function = chunk.get_constants()[code[next - 3]].as_function();
+    if (code[offset] == std::to_underlying(OpCode::GUARD_CALL)) {
+        return is_inlined_closure(top[-1 - code[offset + 1]], function);
+    }
+    ObjString* name = chunk.get_constants()[code[offset + 1]].as_string();
+    InlineCache& cache = chunk.get_inline_caches()[(code[offset + 3] << 8) | code[offset + 4]];
+    return is_inlined_method(top[-1 - code[offset + 2]], name, cache, function);
+}
+
+Value* VM::native_resume(std::size_t call_depth, std::size_t max_depth) {
+    if (m_call_stack.size() > call_depth) {
+        // The instruction called something that isn't compiled, so run it until it returns
+        InterpretResult result = (m_backend == Backend::REGISTER) ? run_register(call_depth) : run(call_depth);
+        if (result != InterpretResult::OK) return nullptr;
+    }
+    std::size_t slots = current_frame().m_value_stack_base_index;
+    m_stack.resize(slots + max_depth);
+    return m_stack.data() + slots;
+}
+
+void VM::native_return(std::size_t depth) {
+    // If this is the top level script, the result is left for whoever called it to clean up
+    std::size_t slots = current_frame().m_value_stack_base_index;
+    Value result = m_stack[slots + depth - 1];
+    close_upvalues(slots);
+    m_stack.erase(m_stack.begin() + slots, m_stack.end());
+    m_call_stack.pop_back();
+    push(result);
+}
+
 ObjUpvalue* VM::capture_upvalue(std::size_t stack_index) {
     // If an open upvalue already exists for this stack index,
     // just return that
@@ -286,29 +529,110 @@ void VM::define_method(ObjString* name) {
     pop();
 }
 
-bool VM::bind_method(ObjClass* klass, ObjString* name) {
-    auto maybe_method = klass->get_method(name);
-    if (!maybe_method.has_value()) {
+bool VM::bind_method(ObjClass* klass, ObjString* name, InlineCache& cache) {
+    // A class's root shape has no fields, so this only ever finds methods
+    const InlineCacheEntry* entry = resolve_property(klass->root_shape(), name, cache);
+    if (entry == nullptr) {
         runtime_error("Undefined property '%s'.", name->chars());
         return false;
     }
+    bind_method(entry->m_method);
+    return true;
+}
 
+void VM::bind_method(ObjClosure* method) {
     // Instance receiving the method is at the top of the stack.
     // Casting directly is safe since we trust the code generated
     // by the compiler. That said, it might not be a bad idea to
     // guard against this here anyway.
     ObjInstance* instance_receiver = peek(0).as_instance();
-    ObjClosure* method_closure = maybe_method.value().as_closure();
-    ObjBoundMethod* bound = new ObjBoundMethod(instance_receiver, method_closure);
+    ObjBoundMethod* bound = new ObjBoundMethod(instance_receiver, method);
 
     // Pop the instance and push the bound method
     pop();
     push(bound);
-    return true;
 }
 
-InterpretResult VM::run() {
-    for (;;) {
+InterpretResult VM::run(std::size_t exit_depth, bool single_step) {
+    // The hot interpreter state lives in locals so the compiler can keep it in
+    // registers, instead of reloading it through m_call_stack on every read.
+    // The instruction pointer is only written back to the frame (sync_ip) before
+    // anything that may look at it: calls, returns and runtime errors. Whenever
+    // the current frame changes we reload everything (load_frame).
+    // NOTE! We keep the frame's base *index* rather than a pointer into m_stack
+    //       since pushing onto the value stack may reallocate it.
+    CallFrame* frame{};
+    const std::uint8_t* ip{};
+    const Value* constants{};
+    InlineCache* inline_caches{};
+    std::size_t slots{};
+
+    auto load_frame = [&]() {
+        frame = &current_frame();
+        ip = frame->m_ip;
+        Chunk& chunk = frame->m_closure->function()->chunk();
+        constants = chunk.get_constants().data();
+        inline_caches = chunk.get_inline_caches().data();
+        slots = frame->m_value_stack_base_index;
+    };
+    auto sync_ip = [&]() { frame->m_ip = ip; };
+
+    /** Return the current byte pointed to, and increment the IP */
+    auto read_byte = [&]() { return *ip++; };
+    /** Return the short pointed to, and increment the IP to after it */
+    auto read_short = [&]() {
+        ip += 2;
+        // Read the HO byte, followed by the LO byte
+        std::uint16_t ho_byte = ip[-2];
+        std::uint16_t lo_byte = ip[-1];
+        return static_cast<std::uint16_t>((ho_byte << 8) | lo_byte);
+    };
+    /** 
+     * Read/increment the current byte and assume it is an index into the chunk's 
+     * constants array, returning the constant at that index. 
+     * NOTE! We do not do any bounds checking here to ensure fast execution, so it's 
+     * important that the compiled code produce correct, in-bound indexes.
+     */
+    auto read_constant = [&]() { return constants[read_byte()]; };
+    auto read_string = [&]() { return read_constant().as_string(); };
+    /** Read the 2 byte index of the instruction's inline cache, returning the cache itself */
+    auto read_inline_cache = [&]() -> InlineCache& { return inline_caches[read_short()]; };
+
+    /** 
+     * Overwrite the opcode of the instruction currently executing, whose operand_bytes
+     * of operands have already been read. This is how instructions quicken themselves
+     * into specialized forms once they have seen what their operands are.
+     */
+    auto rewrite_instruction = [&](OpCode op, std::size_t operand_bytes) {
+        Chunk& chunk = frame->m_closure->function()->chunk();
+        chunk.patch_at(ip - chunk.get_code().data() - 1 - operand_bytes, std::to_underlying(op));
+    };
+    /** 
+     * Rewrite the current instruction and rewind so it executes again in the new form.
+     * Used to revert quickened instructions whose guard failed back to their generic form.
+     */
+    auto reexecute_as = [&](OpCode op, std::size_t operand_bytes) {
+        rewrite_instruction(op, operand_bytes);
+        ip -= 1 + operand_bytes;
+    };
+
+    /** Step over the opcode of a component instruction inside a superinstruction */
+    auto skip_opcode = [&]() { ip++; };
+
+    auto verify_binary_op_types = [&]() {
+        if (!peek(0).is_number() || !peek(1).is_number()) {
+            sync_ip();
+            runtime_error("Operands must be numbers.");
+            return false;
+        }
+        return true;
+    };
+
+    auto trace_instruction = [&]() {
+#ifdef DEBUG_PROFILE_NGRAMS
+        const Chunk& chunk = frame->m_closure->function()->chunk();
+        m_profiler.record(chunk, ip - chunk.get_code().data());
+#endif
 #ifdef DEBUG_TRACE_EXECUTION
         for (auto value : m_stack) {
             printf("[ ");
@@ -316,162 +640,373 @@ InterpretResult VM::run() {
             printf(" ]");
         }
         printf("\n");
-        current_frame().disassemble_instruction();
+        sync_ip();
+        frame->disassemble_instruction();
+#endif
+    };
+
+    /**
+     * Once a TAIL_CALL or TAIL_INVOKE made its call from a frame that had call_depth frames,
+     * start running whatever function took the frame over as call() would. If that ran
+     * it to completion in native code, the result is returned if run() is done too.
+     */
+    auto finish_tail_call = [&](std::size_t call_depth) -> std::optional<InterpretResult> {
+        if (current_frame().is_fresh() && !enter_frame()) return InterpretResult::RUNTIME_ERROR;
+        if (m_call_stack.size() < call_depth && m_call_stack.size() == exit_depth) return InterpretResult::OK;
+        load_frame();
+        return std::nullopt;
+    };
+
+#ifdef JIT
+    // Anything still recording was cut short by a runtime error
+    m_tiering.recorder().abort();
+
+    /**
+     * Do what Tiering decided at a back edge to the loop header at the given offset (ip
+     * is already there, and the LOOP jumped back loop_offset bytes from its end). If that
+     * moved the frame into native code, it has run to completion there, and the result
+     * is returned if run() is done too.
+     */
+    auto take_back_edge = [&](Tiering::BackEdgeAction action, std::size_t header, std::uint16_t loop_offset) -> std::optional<InterpretResult> {
+        ObjFunction* function = frame->m_closure->function();
+        switch (action) {
+            case Tiering::BackEdgeAction::NONE:
+                break;
+            case Tiering::BackEdgeAction::RECORD_TRACE:
+                // The LOOP is 3 bytes long
+                m_tiering.recorder().start(function, header, header + loop_offset - 3, m_stack.size() - slots);
+                break;
+            case Tiering::BackEdgeAction::OSR: {
+                // The value stack at a loop header is exactly what the native code
+                // expects there (see RegisterTranslator), so the frame can move as is.
+                std::size_t index = function->register_code().loop_header_index(header);
+                if (index == SIZE_MAX) break;
+                m_tiering.osr_entered(function, header, frame->m_back_edge_count);
+                sync_ip();
+                std::size_t call_depth = m_call_stack.size();
+                if (!run_native(function, index)) return InterpretResult::RUNTIME_ERROR;
+                // If it made a tail call, the function it called starts running as after a call
+                if (m_call_stack.size() == call_depth && !enter_frame()) return InterpretResult::RUNTIME_ERROR;
+                // Otherwise the native code returned from the frame just as RETURN would
+                if (m_call_stack.empty()) {
+                    reset_stack();
+                    return InterpretResult::OK;
+                }
+                if (m_call_stack.size() == exit_depth) return InterpretResult::OK;
+                load_frame();
+                return std::nullopt;
+            }
+        }
+        return std::nullopt;
+    };
+    /** Pass the instruction at ip to the recorder. Returns false once recording is over. */
+    auto record_instruction = [&]() {
+        if (!m_tiering.recorder().is_recording()) return false;
+        const Chunk& chunk = frame->m_closure->function()->chunk();
+        return m_tiering.recorder().record(ip - chunk.get_code().data(), m_stack.data() + m_stack.size());
+    };
+#endif
+
+    load_frame();
+
+    // When single stepping, the instruction to execute and how many frames there were
+    const std::uint8_t* const step_ip = ip;
+    const std::size_t step_call_depth = m_call_stack.size();
+    /** The opcode to execute first when single stepping, which is never a superinstruction */
+    auto first_step_opcode = [](std::uint8_t op_code) {
+        const Superinstruction* super = Chunk::find_superinstruction(op_code);
+        return super != nullptr ? std::to_underlying(super->m_components[0]) : op_code;
+    };
+
+#ifdef COMPUTED_GOTO
+    // One entry per opcode, in OpCode order. Every handler ends by jumping
+    // straight to the handler of the next instruction, so each opcode gets
+    // its own (more predictable) indirect branch instead of sharing the
+    // single one at the top of a switch.
+    // NOTE! There is no "unknown opcode" check in this mode. We trust the
+    //       compiler to only emit valid opcodes.
+    static void* dispatch_table[] = {
+        &&op_CONSTANT,         // [OpCode::CONSTANT]
+        &&op_NIL,              // [OpCode::NIL]
+        &&op_TRUE,             // [OpCode::TRUE]
+        &&op_FALSE,            // [OpCode::FALSE]
+        &&op_POP,              // [OpCode::POP]
+        &&op_GET_LOCAL,        // [OpCode::GET_LOCAL]
+        &&op_SET_LOCAL,        // [OpCode::SET_LOCAL]
+        &&op_GET_GLOBAL,       // [OpCode::GET_GLOBAL]
+        &&op_DEFINE_GLOBAL,    // [OpCode::DEFINE_GLOBAL]
+        &&op_SET_GLOBAL,       // [OpCode::SET_GLOBAL]
+        &&op_GET_UPVALUE,      // [OpCode::GET_UPVALUE]
+        &&op_SET_UPVALUE,      // [OpCode::SET_UPVALUE]
+        &&op_GET_PROPERTY,     // [OpCode::GET_PROPERTY]
+        &&op_SET_PROPERTY,     // [OpCode::SET_PROPERTY]
+        &&op_GET_SUPER,        // [OpCode::GET_SUPER]
+        &&op_EQUAL,            // [OpCode::EQUAL]
+        &&op_GREATER,          // [OpCode::GREATER]
+        &&op_LESS,             // [OpCode::LESS]
+        &&op_ADD,              // [OpCode::ADD]
+        &&op_SUBTRACT,         // [OpCode::SUBTRACT]
+        &&op_MULTIPLY,         // [OpCode::MULTIPLY]
+        &&op_DIVIDE,           // [OpCode::DIVIDE]
+        &&op_NOT,              // [OpCode::NOT]
+        &&op_NEGATE,           // [OpCode::NEGATE]
+        &&op_PRINT,            // [OpCode::PRINT]
+        &&op_JUMP,             // [OpCode::JUMP]
+        &&op_JUMP_IF_FALSE,    // [OpCode::JUMP_IF_FALSE]
+        &&op_LOOP,             // [OpCode::LOOP]
+        &&op_CALL,             // [OpCode::CALL]
+        &&op_INVOKE,           // [OpCode::INVOKE]
+        &&op_SUPER_INVOKE,     // [OpCode::SUPER_INVOKE]
+        &&op_TAIL_CALL,        // [OpCode::TAIL_CALL]
+        &&op_TAIL_INVOKE,      // [OpCode::TAIL_INVOKE]
+        &&op_CLOSURE,          // [OpCode::CLOSURE]
+        &&op_CLOSE_UPVALUE,    // [OpCode::CLOSE_UPVALUE]
+        &&op_RETURN,           // [OpCode::RETURN]
+        &&op_CLASS,            // [OpCode::CLASS]
+        &&op_INHERIT,          // [OpCode::INHERIT]
+        &&op_METHOD,           // [OpCode::METHOD]
+        &&op_GET_GLOBAL_DEFINED, // [OpCode::GET_GLOBAL_DEFINED]
+        &&op_SET_GLOBAL_DEFINED, // [OpCode::SET_GLOBAL_DEFINED]
+        &&op_GET_FIELD,        // [OpCode::GET_FIELD]
+        &&op_SET_FIELD,        // [OpCode::SET_FIELD]
+        &&op_INVOKE_METHOD,    // [OpCode::INVOKE_METHOD]
+        &&op_GREATER_NUM,      // [OpCode::GREATER_NUM]
+        &&op_LESS_NUM,         // [OpCode::LESS_NUM]
+        &&op_ADD_NUM,          // [OpCode::ADD_NUM]
+        &&op_SUBTRACT_NUM,     // [OpCode::SUBTRACT_NUM]
+        &&op_MULTIPLY_NUM,     // [OpCode::MULTIPLY_NUM]
+        &&op_DIVIDE_NUM,       // [OpCode::DIVIDE_NUM]
+        &&op_LOOP_TRACE,       // [OpCode::LOOP_TRACE]
+        &&op_GUARD_CALL,       // [OpCode::GUARD_CALL]
+        &&op_GUARD_INVOKE,     // [OpCode::GUARD_INVOKE]
+        &&op_GET_UNBOUND,      // [OpCode::GET_UNBOUND]
+        &&op_CALL_UNBOUND,     // [OpCode::CALL_UNBOUND]
+        &&op_GET_LOCAL_GET_LOCAL, // [OpCode::GET_LOCAL_GET_LOCAL]
+        &&op_GET_LOCAL_CONSTANT, // [OpCode::GET_LOCAL_CONSTANT]
+        &&op_GET_LOCAL_GET_PROPERTY, // [OpCode::GET_LOCAL_GET_PROPERTY]
+        &&op_GET_LOCAL_CONSTANT_ADD, // [OpCode::GET_LOCAL_CONSTANT_ADD]
+        &&op_GET_LOCAL_CONSTANT_SUBTRACT, // [OpCode::GET_LOCAL_CONSTANT_SUBTRACT]
+        &&op_GET_LOCAL_CONSTANT_LESS_JUMP_IF_FALSE, // [OpCode::GET_LOCAL_CONSTANT_LESS_JUMP_IF_FALSE]
+        &&op_SET_LOCAL_POP,    // [OpCode::SET_LOCAL_POP]
+    };
+    static_assert(std::size(dispatch_table) == k_opcode_count, "Dispatch table must cover every OpCode.");
+
+#ifdef JIT
+    // While a loop is being recorded, every opcode dispatches through here first
+    static void* record_table[k_opcode_count]{};
+    if (record_table[0] == nullptr) std::fill(std::begin(record_table), std::end(record_table), &&record);
+#endif
+    // While single stepping, every opcode after the first dispatches through here instead
+    static void* step_table[k_opcode_count]{};
+    if (step_table[0] == nullptr) std::fill(std::begin(step_table), std::end(step_table), &&step);
+    void* const* dispatch = dispatch_table;
+
+#define VM_CASE(op) op_##op
+#define VM_NEXT() do { trace_instruction(); goto *dispatch[read_byte()]; } while (false)
+
+    if (single_step) {
+        dispatch = step_table;
+        trace_instruction();
+        goto *dispatch_table[first_step_opcode(read_byte())];
+    }
+    VM_NEXT();
+#ifdef JIT
+record:
+    ip--;
+    if (!record_instruction()) dispatch = dispatch_table;
+    goto *dispatch_table[read_byte()];
 #endif
+step:
+    ip--;
+    // Back at the same instruction means it rewrote itself to execute again in another form
+    if (m_call_stack.size() == step_call_depth && ip == step_ip) goto *dispatch_table[read_byte()];
+    sync_ip();
+    return InterpretResult::OK;
+#else
+#define VM_CASE(op) case std::to_underlying(OpCode::op)
+#define VM_NEXT() break
+
+#ifdef JIT
+    bool recording = false;
+#endif
+
+    for (;;) {
+        trace_instruction();
+#ifdef JIT
+        if (recording) recording = record_instruction();
+#endif
+        if (single_step && !(m_call_stack.size() == step_call_depth && ip == step_ip)) {
+            sync_ip();
+            return InterpretResult::OK;
+        }
         uint8_t instruction = read_byte();
+        if (single_step) instruction = first_step_opcode(instruction);
 
         switch (instruction) {
-            case std::to_underlying(OpCode::CONSTANT): {
+#endif
+            VM_CASE(CONSTANT): {
                 Value constant = read_constant();
                 push(constant);
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::NIL): push(Value()); break;
-            case std::to_underlying(OpCode::TRUE): push(Value(true)); break;
-            case std::to_underlying(OpCode::FALSE): push(Value(false)); break;
-            case std::to_underlying(OpCode::POP): pop(); break;
-            case std::to_underlying(OpCode::GET_LOCAL): {
+            VM_CASE(NIL): push(Value()); VM_NEXT();
+            VM_CASE(TRUE): push(Value(true)); VM_NEXT();
+            VM_CASE(FALSE): push(Value(false)); VM_NEXT();
+            VM_CASE(POP): pop(); VM_NEXT();
+            VM_CASE(GET_LOCAL): {
                 std::uint8_t slot = read_byte();
                 // Push copy of the local to the top of the stack where
                 // other instructions will be able to find it.
                 // We're not a register based VM, so we must use the stack.
-                push(m_stack[current_frame().m_value_stack_base_index + slot]);
-                break;
+                push(m_stack[slots + slot]);
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::SET_LOCAL): {
+            VM_CASE(SET_LOCAL): {
                 std::uint8_t slot = read_byte();
                 // Store the top of the stack back into the local.
                 // Since an assignment is an expression, we leave the
                 // resulting value on the top of the stack.
-                m_stack[current_frame().m_value_stack_base_index + slot] = peek(0);
-                break;
+                m_stack[slots + slot] = peek(0);
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::GET_GLOBAL): {
-                ObjString* name = read_string();
-                auto it = m_globals.find(ObjStringRef(name));
-                if (it == m_globals.end()) {
-                    runtime_error("Undefined variable '%s'.", name->chars());
+            VM_CASE(GET_GLOBAL): {
+                GlobalSlot& global = m_globals[read_short()];
+                if (!global.m_defined) {
+                    sync_ip();
+                    runtime_error("Undefined variable '%s'.", global.m_name->chars());
                     return InterpretResult::RUNTIME_ERROR;
                 }
-                push(it->second);
-                break;
+                // Globals can never become undefined again, so skip the check from now on
+                rewrite_instruction(OpCode::GET_GLOBAL_DEFINED, 2);
+                push(global.m_value);
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::DEFINE_GLOBAL): {
-                ObjString* name = read_string();
-                // NOTE! Peek/pop was done in the C implementation
-                // out of worry that GC might be triggered
-                // by the hash table insert. That shouldn't
-                // be an issue here since resizing of the
-                // globals hash table is independent of our GC.
-                m_globals[ObjStringRef(name)] = pop();
-                break;
+            VM_CASE(DEFINE_GLOBAL): {
+                GlobalSlot& global = m_globals[read_short()];
+                global.m_value = pop();
+                global.m_defined = true;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::SET_GLOBAL): {
-                ObjString* name = read_string();
-                auto it = m_globals.find(ObjStringRef(name));
-                if (it == m_globals.end()) {
-                    runtime_error("Undefined variable '%s'.", name->chars());
+            VM_CASE(SET_GLOBAL): {
+                GlobalSlot& global = m_globals[read_short()];
+                if (!global.m_defined) {
+                    sync_ip();
+                    runtime_error("Undefined variable '%s'.", global.m_name->chars());
                     return InterpretResult::RUNTIME_ERROR;
                 }
-                it->second = peek(0);
-                break;
+                rewrite_instruction(OpCode::SET_GLOBAL_DEFINED, 2);
+                global.m_value = peek(0);
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::GET_UPVALUE): {
+            VM_CASE(GET_UPVALUE): {
                 std::uint8_t slot = read_byte();
-                ObjUpvalue* upvalue = current_frame().m_closure->upvalues()[slot];
+                ObjUpvalue* upvalue = frame->m_closure->upvalues()[slot];
                 if (upvalue->is_stack_index()) {
                     push(m_stack[upvalue->stack_index()]);
                 }
                 else {
                     push(upvalue->closed_value());
                 }
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::SET_UPVALUE): {
+            VM_CASE(SET_UPVALUE): {
                 std::uint8_t slot = read_byte();
-                ObjUpvalue* upvalue = current_frame().m_closure->upvalues()[slot];
+                ObjUpvalue* upvalue = frame->m_closure->upvalues()[slot];
                 if (upvalue->is_stack_index()) {
                     m_stack[upvalue->stack_index()] = peek(0);
                 }
                 else {
-                    upvalue->closed_value() = peek(0);
+                    upvalue->set_closed_value(peek(0));
                 }
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::GET_PROPERTY): {
+            VM_CASE(GET_PROPERTY): {
                 if (!peek(0).is_instance()) {
+                    sync_ip();
                     runtime_error("Only instances have properties.");
                     return InterpretResult::RUNTIME_ERROR;
                 }
 
                 ObjInstance* instance = peek(0).as_instance();
                 ObjString* name = read_string();
+                InlineCache& cache = read_inline_cache();
 
-                auto value_opt = instance->get_field(name);
-                if (value_opt.has_value()) {
-                    // Pop the instance and push the value
-                    pop();
-                    push(value_opt.value());
-                    break;
+                const InlineCacheEntry* entry = resolve_property(instance->shape(), name, cache);
+                if (entry == nullptr) {
+                    sync_ip();
+                    runtime_error("Undefined property '%s'.", name->chars());
+                    return InterpretResult::RUNTIME_ERROR;
                 }
 
-                if (!bind_method(instance->get_class(), name)) {
-                    return InterpretResult::RUNTIME_ERROR;
+                if (entry->m_kind == InlineCacheKind::FIELD) {
+                    if (cache.is_monomorphic()) {
+                        rewrite_instruction(OpCode::GET_FIELD, 3);
+                    }
+                    // Replace the instance with the value
+                    m_stack.back() = instance->field_at(entry->m_slot);
+                    VM_NEXT();
                 }
-                break;
+
+                bind_method(entry->m_method);
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::SET_PROPERTY): {
+            VM_CASE(SET_PROPERTY): {
                 if (!peek(1).is_instance()) {
+                    sync_ip();
                     runtime_error("Only instances have fields.");
                     return InterpretResult::RUNTIME_ERROR;
                 }
                 ObjInstance* instance = peek(1).as_instance();
                 ObjString* name = read_string();
-                // NOTE! Setting fields does inform the garbage collector
-                //       of additional bytes allocated, so we should be careful
-                //       not to pop stuff off the stack during the insert
-                //       in case of GC.
-                instance->set_field(name, peek(0));
+                InlineCache& cache = read_inline_cache();
+                set_property(instance, name, peek(0), cache);
+                if (cache.is_monomorphic()) {
+                    rewrite_instruction(OpCode::SET_FIELD, 3);
+                }
                 Value value = pop();
                 pop();
                 push(value);
-                break;
+                VM_NEXT();
 
             }
-            case std::to_underlying(OpCode::GET_SUPER): {
+            VM_CASE(GET_SUPER): {
                 ObjString* name = read_string();
+                InlineCache& cache = read_inline_cache();
                 ObjClass* superclass = pop().as_class();
 
-                if (!bind_method(superclass, name)) {
+                sync_ip();
+                if (!bind_method(superclass, name, cache)) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::EQUAL): {
+            VM_CASE(EQUAL): {
                 Value b = pop();
                 Value a = pop();
                 push(a == b);
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::GREATER): {
+            VM_CASE(GREATER): {
                 if (!verify_binary_op_types()) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
+                rewrite_instruction(OpCode::GREATER_NUM, 0);
                 double b = pop().as_number();
                 double a = pop().as_number();
                 push(a > b);
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::LESS): {
+            VM_CASE(LESS): {
                 if (!verify_binary_op_types()) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
+                rewrite_instruction(OpCode::LESS_NUM, 0);
                 double b = pop().as_number();
                 double a = pop().as_number();
                 push(a < b);
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::ADD): {
+            VM_CASE(ADD): {
                 Value peek_b = peek(0);
                 Value peek_a = peek(1);
 
@@ -484,110 +1019,168 @@ InterpretResult VM::run() {
                     pop();
                     pop();
                     push(result);
-                    break;
+                    VM_NEXT();
                 }
 
                 if (!verify_binary_op_types()) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
+                rewrite_instruction(OpCode::ADD_NUM, 0);
                 double b = pop().as_number();
                 double a = pop().as_number();
                 push(a + b);
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::SUBTRACT): {
+            VM_CASE(SUBTRACT): {
                 if (!verify_binary_op_types()) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
+                rewrite_instruction(OpCode::SUBTRACT_NUM, 0);
                 double b = pop().as_number();
                 double a = pop().as_number();
                 push(a - b);
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::MULTIPLY): {
+            VM_CASE(MULTIPLY): {
                 if (!verify_binary_op_types()) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
+                rewrite_instruction(OpCode::MULTIPLY_NUM, 0);
                 double b = pop().as_number();
                 double a = pop().as_number();
                 push(a * b);
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::DIVIDE): {
+            VM_CASE(DIVIDE): {
                 if (!verify_binary_op_types()) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
+                rewrite_instruction(OpCode::DIVIDE_NUM, 0);
                 double b = pop().as_number();
                 double a = pop().as_number();
                 push(a / b);
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::NOT): {
+            VM_CASE(NOT): {
                 push(pop().is_falsey());
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::NEGATE): {
+            VM_CASE(NEGATE): {
                 if (!peek(0).is_number()) {
+                    sync_ip();
                     runtime_error("Operand must be a number.");
                     return InterpretResult::RUNTIME_ERROR;
                 }
                 push(-pop().as_number());
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::PRINT): {
+            VM_CASE(PRINT): {
                 pop().print();
                 printf("\n");
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::JUMP): {
+            VM_CASE(JUMP): {
                 std::uint16_t offset = read_short();
-                current_frame().m_ip += offset;
-                break;
+                ip += offset;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::JUMP_IF_FALSE): {
+            VM_CASE(JUMP_IF_FALSE): {
                 std::uint16_t offset = read_short();
-                if (peek(0).is_falsey()) current_frame().m_ip += offset;
-                break;
+                if (peek(0).is_falsey()) ip += offset;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::LOOP): {
+            VM_CASE(LOOP): {
                 std::uint16_t offset = read_short();
-                current_frame().m_ip -= offset;
-                break;
+                ip -= offset;
+#ifdef JIT
+                if (m_tiering.is_enabled()) {
+                    ObjFunction* function = frame->m_closure->function();
+                    std::size_t header = ip - function->chunk().get_code().data();
+                    Tiering::BackEdgeAction action = m_tiering.on_back_edge(function, header, ++frame->m_back_edge_count,
+                                                                            frame->m_interpreted_calls, true);
+                    // Compiling may have added constants to the chunk (see RegisterTranslator)
+                    constants = function->chunk().get_constants().data();
+                    // Most back edges need nothing done, and the optional result is slow to return every time
+                    if (action != Tiering::BackEdgeAction::NONE) {
+                        if (auto result = take_back_edge(action, header, offset)) return *result;
+                    }
+                    if (m_tiering.recorder().is_recording()) {
+#ifdef COMPUTED_GOTO
+                        dispatch = record_table;
+#else
+                        recording = true;
+#endif
+                    }
+                }
+#endif
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::CALL): {
+            VM_CASE(CALL): {
                 std::uint8_t arg_count = read_byte();
+                sync_ip();
                 if (!call_value(peek(arg_count), arg_count)) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
-                // NOTE! If we were caching call frames some how instead
-                //       of going through the m_call_stack vector,
-                //       we would need to update that here.
-                break;
+                // The call may have pushed a new frame, so switch over to it.
+                load_frame();
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::INVOKE): {
+            VM_CASE(INVOKE): {
                 ObjString* method = read_string();
                 std::uint8_t arg_count = read_byte();
-                if (!invoke(method, arg_count)) {
+                InlineCache& cache = read_inline_cache();
+
+                // Once the site has settled on one method for this receiver's shape, switch
+                // to the quickened form. We can't do this after the call since the frame changes.
+                Value receiver = peek(arg_count);
+                if (cache.is_monomorphic() && cache.first().m_kind == InlineCacheKind::METHOD &&
+                        receiver.is_instance() && receiver.as_instance()->shape() == cache.first().m_shape) {
+                    reexecute_as(OpCode::INVOKE_METHOD, 4);
+                    VM_NEXT();
+                }
+
+                sync_ip();
+                if (!invoke(method, arg_count, cache)) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
-                // NOTE! If we were caching call frames some how instead
-                //       of going through the m_call_stack vector,
-                //       we would need to update that here.
-                break;
+                load_frame();
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::SUPER_INVOKE): {
+            VM_CASE(SUPER_INVOKE): {
                 ObjString* method = read_string();
                 std::uint8_t arg_count = read_byte();
+                InlineCache& cache = read_inline_cache();
                 ObjClass* superclass = pop().as_class();
-                if (!invoke_from_class(superclass, method, arg_count)) {
+                sync_ip();
+                if (!invoke_from_class(superclass, method, arg_count, cache)) {
                     return InterpretResult::RUNTIME_ERROR;
                 }
-                // NOTE! If we were caching call frames some how instead
-                //       of going through the m_call_stack vector,
-                //       we would need to update that here.
-                break;
+                load_frame();
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::CLOSURE): {
+            VM_CASE(TAIL_CALL): {
+                std::uint8_t arg_count = read_byte();
+                sync_ip();
+                std::size_t call_depth = m_call_stack.size();
+                if (!call_value(peek(arg_count), arg_count, true)) {
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                if (auto result = finish_tail_call(call_depth)) return *result;
+                VM_NEXT();
+            }
+            VM_CASE(TAIL_INVOKE): {
+                ObjString* method = read_string();
+                std::uint8_t arg_count = read_byte();
+                InlineCache& cache = read_inline_cache();
+                sync_ip();
+                std::size_t call_depth = m_call_stack.size();
+                if (!invoke(method, arg_count, cache, true)) {
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                if (auto result = finish_tail_call(call_depth)) return *result;
+                VM_NEXT();
+            }
+            VM_CASE(CLOSURE): {
                 ObjFunction* function = read_constant().as_function();
                 ObjClosure* closure = new ObjClosure(function);
                 push(closure);
@@ -598,43 +1191,44 @@ InterpretResult VM::run() {
                     std::uint8_t is_local = read_byte();
                     std::uint8_t index = read_byte();
                     if (is_local) {
-                        closure->upvalues()[i] = capture_upvalue(current_frame().m_value_stack_base_index + index);
+                        closure->set_upvalue(i, capture_upvalue(slots + index));
                     }
                     else {
-                        closure->upvalues()[i] = current_frame().m_closure->upvalues()[index];
+                        closure->set_upvalue(i, frame->m_closure->upvalues()[index]);
                     }
                 }
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::CLOSE_UPVALUE): {
+            VM_CASE(CLOSE_UPVALUE): {
                 close_upvalues(m_stack.size() - 1);
                 pop();
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::RETURN): {
+            VM_CASE(RETURN): {
                 // Pop the function return result from the stack.
                 Value result = pop();
 
                 // Close any open upvalues in this function's stack frame.
                 // These values are about to be popped from the stack and
                 // so need to be lifted onto the heap until they are no longer needed.
-                close_upvalues(current_frame().m_value_stack_base_index);
+                close_upvalues(slots);
 
                 // If this is the initial call frame...
                 if (m_call_stack.size() == 1) {
                     // Clean up final frame
                     m_call_stack.pop_back();
 
-                    // If there's more than one thing left on the value stack,
-                    // something is very wrong.
-                    if (m_stack.size() != 1) {
+                    // If there's anything left on the value stack below the script's
+                    // frame, something is very wrong.
+                    if (slots != 0) {
                         printf("Unexpected value stack size on program termination: %zd\n", m_stack.size());
                         reset_stack();
                         return InterpretResult::RUNTIME_ERROR;
                     }
 
-                    // Pop the initial function from the value stack
-                    pop();
+                    // Pop the initial function from the value stack, along with any
+                    // hidden locals the optimizer gave the script (see ssa.hpp)
+                    m_stack.clear();
 
                     // Call and value stacks should now be empty, and we're done.
                     return InterpretResult::OK;
@@ -642,25 +1236,28 @@ InterpretResult VM::run() {
 
                 // Clean up the value stack.
                 // We need to erase all elements of the topmost callframe upwards.
-                m_stack.erase(m_stack.begin() + current_frame().m_value_stack_base_index, m_stack.end());
+                m_stack.erase(m_stack.begin() + slots, m_stack.end());
                 // Clean up call stack
                 m_call_stack.pop_back();
 
                 // Push function return result back on the value stack for the caller to find.
                 push(result);
+                if (m_call_stack.size() == exit_depth) {
+                    return InterpretResult::OK;
+                }
 
-                // NOTE! If we were caching call frames some how instead
-                //       of going through the m_call_stack vector,
-                //       we would need to update that here.
-                break;
+                // Resume the caller where it left off.
+                load_frame();
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::CLASS): {
+            VM_CASE(CLASS): {
                 push(new ObjClass(read_string()));
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::INHERIT): {
+            VM_CASE(INHERIT): {
                 Value superclass = peek(1);
                 if (!superclass.is_class()) {
+                    sync_ip();
                     runtime_error("Superclass must be a class.");
                     return InterpretResult::RUNTIME_ERROR;
                 }
@@ -668,23 +1265,294 @@ InterpretResult VM::run() {
                 subclass->inherit_methods_from(superclass.as_class());
                 // Pop the subclass
                 pop();
-                break;
+                VM_NEXT();
             }
-            case std::to_underlying(OpCode::METHOD): {
+            VM_CASE(METHOD): {
                 define_method(read_string());
-                break;
+                VM_NEXT();
+            }
+            VM_CASE(GET_GLOBAL_DEFINED): {
+                push(m_globals[read_short()].m_value);
+                VM_NEXT();
+            }
+            VM_CASE(SET_GLOBAL_DEFINED): {
+                m_globals[read_short()].m_value = peek(0);
+                VM_NEXT();
+            }
+            VM_CASE(GET_FIELD): {
+                // The name is only needed by the generic form
+                read_byte();
+                const InlineCacheEntry& entry = read_inline_cache().first();
+                Value receiver = peek(0);
+                if (!receiver.is_instance() || receiver.as_instance()->shape() != entry.m_shape) {
+                    reexecute_as(OpCode::GET_PROPERTY, 3);
+                    VM_NEXT();
+                }
+                m_stack.back() = receiver.as_instance()->field_at(entry.m_slot);
+                VM_NEXT();
+            }
+            VM_CASE(SET_FIELD): {
+                read_byte();
+                const InlineCacheEntry& entry = read_inline_cache().first();
+                Value receiver = peek(1);
+                if (!receiver.is_instance() || receiver.as_instance()->shape() != entry.m_shape) {
+                    reexecute_as(OpCode::SET_PROPERTY, 3);
+                    VM_NEXT();
+                }
+                ObjInstance* instance = receiver.as_instance();
+                if (entry.m_kind == InlineCacheKind::FIELD) {
+                    instance->set_field_at(entry.m_slot, peek(0));
+                }
+                else {
+                    instance->add_field(entry.m_transition, peek(0));
+                }
+                // Replace the instance with the assigned value
+                Value value = pop();
+                m_stack.back() = value;
+                VM_NEXT();
+            }
+            VM_CASE(INVOKE_METHOD): {
+                read_byte();
+                std::uint8_t arg_count = read_byte();
+                const InlineCacheEntry& entry = read_inline_cache().first();
+                Value receiver = peek(arg_count);
+                if (!receiver.is_instance() || receiver.as_instance()->shape() != entry.m_shape) {
+                    reexecute_as(OpCode::INVOKE, 4);
+                    VM_NEXT();
+                }
+                sync_ip();
+                if (!call(entry.m_method, arg_count)) {
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                load_frame();
+                VM_NEXT();
+            }
+            VM_CASE(GREATER_NUM): {
+                Value b = peek(0);
+                Value a = peek(1);
+                if (!a.is_number() || !b.is_number()) {
+                    reexecute_as(OpCode::GREATER, 0);
+                    VM_NEXT();
+                }
+                pop();
+                m_stack.back() = Value(a.as_number() > b.as_number());
+                VM_NEXT();
+            }
+            VM_CASE(LESS_NUM): {
+                Value b = peek(0);
+                Value a = peek(1);
+                if (!a.is_number() || !b.is_number()) {
+                    reexecute_as(OpCode::LESS, 0);
+                    VM_NEXT();
+                }
+                pop();
+                m_stack.back() = Value(a.as_number() < b.as_number());
+                VM_NEXT();
+            }
+            VM_CASE(ADD_NUM): {
+                Value b = peek(0);
+                Value a = peek(1);
+                if (!a.is_number() || !b.is_number()) {
+                    reexecute_as(OpCode::ADD, 0);
+                    VM_NEXT();
+                }
+                pop();
+                m_stack.back() = Value(a.as_number() + b.as_number());
+                VM_NEXT();
+            }
+            VM_CASE(SUBTRACT_NUM): {
+                Value b = peek(0);
+                Value a = peek(1);
+                if (!a.is_number() || !b.is_number()) {
+                    reexecute_as(OpCode::SUBTRACT, 0);
+                    VM_NEXT();
+                }
+                pop();
+                m_stack.back() = Value(a.as_number() - b.as_number());
+                VM_NEXT();
+            }
+            VM_CASE(MULTIPLY_NUM): {
+                Value b = peek(0);
+                Value a = peek(1);
+                if (!a.is_number() || !b.is_number()) {
+                    reexecute_as(OpCode::MULTIPLY, 0);
+                    VM_NEXT();
+                }
+                pop();
+                m_stack.back() = Value(a.as_number() * b.as_number());
+                VM_NEXT();
             }
+            VM_CASE(DIVIDE_NUM): {
+                Value b = peek(0);
+                Value a = peek(1);
+                if (!a.is_number() || !b.is_number()) {
+                    reexecute_as(OpCode::DIVIDE, 0);
+                    VM_NEXT();
+                }
+                pop();
+                m_stack.back() = Value(a.as_number() / b.as_number());
+                VM_NEXT();
+            }
+            VM_CASE(LOOP_TRACE): {
+                std::uint16_t offset = read_short();
+                ip -= offset;
+#ifdef JIT
+                if (m_tiering.is_enabled()) {
+                    const std::uint8_t* code = frame->m_closure->function()->chunk().get_code().data();
+                    const Trace& trace = *frame->m_closure->function()->chunk().get_traces().at(ip - code);
+                    // The trace runs in the frame's stack window, so make room for all it pushes
+                    m_stack.resize(slots + trace.max_depth());
+                    const TraceExit& exit = trace.run(m_stack.data() + slots, m_globals.data());
+                    m_stack.resize(slots + exit.m_depth);
+                    ip = code + exit.m_offset;
+                }
+#endif
+                VM_NEXT();
+            }
+            VM_CASE(GUARD_CALL): {
+                std::uint8_t arg_count = read_byte();
+                ObjFunction* function = read_constant().as_function();
+                std::uint16_t offset = read_short();
+                if (!is_inlined_closure(peek(arg_count), function)) ip += offset;
+                VM_NEXT();
+            }
+            VM_CASE(GUARD_INVOKE): {
+                ObjString* method = read_string();
+                std::uint8_t arg_count = read_byte();
+                InlineCache& cache = read_inline_cache();
+                ObjFunction* function = read_constant().as_function();
+                std::uint16_t offset = read_short();
+                if (!is_inlined_method(peek(arg_count), method, cache, function)) ip += offset;
+                VM_NEXT();
+            }
+            VM_CASE(GET_UNBOUND): {
+                if (!peek(0).is_instance()) {
+                    sync_ip();
+                    runtime_error("Only instances have properties.");
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+
+                ObjInstance* instance = peek(0).as_instance();
+                ObjString* name = read_string();
+                InlineCache& cache = read_inline_cache();
+
+                const InlineCacheEntry* entry = resolve_property(instance->shape(), name, cache);
+                if (entry == nullptr) {
+                    sync_ip();
+                    runtime_error("Undefined property '%s'.", name->chars());
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                // The receiver is still in its own local, ready for CALL_UNBOUND to pass it
+                if (entry->m_kind == InlineCacheKind::FIELD) {
+                    m_stack.back() = instance->field_at(entry->m_slot);
+                }
+                else {
+                    m_stack.back() = entry->m_method;
+                }
+                VM_NEXT();
+            }
+            VM_CASE(CALL_UNBOUND): {
+                std::uint8_t slot = read_byte();
+                std::uint8_t arg_count = read_byte();
+                sync_ip();
+                if (!call_value(m_stack[slots + slot], arg_count)) {
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                load_frame();
+                VM_NEXT();
+            }
+            // Superinstructions. The bytes of every fused instruction are still in place,
+            // so when a guard fails we fall back to just doing the first instruction
+            // and continue with the next one as normal.
+            VM_CASE(GET_LOCAL_GET_LOCAL): {
+                push(m_stack[slots + read_byte()]);
+                skip_opcode();
+                push(m_stack[slots + read_byte()]);
+                VM_NEXT();
+            }
+            VM_CASE(GET_LOCAL_CONSTANT): {
+                push(m_stack[slots + read_byte()]);
+                skip_opcode();
+                push(read_constant());
+                VM_NEXT();
+            }
+            VM_CASE(GET_LOCAL_GET_PROPERTY): {
+                Value receiver = m_stack[slots + read_byte()];
+                const std::uint8_t* next_instruction = ip;
+                skip_opcode();
+                // The name is only needed by the generic form
+                read_byte();
+                const InlineCache& cache = read_inline_cache();
+                if (receiver.is_instance() && cache.is_monomorphic() &&
+                        cache.first().m_kind == InlineCacheKind::FIELD &&
+                        receiver.as_instance()->shape() == cache.first().m_shape) {
+                    push(receiver.as_instance()->field_at(cache.first().m_slot));
+                    VM_NEXT();
+                }
+                push(receiver);
+                ip = next_instruction;
+                VM_NEXT();
+            }
+            VM_CASE(GET_LOCAL_CONSTANT_ADD): {
+                Value a = m_stack[slots + read_byte()];
+                const std::uint8_t* next_instruction = ip;
+                skip_opcode();
+                Value b = read_constant();
+                skip_opcode();
+                if (!a.is_number() || !b.is_number()) {
+                    push(a);
+                    ip = next_instruction;
+                    VM_NEXT();
+                }
+                push(Value(a.as_number() + b.as_number()));
+                VM_NEXT();
+            }
+            VM_CASE(GET_LOCAL_CONSTANT_SUBTRACT): {
+                Value a = m_stack[slots + read_byte()];
+                const std::uint8_t* next_instruction = ip;
+                skip_opcode();
+                Value b = read_constant();
+                skip_opcode();
+                if (!a.is_number() || !b.is_number()) {
+                    push(a);
+                    ip = next_instruction;
+                    VM_NEXT();
+                }
+                push(Value(a.as_number() - b.as_number()));
+                VM_NEXT();
+            }
+            VM_CASE(GET_LOCAL_CONSTANT_LESS_JUMP_IF_FALSE): {
+                Value a = m_stack[slots + read_byte()];
+                const std::uint8_t* next_instruction = ip;
+                skip_opcode();
+                Value b = read_constant();
+                skip_opcode();
+                skip_opcode();
+                std::uint16_t offset = read_short();
+                if (!a.is_number() || !b.is_number()) {
+                    push(a);
+                    ip = next_instruction;
+                    VM_NEXT();
+                }
+                // Like JUMP_IF_FALSE, leave the condition on the stack
+                bool condition = a.as_number() < b.as_number();
+                push(Value(condition));
+                if (!condition) ip += offset;
+                VM_NEXT();
+            }
+            VM_CASE(SET_LOCAL_POP): {
+                m_stack[slots + read_byte()] = pop();
+                skip_opcode();
+                VM_NEXT();
+            }
+#ifndef COMPUTED_GOTO
             default:
                 printf("Instruction not recognized: %d\n", instruction);
                 return InterpretResult::RUNTIME_ERROR;
         }
     }
-}
+#endif
 
-bool VM::verify_binary_op_types() {
-    if (!peek(0).is_number() || !peek(1).is_number()) {
-        runtime_error("Operands must be numbers.");
-        return false;
-    }
-    return true;
-}
\ No newline at end of file
+#undef VM_CASE
+#undef VM_NEXT
+}
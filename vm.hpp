@@ -7,17 +7,33 @@
 #include "chunk.hpp"
 #include "object_function.hpp"
 #include "object_class.hpp"
+#include "profiler.hpp"
+#include "register_code.hpp"
+#include "jit.hpp"
+#include "stencil.hpp"
+#include "tiering.hpp"
 
 #define VALUE_STACK_INIT_CAPACITY 256
 
+class AotProgram;
+
 class CallFrame {
 public:
     ObjClosure* m_closure{};
     /** If non-null, this is a pointer into the chunk's code */
     /** @todo Is there any way to make this safer? Maybe using an iterator? */
     const std::uint8_t* m_ip{};
+    /** 
+     * Instruction pointer into the function's register code, when running on the register backend.
+     * Null until the frame starts executing.
+     */
+    const RegInstruction* m_rip{};
     /** Base index into the VM's value stack for this call frame's locals etc. */
     std::size_t m_value_stack_base_index{};
+    /** Loop iterations run by this activation, to decide when to move it into native code (see tiering.hpp) */
+    std::size_t m_back_edge_count{};
+    /** Calls this activation made to functions that run in the interpreter, which native code can't call straight into */
+    std::size_t m_interpreted_calls{};
 
     CallFrame(ObjClosure* closure, std::size_t value_stack_base_index) : 
         m_closure(closure), 
@@ -36,6 +52,44 @@ public:
     void disassemble_instruction() {
         m_closure->function()->chunk().disassemble_instruction(next_instruction_offset());
     }
+
+    /** Source line of the currently executing instruction, on either backend */
+    std::size_t current_line() {
+        ObjFunction* function = m_closure->function();
+        if (m_rip != nullptr) {
+            const RegisterCode& code = function->register_code();
+            return code.get_lines().at(m_rip - code.get_code().data() - 1);
+        }
+        return function->chunk().get_lines().at(current_instruction_offset());
+    }
+
+    /** Whether the frame has yet to run any of its function, which is how a tail call leaves it */
+    bool is_fresh() {
+        return m_rip == nullptr && m_ip == m_closure->function()->chunk().get_code().data();
+    }
+
+    /** The call the optimizer inlined that the currently executing instruction came from, if any */
+    const InlinedCall* current_inlined_call() {
+        if (m_rip != nullptr) return nullptr;
+        return m_closure->function()->chunk().inlined_call(current_instruction_offset());
+    }
+};
+
+/** 
+ * A global variable's storage. The compiler assigns every global name
+ * a slot up front, so a slot can exist before its variable is defined.
+ */
+class GlobalSlot {
+public:
+    ObjString* m_name{};
+    Value m_value{};
+    bool m_defined{};
+};
+
+/** Which instruction set interpret() executes */
+enum class Backend {
+    STACK,
+    REGISTER
 };
 
 enum class InterpretResult {
@@ -50,8 +104,20 @@ public:
     ~VM();
 
     InterpretResult interpret(const char* source);
+    /** Run a script compiled ahead of time (see aot.hpp) */
+    InterpretResult interpret(const AotProgram& program);
+    void set_backend(Backend backend) { m_backend = backend; }
+    /** Whether hot functions and loops are compiled to native code (when built with JIT) */
+    void set_jit_enabled(bool enabled) { m_tiering.set_enabled(enabled); }
+    /** When code moves up a tier, and whether to dump the decisions on exit (see tiering.hpp) */
+    TieringPolicy& tiering_policy() { return m_tiering.policy(); }
+    void set_tiering_report_enabled(bool enabled) { m_tiering.set_report_enabled(enabled); }
 
     void mark_gc_roots();
+
+    /** Return the index of the named global's slot, adding a new (undefined) slot if needed */
+    std::size_t global_slot(ObjString* name);
+    ObjString* global_name(std::size_t slot) { return m_globals[slot].m_name; }
 private:
     /** 
      * There should be a practical limit on the number of stack frames so as to
@@ -60,8 +126,12 @@ private:
     static constexpr std::size_t k_max_call_frames = 1024;
 
     std::vector<CallFrame> m_call_stack{};
-    std::vector<Value> m_stack{};
-    std::unordered_map<ObjStringRef, Value, ObjStringRefHash> m_globals{};
+    /** Each frame's room on it is reserved by call(), so pushing never checks for room (see value_stack.hpp) */
+    ValueStack m_stack{};
+    /** Global variables, indexed by the slots the compiler emits in global instructions */
+    std::vector<GlobalSlot> m_globals{};
+    /** Map from global name to its index in m_globals, only needed at compile time */
+    std::unordered_map<ObjStringRef, std::size_t, ObjStringRefHash> m_global_slots{};
     /** 
      * Map from value stack index to open upvalue referring to that index
      * NOTE! We just use the std::less<std::size_t> compareer, so keys are sorted
@@ -74,6 +144,12 @@ private:
     std::map<std::size_t, ObjUpvalue*> m_open_upvalues{};
 
     ObjString* m_init_string{};
+    Backend m_backend{ Backend::STACK };
+    Tiering m_tiering{};
+
+#ifdef DEBUG_PROFILE_NGRAMS
+    OpcodeProfiler m_profiler{};
+#endif
 
     void reset_stack();
     void runtime_error(const char* format, ...);
@@ -83,42 +159,137 @@ private:
     void patch(Value value, std::size_t distance);
     Value pop();
     Value peek(std::size_t distance);
-    bool call_value(Value callee, std::size_t arg_count);
-    bool invoke_from_class(ObjClass* klass, ObjString* name, std::uint8_t arg_count);
-    bool invoke(ObjString* name, std::uint8_t arg_count);
-    bool call(ObjClosure* closure, std::size_t arg_count);
+    /**
+     * Call the callee under the arguments on top of the stack. A tail call (see
+     * OpCode::TAIL_CALL) hands the current frame over to a Lox function instead of pushing
+     * another, leaving it fresh for whoever made the call to start running.
+     */
+    bool call_value(Value callee, std::size_t arg_count, bool tail = false);
+    /** 
+     * Find what the named property is for instances of the given shape, consulting the
+     * call site's inline cache first. Returns nullptr if there is no such field or method.
+     */
+    const InlineCacheEntry* resolve_property(Shape* shape, ObjString* name, InlineCache& cache);
+    /** Store the named field of the instance, consulting the call site's inline cache first */
+    void set_property(ObjInstance* instance, ObjString* name, Value value, InlineCache& cache);
+    bool invoke_from_class(ObjClass* klass, ObjString* name, std::uint8_t arg_count, InlineCache& cache);
+    bool invoke(ObjString* name, std::uint8_t arg_count, InlineCache& cache, bool tail = false);
+    bool call(ObjClosure* closure, std::size_t arg_count, bool tail = false);
+    /**
+     * Start running the function in the current (fresh) frame: to completion, if it has
+     * native code, or else leaving the frame for the interpreter. Native code that tail
+     * calls hands the frame back here, for the function it called to start in turn.
+     */
+    bool enter_frame() { return !has_native_entry(current_frame().m_closure->function()) || run_native_frames(); }
+    /** Whether the function starts in native code (ahead-of-time, stencil or JIT), which counts the call towards tiering it up */
+    bool has_native_entry(ObjFunction* function) {
+        if (function->m_aot_function != nullptr) return true;
+#ifdef JIT
+        return m_tiering.is_enabled() && m_tiering.on_call(function);
+#else
+        return false;
+#endif
+    }
+    /** Run the native code of the function in the current frame, and of each function it tail calls in turn (see enter_frame) */
+    bool run_native_frames();
+    /** Whether the callee checked by a GUARD_CALL is a closure of the function inlined after it */
+    static bool is_inlined_closure(Value callee, ObjFunction* function);
+    /** Whether the method the receiver checked by a GUARD_INVOKE would invoke is the function inlined after it */
+    bool is_inlined_method(Value receiver, ObjString* name, InlineCache& cache, ObjFunction* function);
     ObjUpvalue* capture_upvalue(std::size_t stack_index);
     // Close upvalues starting at the given index and proceeding to the top of the stack
     void close_upvalues(std::size_t start_index);
     void define_method(ObjString* name);
-    bool bind_method(ObjClass* klass, ObjString* name);
+    bool bind_method(ObjClass* klass, ObjString* name, InlineCache& cache);
+    /** Replace the instance on top of the stack with the given method bound to it */
+    void bind_method(ObjClosure* method);
+
+    /** Call the compiled script and run it to completion */
+    InterpretResult run_script(ObjFunction* function);
+    /** 
+     * Execute until the program finishes, or until a return leaves exit_depth call frames.
+     * The latter lets native code run a callee that isn't compiled to completion.
+     * With single_step, only the instruction at the current frame's ip is executed
+     * (the first one, if it is a superinstruction), which is how native code for the stack
+     * bytecode has the interpreter execute whatever it has no code of its own for.
+     */
+    InterpretResult run(std::size_t exit_depth = 0, bool single_step = false);
+    /** Like run(), but executes each function's register code (see register_code.hpp) */
+    InterpretResult run_register(std::size_t exit_depth = 0);
+
+#ifdef JIT
+    friend class JitCompiler;
+    /**
+     * Run the native code of the function in the current frame until it returns, starting
+     * from the register instruction at index resume. Resuming anywhere but the start is
+     * only possible at loop headers, where every value on the stack is in its register.
+     */
+    bool run_native(ObjFunction* function, std::size_t resume = 0);
+    /** 
+     * Execute a register instruction on behalf of native code in the current frame.
+     * Returns the frame's (possibly moved) registers, or nullptr on a runtime error.
+     */
+    Value* jit_execute(const RegInstruction* instruction);
+    /**
+     * Make the call of a CALL, CALL_UNBOUND or INVOKE instruction on behalf of native code.
+     * A Lox function with native code of its own is called straight into, with nothing
+     * more than a frame pushed for it. Anything else is left to jit_execute().
+     */
+    Value* jit_call(const RegInstruction* instruction);
+    /** Return the result from the current frame on behalf of native code, as RETURN does */
+    void jit_return(Value result);
 
-    InterpretResult run();
+    friend class StencilCompiler;
+    /** Run the stencil code of the function in the current frame, and return from the frame as RETURN does (unless it tail called) */
+    bool run_stencils(ObjFunction* function);
+    /**
+     * Make the call of the CALL (or INVOKE, if invoke is set) at the given offset on behalf
+     * of stencil code in the current frame, which has depth values on the stack. A Lox function
+     * with stencil code is called straight into, with nothing more than a frame pushed for it.
+     * Anything else is left to native_call() or native_invoke().
+     */
+    Value* stencil_call(std::size_t offset, std::size_t depth, bool invoke);
+#endif
+
+    friend class AotRuntime;
+    /** Run the ahead-of-time compiled code of the function in the current frame (see aot.hpp), and return from the frame (unless it tail called) */
+    bool run_aot(ObjFunction* function);
+    /**
+     * Execute the instruction at the given offset on behalf of native code for the stack
+     * bytecode (stencil or ahead-of-time compiled code) in the current frame, which has
+     * depth values on the stack and needs room for max_depth. Any interpreted frame it
+     * pushes is run until it returns. Returns the frame's (possibly moved) slots, or
+     * nullptr on a runtime error.
+     */
+    Value* native_execute(std::size_t offset, std::size_t depth, std::size_t max_depth);
+    /** Like native_execute(), but calls straight from the CALL instruction at the given offset, without going through run() */
+    Value* native_call(std::size_t offset, std::size_t depth, std::size_t max_depth);
+    /** Like native_call(), for the INVOKE instruction at the given offset */
+    Value* native_invoke(std::size_t offset, std::size_t depth, std::size_t max_depth);
+    /**
+     * What native code returns in place of a stack depth when it made a tail call, so the
+     * frame is now the callee's, yet to run
+     */
+    static constexpr std::size_t k_tail_called = SIZE_MAX;
+    /**
+     * Make the call of the TAIL_CALL or TAIL_INVOKE instruction at the given offset, for
+     * native code that then returns what this does. That's k_tail_called if a Lox
+     * function took over the frame, or else the depth with the call's result on top.
+     * Returns 0 on a runtime error.
+     */
+    std::size_t native_tail_call(std::size_t offset, std::size_t depth);
+    /** Whether the GUARD_CALL or GUARD_INVOKE instruction at the given offset carries on into the inlined body */
+    bool native_guard(std::size_t offset, std::size_t depth);
+    /** Finish executing an instruction for native code, which started out with call_depth frames */
+    Value* native_resume(std::size_t call_depth, std::size_t max_depth);
+    /** Return from the current frame as RETURN does, for native code that left depth values on the stack */
+    void native_return(std::size_t depth);
 
     /** 
      * Get reference to current call frame.
      * NOTE! Caller must ensure that there IS a call frame to get!
     */
     CallFrame& current_frame() { return m_call_stack.back(); }
-    /** Return the current byte pointed to, and increment the IP */
-    std::uint8_t read_byte() { return *(current_frame().m_ip++); }
-    /** Return the short pointed to, and increment the IP to after it */
-    std::uint16_t read_short() {
-        current_frame().m_ip += 2;
-        // Read the HO byte, followed by the LO byte
-        std::uint16_t ho_byte = current_frame().m_ip[-2];
-        std::uint16_t lo_byte = current_frame().m_ip[-1];
-        return (ho_byte << 8) | lo_byte;
-    }
-    /** 
-     * Read/increment the current byte and assume it is an index into the chunk's 
-     * constants array, returning the constant at that index. 
-     * NOTE! We do not do any bounds checking here to ensure fast execution, so it's 
-     * important that the compiled code produce correct, in-bound indexes.
-     */
-    Value read_constant() { return current_frame().m_closure->function()->chunk().get_constants()[this->read_byte()]; }
-    ObjString* read_string() { return read_constant().as_string(); }
-    bool verify_binary_op_types();
 };
 
 // Exposes the global g_vm variable from vm.cpp
@@ -0,0 +1,473 @@
+#include <optional>
+
+#include "common.hpp"
+#include "vm.hpp"
+
+InterpretResult VM::run_register(std::size_t exit_depth) {
+    // Each frame's registers are its window of the value stack, starting at its base
+    // index, sized to what its register code needs. As in run(), the hot state lives
+    // in locals, and everything is reloaded whenever the current frame changes.
+    // NOTE! The registers pointer is invalidated whenever m_stack is resized, which
+    //       only happens in calls and returns, after which we always reload.
+    CallFrame* frame{};
+    const RegInstruction* code{};
+    const RegInstruction* rip{};
+    const Value* constants{};
+    InlineCache* inline_caches{};
+    Value* registers{};
+    std::size_t slots{};
+
+    auto load_frame = [&]() {
+        frame = &current_frame();
+        ObjFunction* function = frame->m_closure->function();
+#ifdef DEBUG_PRINT_CODE
+        if (!function->has_register_code()) {
+            function->register_code().dissassemble(function->name(), function->chunk());
+        }
+#endif
+        const RegisterCode& register_code = function->register_code();
+        code = register_code.get_code().data();
+        if (frame->m_rip == nullptr) {
+            frame->m_rip = code;
+        }
+        rip = frame->m_rip;
+        Chunk& chunk = function->chunk();
+        constants = chunk.get_constants().data();
+        inline_caches = chunk.get_inline_caches().data();
+        slots = frame->m_value_stack_base_index;
+        m_stack.resize(slots + register_code.frame_size());
+        registers = m_stack.data() + slots;
+    };
+    auto sync_ip = [&]() { frame->m_rip = rip; };
+
+    /** Value of an operand that may be either a register or a constant */
+    auto read_rk = [&](std::uint16_t operand) {
+        return RegisterCode::is_constant(operand) ? constants[operand & ~RegisterCode::k_constant_bit] : registers[operand];
+    };
+    /**
+     * Prepare the value stack for calling the callee in register base, with its
+     * arguments in the registers after it. call_value() and friends expect them
+     * to be on top of the stack.
+     */
+    auto prepare_call = [&](std::size_t base, std::size_t arg_count) {
+        sync_ip();
+        m_stack.resize(slots + base + arg_count + 1);
+    };
+
+    auto trace_instruction = [&]() {
+#ifdef DEBUG_TRACE_EXECUTION
+        for (auto value : m_stack) {
+            printf("[ ");
+            value.print();
+            printf(" ]");
+        }
+        printf("\n");
+        ObjFunction* function = frame->m_closure->function();
+        function->register_code().disassemble_instruction(function->chunk(), rip - code);
+#endif
+    };
+
+    /** Start running whatever took the frame over after a tail call, as in run() */
+    auto finish_tail_call = [&](std::size_t call_depth) -> std::optional<InterpretResult> {
+        if (current_frame().is_fresh() && !enter_frame()) return InterpretResult::RUNTIME_ERROR;
+        if (m_call_stack.size() < call_depth && m_call_stack.size() == exit_depth) return InterpretResult::OK;
+        load_frame();
+        return std::nullopt;
+    };
+
+#ifdef JIT
+    /**
+     * Move the frame into its native code at the loop header at target, as Tiering decided
+     * at a back edge. It then runs to completion, and the result is returned if
+     * run_register() is done too.
+     */
+    auto enter_osr = [&](std::size_t target) -> std::optional<InterpretResult> {
+        ObjFunction* function = frame->m_closure->function();
+        m_tiering.osr_entered(function, target, frame->m_back_edge_count);
+        sync_ip();
+        std::size_t call_depth = m_call_stack.size();
+        if (!run_native(function, target)) return InterpretResult::RUNTIME_ERROR;
+        // If it made a tail call, the function it called starts running as after a call
+        if (m_call_stack.size() == call_depth && !enter_frame()) return InterpretResult::RUNTIME_ERROR;
+        // Otherwise the native code returned from the frame just as RETURN would
+        if (m_call_stack.empty()) {
+            reset_stack();
+            return InterpretResult::OK;
+        }
+        if (m_call_stack.size() == exit_depth) return InterpretResult::OK;
+        load_frame();
+        return std::nullopt;
+    };
+#endif
+
+    load_frame();
+
+#ifdef COMPUTED_GOTO
+    static void* dispatch_table[] = {
+        &&op_MOVE,             // [RegOpCode::MOVE]
+        &&op_GET_GLOBAL,       // [RegOpCode::GET_GLOBAL]
+        &&op_DEFINE_GLOBAL,    // [RegOpCode::DEFINE_GLOBAL]
+        &&op_SET_GLOBAL,       // [RegOpCode::SET_GLOBAL]
+        &&op_GET_UPVALUE,      // [RegOpCode::GET_UPVALUE]
+        &&op_SET_UPVALUE,      // [RegOpCode::SET_UPVALUE]
+        &&op_GET_PROPERTY,     // [RegOpCode::GET_PROPERTY]
+        &&op_GET_UNBOUND,      // [RegOpCode::GET_UNBOUND]
+        &&op_SET_PROPERTY,     // [RegOpCode::SET_PROPERTY]
+        &&op_GET_SUPER,        // [RegOpCode::GET_SUPER]
+        &&op_EQUAL,            // [RegOpCode::EQUAL]
+        &&op_GREATER,          // [RegOpCode::GREATER]
+        &&op_LESS,             // [RegOpCode::LESS]
+        &&op_ADD,              // [RegOpCode::ADD]
+        &&op_SUBTRACT,         // [RegOpCode::SUBTRACT]
+        &&op_MULTIPLY,         // [RegOpCode::MULTIPLY]
+        &&op_DIVIDE,           // [RegOpCode::DIVIDE]
+        &&op_NOT,              // [RegOpCode::NOT]
+        &&op_NEGATE,           // [RegOpCode::NEGATE]
+        &&op_PRINT,            // [RegOpCode::PRINT]
+        &&op_JUMP,             // [RegOpCode::JUMP]
+        &&op_JUMP_IF_FALSE,    // [RegOpCode::JUMP_IF_FALSE]
+        &&op_CALL,             // [RegOpCode::CALL]
+        &&op_INVOKE,           // [RegOpCode::INVOKE]
+        &&op_SUPER_INVOKE,     // [RegOpCode::SUPER_INVOKE]
+        &&op_TAIL_CALL,        // [RegOpCode::TAIL_CALL]
+        &&op_TAIL_INVOKE,      // [RegOpCode::TAIL_INVOKE]
+        &&op_CALL_UNBOUND,     // [RegOpCode::CALL_UNBOUND]
+        &&op_CLOSURE,          // [RegOpCode::CLOSURE]
+        &&op_CAPTURE,          // [RegOpCode::CAPTURE]
+        &&op_CLOSE_UPVALUE,    // [RegOpCode::CLOSE_UPVALUE]
+        &&op_RETURN,           // [RegOpCode::RETURN]
+        &&op_CLASS,            // [RegOpCode::CLASS]
+        &&op_INHERIT,          // [RegOpCode::INHERIT]
+        &&op_METHOD,           // [RegOpCode::METHOD]
+    };
+    static_assert(std::size(dispatch_table) == k_reg_opcode_count, "Dispatch table must cover every RegOpCode.");
+
+    const RegInstruction* instruction{};
+
+#define VM_CASE(op) op_##op
+#define VM_NEXT() do { trace_instruction(); instruction = rip++; goto *dispatch_table[std::to_underlying(instruction->m_op)]; } while (false)
+
+    VM_NEXT();
+#else
+#define VM_CASE(op) case RegOpCode::op
+#define VM_NEXT() break
+
+    for (;;) {
+        trace_instruction();
+        const RegInstruction* instruction = rip++;
+
+        switch (instruction->m_op) {
+#endif
+            VM_CASE(MOVE): {
+                registers[instruction->m_a] = read_rk(instruction->m_b);
+                VM_NEXT();
+            }
+            VM_CASE(GET_GLOBAL): {
+                GlobalSlot& global = m_globals[instruction->m_b];
+                if (!global.m_defined) {
+                    sync_ip();
+                    runtime_error("Undefined variable '%s'.", global.m_name->chars());
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                registers[instruction->m_a] = global.m_value;
+                VM_NEXT();
+            }
+            VM_CASE(DEFINE_GLOBAL): {
+                GlobalSlot& global = m_globals[instruction->m_b];
+                global.m_value = read_rk(instruction->m_a);
+                global.m_defined = true;
+                VM_NEXT();
+            }
+            VM_CASE(SET_GLOBAL): {
+                GlobalSlot& global = m_globals[instruction->m_b];
+                if (!global.m_defined) {
+                    sync_ip();
+                    runtime_error("Undefined variable '%s'.", global.m_name->chars());
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                global.m_value = read_rk(instruction->m_a);
+                VM_NEXT();
+            }
+            VM_CASE(GET_UPVALUE): {
+                ObjUpvalue* upvalue = frame->m_closure->upvalues()[instruction->m_b];
+                if (upvalue->is_stack_index()) {
+                    registers[instruction->m_a] = m_stack[upvalue->stack_index()];
+                }
+                else {
+                    registers[instruction->m_a] = upvalue->closed_value();
+                }
+                VM_NEXT();
+            }
+            VM_CASE(SET_UPVALUE): {
+                ObjUpvalue* upvalue = frame->m_closure->upvalues()[instruction->m_b];
+                if (upvalue->is_stack_index()) {
+                    m_stack[upvalue->stack_index()] = read_rk(instruction->m_a);
+                }
+                else {
+                    upvalue->set_closed_value(read_rk(instruction->m_a));
+                }
+                VM_NEXT();
+            }
+            VM_CASE(GET_PROPERTY):
+            VM_CASE(GET_UNBOUND): {
+                Value receiver = registers[instruction->m_b];
+                if (!receiver.is_instance()) {
+                    sync_ip();
+                    runtime_error("Only instances have properties.");
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+
+                ObjInstance* instance = receiver.as_instance();
+                ObjString* name = constants[instruction->m_x].as_string();
+                const InlineCacheEntry* entry = resolve_property(instance->shape(), name, inline_caches[instruction->m_c]);
+                if (entry == nullptr) {
+                    sync_ip();
+                    runtime_error("Undefined property '%s'.", name->chars());
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+
+                if (entry->m_kind == InlineCacheKind::FIELD) {
+                    registers[instruction->m_a] = instance->field_at(entry->m_slot);
+                    VM_NEXT();
+                }
+                if (instruction->m_op == RegOpCode::GET_UNBOUND) {
+                    registers[instruction->m_a] = entry->m_method;
+                    VM_NEXT();
+                }
+                // The receiver stays in its register, so it's safe from the GC while we allocate
+                registers[instruction->m_a] = new ObjBoundMethod(instance, entry->m_method);
+                VM_NEXT();
+            }
+            VM_CASE(SET_PROPERTY): {
+                Value receiver = registers[instruction->m_a];
+                if (!receiver.is_instance()) {
+                    sync_ip();
+                    runtime_error("Only instances have fields.");
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                ObjString* name = constants[instruction->m_x].as_string();
+                set_property(receiver.as_instance(), name, read_rk(instruction->m_b), inline_caches[instruction->m_c]);
+                VM_NEXT();
+            }
+            VM_CASE(GET_SUPER): {
+                ObjString* name = constants[instruction->m_x].as_string();
+                ObjClass* superclass = registers[instruction->m_b].as_class();
+                // A class's root shape has no fields, so this only ever finds methods
+                const InlineCacheEntry* entry = resolve_property(superclass->root_shape(), name, inline_caches[instruction->m_c]);
+                if (entry == nullptr) {
+                    sync_ip();
+                    runtime_error("Undefined property '%s'.", name->chars());
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                ObjInstance* instance = registers[instruction->m_a].as_instance();
+                registers[instruction->m_a] = new ObjBoundMethod(instance, entry->m_method);
+                VM_NEXT();
+            }
+            VM_CASE(EQUAL): {
+                registers[instruction->m_a] = Value(read_rk(instruction->m_b) == read_rk(instruction->m_c));
+                VM_NEXT();
+            }
+            VM_CASE(GREATER):
+            VM_CASE(LESS):
+            VM_CASE(SUBTRACT):
+            VM_CASE(MULTIPLY):
+            VM_CASE(DIVIDE): {
+                Value a = read_rk(instruction->m_b);
+                Value b = read_rk(instruction->m_c);
+                if (!a.is_number() || !b.is_number()) {
+                    sync_ip();
+                    runtime_error("Operands must be numbers.");
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                switch (instruction->m_op) {
+                    case RegOpCode::GREATER: registers[instruction->m_a] = Value(a.as_number() > b.as_number()); break;
+                    case RegOpCode::LESS: registers[instruction->m_a] = Value(a.as_number() < b.as_number()); break;
+                    case RegOpCode::SUBTRACT: registers[instruction->m_a] = Value(a.as_number() - b.as_number()); break;
+                    case RegOpCode::MULTIPLY: registers[instruction->m_a] = Value(a.as_number() * b.as_number()); break;
+                    default: registers[instruction->m_a] = Value(a.as_number() / b.as_number()); break;
+                }
+                VM_NEXT();
+            }
+            VM_CASE(ADD): {
+                Value a = read_rk(instruction->m_b);
+                Value b = read_rk(instruction->m_c);
+                if (a.is_number() && b.is_number()) {
+                    registers[instruction->m_a] = Value(a.as_number() + b.as_number());
+                    VM_NEXT();
+                }
+                // Both strings are still in registers or constants while we concatenate,
+                // so they are safe from the GC.
+                if (a.is_string() && b.is_string()) {
+                    registers[instruction->m_a] = *a.as_string() + *b.as_string();
+                    VM_NEXT();
+                }
+                sync_ip();
+                runtime_error("Operands must be numbers.");
+                return InterpretResult::RUNTIME_ERROR;
+            }
+            VM_CASE(NOT): {
+                registers[instruction->m_a] = Value(read_rk(instruction->m_b).is_falsey());
+                VM_NEXT();
+            }
+            VM_CASE(NEGATE): {
+                Value value = read_rk(instruction->m_b);
+                if (!value.is_number()) {
+                    sync_ip();
+                    runtime_error("Operand must be a number.");
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                registers[instruction->m_a] = Value(-value.as_number());
+                VM_NEXT();
+            }
+            VM_CASE(PRINT): {
+                read_rk(instruction->m_a).print();
+                printf("\n");
+                VM_NEXT();
+            }
+            VM_CASE(JUMP): {
+                std::size_t target = instruction->target();
+                rip = code + target;
+#ifdef JIT
+                // Only loops jump backwards
+                if (target <= static_cast<std::size_t>(instruction - code) && m_tiering.is_enabled() &&
+                    m_tiering.on_back_edge(frame->m_closure->function(), target, ++frame->m_back_edge_count, frame->m_interpreted_calls, false) ==
+                        Tiering::BackEdgeAction::OSR) {
+                    if (auto result = enter_osr(target)) return *result;
+                }
+#endif
+                VM_NEXT();
+            }
+            VM_CASE(JUMP_IF_FALSE): {
+                if (registers[instruction->m_a].is_falsey()) {
+                    rip = code + instruction->target();
+                }
+                VM_NEXT();
+            }
+            VM_CASE(CALL): {
+                prepare_call(instruction->m_a, instruction->m_x);
+                if (!call_value(m_stack[slots + instruction->m_a], instruction->m_x)) {
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                load_frame();
+                VM_NEXT();
+            }
+            VM_CASE(CALL_UNBOUND): {
+                prepare_call(instruction->m_a, instruction->m_x);
+                if (!call_value(m_stack[slots + instruction->m_b], instruction->m_x)) {
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                load_frame();
+                VM_NEXT();
+            }
+            VM_CASE(INVOKE): {
+                ObjString* method = constants[instruction->m_b].as_string();
+                prepare_call(instruction->m_a, instruction->m_x);
+                if (!invoke(method, instruction->m_x, inline_caches[instruction->m_c])) {
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                load_frame();
+                VM_NEXT();
+            }
+            VM_CASE(SUPER_INVOKE): {
+                ObjString* method = constants[instruction->m_b].as_string();
+                ObjClass* superclass = registers[instruction->m_a + instruction->m_x + 1].as_class();
+                prepare_call(instruction->m_a, instruction->m_x);
+                if (!invoke_from_class(superclass, method, instruction->m_x, inline_caches[instruction->m_c])) {
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                load_frame();
+                VM_NEXT();
+            }
+            VM_CASE(TAIL_CALL): {
+                std::size_t call_depth = m_call_stack.size();
+                prepare_call(instruction->m_a, instruction->m_x);
+                if (!call_value(m_stack[slots + instruction->m_a], instruction->m_x, true)) {
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                if (auto result = finish_tail_call(call_depth)) return *result;
+                VM_NEXT();
+            }
+            VM_CASE(TAIL_INVOKE): {
+                std::size_t call_depth = m_call_stack.size();
+                ObjString* method = constants[instruction->m_b].as_string();
+                prepare_call(instruction->m_a, instruction->m_x);
+                if (!invoke(method, instruction->m_x, inline_caches[instruction->m_c], true)) {
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                if (auto result = finish_tail_call(call_depth)) return *result;
+                VM_NEXT();
+            }
+            VM_CASE(CLOSURE): {
+                ObjFunction* function = constants[instruction->m_b].as_function();
+                ObjClosure* closure = new ObjClosure(function);
+                // Store the closure before capturing, so the GC can find it
+                registers[instruction->m_a] = closure;
+
+                for (std::size_t i = 0, len = closure->upvalues().size(); i < len; i++) {
+                    const RegInstruction* capture = rip++;
+                    if (capture->m_x) {
+                        closure->set_upvalue(i, capture_upvalue(slots + capture->m_a));
+                    }
+                    else {
+                        closure->set_upvalue(i, frame->m_closure->upvalues()[capture->m_a]);
+                    }
+                }
+                VM_NEXT();
+            }
+            VM_CASE(CAPTURE): {
+                // Only ever read as part of CLOSURE
+                VM_NEXT();
+            }
+            VM_CASE(CLOSE_UPVALUE): {
+                close_upvalues(slots + instruction->m_a);
+                VM_NEXT();
+            }
+            VM_CASE(RETURN): {
+                Value result = read_rk(instruction->m_a);
+                close_upvalues(slots);
+
+                if (m_call_stack.size() == 1) {
+                    m_call_stack.pop_back();
+                    reset_stack();
+                    return InterpretResult::OK;
+                }
+
+                // Leave the result where the callee was, which is the caller's register the call named
+                m_stack.erase(m_stack.begin() + slots, m_stack.end());
+                m_call_stack.pop_back();
+                push(result);
+                if (m_call_stack.size() == exit_depth) {
+                    return InterpretResult::OK;
+                }
+                load_frame();
+                VM_NEXT();
+            }
+            VM_CASE(CLASS): {
+                registers[instruction->m_a] = new ObjClass(constants[instruction->m_b].as_string());
+                VM_NEXT();
+            }
+            VM_CASE(INHERIT): {
+                Value superclass = registers[instruction->m_a];
+                if (!superclass.is_class()) {
+                    sync_ip();
+                    runtime_error("Superclass must be a class.");
+                    return InterpretResult::RUNTIME_ERROR;
+                }
+                registers[instruction->m_b].as_class()->inherit_methods_from(superclass.as_class());
+                VM_NEXT();
+            }
+            VM_CASE(METHOD): {
+                registers[instruction->m_a].as_class()->set_method(constants[instruction->m_x].as_string(), registers[instruction->m_b]);
+                VM_NEXT();
+            }
+#ifndef COMPUTED_GOTO
+            default:
+                printf("Register instruction not recognized: %d\n", std::to_underlying(instruction->m_op));
+                return InterpretResult::RUNTIME_ERROR;
+        }
+    }
+#endif
+
+#undef VM_CASE
+#undef VM_NEXT
+}
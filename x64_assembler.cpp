@@ -0,0 +1,166 @@
+#include "x64_assembler.hpp"
+
+#ifdef JIT
+
+void X64Assembler::emit_u32(std::uint32_t value) {
+    for (int i = 0; i < 4; i++) m_bytes.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+}
+
+void X64Assembler::emit_u64(std::uint64_t value) {
+    for (int i = 0; i < 8; i++) m_bytes.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+}
+
+std::size_t X64Assembler::emit_rel32() {
+    std::size_t position = m_bytes.size();
+    emit_u32(0);
+    return position;
+}
+
+void X64Assembler::patch_rel32(std::size_t position, std::size_t target) {
+    // Relative to the end of the 4 byte operand
+    std::uint32_t relative = static_cast<std::uint32_t>(static_cast<std::int64_t>(target) - static_cast<std::int64_t>(position + 4));
+    for (int i = 0; i < 4; i++) m_bytes[position + i] = static_cast<std::uint8_t>(relative >> (8 * i));
+}
+
+void X64Assembler::patch(std::size_t position, std::uint64_t value, std::size_t size) {
+    for (std::size_t i = 0; i < size; i++) m_bytes[position + i] = static_cast<std::uint8_t>(value >> (8 * i));
+}
+
+void X64Assembler::push(X64 reg) {
+    if (std::to_underlying(reg) & 8) emit({ 0x41 });
+    emit({ static_cast<std::uint8_t>(0x50 | (std::to_underlying(reg) & 7)) });
+}
+
+void X64Assembler::pop(X64 reg) {
+    if (std::to_underlying(reg) & 8) emit({ 0x41 });
+    emit({ static_cast<std::uint8_t>(0x58 | (std::to_underlying(reg) & 7)) });
+}
+
+void X64Assembler::mov_imm64(X64 dst, std::uint64_t value) {
+    emit({ rex_w(X64::RAX, dst), static_cast<std::uint8_t>(0xb8 | (std::to_underlying(dst) & 7)) });
+    emit_u64(value);
+}
+
+void X64Assembler::mov_imm32(X64 dst, std::uint32_t value) {
+    if (std::to_underlying(dst) & 8) emit({ 0x41 });
+    emit({ static_cast<std::uint8_t>(0xb8 | (std::to_underlying(dst) & 7)) });
+    emit_u32(value);
+}
+
+void X64Assembler::alu(std::uint8_t op, X64 dst, X64 src) {
+    emit({ rex_w(src, dst), op, modrm(3, std::to_underlying(src), std::to_underlying(dst)) });
+}
+
+void X64Assembler::add_imm8(X64 dst, std::int8_t value) {
+    emit({ rex_w(X64::RAX, dst), 0x83, modrm(3, 0, std::to_underlying(dst)), static_cast<std::uint8_t>(value) });
+}
+
+void X64Assembler::cmp_imm8(X64 lhs, std::int8_t value) {
+    emit({ rex_w(X64::RAX, lhs), 0x83, modrm(3, 7, std::to_underlying(lhs)), static_cast<std::uint8_t>(value) });
+}
+
+void X64Assembler::memory_operand(std::uint8_t op, X64 reg, X64 base, std::int32_t displacement) {
+    emit({ rex_w(reg, base), op, modrm(2, std::to_underlying(reg), std::to_underlying(base)) });
+    // rsp and r12 as a base need a SIB byte
+    if ((std::to_underlying(base) & 7) == 4) emit({ 0x24 });
+    emit_u32(static_cast<std::uint32_t>(displacement));
+}
+
+void X64Assembler::load(X64 dst, X64 base, std::int32_t displacement) {
+    memory_operand(0x8b, dst, base, displacement);
+}
+
+void X64Assembler::store(X64 base, std::int32_t displacement, X64 src) {
+    memory_operand(0x89, src, base, displacement);
+}
+
+void X64Assembler::byte_immediate(std::uint8_t op, std::uint8_t digit, X64 base, std::int32_t displacement, std::uint8_t value) {
+    if (std::to_underlying(base) & 8) emit({ 0x41 });
+    emit({ op, modrm(2, digit, std::to_underlying(base)) });
+    if ((std::to_underlying(base) & 7) == 4) emit({ 0x24 });
+    emit_u32(static_cast<std::uint32_t>(displacement));
+    emit({ value });
+}
+
+void X64Assembler::cmp_byte(X64 base, std::int32_t displacement, std::uint8_t value) {
+    byte_immediate(0x80, 7, base, displacement, value);
+}
+
+void X64Assembler::store_byte(X64 base, std::int32_t displacement, std::uint8_t value) {
+    byte_immediate(0xc6, 0, base, displacement, value);
+}
+
+void X64Assembler::call(const void* function) {
+    mov_imm64(X64::RAX, reinterpret_cast<std::uint64_t>(function));
+    emit({ 0xff, 0xd0 });                   // call rax
+}
+
+std::size_t X64Assembler::jmp() {
+    emit({ 0xe9 });
+    return emit_rel32();
+}
+
+std::size_t X64Assembler::jcc(X64Condition condition) {
+    emit({ 0x0f, static_cast<std::uint8_t>(0x80 | std::to_underlying(condition)) });
+    return emit_rel32();
+}
+
+void X64Assembler::setcc_rax(X64Condition condition) {
+    emit({ 0x0f, static_cast<std::uint8_t>(0x90 | std::to_underlying(condition)), 0xc0 }); // setcc al
+    emit({ 0x0f, 0xb6, 0xc0 });             // movzx eax, al
+}
+
+void X64Assembler::movq_to_xmm(std::uint8_t xmm, X64 src) {
+    emit({ 0x66, rex_w(X64::RAX, src), 0x0f, 0x6e, modrm(3, xmm, std::to_underlying(src)) });
+}
+
+void X64Assembler::movq_from_xmm(X64 dst, std::uint8_t xmm) {
+    emit({ 0x66, rex_w(X64::RAX, dst), 0x0f, 0x7e, modrm(3, xmm, std::to_underlying(dst)) });
+}
+
+void X64Assembler::sse_arithmetic(std::uint8_t op) {
+    emit({ 0xf2, 0x0f, op, 0xc1 });
+}
+
+void X64Assembler::ucomisd(std::uint8_t lhs, std::uint8_t rhs) {
+    emit({ 0x66, 0x0f, 0x2e, modrm(3, lhs, rhs) });
+}
+
+void X64Assembler::test_falsey(X64 reg) {
+    // nil and false are adjacent tags, so the value is falsey when
+    // (bits - false) + 1 is 0 or 1, as an unsigned comparison.
+    alu(k_sub, reg, X64::R15);
+    add_imm8(reg, 1);
+    cmp_imm8(reg, 1);
+}
+
+void X64Assembler::test_number(X64 reg) {
+    // A value is a number unless all of the quiet NaN bits are set
+    alu(k_mov, X64::RDX, reg);
+    alu(k_and, X64::RDX, X64::R14);
+    alu(k_cmp, X64::RDX, X64::R14);
+}
+
+void X64Assembler::values_equal() {
+    // Numbers compare as doubles, everything else by its bits
+    test_number(X64::RAX);
+    std::size_t a_not_number = jcc(X64Condition::EQUAL);
+    test_number(X64::RCX);
+    std::size_t b_not_number = jcc(X64Condition::EQUAL);
+    movq_to_xmm(0, X64::RAX);
+    movq_to_xmm(1, X64::RCX);
+    ucomisd(0, 1);
+    // Unordered (NaN) compares set the parity flag, and are never equal
+    emit({ 0x0f, 0x94, 0xc0 });             // sete al
+    emit({ 0x0f, 0x9b, 0xc1 });             // setnp cl
+    emit({ 0x20, 0xc8 });                   // and al, cl
+    std::size_t done = jmp();
+    patch_rel32(a_not_number, size());
+    patch_rel32(b_not_number, size());
+    alu(k_cmp, X64::RAX, X64::RCX);
+    emit({ 0x0f, 0x94, 0xc0 });             // sete al
+    patch_rel32(done, size());
+    emit({ 0x0f, 0xb6, 0xc0 });             // movzx eax, al
+}
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef ppclox_x64_assembler_hpp
+#define ppclox_x64_assembler_hpp
+
+#include <utility>
+
+#include "common.hpp"
+
+#ifdef JIT
+
+/** x86-64 general purpose registers, numbered as in their encodings */
+enum class X64 : std::uint8_t {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/** Condition codes, as used in the low nibble of jcc and setcc opcodes */
+enum class X64Condition : std::uint8_t {
+    BELOW = 0x2,
+    ABOVE_EQUAL = 0x3,
+    EQUAL = 0x4,
+    NOT_EQUAL = 0x5,
+    BELOW_EQUAL = 0x6,
+    ABOVE = 0x7,
+    PARITY = 0xa,
+    NOT_PARITY = 0xb
+};
+
+/**
+ * Just enough of an x86-64 assembler for the JIT tiers. Instructions are appended
+ * to a byte buffer. Jumps are emitted with 32 bit placeholders that are patched once
+ * their targets are known.
+ *
+ * The tiers' generated code keeps its state in the same callee saved registers:
+ *   rbx - the frame's slots (reloaded after anything that may move the value stack)
+ *   r12 - the VM
+ *   r13 - the VM's global slots, which never move while code runs (only the compiler adds any)
+ *   r14 - Value::k_qnan, for testing whether values are numbers
+ *   r15 - Value::k_false_bits. true is the same with the lowest bit set.
+ * The Value helpers at the end rely on r14 and r15.
+ */
+class X64Assembler {
+public:
+    // Opcodes of "op r/m64, r64" instructions, for use with alu()
+    static constexpr std::uint8_t k_add = 0x01;
+    static constexpr std::uint8_t k_or = 0x09;
+    static constexpr std::uint8_t k_and = 0x21;
+    static constexpr std::uint8_t k_sub = 0x29;
+    static constexpr std::uint8_t k_xor = 0x31;
+    static constexpr std::uint8_t k_cmp = 0x39;
+    static constexpr std::uint8_t k_test = 0x85;
+    static constexpr std::uint8_t k_mov = 0x89;
+
+    const std::vector<std::uint8_t>& bytes() const { return m_bytes; }
+    std::size_t size() const { return m_bytes.size(); }
+
+    void emit(std::initializer_list<std::uint8_t> bytes) { m_bytes.insert(m_bytes.end(), bytes); }
+    /** Append machine code assembled elsewhere */
+    void append(const std::vector<std::uint8_t>& bytes) { m_bytes.insert(m_bytes.end(), bytes.begin(), bytes.end()); }
+    void emit_u32(std::uint32_t value);
+    void emit_u64(std::uint64_t value);
+    /** Emit a 32 bit placeholder for a relative jump, returning its position */
+    std::size_t emit_rel32();
+    /** Make the placeholder at the given position jump to the given offset */
+    void patch_rel32(std::size_t position, std::size_t target);
+    /** Overwrite the size bytes at the given position with the low bytes of value */
+    void patch(std::size_t position, std::uint64_t value, std::size_t size);
+
+    void push(X64 reg);
+    void pop(X64 reg);
+    void mov_imm64(X64 dst, std::uint64_t value);
+    void mov_imm32(X64 dst, std::uint32_t value);
+    /** Any "op r/m64, r64" instruction between two registers */
+    void alu(std::uint8_t op, X64 dst, X64 src);
+    void add_imm8(X64 dst, std::int8_t value);
+    void cmp_imm8(X64 lhs, std::int8_t value);
+    void load(X64 dst, X64 base, std::int32_t displacement);
+    void store(X64 base, std::int32_t displacement, X64 src);
+    /** Compare or set a byte in memory. The displacement is followed by the immediate. */
+    void cmp_byte(X64 base, std::int32_t displacement, std::uint8_t value);
+    void store_byte(X64 base, std::int32_t displacement, std::uint8_t value);
+    /** Call the function at the given address, clobbering rax */
+    void call(const void* function);
+    void ret() { emit({ 0xc3 }); }
+    /** Jump to a placeholder target, returning its position for patching */
+    std::size_t jmp();
+    std::size_t jcc(X64Condition condition);
+    /** Set al to whether the condition holds, then zero extend it into rax */
+    void setcc_rax(X64Condition condition);
+    /** Move between rax or rcx and xmm0 or xmm1 (register numbers 0 or 1) */
+    void movq_to_xmm(std::uint8_t xmm, X64 src);
+    void movq_from_xmm(X64 dst, std::uint8_t xmm);
+    /** Scalar double arithmetic "op xmm0, xmm1", with op one of 0x58 (add), 0x5c (sub), 0x59 (mul), 0x5e (div) */
+    void sse_arithmetic(std::uint8_t op);
+    /** Compare the two xmm registers, setting the flags as an unsigned comparison would */
+    void ucomisd(std::uint8_t lhs, std::uint8_t rhs);
+
+    /** Set the flags so that "below or equal" means the value in reg is falsey. Clobbers reg. */
+    void test_falsey(X64 reg);
+    /** Set the flags so that "not equal" means the value in reg is a number. Clobbers rdx. */
+    void test_number(X64 reg);
+    /** Set rax to whether the values in rax and rcx are equal, as Value::operator== has it. Clobbers rcx, rdx, xmm0 and xmm1. */
+    void values_equal();
+private:
+    std::vector<std::uint8_t> m_bytes{};
+
+    static std::uint8_t rex_w(X64 reg, X64 rm) {
+        return 0x48 | ((std::to_underlying(reg) & 8) ? 0x04 : 0) | ((std::to_underlying(rm) & 8) ? 0x01 : 0);
+    }
+    static std::uint8_t modrm(std::uint8_t mod, std::uint8_t reg, std::uint8_t rm) {
+        return static_cast<std::uint8_t>((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+    }
+    void memory_operand(std::uint8_t op, X64 reg, X64 base, std::int32_t displacement);
+    /** An "op r/m8, imm8" instruction with a memory operand, where digit is the opcode's reg field */
+    void byte_immediate(std::uint8_t op, std::uint8_t digit, X64 base, std::int32_t displacement, std::uint8_t value);
+};
+
+#endif
+
+#endif